@@ -0,0 +1,351 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    bustime.cpp
+
+Abstract:
+
+    This module computes the theoretical wire time of the
+    forwarded requests from the connection speed of their
+    target, and compares it to the measured latency.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "stats.h"
+#include "bustime.h"
+
+#include "bustime.tmh"
+
+//
+// I2C framing, in bit times: a start or repeated start
+// condition, an address byte or data byte with its ACK bit,
+// and the stop condition closing the request.
+//
+
+#define I2C_START_BITS 1
+#define I2C_BYTE_BITS  9
+#define I2C_STOP_BITS  1
+
+ULONGLONG
+PbcBusTimeTransferNs(
+    _In_  PPBC_TARGET_SETTINGS    pSettings,
+    _In_  SPB_TRANSFER_DIRECTION  Direction,
+    _In_  size_t                  Length
+    )
+/*++
+
+  Routine Description:
+
+    This routine computes the wire time of one transfer,
+    without the stop condition of an I2C request.
+
+  Arguments:
+
+    pSettings - the settings of the target
+    Direction - the direction of the transfer
+    Length - the length of the transfer in bytes
+
+  Return Value:
+
+    The wire time in nanoseconds, 0 if the connection speed
+    is unknown
+
+--*/
+{
+    ULONGLONG bits = 0;
+
+    if (pSettings->ConnectionSpeed == 0)
+    {
+        return 0;
+    }
+
+    if (pSettings->BusType == I2C_SERIAL_BUS_TYPE)
+    {
+        //
+        // A 7-bit address takes one byte. A 10-bit address
+        // takes two bytes, and a read sends a repeated start
+        // and the first address byte again with the read bit.
+        //
+
+        bits = I2C_START_BITS + I2C_BYTE_BITS;
+
+        if (pSettings->AddressMode == AddressMode10Bit)
+        {
+            bits += I2C_BYTE_BITS;
+
+            if (Direction == SpbTransferDirectionFromDevice)
+            {
+                bits += I2C_START_BITS + I2C_BYTE_BITS;
+            }
+        }
+
+        bits += (ULONGLONG)Length * I2C_BYTE_BITS;
+    }
+    else
+    {
+        //
+        // SPI clocks DataBitLength bits per word without
+        // framing. Words wider than 8 bits take the next
+        // power of two bytes in the buffer.
+        //
+
+        ULONG wordBits = pSettings->DataBitLength;
+        ULONG wordBytes;
+
+        if (wordBits == 0)
+        {
+            wordBits = 8;
+        }
+
+        wordBytes = (wordBits <= 8) ? 1 : ((wordBits <= 16) ? 2 : 4);
+
+        bits = ((ULONGLONG)Length / wordBytes) * wordBits;
+    }
+
+    return (bits * 1000000000) / pSettings->ConnectionSpeed;
+}
+
+ULONGLONG
+PbcBusTimeRequestNs(
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        ClientRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine computes the wire time of a client request,
+    including the delays requested between its transfers.
+
+  Arguments:
+
+    pTarget - a pointer to the target context
+    ClientRequest - the client request object
+
+  Return Value:
+
+    The wire time in nanoseconds, 0 if it cannot be modeled
+
+--*/
+{
+    PPBC_TARGET_SETTINGS pSettings = &pTarget->Settings;
+    PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+    SPB_REQUEST_PARAMETERS params;
+    SPB_TRANSFER_DESCRIPTOR descriptor;
+    PMDL pMdl;
+    BOOLEAN fullDuplex = FALSE;
+    ULONGLONG transferNs;
+    ULONGLONG wireNs = 0;
+
+    if (pSettings->ConnectionSpeed == 0)
+    {
+        return 0;
+    }
+
+    if (pRequest->Type == SpbRequestTypeOther)
+    {
+        WDF_REQUEST_PARAMETERS fxParams;
+        WDF_REQUEST_PARAMETERS_INIT(&fxParams);
+        WdfRequestGetParameters(ClientRequest, &fxParams);
+
+        fullDuplex = (fxParams.Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_SPB_FULL_DUPLEX);
+    }
+
+    //
+    // The posted write of a coalesced read went first.
+    //
+
+    if (pRequest->CoalescedWriteLength != 0)
+    {
+        wireNs += PbcBusTimeTransferNs(
+            pSettings,
+            SpbTransferDirectionToDevice,
+            pRequest->CoalescedWriteLength);
+    }
+
+    SPB_REQUEST_PARAMETERS_INIT(&params);
+    SpbRequestGetParameters(ClientRequest, &params);
+
+    for (ULONG i = 0; i < params.SequenceTransferCount; i++)
+    {
+        SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+
+        SpbRequestGetTransferParameters(
+            ClientRequest,
+            i,
+            &descriptor,
+            &pMdl);
+
+        transferNs = PbcBusTimeTransferNs(
+            pSettings,
+            descriptor.Direction,
+            descriptor.TransferLength);
+
+        //
+        // Both buffers of a full duplex transfer are clocked
+        // at the same time.
+        //
+
+        if (fullDuplex)
+        {
+            wireNs = max(wireNs, transferNs);
+        }
+        else
+        {
+            wireNs += transferNs + ((ULONGLONG)descriptor.DelayInUs * 1000);
+        }
+    }
+
+    if ((wireNs != 0) && (pSettings->BusType == I2C_SERIAL_BUS_TYPE))
+    {
+        wireNs += ((ULONGLONG)I2C_STOP_BITS * 1000000000) /
+            pSettings->ConnectionSpeed;
+    }
+
+    return wireNs;
+}
+
+VOID
+PbcBusTimeRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          status
+    )
+/*++
+
+  Routine Description:
+
+    This routine compares the wire time of a completed
+    request to the time between send and completion.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request being completed
+    status - the client completion status
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+    PPBC_TARGET pTarget = pRequest->pTarget;
+    ULONGLONG wireNs;
+    ULONGLONG busyNs;
+
+    UNREFERENCED_PARAMETER(pDevice);
+
+    if (!NT_SUCCESS(status) ||
+        (pTarget == NULL) ||
+        (pRequest->SendTime == 0))
+    {
+        return;
+    }
+
+    switch (pRequest->Type)
+    {
+    case SpbRequestTypeRead:
+    case SpbRequestTypeWrite:
+    case SpbRequestTypeSequence:
+    case SpbRequestTypeOther:
+        break;
+
+    default:
+        return;
+    }
+
+    wireNs = PbcBusTimeRequestNs(pTarget, ClientRequest);
+
+    if (wireNs == 0)
+    {
+        return;
+    }
+
+    busyNs = PbcElapsedNs(pRequest->SendTime, PbcQueryTimestamp());
+
+    pTarget->ModeledRequests++;
+    pTarget->WireTimeNs += wireNs;
+    pTarget->BusyTimeNs += busyNs;
+
+    PbcHistogramRecord(
+        &pTarget->ControllerOverhead,
+        (busyNs > wireNs) ? ((busyNs - wireNs) / 1000) : 0);
+}
+
+VOID
+PbcBusTimeTrace(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine dumps the bus efficiency of a target: the
+    share of the measured latency spent on the wire, and the
+    controller overhead per request. An efficiency above 100%
+    means the bus runs faster than the connection speed says,
+    and is reported as is.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if ((pTarget->ModeledRequests == 0) || (pTarget->BusyTimeNs == 0))
+    {
+        return;
+    }
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_OTHER,
+        "device %I64d: target 0x%hx at %lu Hz requests=%lu "
+        "wire time=%I64u us busy time=%I64u us efficiency=%I64u%% "
+        "overhead=%I64u us/request",
+        pDevice->PeripheralId.QuadPart,
+        pTarget->Settings.Address,
+        pTarget->Settings.ConnectionSpeed,
+        pTarget->ModeledRequests,
+        pTarget->WireTimeNs / 1000,
+        pTarget->BusyTimeNs / 1000,
+        (pTarget->WireTimeNs * 100) / pTarget->BusyTimeNs,
+        (pTarget->BusyTimeNs > pTarget->WireTimeNs) ?
+            ((pTarget->BusyTimeNs - pTarget->WireTimeNs) / 1000 /
+                pTarget->ModeledRequests) : 0);
+
+    if (pTarget->WireTimeNs > pTarget->BusyTimeNs)
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_OTHER,
+            "device %I64d: target 0x%hx wire time above busy time, "
+            "the bus runs faster than %lu Hz",
+            pDevice->PeripheralId.QuadPart,
+            pTarget->Settings.Address,
+            pTarget->Settings.ConnectionSpeed);
+    }
+
+    PbcHistogramTrace(pDevice, pTarget,
+        &pTarget->ControllerOverhead,
+        "controller overhead", "us");
+}
@@ -0,0 +1,47 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    bustime.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the bus time model.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _BUSTIME_H_
+#define _BUSTIME_H_
+
+ULONGLONG
+PbcBusTimeTransferNs(
+    _In_  PPBC_TARGET_SETTINGS    pSettings,
+    _In_  SPB_TRANSFER_DIRECTION  Direction,
+    _In_  size_t                  Length);
+
+ULONGLONG
+PbcBusTimeRequestNs(
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        ClientRequest);
+
+VOID
+PbcBusTimeRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          status);
+
+VOID
+PbcBusTimeTrace(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget);
+
+#endif // _BUSTIME_H_
@@ -0,0 +1,740 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    cache.cpp
+
+Abstract:
+
+    This module serves reads of idempotent registers, such
+    as descriptor and ID registers, from responses captured
+    earlier without sending them to the SPB controller.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "peripheral.h"
+#include "stats.h"
+#include "config.h"
+#include "cache.h"
+#include "recorder.h"
+
+#include "cache.tmh"
+
+VOID
+PbcCacheAttach(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine gives a connecting target the register read
+    cache of its address, shared with the other targets
+    opened on it, when a register of the address is in the
+    cache allow-list.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_DEVICE_CONFIG pConfig = &pDevice->Config;
+    PPBC_REGISTER_CACHE pCache = NULL;
+    USHORT address = pTarget->Settings.Address;
+
+    pTarget->pCache = NULL;
+
+    if (!PbcDeviceIsTargetCached(pDevice, address))
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < PBC_MAX_CACHED_REGISTERS; i++)
+    {
+        PPBC_REGISTER_CACHE pSlot = &pDevice->RegisterCaches[i];
+
+        if ((pSlot->TargetCount != 0) && (pSlot->Address == address))
+        {
+            pSlot->TargetCount++;
+            pTarget->pCache = pSlot;
+            return;
+        }
+
+        if ((pCache == NULL) && (pSlot->TargetCount == 0))
+        {
+            pCache = pSlot;
+        }
+    }
+
+    //
+    // Each cached address has at least one register in the
+    // allow-list, so there is always a free slot.
+    //
+
+    NT_ASSERT(pCache != NULL);
+
+    RtlZeroMemory(pCache, sizeof(PBC_REGISTER_CACHE));
+
+    pCache->TargetCount = 1;
+    pCache->Address = address;
+    pCache->RegisterBytes = 1;
+
+    for (ULONG i = 0; i < pConfig->CachedRegisterCount; i++)
+    {
+        if (((pConfig->CachedRegisters[i] >> 16) == address) &&
+            ((pConfig->CachedRegisters[i] & 0xFFFF) > 0xFF))
+        {
+            pCache->RegisterBytes = 2;
+        }
+    }
+
+    pTarget->pCache = pCache;
+}
+
+VOID
+PbcCacheDetach(
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine releases the register read cache of a
+    target being closed. The responses are dropped with the
+    last target of the address, as the device may be reset
+    before the next one opens.
+
+  Arguments:
+
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (pTarget->pCache == NULL)
+    {
+        return;
+    }
+
+    NT_ASSERT(pTarget->pCache->TargetCount != 0);
+
+    pTarget->pCache->TargetCount--;
+    pTarget->pCache = NULL;
+}
+
+static
+BOOLEAN
+PbcCacheGetRegister(
+    _In_   PPBC_REGISTER_CACHE pCache,
+    _In_   PMDL     pMdl,
+    _In_   size_t   Length,
+    _Out_  PULONG   pRegister
+    )
+/*++
+
+  Routine Description:
+
+    This routine reads the register address of a register
+    address select write.
+
+  Arguments:
+
+    pCache - the register read cache of the target
+    pMdl - the MDL chain of the write
+    Length - the length of the write
+    pRegister - receives the register address
+
+  Return Value:
+
+    TRUE if the write only carries a register address
+
+--*/
+{
+    UCHAR byte;
+
+    *pRegister = 0;
+
+    if (Length != pCache->RegisterBytes)
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < (ULONG)Length; i++)
+    {
+        if (!NT_SUCCESS(RequestGetByte(pMdl, Length, i, &byte)))
+        {
+            return FALSE;
+        }
+
+        *pRegister |= (ULONG)byte << (8 * i);
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+PbcCacheIsRegisterSelect(
+    _In_   PPBC_TARGET       pTarget,
+    _In_reads_bytes_(Length) const UCHAR *pBuffer,
+    _In_   ULONG             Length,
+    _Out_  PULONG            pRegister
+    )
+/*++
+
+  Routine Description:
+
+    This routine reads the register address of a write held
+    in a buffer, such as a posted write. Only a write of the
+    length of a register address of the target is a select;
+    a longer one carries data, and so does a 2-byte write to
+    a target with 1-byte registers.
+
+  Arguments:
+
+    pTarget - a pointer to the target context
+    pBuffer - the data of the write
+    Length - the length of the write
+    pRegister - receives the register address
+
+  Return Value:
+
+    TRUE if the write selects a register of a cached target
+
+--*/
+{
+    *pRegister = 0;
+
+    if ((pTarget->pCache == NULL) ||
+        (Length != pTarget->pCache->RegisterBytes))
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < Length; i++)
+    {
+        *pRegister |= (ULONG)pBuffer[i] << (8 * i);
+    }
+
+    return TRUE;
+}
+
+static
+PPBC_CACHE_ENTRY
+PbcCacheFind(
+    _In_  PPBC_REGISTER_CACHE pCache,
+    _In_  ULONG             Register
+    )
+{
+    for (ULONG i = 0; i < PBC_MAX_CACHE_ENTRIES; i++)
+    {
+        if (pCache->Entries[i].Valid &&
+            (pCache->Entries[i].Register == Register))
+        {
+            return &pCache->Entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static
+BOOLEAN
+PbcCacheServe(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest,
+    _In_  ULONG             Register,
+    _In_  ULONG             ReadIndex,
+    _In_  size_t            WriteLength
+    )
+/*++
+
+  Routine Description:
+
+    This routine completes a register read from the cache,
+    or marks the request so that its response is cached on
+    completion.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+    spbRequest - the client request
+    Register - the register address written ahead of the read
+    ReadIndex - the index of the read transfer in the request
+    WriteLength - the length of the register address transfer
+        reported with the read, 0 if it was completed already
+
+  Return Value:
+
+    TRUE if the request was completed from the cache
+
+--*/
+{
+    PPBC_REQUEST pRequest = GetRequestContext(spbRequest);
+    PPBC_CACHE_ENTRY pEntry;
+    SPB_TRANSFER_DESCRIPTOR descriptor;
+    PMDL pMdl;
+    ULONGLONG age = 0;
+
+    if (!PbcDeviceIsRegisterCached(
+        pDevice,
+        pTarget->Settings.Address,
+        Register))
+    {
+        return FALSE;
+    }
+
+    SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+
+    SpbRequestGetTransferParameters(
+        spbRequest,
+        ReadIndex,
+        &descriptor,
+        &pMdl);
+
+    if ((descriptor.TransferLength == 0) ||
+        (descriptor.TransferLength > PBC_MAX_CACHED_READ))
+    {
+        return FALSE;
+    }
+
+    pEntry = PbcCacheFind(pTarget->pCache, Register);
+
+    if (pEntry != NULL)
+    {
+        age = PbcElapsedUs(pEntry->Timestamp, PbcQueryTimestamp());
+
+        if (age > (ULONGLONG)pDevice->Config.CacheTtlMs * 1000)
+        {
+            pEntry->Valid = FALSE;
+            pEntry = NULL;
+        }
+    }
+
+    if ((pEntry == NULL) || (pEntry->Length < descriptor.TransferLength))
+    {
+        pTarget->CacheMisses++;
+
+        pRequest->CacheFill = TRUE;
+        pRequest->CacheRegister = Register;
+        pRequest->CacheReadIndex = ReadIndex;
+
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < (ULONG)descriptor.TransferLength; i++)
+    {
+        if (!NT_SUCCESS(RequestSetByte(
+            pMdl,
+            descriptor.TransferLength,
+            i,
+            pEntry->Data[i])))
+        {
+            return FALSE;
+        }
+    }
+
+    pTarget->CacheHits++;
+    pTarget->CacheTimeSaved += pEntry->BusTime;
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Serving read of register 0x%lx of target 0x%hx from cache, "
+        "%Iu bytes, age %I64u us",
+        Register,
+        pTarget->Settings.Address,
+        descriptor.TransferLength,
+        age);
+
+    SpbPeripheralTraceComplete(pDevice, spbRequest, STATUS_SUCCESS);
+    SpbPeripheralAccountRequest(pDevice, spbRequest, STATUS_SUCCESS);
+    PbcRecorderRecord(pDevice, spbRequest, STATUS_SUCCESS);
+
+    WdfRequestCompleteWithInformation(
+        spbRequest,
+        STATUS_SUCCESS,
+        WriteLength + descriptor.TransferLength);
+
+    return TRUE;
+}
+
+BOOLEAN
+PbcCacheServeSequence(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine looks a write-read sequence up in the
+    register read cache. A write-read of a register not
+    cached leaves the cache alone, any other sequence
+    writing to the target invalidates it.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+    spbRequest - the client sequence request
+
+  Return Value:
+
+    TRUE if the request was completed from the cache
+
+--*/
+{
+    SPB_REQUEST_PARAMETERS params;
+    SPB_TRANSFER_DESCRIPTOR writeDescriptor;
+    SPB_TRANSFER_DESCRIPTOR readDescriptor;
+    PMDL pWriteMdl;
+    PMDL pReadMdl;
+    ULONG reg;
+
+    if (pTarget->pCache == NULL)
+    {
+        return FALSE;
+    }
+
+    SPB_REQUEST_PARAMETERS_INIT(&params);
+    SpbRequestGetParameters(spbRequest, &params);
+
+    if (params.SequenceTransferCount == 2)
+    {
+        SPB_TRANSFER_DESCRIPTOR_INIT(&writeDescriptor);
+        SPB_TRANSFER_DESCRIPTOR_INIT(&readDescriptor);
+
+        SpbRequestGetTransferParameters(
+            spbRequest,
+            0,
+            &writeDescriptor,
+            &pWriteMdl);
+
+        SpbRequestGetTransferParameters(
+            spbRequest,
+            1,
+            &readDescriptor,
+            &pReadMdl);
+
+        if ((writeDescriptor.Direction == SpbTransferDirectionToDevice) &&
+            (readDescriptor.Direction == SpbTransferDirectionFromDevice) &&
+            PbcCacheGetRegister(
+                pTarget->pCache,
+                pWriteMdl,
+                writeDescriptor.TransferLength,
+                &reg))
+        {
+            return PbcCacheServe(
+                pDevice,
+                pTarget,
+                spbRequest,
+                reg,
+                1,
+                writeDescriptor.TransferLength);
+        }
+    }
+
+    for (ULONG i = 0; i < params.SequenceTransferCount; i++)
+    {
+        SPB_TRANSFER_DESCRIPTOR_INIT(&writeDescriptor);
+
+        SpbRequestGetTransferParameters(
+            spbRequest,
+            i,
+            &writeDescriptor,
+            &pWriteMdl);
+
+        if (writeDescriptor.Direction == SpbTransferDirectionToDevice)
+        {
+            PbcCacheInvalidate(pTarget);
+            break;
+        }
+    }
+
+    return FALSE;
+}
+
+BOOLEAN
+PbcCacheServeCoalescedRead(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine looks a read following a posted register
+    address write up in the register read cache. On a hit
+    the posted write is consumed without being sent; any
+    other posted write is never consumed.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+    spbRequest - the client read request
+
+  Return Value:
+
+    TRUE if the request was completed from the cache
+
+--*/
+{
+    PPBC_POSTED_WRITE pPosted = &pDevice->PostedWrite;
+    ULONG reg = 0;
+
+    if ((pPosted->Pending == FALSE) ||
+        !PbcCacheIsRegisterSelect(pTarget, pPosted->Buffer, pPosted->Length, &reg))
+    {
+        return FALSE;
+    }
+
+    NT_ASSERT(pPosted->pTarget == pTarget);
+
+    if (!PbcCacheServe(pDevice, pTarget, spbRequest, reg, 0, 0))
+    {
+        return FALSE;
+    }
+
+    pPosted->Pending = FALSE;
+    pTarget->CachedCoalescedReads++;
+
+    return TRUE;
+}
+
+VOID
+PbcCacheFill(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          status
+    )
+/*++
+
+  Routine Description:
+
+    This routine stores the response of a cacheable register
+    read once the controller completed it. The oldest entry
+    of the address is replaced when the cache is full.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request being completed
+    status - the client completion status
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+    PPBC_TARGET pTarget = pRequest->pTarget;
+    PPBC_REGISTER_CACHE pCache;
+    PPBC_CACHE_ENTRY pEntry;
+    SPB_TRANSFER_DESCRIPTOR descriptor;
+    PMDL pMdl;
+    LONGLONG now;
+
+    UNREFERENCED_PARAMETER(pDevice);
+
+    if (pRequest->CacheFill == FALSE)
+    {
+        return;
+    }
+
+    pRequest->CacheFill = FALSE;
+
+    if (!NT_SUCCESS(status) || (pTarget == NULL) || (pTarget->pCache == NULL))
+    {
+        return;
+    }
+
+    pCache = pTarget->pCache;
+    pEntry = PbcCacheFind(pCache, pRequest->CacheRegister);
+
+    for (ULONG i = 0; (pEntry == NULL) && (i < PBC_MAX_CACHE_ENTRIES); i++)
+    {
+        if (pCache->Entries[i].Valid == FALSE)
+        {
+            pEntry = &pCache->Entries[i];
+        }
+    }
+
+    if (pEntry == NULL)
+    {
+        pEntry = &pCache->Entries[0];
+
+        for (ULONG i = 1; i < PBC_MAX_CACHE_ENTRIES; i++)
+        {
+            if (pCache->Entries[i].Timestamp < pEntry->Timestamp)
+            {
+                pEntry = &pCache->Entries[i];
+            }
+        }
+    }
+
+    SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+
+    SpbRequestGetTransferParameters(
+        ClientRequest,
+        pRequest->CacheReadIndex,
+        &descriptor,
+        &pMdl);
+
+    NT_ASSERT(descriptor.TransferLength <= PBC_MAX_CACHED_READ);
+
+    pEntry->Valid = FALSE;
+
+    for (ULONG i = 0; i < (ULONG)descriptor.TransferLength; i++)
+    {
+        if (!NT_SUCCESS(RequestGetByte(
+            pMdl,
+            descriptor.TransferLength,
+            i,
+            &pEntry->Data[i])))
+        {
+            return;
+        }
+    }
+
+    now = PbcQueryTimestamp();
+
+    pEntry->Register = pRequest->CacheRegister;
+    pEntry->Length = (ULONG)descriptor.TransferLength;
+    pEntry->Timestamp = now;
+    pEntry->BusTime = PbcElapsedUs(pRequest->DispatchTime, now);
+    pEntry->Valid = TRUE;
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Cached %lu bytes of register 0x%lx of target 0x%hx, "
+        "read in %I64u us",
+        pEntry->Length,
+        pEntry->Register,
+        pTarget->Settings.Address,
+        pEntry->BusTime);
+}
+
+VOID
+PbcCacheInvalidateOnWrite(
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine drops the cached responses of the address
+    of a target sent a write, unless the write only selects
+    a register.
+
+  Arguments:
+
+    pTarget - a pointer to the target context
+    spbRequest - the client write request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    SPB_TRANSFER_DESCRIPTOR descriptor;
+    PMDL pMdl;
+    ULONG reg;
+
+    if (pTarget->pCache == NULL)
+    {
+        return;
+    }
+
+    SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+
+    SpbRequestGetTransferParameters(
+        spbRequest,
+        0,
+        &descriptor,
+        &pMdl);
+
+    if (!PbcCacheGetRegister(
+        pTarget->pCache,
+        pMdl,
+        descriptor.TransferLength,
+        &reg))
+    {
+        PbcCacheInvalidate(pTarget);
+    }
+}
+
+VOID
+PbcCacheInvalidate(
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine drops every cached response of the address
+    of a target, whichever target read them. It is called
+    for any write other than a register address select.
+
+  Arguments:
+
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_REGISTER_CACHE pCache = pTarget->pCache;
+    BOOLEAN invalidated = FALSE;
+
+    if (pCache == NULL)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < PBC_MAX_CACHE_ENTRIES; i++)
+    {
+        invalidated |= pCache->Entries[i].Valid;
+        pCache->Entries[i].Valid = FALSE;
+    }
+
+    if (invalidated)
+    {
+        pTarget->CacheInvalidations++;
+
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_FLAG_SPBAPI,
+            "Invalidated register cache of target 0x%hx",
+            pTarget->Settings.Address);
+    }
+}
@@ -0,0 +1,68 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    cache.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the register read cache.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+VOID
+PbcCacheAttach(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget);
+
+VOID
+PbcCacheDetach(
+    _In_  PPBC_TARGET       pTarget);
+
+BOOLEAN
+PbcCacheIsRegisterSelect(
+    _In_  PPBC_TARGET       pTarget,
+    _In_reads_bytes_(Length) const UCHAR *pBuffer,
+    _In_  ULONG             Length,
+    _Out_ PULONG            pRegister);
+
+BOOLEAN
+PbcCacheServeSequence(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest);
+
+BOOLEAN
+PbcCacheServeCoalescedRead(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest);
+
+VOID
+PbcCacheFill(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          status);
+
+VOID
+PbcCacheInvalidateOnWrite(
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest);
+
+VOID
+PbcCacheInvalidate(
+    _In_  PPBC_TARGET       pTarget);
+
+#endif // _CACHE_H_
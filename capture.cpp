@@ -0,0 +1,1045 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    capture.cpp
+
+Abstract:
+
+    This module captures the transfers of the completed requests
+    into one ring buffer per processor, so that completions on
+    different processors never write to the same cache lines.
+    Each record gets a sequence number, global to all the
+    devices and processors, and a timestamp. The collector
+    merges the rings back into one stream ordered by sequence
+    number, for the control device. What happens to a record
+    that does not fit is the capture policy of its device.
+
+    The payloads of the writes are taken just before the
+    request is sent, those of the reads at the completion, each
+    with its own timestamp. The two halves of a full duplex
+    transfer are written together, as a pair of records.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "peripheral.h"
+#include "capture.h"
+#include "stats.h"
+
+#include "capture.tmh"
+
+//
+// Ring of one processor. Only that processor writes the
+// records and Head, at DISPATCH_LEVEL. Tail moves by compare
+// exchange, one record at a time: the collector moves it past
+// the records it reads, and the processor past the records it
+// overwrites, so that each record is either read or counted
+// as lost, never both.
+//
+
+typedef struct PBC_CAPTURE_RING
+{
+    // Index of the next record to write, and while a record
+    // is being written, a lower bound of its sequence number
+    // (0 otherwise).
+    DECLSPEC_CACHEALIGN volatile LONG64 Head;
+    volatile LONG64               Floor;
+
+    // Records lost since the last record written, reported in
+    // the Dropped field of the next one, and the records
+    // counted for the sampling.
+    LONG64                        Dropped;
+    ULONG                         Sampled;
+
+    // Index of the next record to read.
+    DECLSPEC_CACHEALIGN volatile LONG64 Tail;
+
+    DECLSPEC_CACHEALIGN SPBPROBE_CAPTURE_RECORD Records[PBC_CAPTURE_RING_RECORDS];
+}
+PBC_CAPTURE_RING, *PPBC_CAPTURE_RING;
+
+//
+// Position of the collector in one ring during a read, and a
+// copy of the next record.
+//
+
+typedef struct PBC_CAPTURE_CURSOR
+{
+    LONG64                        Next;
+    LONG64                        End;
+    SPBPROBE_CAPTURE_RECORD       Record;
+}
+PBC_CAPTURE_CURSOR, *PPBC_CAPTURE_CURSOR;
+
+typedef struct PBC_CAPTURE
+{
+    ULONG                         RingCount;
+    PPBC_CAPTURE_RING            *Rings;
+
+    // Merge state of the collector, under s_CaptureLock: one
+    // cursor per ring, and a min-heap of the rings ordered by
+    // the sequence number of their next record.
+    PPBC_CAPTURE_CURSOR           Cursors;
+    PULONG                        Heap;
+}
+PBC_CAPTURE, *PPBC_CAPTURE;
+
+//
+// The sequence number is the only line shared by the
+// producers, touched once per record.
+//
+
+static DECLSPEC_CACHEALIGN volatile LONG64 s_CaptureSequence = 0;
+static PPBC_CAPTURE s_Capture = NULL;
+static WDFWAITLOCK s_CaptureLock = NULL;
+
+NTSTATUS
+PbcCaptureInitialize(
+    _In_  WDFDRIVER         FxDriver
+    )
+/*++
+
+  Routine Description:
+
+    This routine creates the lock of the collector. The rings
+    are allocated when the first device enables the capture.
+
+  Arguments:
+
+    FxDriver - the WDF driver object handle
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FxDriver;
+
+    status = WdfWaitLockCreate(&attributes, &s_CaptureLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to create capture lock - %!STATUS!",
+            status);
+
+        s_CaptureLock = NULL;
+    }
+
+    return status;
+}
+
+static
+VOID
+PbcCaptureFree(
+    _In_  PPBC_CAPTURE      pCapture
+    )
+/*++
+
+  Routine Description:
+
+    This routine frees the rings.
+
+  Arguments:
+
+    pCapture - the capture state
+
+  Return Value:
+
+    None
+
+--*/
+{
+    for (ULONG i = 0; i < pCapture->RingCount; i++)
+    {
+        if (pCapture->Rings[i] != NULL)
+        {
+            ExFreePoolWithTag(pCapture->Rings[i], SI2C_POOL_TAG);
+        }
+    }
+
+    ExFreePoolWithTag(pCapture, SI2C_POOL_TAG);
+}
+
+VOID
+PbcCaptureCleanup(VOID)
+/*++
+
+  Routine Description:
+
+    This routine frees the rings when the driver unloads.
+
+  Arguments:
+
+    None
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (s_Capture != NULL)
+    {
+        PbcCaptureFree(s_Capture);
+        s_Capture = NULL;
+    }
+}
+
+NTSTATUS
+PbcCaptureEnable(VOID)
+/*++
+
+  Routine Description:
+
+    This routine allocates one ring per active processor, once
+    for all the devices.
+
+  Arguments:
+
+    None
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    PPBC_CAPTURE pCapture = NULL;
+    ULONG ringCount;
+    size_t size;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (s_CaptureLock == NULL)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    WdfWaitLockAcquire(s_CaptureLock, NULL);
+
+    if (s_Capture != NULL)
+    {
+        goto exit;
+    }
+
+    ringCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    size = sizeof(PBC_CAPTURE) +
+        ringCount * (sizeof(PPBC_CAPTURE_RING) + sizeof(PBC_CAPTURE_CURSOR) + sizeof(ULONG));
+
+    pCapture = (PPBC_CAPTURE)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        size,
+        SI2C_POOL_TAG);
+
+    if (pCapture == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    pCapture->RingCount = ringCount;
+    pCapture->Cursors = (PPBC_CAPTURE_CURSOR)(pCapture + 1);
+    pCapture->Rings = (PPBC_CAPTURE_RING *)(pCapture->Cursors + ringCount);
+    pCapture->Heap = (PULONG)(pCapture->Rings + ringCount);
+
+    for (ULONG i = 0; i < ringCount; i++)
+    {
+        pCapture->Rings[i] = (PPBC_CAPTURE_RING)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            sizeof(PBC_CAPTURE_RING),
+            SI2C_POOL_TAG);
+
+        if (pCapture->Rings[i] == NULL)
+        {
+            PbcCaptureFree(pCapture);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+    }
+
+    WritePointerRelease((PVOID volatile *)&s_Capture, pCapture);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_WDFLOADING,
+        "Capture enabled, %lu rings of %lu records",
+        ringCount,
+        (ULONG)PBC_CAPTURE_RING_RECORDS);
+
+exit:
+
+    WdfWaitLockRelease(s_CaptureLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to allocate the capture rings - %!STATUS!",
+            status);
+    }
+
+    return status;
+}
+
+BOOLEAN
+PbcCapturePolicyIsValid(
+    _In_  const SPBPROBE_CAPTURE_POLICY *pPolicy
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks a capture policy.
+
+  Arguments:
+
+    pPolicy - the policy
+
+  Return Value:
+
+    TRUE if the policy is valid
+
+--*/
+{
+    return ((pPolicy->Mode < SpbProbeCaptureModeMax) &&
+            (pPolicy->SampleRate != 0) &&
+            (pPolicy->WatermarkPercent != 0) &&
+            (pPolicy->WatermarkPercent <= 100));
+}
+
+BOOLEAN
+PbcCaptureWrite(
+    _In_reads_(Count) const SPBPROBE_CAPTURE_RECORD *pRecords,
+    _In_  ULONG             Count,
+    _In_  const SPBPROBE_CAPTURE_POLICY *pPolicy
+    )
+/*++
+
+  Routine Description:
+
+    This routine appends records to the ring of the current
+    processor, with consecutive sequence numbers, a timestamp
+    unless they have one, the processor and the records lost
+    before them. It never waits: when the ring is full, the
+    policy either drops the records or overwrites the oldest
+    ones, and above the watermark of the sampling policy only
+    1 call in SampleRate is kept. The records of one call are
+    kept or lost together.
+
+  Arguments:
+
+    pRecords - the records, Sequence, Processor and Dropped are
+        ignored, and Timestamp if 0
+    Count - the number of records, up to 2
+    pPolicy - the capture policy of the device
+
+  Return Value:
+
+    TRUE if the records were written
+
+--*/
+{
+    PPBC_CAPTURE pCapture;
+    PPBC_CAPTURE_RING pRing;
+    ULONG processor;
+    LONG64 head;
+    LONG64 tail;
+    LONGLONG timestamp;
+    ULONGLONG sequence;
+    KIRQL oldIrql;
+    BOOLEAN written = FALSE;
+
+    NT_ASSERT((Count > 0) && (Count <= 2));
+
+    pCapture = (PPBC_CAPTURE)ReadPointerAcquire((PVOID volatile *)&s_Capture);
+
+    if (pCapture == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Stay on the processor, and its only writer, until the
+    // records are published.
+    //
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (processor >= pCapture->RingCount)
+    {
+        goto exit;
+    }
+
+    pRing = pCapture->Rings[processor];
+    head = pRing->Head;
+    tail = ReadAcquire64(&pRing->Tail);
+
+    if (head + Count - tail > PBC_CAPTURE_RING_RECORDS)
+    {
+        if (pPolicy->Mode != SpbProbeCaptureOverwriteOldest)
+        {
+            pRing->Dropped += Count;
+            goto exit;
+        }
+
+        //
+        // Take the oldest records from the collector. Those it
+        // read in the meantime make room as well.
+        //
+
+        while (head + Count - tail > PBC_CAPTURE_RING_RECORDS)
+        {
+            if (InterlockedCompareExchange64(&pRing->Tail, tail + 1, tail) == tail)
+            {
+                pRing->Dropped +=
+                    pRing->Records[tail & (PBC_CAPTURE_RING_RECORDS - 1)].Dropped + 1;
+            }
+
+            tail = ReadAcquire64(&pRing->Tail);
+        }
+    }
+    else if ((pPolicy->Mode == SpbProbeCaptureSample) &&
+             ((ULONG64)(head - tail) * 100 >=
+              (ULONG64)pPolicy->WatermarkPercent * PBC_CAPTURE_RING_RECORDS) &&
+             ((pRing->Sampled++ % pPolicy->SampleRate) != 0))
+    {
+        pRing->Dropped += Count;
+        goto exit;
+    }
+
+    //
+    // The floor is visible to the collector before the
+    // sequence numbers are taken, so that it holds back the
+    // records of the other processors with higher numbers
+    // until these are published.
+    //
+
+    pRing->Floor = ReadAcquire64(&s_CaptureSequence) + 1;
+
+    sequence = (ULONGLONG)InterlockedAdd64(&s_CaptureSequence, Count) - Count + 1;
+    timestamp = PbcQueryTimestamp();
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        PSPBPROBE_CAPTURE_RECORD pSlot =
+            &pRing->Records[(head + i) & (PBC_CAPTURE_RING_RECORDS - 1)];
+
+        RtlCopyMemory(pSlot, &pRecords[i], sizeof(SPBPROBE_CAPTURE_RECORD));
+
+        pSlot->Sequence = sequence + i;
+        pSlot->Timestamp = (pRecords[i].Timestamp != 0) ? pRecords[i].Timestamp : timestamp;
+        pSlot->Processor = processor;
+        pSlot->Dropped = (i == 0) ? (ULONG)min(pRing->Dropped, (LONG64)MAXULONG) : 0;
+    }
+
+    pRing->Dropped = 0;
+
+    WriteRelease64(&pRing->Head, head + Count);
+    WriteRelease64(&pRing->Floor, 0);
+
+    written = TRUE;
+
+exit:
+
+    KeLowerIrql(oldIrql);
+
+    return written;
+}
+
+VOID
+PbcCaptureInitRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  ULONG             TransferCount,
+    _Out_ PSPBPROBE_CAPTURE_RECORD pRecord
+    )
+/*++
+
+  Routine Description:
+
+    This routine fills the fields of a record common to all
+    the transfers of a request.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+    TransferCount - the number of transfers of the request
+    pRecord - the record
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_TARGET pTarget = GetRequestContext(ClientRequest)->pTarget;
+
+    RtlZeroMemory(pRecord, sizeof(SPBPROBE_CAPTURE_RECORD));
+
+    pRecord->PeripheralId = pDevice->PeripheralId.QuadPart;
+    pRecord->TransactionId = GetRequestContext(ClientRequest)->TransactionId;
+    pRecord->TransferCount = (UCHAR)min(TransferCount, (ULONG)MAXUCHAR);
+
+    if (pTarget != NULL)
+    {
+        pRecord->BusType = pTarget->Settings.BusType;
+        pRecord->Address = pTarget->Settings.Address;
+    }
+}
+
+VOID
+PbcCaptureCopyPayload(
+    _In_  ULONG             Index,
+    _In_  const SPB_TRANSFER_DESCRIPTOR *pDescriptor,
+    _In_  PMDL              pMdl,
+    _Inout_ PSPBPROBE_CAPTURE_RECORD pRecord
+    )
+/*++
+
+  Routine Description:
+
+    This routine fills the fields of a record for one transfer,
+    with the first bytes of its payload as they are now.
+
+  Arguments:
+
+    Index - the index of the transfer
+    pDescriptor - the descriptor of the transfer
+    pMdl - the buffer of the transfer
+    pRecord - the record
+
+  Return Value:
+
+    None
+
+--*/
+{
+    pRecord->Index = (UCHAR)min(Index, (ULONG)MAXUCHAR);
+    pRecord->Direction = (UCHAR)pDescriptor->Direction;
+    pRecord->Length = (ULONG)pDescriptor->TransferLength;
+    pRecord->PayloadLength = (UCHAR)min(pRecord->Length, (ULONG)SPBPROBE_CAPTURE_PAYLOAD);
+
+    for (ULONG j = 0; j < pRecord->PayloadLength; j++)
+    {
+        RequestGetByte(pMdl, pDescriptor->TransferLength, j, &pRecord->Payload[j]);
+    }
+}
+
+VOID
+PbcCaptureSubmit(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine takes the records of the transfers to the
+    device of a request about to be sent, with the payload and
+    the time they are sent with. They are written to the ring
+    with the status of the request, when it completes.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    SPB_REQUEST_PARAMETERS parameters;
+    SPBPROBE_CAPTURE_RECORD record;
+    ULONG count = 0;
+
+    pDevice->SubmitRecordCount = 0;
+
+    if (s_Capture == NULL)
+    {
+        return;
+    }
+
+    SPB_REQUEST_PARAMETERS_INIT(&parameters);
+    SpbRequestGetParameters(ClientRequest, &parameters);
+
+    PbcCaptureInitRecord(pDevice, ClientRequest, parameters.SequenceTransferCount, &record);
+
+    record.Flags = SPBPROBE_CAPTURE_FLAG_SUBMIT;
+    record.Timestamp = PbcQueryTimestamp();
+
+    for (ULONG i = 0;
+         (i < parameters.SequenceTransferCount) && (count < PBC_CAPTURE_SUBMIT_RECORDS);
+         i++)
+    {
+        SPB_TRANSFER_DESCRIPTOR descriptor;
+        PMDL pMdl;
+
+        SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+        SpbRequestGetTransferParameters(ClientRequest, i, &descriptor, &pMdl);
+
+        if (descriptor.Direction != SpbTransferDirectionToDevice)
+        {
+            continue;
+        }
+
+        PbcCaptureCopyPayload(i, &descriptor, pMdl, &record);
+
+        RtlCopyMemory(&pDevice->SubmitRecords[count++], &record, sizeof(record));
+    }
+
+    pDevice->SubmitRecordCount = count;
+}
+
+BOOLEAN
+PbcCaptureIsFullDuplex(
+    _In_  SPBREQUEST        ClientRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine tells whether a request is a full duplex
+    transfer.
+
+  Arguments:
+
+    ClientRequest - the client request
+
+  Return Value:
+
+    TRUE for IOCTL_SPB_FULL_DUPLEX
+
+--*/
+{
+    WDF_REQUEST_PARAMETERS fxParams;
+
+    if (GetRequestContext(ClientRequest)->Type != SpbRequestTypeOther)
+    {
+        return FALSE;
+    }
+
+    WDF_REQUEST_PARAMETERS_INIT(&fxParams);
+    WdfRequestGetParameters(ClientRequest, &fxParams);
+
+    return (fxParams.Parameters.DeviceIoControl.IoControlCode == IOCTL_SPB_FULL_DUPLEX);
+}
+
+VOID
+PbcCaptureTransfers(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status
+    )
+/*++
+
+  Routine Description:
+
+    This routine captures one record per transfer of a
+    completed client request, with the first bytes of its
+    payload: the records of the writes taken when the request
+    was sent, and new ones for the reads and the writes that
+    were not taken. The write and the read of a full duplex
+    transfer are written as a pair.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+    Status - the completion status of the request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    SPB_REQUEST_PARAMETERS parameters;
+    SPBPROBE_CAPTURE_RECORD records[2];
+    SPBPROBE_CAPTURE_RECORD record;
+    SPBPROBE_CAPTURE_POLICY policy;
+    ULONG submitted = 0;
+    ULONG writes = 0;
+    ULONG count = 0;
+    UCHAR flags = 0;
+
+    if (GetRequestContext(ClientRequest)->Submitted)
+    {
+        submitted = pDevice->SubmitRecordCount;
+    }
+
+    pDevice->SubmitRecordCount = 0;
+
+    if (s_Capture == NULL)
+    {
+        return;
+    }
+
+    //
+    // The control device may change the policy meanwhile; any
+    // mix of the old and new fields is still valid.
+    //
+
+    policy = pDevice->CapturePolicy;
+
+    SPB_REQUEST_PARAMETERS_INIT(&parameters);
+    SpbRequestGetParameters(ClientRequest, &parameters);
+
+    PbcCaptureInitRecord(pDevice, ClientRequest, parameters.SequenceTransferCount, &record);
+
+    record.Status = Status;
+
+    if ((parameters.SequenceTransferCount == 2) && PbcCaptureIsFullDuplex(ClientRequest))
+    {
+        flags = SPBPROBE_CAPTURE_FLAG_FULL_DUPLEX;
+    }
+
+    for (ULONG i = 0; i < parameters.SequenceTransferCount; i++)
+    {
+        SPB_TRANSFER_DESCRIPTOR descriptor;
+        PMDL pMdl;
+
+        SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+        SpbRequestGetTransferParameters(ClientRequest, i, &descriptor, &pMdl);
+
+        if ((descriptor.Direction == SpbTransferDirectionToDevice) && (writes < submitted))
+        {
+            RtlCopyMemory(&records[count], &pDevice->SubmitRecords[writes], sizeof(record));
+
+            records[count].Status = Status;
+        }
+        else
+        {
+            RtlCopyMemory(&records[count], &record, sizeof(record));
+
+            PbcCaptureCopyPayload(i, &descriptor, pMdl, &records[count]);
+        }
+
+        if (descriptor.Direction == SpbTransferDirectionToDevice)
+        {
+            writes++;
+        }
+
+        records[count++].Flags |= flags;
+
+        //
+        // The MOSI record waits for its MISO record.
+        //
+
+        if ((flags != 0) && (count < 2))
+        {
+            continue;
+        }
+
+        (VOID)PbcCaptureWrite(records, count, &policy);
+
+        count = 0;
+    }
+}
+
+VOID
+PbcCaptureInterrupt(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          Timestamp
+    )
+/*++
+
+  Routine Description:
+
+    This routine captures an edge of the GPIO interrupt of the
+    device, with the time the ISR took it, so that it sorts
+    with the transfers on the same timeline.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    Timestamp - the time of the edge
+
+  Return Value:
+
+    None
+
+--*/
+{
+    SPBPROBE_CAPTURE_RECORD record;
+    SPBPROBE_CAPTURE_POLICY policy;
+
+    if (s_Capture == NULL)
+    {
+        return;
+    }
+
+    policy = pDevice->CapturePolicy;
+
+    RtlZeroMemory(&record, sizeof(record));
+
+    record.PeripheralId = pDevice->PeripheralId.QuadPart;
+    record.Timestamp = Timestamp;
+    record.Direction = (UCHAR)SpbTransferDirectionNone;
+    record.Flags = SPBPROBE_CAPTURE_FLAG_INTERRUPT;
+
+    (VOID)PbcCaptureWrite(&record, 1, &policy);
+}
+
+static
+FORCEINLINE
+ULONGLONG
+PbcCaptureNextSequence(
+    _In_  PPBC_CAPTURE      pCapture,
+    _In_  ULONG             Ring
+    )
+{
+    return pCapture->Cursors[Ring].Record.Sequence;
+}
+
+static
+BOOLEAN
+PbcCaptureStage(
+    _In_  PPBC_CAPTURE      pCapture,
+    _In_  ULONG             Ring
+    )
+/*++
+
+  Routine Description:
+
+    This routine copies the next record of a ring into its
+    cursor, skipping the records the processor overwrote. The
+    copy may still be overwritten before it is read; the
+    compare exchange of the tail tells.
+
+  Arguments:
+
+    pCapture - the capture state
+    Ring - the ring
+
+  Return Value:
+
+    TRUE if a record was copied
+
+--*/
+{
+    PPBC_CAPTURE_RING pRing = pCapture->Rings[Ring];
+    PPBC_CAPTURE_CURSOR pCursor = &pCapture->Cursors[Ring];
+
+    while (pCursor->Next < pCursor->End)
+    {
+        LONG64 tail;
+
+        RtlCopyMemory(
+            &pCursor->Record,
+            &pRing->Records[pCursor->Next & (PBC_CAPTURE_RING_RECORDS - 1)],
+            sizeof(SPBPROBE_CAPTURE_RECORD));
+
+        KeMemoryBarrier();
+
+        tail = ReadAcquire64(&pRing->Tail);
+
+        if (tail <= pCursor->Next)
+        {
+            return TRUE;
+        }
+
+        pCursor->Next = tail;
+    }
+
+    return FALSE;
+}
+
+static
+VOID
+PbcCaptureSiftDown(
+    _In_  PPBC_CAPTURE      pCapture,
+    _In_  ULONG             HeapSize,
+    _In_  ULONG             Position
+    )
+/*++
+
+  Routine Description:
+
+    This routine moves a ring down the heap of the collector
+    until its next record has the lowest sequence number of
+    its subtree.
+
+  Arguments:
+
+    pCapture - the capture state
+    HeapSize - the number of rings in the heap
+    Position - the position of the ring to move
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PULONG heap = pCapture->Heap;
+
+    for (;;)
+    {
+        ULONG smallest = Position;
+        ULONG left = 2 * Position + 1;
+        ULONG right = left + 1;
+
+        if ((left < HeapSize) &&
+            (PbcCaptureNextSequence(pCapture, heap[left]) <
+             PbcCaptureNextSequence(pCapture, heap[smallest])))
+        {
+            smallest = left;
+        }
+
+        if ((right < HeapSize) &&
+            (PbcCaptureNextSequence(pCapture, heap[right]) <
+             PbcCaptureNextSequence(pCapture, heap[smallest])))
+        {
+            smallest = right;
+        }
+
+        if (smallest == Position)
+        {
+            break;
+        }
+
+        ULONG ring = heap[Position];
+        heap[Position] = heap[smallest];
+        heap[smallest] = ring;
+
+        Position = smallest;
+    }
+}
+
+ULONG
+PbcCaptureRead(
+    _Out_writes_to_(Count, return) PSPBPROBE_CAPTURE_RECORD pRecords,
+    _In_  ULONG             Count
+    )
+/*++
+
+  Routine Description:
+
+    This routine moves up to Count records out of the rings,
+    in the order of their sequence number: a k-way merge of the
+    rings, each already ordered, through a min-heap.
+
+  Arguments:
+
+    pRecords - the records read
+    Count - the number of records that fit in pRecords
+
+  Return Value:
+
+    The number of records read
+
+--*/
+{
+    PPBC_CAPTURE pCapture;
+    ULONGLONG limit;
+    ULONG heapSize = 0;
+    ULONG count = 0;
+
+    pCapture = (PPBC_CAPTURE)ReadPointerAcquire((PVOID volatile *)&s_Capture);
+
+    if ((pCapture == NULL) || (Count == 0))
+    {
+        return 0;
+    }
+
+    WdfWaitLockAcquire(s_CaptureLock, NULL);
+
+    //
+    // Records are only read up to the lowest sequence number a
+    // processor may still be writing, so that no record can
+    // be published later with a lower number than one already
+    // read. The floors are read after the sequence number, and
+    // the heads after the floors.
+    //
+
+    limit = (ULONGLONG)ReadAcquire64(&s_CaptureSequence);
+
+    for (ULONG i = 0; i < pCapture->RingCount; i++)
+    {
+        ULONGLONG floor = (ULONGLONG)ReadAcquire64(&pCapture->Rings[i]->Floor);
+
+        if ((floor != 0) && (floor <= limit))
+        {
+            limit = floor - 1;
+        }
+    }
+
+    for (ULONG i = 0; i < pCapture->RingCount; i++)
+    {
+        PPBC_CAPTURE_CURSOR pCursor = &pCapture->Cursors[i];
+
+        pCursor->Next = ReadAcquire64(&pCapture->Rings[i]->Tail);
+        pCursor->End = ReadAcquire64(&pCapture->Rings[i]->Head);
+
+        if (PbcCaptureStage(pCapture, i) &&
+            (PbcCaptureNextSequence(pCapture, i) <= limit))
+        {
+            pCapture->Heap[heapSize++] = i;
+        }
+    }
+
+    for (ULONG i = heapSize / 2; i-- > 0;)
+    {
+        PbcCaptureSiftDown(pCapture, heapSize, i);
+    }
+
+    while ((heapSize > 0) && (count < Count))
+    {
+        ULONG ring = pCapture->Heap[0];
+        PPBC_CAPTURE_RING pRing = pCapture->Rings[ring];
+        PPBC_CAPTURE_CURSOR pCursor = &pCapture->Cursors[ring];
+
+        //
+        // Hand the slot back to the processor. If the processor
+        // took it first, the copy may be torn: it counted the
+        // record as lost, so go on from its tail.
+        //
+
+        if (InterlockedCompareExchange64(&pRing->Tail, pCursor->Next + 1, pCursor->Next) ==
+            pCursor->Next)
+        {
+            RtlCopyMemory(&pRecords[count++], &pCursor->Record, sizeof(SPBPROBE_CAPTURE_RECORD));
+
+            pCursor->Next++;
+        }
+        else
+        {
+            pCursor->Next = ReadAcquire64(&pRing->Tail);
+        }
+
+        if (!PbcCaptureStage(pCapture, ring) ||
+            (PbcCaptureNextSequence(pCapture, ring) > limit))
+        {
+            pCapture->Heap[0] = pCapture->Heap[--heapSize];
+        }
+
+        PbcCaptureSiftDown(pCapture, heapSize, 0);
+    }
+
+    WdfWaitLockRelease(s_CaptureLock);
+
+    return count;
+}
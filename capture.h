@@ -0,0 +1,90 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    capture.h
+
+Abstract:
+
+    This module contains the function definitions for the
+    per-processor capture buffers of the transfer records.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+//
+// Records per processor, a power of 2.
+//
+
+#define PBC_CAPTURE_RING_RECORDS    1024
+
+NTSTATUS
+PbcCaptureInitialize(
+    _In_  WDFDRIVER         FxDriver);
+
+VOID
+PbcCaptureCleanup(VOID);
+
+NTSTATUS
+PbcCaptureEnable(VOID);
+
+VOID
+PbcCaptureInitRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  ULONG             TransferCount,
+    _Out_ PSPBPROBE_CAPTURE_RECORD pRecord);
+
+VOID
+PbcCaptureCopyPayload(
+    _In_  ULONG             Index,
+    _In_  const SPB_TRANSFER_DESCRIPTOR *pDescriptor,
+    _In_  PMDL              pMdl,
+    _Inout_ PSPBPROBE_CAPTURE_RECORD pRecord);
+
+BOOLEAN
+PbcCaptureIsFullDuplex(
+    _In_  SPBREQUEST        ClientRequest);
+
+VOID
+PbcCaptureSubmit(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest);
+
+VOID
+PbcCaptureTransfers(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status);
+
+VOID
+PbcCaptureInterrupt(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          Timestamp);
+
+BOOLEAN
+PbcCapturePolicyIsValid(
+    _In_  const SPBPROBE_CAPTURE_POLICY *pPolicy);
+
+BOOLEAN
+PbcCaptureWrite(
+    _In_reads_(Count) const SPBPROBE_CAPTURE_RECORD *pRecords,
+    _In_  ULONG             Count,
+    _In_  const SPBPROBE_CAPTURE_POLICY *pPolicy);
+
+ULONG
+PbcCaptureRead(
+    _Out_writes_to_(Count, return) PSPBPROBE_CAPTURE_RECORD pRecords,
+    _In_  ULONG             Count);
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,598 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    coalesce.cpp
+
+Abstract:
+
+    This module merges a register address write and the read
+    following it inside a controller lock into a single
+    repeated-start sequence sent to the SPB controller.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "device.h"
+#include "peripheral.h"
+#include "coalesce.h"
+#include "cache.h"
+#include "recorder.h"
+
+#include "coalesce.tmh"
+
+BOOLEAN
+SpbPeripheralPostWrite(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine holds back a register address write issued
+    while the target owns the controller lock, and completes
+    it. The address is sent with the next read, or alone
+    before any other request. Longer writes carry data whose
+    status the client must get, and are never posted.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+    spbRequest - the client write request
+
+  Return Value:
+
+    TRUE if the write was posted and completed, FALSE if it
+    is to be sent to the controller
+
+--*/
+{
+    PPBC_POSTED_WRITE pPosted = &pDevice->PostedWrite;
+    SPB_TRANSFER_DESCRIPTOR descriptor;
+    PMDL pMdl;
+
+    if ((pTarget->CoalesceWriteRead == FALSE) ||
+        (pTarget->ControllerLock.Held == FALSE))
+    {
+        return FALSE;
+    }
+
+    NT_ASSERT(pPosted->Pending == FALSE);
+
+    SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+
+    SpbRequestGetTransferParameters(
+        spbRequest,
+        0,
+        &descriptor,
+        &pMdl);
+
+    if ((descriptor.TransferLength == 0) ||
+        (descriptor.TransferLength > PBC_MAX_REGISTER_BYTES))
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < (ULONG)descriptor.TransferLength; i++)
+    {
+        if (!NT_SUCCESS(RequestGetByte(
+            pMdl,
+            descriptor.TransferLength,
+            i,
+            &pPosted->Buffer[i])))
+        {
+            return FALSE;
+        }
+    }
+
+    pPosted->Length = (ULONG)descriptor.TransferLength;
+    pPosted->TransactionId = PbcTransactionId(spbRequest);
+    pPosted->pTarget = pTarget;
+    pPosted->Pending = TRUE;
+
+    pTarget->PostedWrites++;
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Posted write of %lu bytes for target 0x%hx, completing "
+        "client request %p (txn %I64u)",
+        pPosted->Length,
+        pTarget->Settings.Address,
+        spbRequest,
+        pPosted->TransactionId);
+
+    SpbPeripheralTraceComplete(pDevice, spbRequest, STATUS_SUCCESS);
+    PbcRecorderRecord(pDevice, spbRequest, STATUS_SUCCESS);
+
+    WdfRequestCompleteWithInformation(
+        spbRequest,
+        STATUS_SUCCESS,
+        pPosted->Length);
+
+    return TRUE;
+}
+
+BOOLEAN
+SpbPeripheralCoalescedRead(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        spbRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine sends the posted write and a read as a
+    2-transfer sequence.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    spbRequest - the client read request
+
+  Return Value:
+
+    TRUE if the read was merged with a posted write (the
+    request is completed asynchronously), FALSE otherwise
+
+--*/
+{
+    PPBC_POSTED_WRITE pPosted = &pDevice->PostedWrite;
+    SPB_TRANSFER_DESCRIPTOR readDescriptor;
+    PMDL pReadMdl;
+    ULONG reg;
+    NTSTATUS status;
+
+    if (pPosted->Pending == FALSE)
+    {
+        return FALSE;
+    }
+
+    FuncEntry(TRACE_FLAG_SPBAPI);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Formatting SPB request %p (txn %I64u) for coalesced write-read "
+        "with the posted write of txn %I64u",
+        pDevice->SpbRequest,
+        PbcTransactionId(spbRequest),
+        pPosted->TransactionId);
+
+    //
+    // Save the client request.
+    //
+
+    pDevice->ClientRequest = spbRequest;
+
+    SPB_TRANSFER_DESCRIPTOR_INIT(&readDescriptor);
+
+    SpbRequestGetTransferParameters(
+        spbRequest,
+        0,
+        &readDescriptor,
+        &pReadMdl);
+
+    const ULONG transfers = 2;
+
+    PBC_TRANSFER_LIST &seq = pDevice->TransferList;
+    SPB_TRANSFER_LIST_INIT(&(seq.List), transfers);
+
+    {
+        //
+        // PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
+        // "struct hack" size but using an index variable quiets
+        // the warning. This is a false positive from OACR.
+        //
+
+        const ULONG index = 0;
+
+        seq.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_NON_PAGED(
+            SpbTransferDirectionToDevice,
+            0,
+            pPosted->Buffer,
+            pPosted->Length);
+
+        seq.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+            SpbTransferDirectionFromDevice,
+            0,
+            pReadMdl);
+    }
+
+    //
+    // The posted data now belongs to this sequence. The buffer
+    // is not reused before the sequence completes since the
+    // queue is sequential.
+    //
+
+    pPosted->Pending = FALSE;
+    GetRequestContext(spbRequest)->CoalescedWriteLength = pPosted->Length;
+
+    //
+    // As in a write-read sequence, only the select of a cached
+    // register leaves the cached responses of the target valid.
+    //
+
+    if (!PbcCacheIsRegisterSelect(
+        pPosted->pTarget,
+        pPosted->Buffer,
+        pPosted->Length,
+        &reg))
+    {
+        PbcCacheInvalidate(pPosted->pTarget);
+    }
+
+    status = WdfMemoryAssignBuffer(
+        pDevice->InputMemory,
+        (PVOID)&seq,
+        sizeof(seq));
+
+    if (NT_SUCCESS(status))
+    {
+        status = WdfIoTargetFormatRequestForIoctl(
+            pDevice->TrueSpbController,
+            pDevice->SpbRequest,
+            IOCTL_SPB_EXECUTE_SEQUENCE,
+            pDevice->InputMemory,
+            nullptr,
+            nullptr,
+            nullptr);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = SpbPeripheralSendRequest(
+            pDevice,
+            pDevice->SpbRequest,
+            spbRequest);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        pPosted->pTarget->CoalescedReads++;
+    }
+    else
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_SPBAPI,
+            "Failed to send SPB request %p (txn %I64u) for "
+            "coalesced write-read - %!STATUS!",
+            pDevice->SpbRequest,
+            PbcTransactionId(spbRequest),
+            status);
+
+        SpbPeripheralCompleteRequestPair(
+            pDevice,
+            status,
+            0);
+    }
+
+    FuncExit(TRACE_FLAG_SPBAPI);
+
+    return TRUE;
+}
+
+BOOLEAN
+SpbPeripheralFlushPostedWrite(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        spbRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine sends a posted write on its own when the
+    next request cannot be merged with it. The request is
+    dispatched again once the write completes.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    spbRequest - the client request being dispatched
+
+  Return Value:
+
+    TRUE if the request is deferred until the posted write
+    completes, FALSE if it can be processed now
+
+--*/
+{
+    PPBC_POSTED_WRITE pPosted = &pDevice->PostedWrite;
+    SPB_REQUEST_PARAMETERS params;
+    NTSTATUS status;
+    ULONG reg;
+
+    if (pPosted->Pending == FALSE)
+    {
+        return FALSE;
+    }
+
+    //
+    // A read of the same target is merged, see
+    // SpbPeripheralCoalescedRead.
+    //
+
+    SPB_REQUEST_PARAMETERS_INIT(&params);
+    SpbRequestGetParameters(spbRequest, &params);
+
+    if ((params.Type == SpbRequestTypeRead) &&
+        (SpbRequestGetTarget(spbRequest) == pPosted->pTarget->SpbTarget))
+    {
+        return FALSE;
+    }
+
+    FuncEntry(TRACE_FLAG_SPBAPI);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Sending posted write of %lu bytes (txn %I64u) before client "
+        "request %p (txn %I64u)",
+        pPosted->Length,
+        pPosted->TransactionId,
+        spbRequest,
+        PbcTransactionId(spbRequest));
+
+    pPosted->Pending = FALSE;
+    pPosted->DeferredRequest = spbRequest;
+
+    //
+    // The request stays cancelable while the write is on the
+    // bus. A request already cancelled is completed once the
+    // write completes as well.
+    //
+
+    pPosted->DeferredCancelable = NT_SUCCESS(WdfRequestMarkCancelableEx(
+        spbRequest,
+        SpbPeripheralOnDeferredCancel));
+
+    if (!PbcCacheIsRegisterSelect(
+        pPosted->pTarget,
+        pPosted->Buffer,
+        pPosted->Length,
+        &reg))
+    {
+        PbcCacheInvalidate(pPosted->pTarget);
+    }
+
+    status = WdfMemoryAssignBuffer(
+        pDevice->InputMemory,
+        (PVOID)pPosted->Buffer,
+        pPosted->Length);
+
+    if (NT_SUCCESS(status))
+    {
+        status = WdfIoTargetFormatRequestForWrite(
+            pDevice->TrueSpbController,
+            pDevice->SpbRequest,
+            pDevice->InputMemory,
+            nullptr,
+            nullptr);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        GetRequestContext(pDevice->SpbRequest)->TransactionId = pPosted->TransactionId;
+
+        WdfRequestSetCompletionRoutine(
+            pDevice->SpbRequest,
+            SpbPeripheralOnFlushCompletion,
+            GetRequestContext(pDevice->SpbRequest));
+
+        if (!WdfRequestSend(
+            pDevice->SpbRequest,
+            pDevice->TrueSpbController,
+            WDF_NO_SEND_OPTIONS))
+        {
+            status = WdfRequestGetStatus(pDevice->SpbRequest);
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        WDF_REQUEST_COMPLETION_PARAMS completionParams;
+
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_SPBAPI,
+            "Failed to send SPB request %p (txn %I64u) for "
+            "posted write - %!STATUS!",
+            pDevice->SpbRequest,
+            pPosted->TransactionId,
+            status);
+
+        RtlZeroMemory(&completionParams, sizeof(completionParams));
+        completionParams.IoStatus.Status = status;
+
+        SpbPeripheralOnFlushCompletion(
+            pDevice->SpbRequest,
+            pDevice->TrueSpbController,
+            &completionParams,
+            GetRequestContext(pDevice->SpbRequest));
+    }
+
+    FuncExit(TRACE_FLAG_SPBAPI);
+
+    return TRUE;
+}
+
+VOID
+SpbPeripheralOnFlushCompletion(
+    _In_  WDFREQUEST                      spbRequest,
+    _In_  WDFIOTARGET                     FxTarget,
+    _In_  PWDF_REQUEST_COMPLETION_PARAMS  Params,
+    _In_  WDFCONTEXT                      Context
+    )
+/*++
+
+  Routine Description:
+
+    This routine is called when a posted write sent on its
+    own completes. It dispatches the deferred request again,
+    or completes it if it was cancelled meanwhile. A failure
+    of the write is counted against its target and traced,
+    but is not the status of the deferred request, which may
+    be of another client.
+
+  Arguments:
+
+    spbRequest - the framework request object
+    FxTarget - the framework IO target object
+    Params - a pointer to the request completion parameters
+    Context - the request context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_SPBAPI);
+
+    UNREFERENCED_PARAMETER(FxTarget);
+    UNREFERENCED_PARAMETER(Context);
+
+    PPBC_REQUEST pRequest = GetRequestContext(spbRequest);
+    PPBC_DEVICE pDevice = GetDeviceContext(pRequest->FxDevice);
+    PPBC_POSTED_WRITE pPosted = &pDevice->PostedWrite;
+    NTSTATUS status = Params->IoStatus.Status;
+    SPBREQUEST deferredRequest;
+    BOOLEAN cancelled = TRUE;
+
+    WDF_REQUEST_REUSE_PARAMS params;
+    WDF_REQUEST_REUSE_PARAMS_INIT(
+        &params,
+        WDF_REQUEST_REUSE_NO_FLAGS,
+        STATUS_SUCCESS);
+
+    WdfRequestReuse(pDevice->SpbRequest, &params);
+
+    deferredRequest = pPosted->DeferredRequest;
+    pPosted->DeferredRequest = nullptr;
+
+    if (!NT_SUCCESS(status))
+    {
+        pPosted->pTarget->FailedPostedWrites++;
+
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_SPBAPI,
+            "Posted write of %lu bytes (txn %I64u) to target 0x%hx failed, "
+            "completed with success before - %!STATUS!",
+            pPosted->Length,
+            pPosted->TransactionId,
+            pPosted->pTarget->Settings.Address,
+            status);
+    }
+
+    if (pPosted->DeferredCancelable)
+    {
+        cancelled = (WdfRequestUnmarkCancelable(deferredRequest) == STATUS_CANCELLED);
+    }
+
+    if (cancelled)
+    {
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_FLAG_SPBAPI,
+            "Client request %p (txn %I64u) cancelled behind a posted write",
+            deferredRequest,
+            PbcTransactionId(deferredRequest));
+
+        SpbRequestComplete(deferredRequest, STATUS_CANCELLED);
+        goto exit;
+    }
+
+    PbcRequestRedispatch(pDevice, deferredRequest);
+
+exit:
+
+    FuncExit(TRACE_FLAG_SPBAPI);
+}
+
+VOID
+SpbPeripheralOnDeferredCancel(
+    _In_  WDFREQUEST  spbRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine is called when a client request waiting for
+    a posted write to be sent alone is cancelled. The write
+    is left to complete, since its client was already told it
+    succeeded; the request is completed then, see
+    SpbPeripheralOnFlushCompletion.
+
+  Arguments:
+
+    spbRequest - the client request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_SPBAPI,
+        "Cancel received for client request %p (txn %I64u) waiting "
+        "for a posted write",
+        spbRequest,
+        PbcTransactionId(spbRequest));
+}
+
+VOID
+SpbPeripheralDropPostedWrite(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine discards the posted write of a target
+    disconnecting without releasing its lock.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_POSTED_WRITE pPosted = &pDevice->PostedWrite;
+
+    if ((pPosted->Pending == FALSE) || (pPosted->pTarget != pTarget))
+    {
+        return;
+    }
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_SPBAPI,
+        "Dropping posted write of %lu bytes (txn %I64u) to target 0x%hx",
+        pPosted->Length,
+        pPosted->TransactionId,
+        pTarget->Settings.Address);
+
+    pPosted->Pending = FALSE;
+    pPosted->pTarget = NULL;
+}
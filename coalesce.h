@@ -0,0 +1,49 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    coalesce.h
+
+Abstract:
+
+    This module contains the function definitions for
+    write/read coalescing.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _COALESCE_H_
+#define _COALESCE_H_
+
+EVT_WDF_REQUEST_COMPLETION_ROUTINE SpbPeripheralOnFlushCompletion;
+EVT_WDF_REQUEST_CANCEL             SpbPeripheralOnDeferredCancel;
+
+BOOLEAN
+SpbPeripheralPostWrite(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget,
+    _In_  SPBREQUEST        spbRequest);
+
+BOOLEAN
+SpbPeripheralCoalescedRead(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        spbRequest);
+
+BOOLEAN
+SpbPeripheralFlushPostedWrite(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        spbRequest);
+
+VOID
+SpbPeripheralDropPostedWrite(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget);
+
+#endif // _COALESCE_H_
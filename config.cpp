@@ -0,0 +1,724 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    config.cpp
+
+Abstract:
+
+    This module contains the routines reading the probe
+    configuration from the device parameters registry key.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "config.h"
+#include "capture.h"
+
+#include "config.tmh"
+
+static
+BOOLEAN
+PbcConfigListContains(
+    _In_reads_(Count)  PULONG   pValues,
+    _In_               ULONG    Count,
+    _In_               ULONG    Value
+    )
+{
+    for (ULONG i = 0; i < Count; i++)
+    {
+        if (pValues[i] == Value)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static
+ULONG
+PbcConfigQueryUlong(
+    _In_  WDFKEY   Key,
+    _In_  PCWSTR   ValueName,
+    _In_  ULONG    Default
+    )
+{
+    UNICODE_STRING valueName;
+    ULONG value;
+
+    RtlInitUnicodeString(&valueName, ValueName);
+
+    if (!NT_SUCCESS(WdfRegistryQueryULong(Key, &valueName, &value)))
+    {
+        value = Default;
+    }
+
+    return value;
+}
+
+static
+VOID
+PbcConfigLoadInjectionRules(
+    _In_  WDFKEY               Key,
+    _In_  PPBC_DEVICE_CONFIG   pConfig
+    )
+/*++
+
+  Routine Description:
+
+    This routine reads the fault and latency injection rules
+    from the numbered subkeys (0 to 7) of the Injection key.
+
+  Arguments:
+
+    Key - the device parameters key
+    pConfig - the configuration receiving the rules
+
+  Return Value:
+
+    None
+
+--*/
+{
+    DECLARE_CONST_UNICODE_STRING(injectionName, PBC_REGKEY_INJECTION);
+    DECLARE_UNICODE_STRING_SIZE(ruleName, 4);
+    WDFKEY injectionKey = WDF_NO_HANDLE;
+    WDFKEY ruleKey;
+    NTSTATUS status;
+
+    status = WdfRegistryOpenKey(
+        Key,
+        &injectionName,
+        KEY_READ,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &injectionKey);
+
+    if (!NT_SUCCESS(status))
+    {
+        return;
+    }
+
+    pConfig->InjectionSeed = PbcConfigQueryUlong(
+        Key,
+        PBC_REGVALUE_INJECTION_SEED,
+        1);
+
+    for (ULONG i = 0; i < PBC_MAX_INJECTION_RULES; i++)
+    {
+        PPBC_INJECTION_RULE pRule =
+            &pConfig->InjectionRules[pConfig->InjectionRuleCount];
+
+        RtlUnicodeStringPrintf(&ruleName, L"%lu", i);
+
+        status = WdfRegistryOpenKey(
+            injectionKey,
+            &ruleName,
+            KEY_READ,
+            WDF_NO_OBJECT_ATTRIBUTES,
+            &ruleKey);
+
+        if (!NT_SUCCESS(status))
+        {
+            continue;
+        }
+
+        pRule->Target = PbcConfigQueryUlong(
+            ruleKey, L"Target", PBC_INJECTION_ANY_TARGET);
+        pRule->RequestTypes = PbcConfigQueryUlong(ruleKey, L"Types", 0);
+        pRule->Every = PbcConfigQueryUlong(ruleKey, L"Every", 1);
+        pRule->LatencyUs = PbcConfigQueryUlong(ruleKey, L"LatencyUs", 0);
+        pRule->JitterUs = PbcConfigQueryUlong(ruleKey, L"JitterUs", 0);
+        pRule->FailStatus = (NTSTATUS)PbcConfigQueryUlong(
+            ruleKey, L"FailStatus", (ULONG)STATUS_SUCCESS);
+        pRule->TruncateBytes = PbcConfigQueryUlong(
+            ruleKey, L"TruncateBytes", 0);
+        pRule->DropCompletion =
+            (PbcConfigQueryUlong(ruleKey, L"DropCompletion", 0) != 0);
+
+        WdfRegistryClose(ruleKey);
+
+        if (pRule->Every == 0)
+        {
+            pRule->Every = 1;
+        }
+
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_PBCLOADING,
+            "Injection rule %lu: target 0x%lx types 0x%lx every %lu "
+            "latency %lu+%lu us fail %!STATUS! truncate %lu drop %d",
+            i,
+            pRule->Target,
+            pRule->RequestTypes,
+            pRule->Every,
+            pRule->LatencyUs,
+            pRule->JitterUs,
+            pRule->FailStatus,
+            pRule->TruncateBytes,
+            pRule->DropCompletion);
+
+        pConfig->InjectionRuleCount++;
+    }
+
+    WdfRegistryClose(injectionKey);
+}
+
+static
+VOID
+PbcConfigLoadRecorder(
+    _In_  WDFKEY               Key,
+    _In_  PPBC_DEVICE_CONFIG   pConfig
+    )
+/*++
+
+  Routine Description:
+
+    This routine reads the flight recorder settings from the
+    FlightRecorder key. Without the key, there is no recorder.
+
+  Arguments:
+
+    Key - the device parameters key
+    pConfig - the configuration receiving the settings
+
+  Return Value:
+
+    None
+
+--*/
+{
+    DECLARE_CONST_UNICODE_STRING(recorderName, PBC_REGKEY_FLIGHT_RECORDER);
+    PPBC_RECORDER_CONFIG pRecorder = &pConfig->Recorder;
+    WDFKEY recorderKey = WDF_NO_HANDLE;
+    NTSTATUS status;
+
+    status = WdfRegistryOpenKey(
+        Key,
+        &recorderName,
+        KEY_READ,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &recorderKey);
+
+    if (!NT_SUCCESS(status))
+    {
+        return;
+    }
+
+    pRecorder->WindowMs = PbcConfigQueryUlong(
+        recorderKey, L"WindowMs", PBC_DEFAULT_RECORDER_WINDOW_MS);
+    pRecorder->Bytes = min(PbcConfigQueryUlong(
+        recorderKey, L"Bytes", PBC_DEFAULT_RECORDER_BYTES), (ULONG)PBC_MAX_RECORDER_BYTES);
+    pRecorder->LatencyUs = PbcConfigQueryUlong(recorderKey, L"LatencyUs", 0);
+    pRecorder->PatternOffset = PbcConfigQueryUlong(recorderKey, L"PatternOffset", 0);
+    pRecorder->PatternMask = PbcConfigQueryUlong(recorderKey, L"PatternMask", 0);
+    pRecorder->PatternValue = PbcConfigQueryUlong(recorderKey, L"PatternValue", 0);
+
+    (VOID)PbcConfigQueryUlongList(
+        recorderKey,
+        L"Statuses",
+        pRecorder->Statuses,
+        PBC_MAX_RECORDER_STATUSES,
+        &pRecorder->StatusCount);
+
+    WdfRegistryClose(recorderKey);
+
+    if (pRecorder->Bytes < sizeof(SPBPROBE_CAPTURE_RECORD))
+    {
+        pRecorder->WindowMs = 0;
+    }
+
+    Trace(
+        TRACE_LEVEL_WARNING,
+        TRACE_FLAG_PBCLOADING,
+        "Flight recorder: last %lu ms in %lu bytes, dump on %lu "
+        "statuses, latency %lu us, pattern 0x%lx/0x%lx at %lu",
+        pRecorder->WindowMs,
+        pRecorder->Bytes,
+        pRecorder->StatusCount,
+        pRecorder->LatencyUs,
+        pRecorder->PatternValue,
+        pRecorder->PatternMask,
+        pRecorder->PatternOffset);
+}
+
+NTSTATUS
+PbcConfigQueryUlongList(
+    _In_                             WDFKEY   Key,
+    _In_                             PCWSTR   ValueName,
+    _Out_writes_(MaxValues)          PULONG   pValues,
+    _In_                             ULONG    MaxValues,
+    _Out_                            PULONG   pCount
+    )
+/*++
+
+  Routine Description:
+
+    This routine reads a REG_MULTI_SZ value holding one number
+    per string. Numbers are decimal, or hexadecimal when
+    prefixed with 0x.
+
+  Arguments:
+
+    Key - the registry key to read from
+    ValueName - the name of the value
+    pValues - the array receiving the numbers
+    MaxValues - the number of elements in pValues
+    pCount - receives the number of elements written to pValues
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    UNICODE_STRING valueName;
+    WDFMEMORY memory = WDF_NO_HANDLE;
+    ULONG valueType;
+    PWCHAR pBuffer;
+    size_t bufferSize;
+    size_t index = 0;
+    size_t length;
+    NTSTATUS status;
+
+    *pCount = 0;
+
+    RtlInitUnicodeString(&valueName, ValueName);
+
+    status = WdfRegistryQueryMemory(
+        Key,
+        &valueName,
+        PagedPool,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &memory,
+        &valueType);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    if (valueType != REG_MULTI_SZ)
+    {
+        status = STATUS_OBJECT_TYPE_MISMATCH;
+        goto exit;
+    }
+
+    pBuffer = (PWCHAR)WdfMemoryGetBuffer(memory, &bufferSize);
+    length = bufferSize / sizeof(WCHAR);
+
+    while ((index < length) && (pBuffer[index] != L'\0'))
+    {
+        UNICODE_STRING string;
+        size_t start = index;
+        ULONG value;
+
+        while ((index < length) && (pBuffer[index] != L'\0'))
+        {
+            index++;
+        }
+
+        string.Buffer = &pBuffer[start];
+        string.Length = (USHORT)((index - start) * sizeof(WCHAR));
+        string.MaximumLength = string.Length;
+
+        index++;
+
+        if (!NT_SUCCESS(RtlUnicodeStringToInteger(&string, 0, &value)))
+        {
+            Trace(
+                TRACE_LEVEL_WARNING,
+                TRACE_FLAG_PBCLOADING,
+                "Ignoring malformed entry %wZ in %ws",
+                &string,
+                ValueName);
+
+            continue;
+        }
+
+        if (*pCount == MaxValues)
+        {
+            Trace(
+                TRACE_LEVEL_WARNING,
+                TRACE_FLAG_PBCLOADING,
+                "Ignoring entries of %ws past the first %lu",
+                ValueName,
+                MaxValues);
+
+            break;
+        }
+
+        pValues[(*pCount)++] = value;
+    }
+
+exit:
+
+    if (memory != WDF_NO_HANDLE)
+    {
+        WdfObjectDelete(memory);
+    }
+
+    return status;
+}
+
+VOID
+PbcDeviceLoadConfiguration(
+    _In_  PPBC_DEVICE  pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine reads the device configuration from the
+    device parameters registry key. Missing values keep
+    their defaults.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_PBCLOADING);
+
+    PPBC_DEVICE_CONFIG pConfig = &pDevice->Config;
+    SPBPROBE_CAPTURE_POLICY policy;
+    WDFKEY key = WDF_NO_HANDLE;
+    NTSTATUS status;
+
+    //
+    // Defaults.
+    //
+
+    RtlZeroMemory(pConfig, sizeof(PBC_DEVICE_CONFIG));
+    pConfig->ForwardAllIoctls = TRUE;
+    pConfig->CacheTtlMs = PBC_DEFAULT_CACHE_TTL_MS;
+    pConfig->InjectionSeed = 1;
+    pConfig->TraceBuffers = PBC_TRACE_BUFFERS_TEXT & PBC_TRACE_STAGES;
+    pConfig->CapturePolicy.Mode = SpbProbeCaptureDropNewest;
+    pConfig->CapturePolicy.SampleRate = PBC_DEFAULT_CAPTURE_SAMPLE_RATE;
+    pConfig->CapturePolicy.WatermarkPercent = PBC_DEFAULT_CAPTURE_WATERMARK;
+
+    status = WdfDeviceOpenRegistryKey(
+        pDevice->FxDevice,
+        PLUGPLAY_REGKEY_DEVICE,
+        KEY_READ,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &key);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_PBCLOADING,
+            "Failed to open device parameters key, using defaults - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    //
+    // Custom IOCTL allow-list.
+    //
+
+    status = PbcConfigQueryUlongList(
+        key,
+        PBC_REGVALUE_FORWARDED_IOCTLS,
+        pConfig->ForwardedIoctls,
+        PBC_MAX_FORWARDED_IOCTLS,
+        &pConfig->ForwardedIoctlCount);
+
+    if (NT_SUCCESS(status))
+    {
+        pConfig->ForwardAllIoctls = FALSE;
+
+        for (ULONG i = 0; i < pConfig->ForwardedIoctlCount; i++)
+        {
+            Trace(
+                TRACE_LEVEL_INFORMATION,
+                TRACE_FLAG_PBCLOADING,
+                "Forwarding custom IOCTL 0x%lx",
+                pConfig->ForwardedIoctls[i]);
+        }
+    }
+
+    //
+    // Targets with write/read coalescing.
+    //
+
+    status = PbcConfigQueryUlongList(
+        key,
+        PBC_REGVALUE_COALESCED_TARGETS,
+        pConfig->CoalescedTargets,
+        PBC_MAX_CONFIG_TARGETS,
+        &pConfig->CoalescedTargetCount);
+
+    if (NT_SUCCESS(status))
+    {
+        for (ULONG i = 0; i < pConfig->CoalescedTargetCount; i++)
+        {
+            Trace(
+                TRACE_LEVEL_INFORMATION,
+                TRACE_FLAG_PBCLOADING,
+                "Coalescing writes and reads of target 0x%lx",
+                pConfig->CoalescedTargets[i]);
+        }
+    }
+
+    //
+    // Register read cache.
+    //
+
+    pConfig->CacheTtlMs = PbcConfigQueryUlong(
+        key,
+        PBC_REGVALUE_CACHE_TTL,
+        PBC_DEFAULT_CACHE_TTL_MS);
+
+    status = PbcConfigQueryUlongList(
+        key,
+        PBC_REGVALUE_CACHED_REGISTERS,
+        pConfig->CachedRegisters,
+        PBC_MAX_CACHED_REGISTERS,
+        &pConfig->CachedRegisterCount);
+
+    if (NT_SUCCESS(status))
+    {
+        for (ULONG i = 0; i < pConfig->CachedRegisterCount; i++)
+        {
+            Trace(
+                TRACE_LEVEL_INFORMATION,
+                TRACE_FLAG_PBCLOADING,
+                "Caching register 0x%lx of target 0x%lx for %lu ms",
+                pConfig->CachedRegisters[i] & 0xFFFF,
+                pConfig->CachedRegisters[i] >> 16,
+                pConfig->CacheTtlMs);
+        }
+    }
+
+    //
+    // Fault and latency injection.
+    //
+
+    PbcConfigLoadInjectionRules(key, pConfig);
+
+    //
+    // Flight recorder.
+    //
+
+    PbcConfigLoadRecorder(key, pConfig);
+
+    //
+    // Adaptive idle timeout.
+    //
+
+    pConfig->AdaptiveIdle = (PbcConfigQueryUlong(
+        key,
+        PBC_REGVALUE_ADAPTIVE_IDLE,
+        0) != 0);
+
+    //
+    // Buffer dumps.
+    //
+
+    pConfig->TraceBuffers = PbcConfigQueryUlong(
+        key,
+        PBC_REGVALUE_TRACE_BUFFERS,
+        PBC_TRACE_BUFFERS_TEXT) & PBC_TRACE_STAGES;
+
+    //
+    // Capture policy, left to the defaults unless valid as a
+    // whole.
+    //
+
+    policy.Mode = PbcConfigQueryUlong(
+        key,
+        PBC_REGVALUE_CAPTURE_POLICY,
+        pConfig->CapturePolicy.Mode);
+
+    policy.SampleRate = PbcConfigQueryUlong(
+        key,
+        PBC_REGVALUE_CAPTURE_SAMPLING,
+        pConfig->CapturePolicy.SampleRate);
+
+    policy.WatermarkPercent = PbcConfigQueryUlong(
+        key,
+        PBC_REGVALUE_CAPTURE_WATERMARK,
+        pConfig->CapturePolicy.WatermarkPercent);
+
+    if (PbcCapturePolicyIsValid(&policy))
+    {
+        pConfig->CapturePolicy = policy;
+    }
+    else
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_PBCLOADING,
+            "Ignoring capture policy %lu, 1 in %lu above %lu%%",
+            policy.Mode,
+            policy.SampleRate,
+            policy.WatermarkPercent);
+    }
+
+exit:
+
+    if (key != WDF_NO_HANDLE)
+    {
+        WdfRegistryClose(key);
+    }
+
+    FuncExit(TRACE_FLAG_PBCLOADING);
+}
+
+BOOLEAN
+PbcDeviceIsIoctlForwarded(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  ULONG        IoControlCode
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks a custom IOCTL against the allow-list.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    IoControlCode - the device IO control code
+
+  Return Value:
+
+    TRUE if the IOCTL is to be forwarded to the true controller
+
+--*/
+{
+    PPBC_DEVICE_CONFIG pConfig = &pDevice->Config;
+
+    if (pConfig->ForwardAllIoctls)
+    {
+        return TRUE;
+    }
+
+    return PbcConfigListContains(
+        pConfig->ForwardedIoctls,
+        pConfig->ForwardedIoctlCount,
+        IoControlCode);
+}
+
+BOOLEAN
+PbcDeviceIsTargetCoalesced(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  USHORT       Address
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks whether write/read coalescing is
+    enabled for a target.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    Address - the address of the target
+
+  Return Value:
+
+    TRUE if the writes of the target may be posted
+
+--*/
+{
+    PPBC_DEVICE_CONFIG pConfig = &pDevice->Config;
+
+    return PbcConfigListContains(
+        pConfig->CoalescedTargets,
+        pConfig->CoalescedTargetCount,
+        Address);
+}
+
+BOOLEAN
+PbcDeviceIsRegisterCached(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  USHORT       Address,
+    _In_  ULONG        Register
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks a register against the cache
+    allow-list.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    Address - the address of the target
+    Register - the register address bytes, the first byte
+        in the low byte
+
+  Return Value:
+
+    TRUE if the reads of the register may be cached
+
+--*/
+{
+    PPBC_DEVICE_CONFIG pConfig = &pDevice->Config;
+
+    if (Register > 0xFFFF)
+    {
+        return FALSE;
+    }
+
+    return PbcConfigListContains(
+        pConfig->CachedRegisters,
+        pConfig->CachedRegisterCount,
+        ((ULONG)Address << 16) | Register);
+}
+
+BOOLEAN
+PbcDeviceIsTargetCached(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  USHORT       Address
+    )
+/*++
+
+  Routine Description:
+
+    This routine checks whether any register of a target
+    is in the cache allow-list.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    Address - the address of the target
+
+  Return Value:
+
+    TRUE if the target needs a register read cache
+
+--*/
+{
+    PPBC_DEVICE_CONFIG pConfig = &pDevice->Config;
+
+    for (ULONG i = 0; i < pConfig->CachedRegisterCount; i++)
+    {
+        if ((pConfig->CachedRegisters[i] >> 16) == Address)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
@@ -0,0 +1,58 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    config.h
+
+Abstract:
+
+    This module contains the function definitions for
+    reading the probe configuration from the registry.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+NTSTATUS
+PbcConfigQueryUlongList(
+    _In_                             WDFKEY   Key,
+    _In_                             PCWSTR   ValueName,
+    _Out_writes_(MaxValues)          PULONG   pValues,
+    _In_                             ULONG    MaxValues,
+    _Out_                            PULONG   pCount);
+
+VOID
+PbcDeviceLoadConfiguration(
+    _In_  PPBC_DEVICE  pDevice);
+
+BOOLEAN
+PbcDeviceIsIoctlForwarded(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  ULONG        IoControlCode);
+
+BOOLEAN
+PbcDeviceIsTargetCoalesced(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  USHORT       Address);
+
+BOOLEAN
+PbcDeviceIsRegisterCached(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  USHORT       Address,
+    _In_  ULONG        Register);
+
+BOOLEAN
+PbcDeviceIsTargetCached(
+    _In_  PPBC_DEVICE  pDevice,
+    _In_  USHORT       Address);
+
+#endif // _CONFIG_H_
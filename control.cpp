@@ -0,0 +1,698 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    control.cpp
+
+Abstract:
+
+    This module contains the control device, which lets
+    user-mode tools query the probe devices. It exists while
+    at least one probe device exists, so that the driver can
+    still unload.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "control.h"
+#include "capture.h"
+#include "stats.h"
+
+#include <wdmsec.h>
+
+#include "control.tmh"
+
+static WDFDEVICE   s_ControlDevice = NULL;
+static WDFCOLLECTION s_Devices = NULL;
+static WDFWAITLOCK s_DevicesLock = NULL;
+
+NTSTATUS
+PbcControlInitialize(
+    _In_  WDFDRIVER         FxDriver
+    )
+/*++
+
+  Routine Description:
+
+    This routine creates the list of the probe devices.
+
+  Arguments:
+
+    FxDriver - the WDF driver object handle
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FxDriver;
+
+    status = WdfCollectionCreate(&attributes, &s_Devices);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to create device collection - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FxDriver;
+
+    status = WdfWaitLockCreate(&attributes, &s_DevicesLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to create device collection lock - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+exit:
+
+    return status;
+}
+
+static
+NTSTATUS
+PbcControlCreateDevice(
+    _In_  WDFDRIVER         FxDriver
+    )
+/*++
+
+  Routine Description:
+
+    This routine creates the control device and its
+    symbolic link. Only the system and administrators
+    can open it.
+
+  Arguments:
+
+    FxDriver - the WDF driver object handle
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    DECLARE_CONST_UNICODE_STRING(deviceName, SPBPROBE_DEVICE_NAME);
+    DECLARE_CONST_UNICODE_STRING(symbolicName, SPBPROBE_SYMBOLIC_NAME);
+    PWDFDEVICE_INIT pDeviceInit;
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    WDFDEVICE fxDevice = NULL;
+    WDFQUEUE fxQueue;
+    NTSTATUS status;
+
+    pDeviceInit = WdfControlDeviceInitAllocate(
+        FxDriver,
+        &SDDL_DEVOBJ_SYS_ALL_ADM_ALL);
+
+    if (pDeviceInit == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    status = WdfDeviceInitAssignName(pDeviceInit, &deviceName);
+
+    if (!NT_SUCCESS(status))
+    {
+        WdfDeviceInitFree(pDeviceInit);
+        goto exit;
+    }
+
+    status = WdfDeviceCreate(
+        &pDeviceInit,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &fxDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        WdfDeviceInitFree(pDeviceInit);
+        goto exit;
+    }
+
+    status = WdfDeviceCreateSymbolicLink(fxDevice, &symbolicName);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
+        &queueConfig,
+        WdfIoQueueDispatchSequential);
+
+    queueConfig.EvtIoDeviceControl = OnControlDeviceControl;
+
+    status = WdfIoQueueCreate(
+        fxDevice,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &fxQueue);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    WdfControlFinishInitializing(fxDevice);
+
+    s_ControlDevice = fxDevice;
+    fxDevice = NULL;
+
+exit:
+
+    if (fxDevice != NULL)
+    {
+        WdfObjectDelete(fxDevice);
+    }
+
+    return status;
+}
+
+VOID
+PbcControlRegisterDevice(
+    _In_  WDFDRIVER         FxDriver,
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine adds a probe device to the list queried
+    through the control device, creates the list of its
+    targets, and creates the control device with the first
+    probe device. Failures only disable the queries.
+
+  Arguments:
+
+    FxDriver - the WDF driver object handle
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
+
+    if (s_Devices == NULL)
+    {
+        return;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = pDevice->FxDevice;
+
+    status = WdfWaitLockCreate(&attributes, &pDevice->TargetsLock);
+
+    if (NT_SUCCESS(status))
+    {
+        status = WdfCollectionCreate(&attributes, &pDevice->Targets);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to create target collection of WDFDEVICE %p - %!STATUS!",
+            pDevice->FxDevice,
+            status);
+
+        pDevice->Targets = NULL;
+    }
+
+    WdfWaitLockAcquire(s_DevicesLock, NULL);
+
+    status = WdfCollectionAdd(s_Devices, pDevice->FxDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to add WDFDEVICE %p to the device collection - %!STATUS!",
+            pDevice->FxDevice,
+            status);
+
+        goto exit;
+    }
+
+    if (s_ControlDevice == NULL)
+    {
+        status = PbcControlCreateDevice(FxDriver);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_FLAG_WDFLOADING,
+                "Failed to create control device - %!STATUS!",
+                status);
+
+            goto exit;
+        }
+    }
+
+exit:
+
+    WdfWaitLockRelease(s_DevicesLock);
+}
+
+VOID
+PbcControlUnregisterDevice(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine removes a probe device from the list, and
+    deletes the control device with the last probe device.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (s_Devices == NULL)
+    {
+        return;
+    }
+
+    WdfWaitLockAcquire(s_DevicesLock, NULL);
+
+    for (ULONG i = 0; i < WdfCollectionGetCount(s_Devices); i++)
+    {
+        if (WdfCollectionGetItem(s_Devices, i) == pDevice->FxDevice)
+        {
+            WdfCollectionRemove(s_Devices, pDevice->FxDevice);
+            break;
+        }
+    }
+
+    if ((WdfCollectionGetCount(s_Devices) == 0) &&
+        (s_ControlDevice != NULL))
+    {
+        WdfObjectDelete(s_ControlDevice);
+        s_ControlDevice = NULL;
+    }
+
+    WdfWaitLockRelease(s_DevicesLock);
+}
+
+VOID
+PbcControlRegisterTarget(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine adds a connected target to the list of its
+    device. Failures only hide the target from the queries.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS status;
+
+    if (pDevice->Targets == NULL)
+    {
+        return;
+    }
+
+    WdfWaitLockAcquire(pDevice->TargetsLock, NULL);
+
+    status = WdfCollectionAdd(pDevice->Targets, pTarget->SpbTarget);
+
+    WdfWaitLockRelease(pDevice->TargetsLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_SPBDDI,
+            "Failed to add SPBTARGET %p to the target collection - %!STATUS!",
+            pTarget->SpbTarget,
+            status);
+    }
+}
+
+VOID
+PbcControlUnregisterTarget(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine removes a disconnecting target from the
+    list of its device, before its context goes away.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (pDevice->Targets == NULL)
+    {
+        return;
+    }
+
+    WdfWaitLockAcquire(pDevice->TargetsLock, NULL);
+
+    for (ULONG i = 0; i < WdfCollectionGetCount(pDevice->Targets); i++)
+    {
+        if (WdfCollectionGetItem(pDevice->Targets, i) == pTarget->SpbTarget)
+        {
+            WdfCollectionRemove(pDevice->Targets, pTarget->SpbTarget);
+            break;
+        }
+    }
+
+    WdfWaitLockRelease(pDevice->TargetsLock);
+}
+
+static
+NTSTATUS
+PbcControlQueryLockStatistics(
+    _In_   const SPBPROBE_LOCK_STATISTICS_INPUT *pInput,
+    _Out_  PSPBPROBE_LOCK_STATISTICS  pStatistics
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns the lock statistics of a target of
+    a probe device.
+
+  Arguments:
+
+    pInput - the indices of the device and of the target
+    pStatistics - the statistics returned to user-mode
+
+  Return Value:
+
+    STATUS_NO_MORE_ENTRIES past the last device or target
+
+--*/
+{
+    SPBPROBE_LOCK_STATISTICS_INPUT input = *pInput;
+    NTSTATUS status = STATUS_NO_MORE_ENTRIES;
+
+    WdfWaitLockAcquire(s_DevicesLock, NULL);
+
+    if (input.DeviceIndex < WdfCollectionGetCount(s_Devices))
+    {
+        PPBC_DEVICE pDevice = GetDeviceContext(
+            (WDFDEVICE)WdfCollectionGetItem(s_Devices, input.DeviceIndex));
+
+        if (pDevice->Targets != NULL)
+        {
+            WdfWaitLockAcquire(pDevice->TargetsLock, NULL);
+
+            if (input.TargetIndex < WdfCollectionGetCount(pDevice->Targets))
+            {
+                SPBTARGET spbTarget = (SPBTARGET)WdfCollectionGetItem(
+                    pDevice->Targets,
+                    input.TargetIndex);
+
+                PbcTargetQueryLockStatistics(
+                    pDevice,
+                    GetTargetContext(spbTarget),
+                    pStatistics);
+
+                status = STATUS_SUCCESS;
+            }
+
+            WdfWaitLockRelease(pDevice->TargetsLock);
+        }
+    }
+
+    WdfWaitLockRelease(s_DevicesLock);
+
+    return status;
+}
+
+VOID
+OnControlDeviceControl(
+    _In_  WDFQUEUE    FxQueue,
+    _In_  WDFREQUEST  FxRequest,
+    _In_  size_t      OutputBufferLength,
+    _In_  size_t      InputBufferLength,
+    _In_  ULONG       IoControlCode
+    )
+/*++
+
+  Routine Description:
+
+    This routine handles the IOCTLs of the control device:
+    the timeline and lock statistics queries, the reads of
+    the capture and the changes of the capture policies.
+
+  Arguments:
+
+    FxQueue - the queue of the control device
+    FxRequest - the request object
+    OutputBufferLength - the length of the output buffer
+    InputBufferLength - the length of the input buffer
+    IoControlCode - the IOCTL code
+
+  Return Value:
+
+    None
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_OTHER);
+
+    PULONG pIndex;
+    PSPBPROBE_TIMELINE pTimeline;
+    PSPBPROBE_CAPTURE_RECORD pRecords;
+    PSPBPROBE_CAPTURE_POLICY_INPUT pPolicy;
+    PSPBPROBE_LOCK_STATISTICS_INPUT pLockInput;
+    PSPBPROBE_LOCK_STATISTICS pLockStatistics;
+    ULONG_PTR information = 0;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(FxQueue);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    if (IoControlCode == IOCTL_SPBPROBE_READ_CAPTURE)
+    {
+        status = WdfRequestRetrieveOutputBuffer(
+            FxRequest,
+            sizeof(SPBPROBE_CAPTURE_RECORD),
+            (PVOID*)&pRecords,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            goto exit;
+        }
+
+        information = sizeof(SPBPROBE_CAPTURE_RECORD) * PbcCaptureRead(
+            pRecords,
+            (ULONG)min(OutputBufferLength / sizeof(SPBPROBE_CAPTURE_RECORD), (size_t)MAXULONG));
+
+        goto exit;
+    }
+
+    if (IoControlCode == IOCTL_SPBPROBE_SET_CAPTURE_POLICY)
+    {
+        status = WdfRequestRetrieveInputBuffer(
+            FxRequest,
+            sizeof(SPBPROBE_CAPTURE_POLICY_INPUT),
+            (PVOID*)&pPolicy,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            goto exit;
+        }
+
+        if (!PbcCapturePolicyIsValid(&pPolicy->Policy))
+        {
+            status = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        WdfWaitLockAcquire(s_DevicesLock, NULL);
+
+        if (pPolicy->DeviceIndex < WdfCollectionGetCount(s_Devices))
+        {
+            WDFDEVICE fxDevice =
+                (WDFDEVICE)WdfCollectionGetItem(s_Devices, pPolicy->DeviceIndex);
+
+            GetDeviceContext(fxDevice)->CapturePolicy = pPolicy->Policy;
+
+            Trace(
+                TRACE_LEVEL_INFORMATION,
+                TRACE_FLAG_OTHER,
+                "Capture policy of WDFDEVICE %p set to %lu, 1 in %lu above %lu%%",
+                fxDevice,
+                pPolicy->Policy.Mode,
+                pPolicy->Policy.SampleRate,
+                pPolicy->Policy.WatermarkPercent);
+        }
+        else
+        {
+            status = STATUS_NO_MORE_ENTRIES;
+        }
+
+        WdfWaitLockRelease(s_DevicesLock);
+
+        goto exit;
+    }
+
+    if (IoControlCode == IOCTL_SPBPROBE_QUERY_LOCK_STATISTICS)
+    {
+        status = WdfRequestRetrieveInputBuffer(
+            FxRequest,
+            sizeof(SPBPROBE_LOCK_STATISTICS_INPUT),
+            (PVOID*)&pLockInput,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            goto exit;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(
+            FxRequest,
+            sizeof(SPBPROBE_LOCK_STATISTICS),
+            (PVOID*)&pLockStatistics,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            goto exit;
+        }
+
+        //
+        // The input and output share the system buffer, the
+        // input is copied first.
+        //
+
+        status = PbcControlQueryLockStatistics(pLockInput, pLockStatistics);
+
+        if (NT_SUCCESS(status))
+        {
+            information = sizeof(SPBPROBE_LOCK_STATISTICS);
+        }
+
+        goto exit;
+    }
+
+    if (IoControlCode != IOCTL_SPBPROBE_QUERY_TIMELINE)
+    {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        goto exit;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(
+        FxRequest,
+        sizeof(ULONG),
+        (PVOID*)&pIndex,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(
+        FxRequest,
+        sizeof(SPBPROBE_TIMELINE),
+        (PVOID*)&pTimeline,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    //
+    // The input and output share the system buffer, the
+    // index is read before the timeline is copied.
+    //
+
+    {
+        ULONG index = *pIndex;
+
+        WdfWaitLockAcquire(s_DevicesLock, NULL);
+
+        if (index < WdfCollectionGetCount(s_Devices))
+        {
+            WDFDEVICE fxDevice =
+                (WDFDEVICE)WdfCollectionGetItem(s_Devices, index);
+
+            RtlCopyMemory(
+                pTimeline,
+                &GetDeviceContext(fxDevice)->Timeline,
+                sizeof(SPBPROBE_TIMELINE));
+
+            information = sizeof(SPBPROBE_TIMELINE);
+        }
+        else
+        {
+            status = STATUS_NO_MORE_ENTRIES;
+        }
+
+        WdfWaitLockRelease(s_DevicesLock);
+    }
+
+exit:
+
+    WdfRequestCompleteWithInformation(FxRequest, status, information);
+
+    FuncExit(TRACE_FLAG_OTHER);
+}
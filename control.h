@@ -0,0 +1,50 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    control.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the probe control device.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL  OnControlDeviceControl;
+
+NTSTATUS
+PbcControlInitialize(
+    _In_  WDFDRIVER         FxDriver);
+
+VOID
+PbcControlRegisterDevice(
+    _In_  WDFDRIVER         FxDriver,
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+PbcControlUnregisterDevice(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+PbcControlRegisterTarget(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget);
+
+VOID
+PbcControlUnregisterTarget(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget);
+
+#endif // _CONTROL_H_
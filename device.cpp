@@ -22,11 +22,171 @@ Revision History:
 #include "internal.h"
 #include "device.h"
 #include "peripheral.h"
+#include "stats.h"
+#include "config.h"
+#include "coalesce.h"
+#include "cache.h"
+#include "idle.h"
+#include "capture.h"
+#include "control.h"
 
 #include "device.tmh"
 
 #pragma warning(disable:4100)
 
+//
+// Last transaction ID given, over all the devices.
+//
+
+static volatile LONG64 s_PbcTransactionId = 0;
+
+static
+VOID
+PbcRequestStartTransaction(
+	_In_  SPBREQUEST        SpbRequest
+)
+/*++
+
+Routine Description:
+
+This routine gives a client request its transaction ID when it
+is first dispatched. A request dispatched again after a posted
+write keeps its ID.
+
+Arguments:
+
+SpbRequest - a handle to the SPBREQUEST object
+
+Return Value:
+
+None
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(SpbRequest);
+
+	if (pRequest->TransactionId == 0)
+	{
+		pRequest->TransactionId = (ULONGLONG)InterlockedIncrement64(&s_PbcTransactionId);
+	}
+}
+
+static
+VOID
+PbcRequestSetTarget(
+	_In_  SPBREQUEST        SpbRequest,
+	_In_  PPBC_TARGET       pTarget,
+	_In_  SPB_REQUEST_TYPE  Type
+)
+/*++
+
+Routine Description:
+
+This routine records the target and the type of a client
+request in its context.
+
+Arguments:
+
+SpbRequest - a handle to the SPBREQUEST object
+pTarget - a pointer to the target context
+Type - the SPB request type
+
+Return Value:
+
+None
+
+--*/
+{
+	PPBC_REQUEST pRequest = GetRequestContext(SpbRequest);
+
+	NT_ASSERT(pRequest != NULL);
+
+	pRequest->pTarget = pTarget;
+	pRequest->Type = Type;
+	pRequest->CoalescedWriteLength = 0;
+	pRequest->DispatchTime = PbcQueryTimestamp();
+	pRequest->SendTime = 0;
+	pRequest->Submitted = FALSE;
+	pRequest->CacheFill = FALSE;
+}
+
+static
+VOID
+PbcDeviceCreateInterrupt(
+	_In_  PPBC_DEVICE                      pDevice,
+	_In_  PCM_PARTIAL_RESOURCE_DESCRIPTOR  pRawDescriptor,
+	_In_  PCM_PARTIAL_RESOURCE_DESCRIPTOR  pDescriptor
+)
+/*++
+
+Routine Description:
+
+This routine connects to the GPIO interrupt of the peripheral,
+to timestamp its edges. The interrupt belongs to the client
+driver: it is shared, and the device starts without it if it
+cannot be connected.
+
+Arguments:
+
+pDevice - a pointer to the device context
+pRawDescriptor - the raw interrupt resource
+pDescriptor - the translated interrupt resource
+
+Return Value:
+
+None
+
+--*/
+{
+	WDF_INTERRUPT_CONFIG interruptConfig;
+	WDF_OBJECT_ATTRIBUTES interruptAttributes;
+	NTSTATUS status;
+
+	if (pDevice->Interrupt != WDF_NO_HANDLE)
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_FLAG_WDFLOADING,
+			"Ignoring additional interrupt resource");
+
+		return;
+	}
+
+	WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, OnInterruptIsr, OnInterruptDpc);
+
+	interruptConfig.ShareVector = WdfTrue;
+	interruptConfig.InterruptRaw = pRawDescriptor;
+	interruptConfig.InterruptTranslated = pDescriptor;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&interruptAttributes);
+
+	status = WdfInterruptCreate(
+		pDevice->FxDevice,
+		&interruptConfig,
+		&interruptAttributes,
+		&pDevice->Interrupt);
+
+	if (!NT_SUCCESS(status))
+	{
+		pDevice->Interrupt = WDF_NO_HANDLE;
+
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_FLAG_WDFLOADING,
+			"Failed to connect interrupt, edges are not "
+			"timestamped - %!STATUS!",
+			status);
+
+		return;
+	}
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_WDFLOADING,
+		"Interrupt resource found, %s triggered",
+		(pDescriptor->Flags & CM_RESOURCE_INTERRUPT_LATCHED) ? "edge" : "level");
+}
+
 
 /////////////////////////////////////////////////
 //
@@ -44,7 +204,9 @@ OnPrepareHardware(
 
 Routine Description:
 
-This routine caches the SPB resource connection ID.
+This routine caches the SPB resource connection ID, connects
+to the GPIO interrupt if there is one, and opens the SPB
+target with the request used to forward client requests.
 
 Arguments:
 
@@ -63,11 +225,10 @@ Status
 	FuncEntry(TRACE_FLAG_WDFLOADING);
 
 	PPBC_DEVICE pDevice = GetDeviceContext(FxDevice);
+	LONGLONG startTime = PbcQueryTimestamp();
 	BOOLEAN fSpbResourceFound = FALSE;
 	NTSTATUS status = STATUS_SUCCESS;
 
-	UNREFERENCED_PARAMETER(FxResourcesRaw);
-
 	//
 	// Parse the peripheral's resources.
 	//
@@ -105,6 +266,9 @@ Status
 					pDevice->PeripheralId.HighPart =
 						pDescriptor->u.Connection.IdHighPart;
 
+					pDevice->Timeline.PeripheralId =
+						pDevice->PeripheralId.QuadPart;
+
 					fSpbResourceFound = TRUE;
 
 					Trace(
@@ -125,6 +289,19 @@ Status
 
 			break;
 
+		case CmResourceTypeInterrupt:
+
+			//
+			// Optional GPIO interrupt of the peripheral.
+			//
+
+			PbcDeviceCreateInterrupt(
+				pDevice,
+				WdfCmResourceListGetDescriptor(FxResourcesRaw, i),
+				pDescriptor);
+
+			break;
+
 		default:
 
 			//
@@ -147,8 +324,112 @@ Status
 			TRACE_FLAG_WDFLOADING,
 			"SPB resource not found - %!STATUS!",
 			status);
+
+		goto exit;
+	}
+
+	//
+	// Create the SPB target. It stays open until the hardware
+	// is released, and is only started and stopped on power
+	// transitions.
+	//
+
+	WDF_OBJECT_ATTRIBUTES targetAttributes;
+	WDF_OBJECT_ATTRIBUTES_INIT(&targetAttributes);
+
+	status = WdfIoTargetCreate(
+		pDevice->FxDevice,
+		&targetAttributes,
+		&pDevice->TrueSpbController);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_WDFLOADING,
+			"Failed to create IO target - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Create the input memory of the SPB request once, over the
+	// transfer list of the device. Each send points it at the
+	// buffer it needs with WdfMemoryAssignBuffer.
+	//
+
+	WDF_OBJECT_ATTRIBUTES memoryAttributes;
+	WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttributes);
+
+	status = WdfMemoryCreatePreallocated(
+		&memoryAttributes,
+		(PVOID)&pDevice->TransferList,
+		sizeof(pDevice->TransferList),
+		&pDevice->InputMemory);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_WDFLOADING,
+			"Failed to create WDFMEMORY - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	//
+	// Create the SPB request.
+	//
+
+	WDF_OBJECT_ATTRIBUTES requestAttributes;
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, PBC_REQUEST);
+
+	status = WdfRequestCreate(
+		&requestAttributes,
+		pDevice->TrueSpbController,
+		&pDevice->SpbRequest);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_WDFLOADING,
+			"Failed to create IO request - %!STATUS!",
+			status);
+
+		goto exit;
 	}
 
+	GetRequestContext(pDevice->SpbRequest)->FxDevice = pDevice->FxDevice;
+
+	//
+	// The device starts even if the controller is not reachable
+	// yet; the open is retried when a client connects a target.
+	//
+
+	status = SpbPeripheralOpen(pDevice);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_FLAG_WDFLOADING,
+			"SPB target not opened, retrying on target connect - %!STATUS!",
+			status);
+
+		status = STATUS_SUCCESS;
+	}
+
+	PbcTimelineRecord(
+		pDevice,
+		SpbProbePhasePrepareHardware,
+		startTime,
+		PbcQueryTimestamp());
+
+exit:
+
 	FuncExit(TRACE_FLAG_WDFLOADING);
 
 	return status;
@@ -163,6 +444,9 @@ OnReleaseHardware(
 
 Routine Description:
 
+This routine closes the SPB target and deletes the
+objects created in OnPrepareHardware.
+
 Arguments:
 
 FxDevice - a handle to the framework device object
@@ -177,10 +461,40 @@ Status
 {
 	FuncEntry(TRACE_FLAG_WDFLOADING);
 
+	PPBC_DEVICE pDevice = GetDeviceContext(FxDevice);
 	NTSTATUS status = STATUS_SUCCESS;
 
 	UNREFERENCED_PARAMETER(FxResourcesTranslated);
 
+	PbcDeviceTraceStatistics(pDevice);
+
+	SpbPeripheralClose(pDevice);
+
+	if (pDevice->SpbRequest != WDF_NO_HANDLE)
+	{
+		WdfObjectDelete(pDevice->SpbRequest);
+		pDevice->SpbRequest = WDF_NO_HANDLE;
+	}
+
+	if (pDevice->InputMemory != WDF_NO_HANDLE)
+	{
+		WdfObjectDelete(pDevice->InputMemory);
+		pDevice->InputMemory = WDF_NO_HANDLE;
+	}
+
+	if (pDevice->TrueSpbController != WDF_NO_HANDLE)
+	{
+		WdfObjectDelete(pDevice->TrueSpbController);
+		pDevice->TrueSpbController = WDF_NO_HANDLE;
+	}
+
+	//
+	// The framework deletes the interrupt created in
+	// OnPrepareHardware.
+	//
+
+	pDevice->Interrupt = WDF_NO_HANDLE;
+
 	FuncExit(TRACE_FLAG_WDFLOADING);
 
 	return status;
@@ -195,7 +509,8 @@ OnD0Entry(
 
 Routine Description:
 
-This routine allocates objects needed by the driver.
+This routine starts the SPB target when the device
+enters D0.
 
 Arguments:
 
@@ -213,66 +528,38 @@ Status
 	UNREFERENCED_PARAMETER(FxPreviousState);
 
 	PPBC_DEVICE pDevice = GetDeviceContext(FxDevice);
+	LONGLONG startTime = PbcQueryTimestamp();
 	NTSTATUS status;
 
 	//
-	// Create the SPB target.
+	// Restart the SPB target opened in OnPrepareHardware. A
+	// target not opened yet is started by its open.
 	//
 
-	WDF_OBJECT_ATTRIBUTES targetAttributes;
-	WDF_OBJECT_ATTRIBUTES_INIT(&targetAttributes);
-
-	status = WdfIoTargetCreate(
-		pDevice->FxDevice,
-		&targetAttributes,
-		&pDevice->TrueSpbController);
+	status = pDevice->SpbTargetOpen ?
+		WdfIoTargetStart(pDevice->TrueSpbController) :
+		STATUS_SUCCESS;
 
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_WDFLOADING,
-			"Failed to create IO target - %!STATUS!",
+			"Failed to start IO target - %!STATUS!",
 			status);
 	}
-
-	//
-	// InputMemory will be created when an SPB request is about to be
-	// sent. Indicate that it is not yet initialized.
-	//
-
-	pDevice->InputMemory = WDF_NO_HANDLE;
-
-	//
-	// Create the SPB request.
-	//
-
-	if (NT_SUCCESS(status))
+	else
 	{
-		WDF_OBJECT_ATTRIBUTES requestAttributes;
-		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, PBC_REQUEST);
+		pDevice->ResumeTime = PbcQueryTimestamp();
+		pDevice->D0Entries++;
 
-		status = WdfRequestCreate(
-			&requestAttributes,
-			nullptr,
-			&pDevice->SpbRequest);
+		PbcTimelineRecord(
+			pDevice,
+			SpbProbePhaseD0Entry,
+			startTime,
+			pDevice->ResumeTime);
 
-		if (!NT_SUCCESS(status))
-		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_FLAG_WDFLOADING,
-				"Failed to create IO request - %!STATUS!",
-				status);
-		}
-
-		if (NT_SUCCESS(status))
-		{
-			PPBC_REQUEST pRequest = GetRequestContext(
-				pDevice->SpbRequest);
-
-			pRequest->FxDevice = pDevice->FxDevice;
-		}
+		PbcIdleCountD0Entry(pDevice, startTime, pDevice->ResumeTime);
 	}
 
 	FuncExit(TRACE_FLAG_WDFLOADING);
@@ -289,7 +576,8 @@ OnD0Exit(
 
 Routine Description:
 
-This routine destroys objects needed by the driver.
+This routine stops the SPB target when the device
+leaves D0.
 
 Arguments:
 
@@ -307,30 +595,124 @@ Status
 	UNREFERENCED_PARAMETER(FxPreviousState);
 
 	PPBC_DEVICE pDevice = GetDeviceContext(FxDevice);
+	LONGLONG startTime = PbcQueryTimestamp();
 
-	if (pDevice->TrueSpbController != WDF_NO_HANDLE)
-	{
-		WdfObjectDelete(pDevice->TrueSpbController);
-		pDevice->TrueSpbController = WDF_NO_HANDLE;
-	}
+	//
+	// The target and the SPB request are kept until the
+	// hardware is released.
+	//
 
-	if (pDevice->SpbRequest != WDF_NO_HANDLE)
+	if (pDevice->SpbTargetOpen)
 	{
-		WdfObjectDelete(pDevice->SpbRequest);
-		pDevice->SpbRequest = WDF_NO_HANDLE;
+		WdfIoTargetStop(
+			pDevice->TrueSpbController,
+			WdfIoTargetLeaveSentIoPending);
 	}
 
-	if (pDevice->InputMemory != WDF_NO_HANDLE)
-	{
-		WdfObjectDelete(pDevice->InputMemory);
-		pDevice->InputMemory = WDF_NO_HANDLE;
-	}
+	pDevice->ResumeTime = 0;
+
+	//
+	// An edge not followed by a read before the device left D0
+	// is not counted against the reads after the next D0 entry.
+	//
+
+	InterlockedExchange64(&pDevice->PendingInterruptTime, 0);
+
+	PbcIdleCountD0Exit(pDevice, startTime);
 
 	FuncExit(TRACE_FLAG_WDFLOADING);
 
 	return STATUS_SUCCESS;
 }
 
+BOOLEAN
+OnInterruptIsr(
+	_In_  WDFINTERRUPT  FxInterrupt,
+	_In_  ULONG         MessageID
+)
+/*++
+
+Routine Description:
+
+This routine timestamps an edge of the GPIO interrupt of the
+peripheral, on the timeline of the transfers, and defers the
+rest to the DPC. The interrupt is left to the client driver.
+
+The ISRs of a shared line are called in turn until one claims
+the interrupt. On a level-triggered line, an ISR of the client
+driver connected ahead of the probe ends the chain before this
+routine runs, and the edge is never seen. The reads completed
+without a pending edge are counted so that this shows up in
+the device statistics.
+
+Arguments:
+
+FxInterrupt - a handle to the framework interrupt object
+MessageID - the message ID, unused for a line interrupt
+
+Return Value:
+
+FALSE, the interrupt is never claimed
+
+--*/
+{
+	UNREFERENCED_PARAMETER(MessageID);
+
+	PPBC_DEVICE pDevice = GetDeviceContext(WdfInterruptGetDevice(FxInterrupt));
+	LONGLONG timestamp = PbcQueryTimestamp();
+
+	InterlockedExchange64(&pDevice->InterruptTime, timestamp);
+	InterlockedCompareExchange64(&pDevice->PendingInterruptTime, timestamp, 0);
+	InterlockedIncrement(&pDevice->Interrupts);
+
+	WdfInterruptQueueDpcForIsr(FxInterrupt);
+
+	return FALSE;
+}
+
+VOID
+OnInterruptDpc(
+	_In_  WDFINTERRUPT  FxInterrupt,
+	_In_  WDFOBJECT     FxAssociatedObject
+)
+/*++
+
+Routine Description:
+
+This routine traces the last edge timestamped by the ISR and
+writes it to the capture buffers. Edges coming faster than the
+DPC runs are counted but only the last one is recorded.
+
+Arguments:
+
+FxInterrupt - a handle to the framework interrupt object
+FxAssociatedObject - the device the interrupt belongs to
+
+Return Value:
+
+None
+
+--*/
+{
+	UNREFERENCED_PARAMETER(FxAssociatedObject);
+
+	PPBC_DEVICE pDevice = GetDeviceContext(WdfInterruptGetDevice(FxInterrupt));
+	LONGLONG timestamp = ReadAcquire64(&pDevice->InterruptTime);
+
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		TRACE_FLAG_OTHER,
+		"device %I64d: interrupt #%ld at %I64d",
+		pDevice->PeripheralId.QuadPart,
+		ReadAcquire(&pDevice->Interrupts),
+		timestamp);
+
+	if (pDevice->Config.TraceBuffers & PBC_TRACE_STAGES & PBC_TRACE_BUFFERS_CAPTURE)
+	{
+		PbcCaptureInterrupt(pDevice, timestamp);
+	}
+}
+
 NTSTATUS
 OnTargetConnect(
     _In_  WDFDEVICE  SpbController,
@@ -364,6 +746,7 @@ OnTargetConnect(
     NT_ASSERT(pDevice != NULL);
     NT_ASSERT(pTarget != NULL);
     
+    LONGLONG startTime = PbcQueryTimestamp();
     NTSTATUS status = STATUS_SUCCESS;
 
     //
@@ -373,7 +756,33 @@ OnTargetConnect(
     SPB_CONNECTION_PARAMETERS params;
     SPB_CONNECTION_PARAMETERS_INIT(&params);
 
-    SpbTargetGetConnectionParameters(SpbTarget, &params);
+    SpbTargetGetConnectionParameters(SpbTarget, &params);
+
+	//
+	// Open the SPB target if it failed to open when the
+	// hardware was prepared. The connect fails if it still
+	// cannot be opened.
+	//
+
+	WdfWaitLockAcquire(pDevice->SpbTargetLock, NULL);
+
+	if (!pDevice->SpbTargetOpen)
+	{
+		status = SpbPeripheralOpen(pDevice);
+	}
+
+	WdfWaitLockRelease(pDevice->SpbTargetLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBDDI,
+			"Can't open the underlying device - %!STATUS!",
+			status);
+
+		goto exit;
+	}
 
 	//
 	// Retrieve target settings.
@@ -392,6 +801,11 @@ OnTargetConnect(
 	{
 		pTarget->SpbTarget = SpbTarget;
 		pTarget->pCurrentRequest = NULL;
+		pTarget->CoalesceWriteRead = PbcDeviceIsTargetCoalesced(
+			pDevice,
+			pTarget->Settings.Address);
+
+		PbcCacheAttach(pDevice, pTarget);
 
 		Trace(
 			TRACE_LEVEL_INFORMATION,
@@ -400,18 +814,18 @@ OnTargetConnect(
 			pTarget->SpbTarget,
 			pTarget->Settings.Address,
 			pDevice->FxDevice);
-	}
 
-	status = SpbPeripheralOpen(pDevice);
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBDDI,
-			"Can't open the underlying device -  %!STATUS!",
-			status);
+		PbcControlRegisterTarget(pDevice, pTarget);
+
+		PbcTimelineRecord(
+			pDevice,
+			SpbProbePhaseTargetConnect,
+			startTime,
+			PbcQueryTimestamp());
 	}
 
+exit:
+
 	FuncExit(TRACE_FLAG_SPBDDI);
 
     return status;
@@ -449,7 +863,25 @@ None
 	NT_ASSERT(pDevice != NULL);
 	NT_ASSERT(pTarget != NULL);
 
-	SpbPeripheralClose(pDevice);
+	PbcControlUnregisterTarget(pDevice, pTarget);
+
+	//
+	// A client going away with a lock held still
+	// accounts for the time it held it.
+	//
+
+	PbcLockReleased(&pTarget->ControllerLock);
+	PbcLockReleased(&pTarget->ConnectionLock);
+
+	SpbPeripheralDropPostedWrite(pDevice, pTarget);
+	PbcCacheDetach(pTarget);
+
+	if (pDevice->pCurrentTarget == pTarget)
+	{
+		pDevice->pCurrentTarget = NULL;
+	}
+
+	PbcTargetTraceStatistics(pDevice, pTarget);
 
 	FuncExit(TRACE_FLAG_SPBDDI);
 }
@@ -483,12 +915,17 @@ OnControllerLock(
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
 
+    PbcRequestStartTransaction(SpbRequest);
+
     PPBC_DEVICE  pDevice  = GetDeviceContext(SpbController);
     PPBC_TARGET  pTarget  = GetTargetContext(SpbTarget);
     
     NT_ASSERT(pDevice  != NULL);
     NT_ASSERT(pTarget  != NULL);
 
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeLockController);
+	PbcLockRequested(&pTarget->ControllerLock);
+
 	SpbPeripheralLock(pDevice, SpbRequest);
 
 	Trace(
@@ -531,13 +968,26 @@ OnControllerUnlock(
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
 
+    PbcRequestStartTransaction(SpbRequest);
+
     PPBC_DEVICE  pDevice  = GetDeviceContext(SpbController);
     PPBC_TARGET  pTarget  = GetTargetContext(SpbTarget);
     
     NT_ASSERT(pDevice  != NULL);
     NT_ASSERT(pTarget  != NULL);
 
-	
+	//
+	// A posted write is sent before any other request.
+	//
+
+	if (SpbPeripheralFlushPostedWrite(pDevice, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeUnlockController);
+
 	SpbPeripheralUnlock(pDevice, SpbRequest);
     
 	Trace(
@@ -551,6 +1001,130 @@ OnControllerUnlock(
 	FuncExit(TRACE_FLAG_SPBDDI);
 }
 
+VOID
+OnConnectionLock(
+	_In_  WDFDEVICE   SpbController,
+	_In_  SPBTARGET   SpbTarget,
+	_In_  SPBREQUEST  SpbRequest
+)
+/*++
+
+Routine Description:
+
+This routine is invoked whenever the connection of a target
+is to be locked, so that the target has exclusive access to
+a resource shared with another controller.
+
+Arguments:
+
+SpbController - a handle to the framework device object
+representing an SPB controller
+SpbTarget - a handle to the SPBTARGET object
+SpbRequest - a handle to the SPBREQUEST object
+
+Return Value:
+
+None.  The request is completed asynchronously.
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBDDI);
+
+	PbcRequestStartTransaction(SpbRequest);
+
+	PPBC_DEVICE  pDevice = GetDeviceContext(SpbController);
+	PPBC_TARGET  pTarget = GetTargetContext(SpbTarget);
+
+	NT_ASSERT(pDevice != NULL);
+	NT_ASSERT(pTarget != NULL);
+
+	//
+	// A posted write is sent before any other request.
+	//
+
+	if (SpbPeripheralFlushPostedWrite(pDevice, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeLockConnection);
+	PbcLockRequested(&pTarget->ConnectionLock);
+
+	SpbPeripheralLockConnection(pDevice, SpbRequest);
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_SPBDDI,
+		"Connection locked for SPBTARGET %p at address 0x%lx (WDFDEVICE %p)",
+		pTarget->SpbTarget,
+		pTarget->Settings.Address,
+		pDevice->FxDevice);
+
+	FuncExit(TRACE_FLAG_SPBDDI);
+}
+
+VOID
+OnConnectionUnlock(
+	_In_  WDFDEVICE   SpbController,
+	_In_  SPBTARGET   SpbTarget,
+	_In_  SPBREQUEST  SpbRequest
+)
+/*++
+
+Routine Description:
+
+This routine is invoked whenever the connection of a target
+is to be unlocked.
+
+Arguments:
+
+SpbController - a handle to the framework device object
+representing an SPB controller
+SpbTarget - a handle to the SPBTARGET object
+SpbRequest - a handle to the SPBREQUEST object
+
+Return Value:
+
+None.  The request is completed asynchronously.
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBDDI);
+
+	PbcRequestStartTransaction(SpbRequest);
+
+	PPBC_DEVICE  pDevice = GetDeviceContext(SpbController);
+	PPBC_TARGET  pTarget = GetTargetContext(SpbTarget);
+
+	NT_ASSERT(pDevice != NULL);
+	NT_ASSERT(pTarget != NULL);
+
+	//
+	// A posted write is sent before any other request.
+	//
+
+	if (SpbPeripheralFlushPostedWrite(pDevice, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeUnlockConnection);
+
+	SpbPeripheralUnlockConnection(pDevice, SpbRequest);
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_FLAG_SPBDDI,
+		"Connection unlocked for SPBTARGET %p at address 0x%lx (WDFDEVICE %p)",
+		pTarget->SpbTarget,
+		pTarget->Settings.Address,
+		pDevice->FxDevice);
+
+	FuncExit(TRACE_FLAG_SPBDDI);
+}
+
 VOID
 OnRead(
     _In_  WDFDEVICE   SpbController,
@@ -581,20 +1155,47 @@ OnRead(
 --*/
 {
 	PPBC_DEVICE  pDevice = GetDeviceContext(SpbController);
+	PPBC_TARGET  pTarget = GetTargetContext(SpbTarget);
 	
 	FuncEntry(TRACE_FLAG_SPBDDI);
 
+	PbcRequestStartTransaction(SpbRequest);
+
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBDDI,
-        "Received read request %p of length %Iu for SPBTARGET %p "
+        "Received read request %p txn %I64u of length %Iu for SPBTARGET %p "
         "(WDFDEVICE %p)",
         SpbRequest,
+        PbcTransactionId(SpbRequest),
         Length,
         SpbTarget,
         SpbController);
 
-	SpbPeripheralRead(pDevice, SpbRequest, WdfFalse);
+	//
+	// A posted write is sent before any other request,
+	// or with the read of its own target.
+	//
+
+	if (SpbPeripheralFlushPostedWrite(pDevice, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeRead);
+	PbcLockCountTransfer(pTarget);
+
+	if (PbcCacheServeCoalescedRead(pDevice, pTarget, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	if (!SpbPeripheralCoalescedRead(pDevice, SpbRequest))
+	{
+		SpbPeripheralRead(pDevice, SpbRequest, WdfFalse);
+	}
 
     FuncExit(TRACE_FLAG_SPBDDI);
 }
@@ -629,20 +1230,41 @@ OnWrite(
 --*/
 {
 	PPBC_DEVICE  pDevice = GetDeviceContext(SpbController);
+	PPBC_TARGET  pTarget = GetTargetContext(SpbTarget);
 
 	FuncEntry(TRACE_FLAG_SPBDDI);
 
+	PbcRequestStartTransaction(SpbRequest);
+
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBDDI,
-        "Received write request %p of length %Iu for SPBTARGET %p "
+        "Received write request %p txn %I64u of length %Iu for SPBTARGET %p "
         "(WDFDEVICE %p)",
         SpbRequest,
+        PbcTransactionId(SpbRequest),
         Length,
         SpbTarget,
         SpbController);
 
-	SpbPeripheralWrite(pDevice, SpbRequest, WdfFalse);
+	//
+	// A posted write is sent before any other request.
+	//
+
+	if (SpbPeripheralFlushPostedWrite(pDevice, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeWrite);
+	PbcLockCountTransfer(pTarget);
+
+	if (!SpbPeripheralPostWrite(pDevice, pTarget, SpbRequest))
+	{
+		PbcCacheInvalidateOnWrite(pTarget, SpbRequest);
+		SpbPeripheralWrite(pDevice, SpbRequest, WdfFalse);
+	}
 
 	FuncExit(TRACE_FLAG_SPBDDI);
 }
@@ -678,6 +1300,8 @@ OnSequence(
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
 
+    PbcRequestStartTransaction(SpbRequest);
+
     PPBC_DEVICE  pDevice  = GetDeviceContext(SpbController);
     PPBC_TARGET  pTarget  = GetTargetContext(SpbTarget);
     PPBC_REQUEST pRequest = GetRequestContext(SpbRequest);
@@ -700,13 +1324,33 @@ OnSequence(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBDDI,
-        "Received sequence request %p with transfer count %d for SPBTARGET %p "
+        "Received sequence request %p txn %I64u with transfer count %d for SPBTARGET %p "
         "(WDFDEVICE %p)",
         SpbRequest,
+        pRequest->TransactionId,
         TransferCount,
         SpbTarget,
         SpbController);
 
+	//
+	// A posted write is sent before any other request.
+	//
+
+	if (SpbPeripheralFlushPostedWrite(pDevice, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeSequence);
+	PbcLockCountTransfer(pTarget);
+
+	if (PbcCacheServeSequence(pDevice, pTarget, SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
 	SpbPeripheralSequence(pDevice, SpbRequest, TransferCount);
     
     FuncExit(TRACE_FLAG_SPBDDI);
@@ -767,10 +1411,30 @@ OnOtherInCallerContext(
     }
 
     //
-    // TODO: verify the driver supports this DeviceIoContol code,
-    //       otherwise mark as STATUS_NOT_SUPPORTED and complete.
+    // Full duplex is handled by the probe, other IOCTLs are
+    // forwarded to the true controller if they are allowed.
     //
 
+    {
+        PPBC_DEVICE pDevice = GetDeviceContext(SpbController);
+        ULONG ioControlCode = fxParams.Parameters.DeviceIoControl.IoControlCode;
+
+        if ((ioControlCode != IOCTL_SPB_FULL_DUPLEX) &&
+            !PbcDeviceIsIoctlForwarded(pDevice, ioControlCode))
+        {
+            status = STATUS_NOT_SUPPORTED;
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_FLAG_SPBDDI,
+                "IOCTL 0x%lx of FxRequest %p is not in the allow-list - %!STATUS!",
+                ioControlCode,
+                FxRequest,
+                status
+                );
+            goto exit;
+        }
+    }
+
     //
     // For custom IOCTLs that use the SPB transfer list format
     // (i.e. sequence formatting), call SpbRequestCaptureIoOtherTransferList
@@ -845,6 +1509,9 @@ None.  The request is completed asynchronously.
 	NTSTATUS status = STATUS_SUCCESS;
 	PPBC_DEVICE  pDevice = GetDeviceContext(SpbController);
 
+	const ULONG fullDuplexWriteIndex = 0;
+	const ULONG fullDuplexReadIndex = 1;
+
 	UNREFERENCED_PARAMETER(SpbController);
 	UNREFERENCED_PARAMETER(SpbTarget);
 	UNREFERENCED_PARAMETER(SpbRequest);
@@ -872,9 +1539,6 @@ None.  The request is completed asynchronously.
 	// Retrieve the write and read transfer descriptors.
 	//
 
-	const ULONG fullDuplexWriteIndex = 0;
-	const ULONG fullDuplexReadIndex = 1;
-
 	SPB_TRANSFER_DESCRIPTOR writeDescriptor;
 	SPB_TRANSFER_DESCRIPTOR readDescriptor;
 	PMDL pWriteMdl;
@@ -986,8 +1650,11 @@ OnOther(
 --*/
 {
     FuncEntry(TRACE_FLAG_SPBDDI);
+
+    PbcRequestStartTransaction(SpbRequest);
     
     NTSTATUS status = STATUS_NOT_SUPPORTED;
+    PPBC_TARGET  pTarget = GetTargetContext(SpbTarget);
 
     UNREFERENCED_PARAMETER(SpbController);
     UNREFERENCED_PARAMETER(SpbTarget);
@@ -996,14 +1663,30 @@ OnOther(
     UNREFERENCED_PARAMETER(InputBufferLength);
     UNREFERENCED_PARAMETER(IoControlCode);
 
+	if (SpbPeripheralFlushPostedWrite(GetDeviceContext(SpbController), SpbRequest))
+	{
+		FuncExit(TRACE_FLAG_SPBDDI);
+		return;
+	}
+
+	PbcRequestSetTarget(SpbRequest, pTarget, SpbRequestTypeOther);
+	PbcLockCountTransfer(pTarget);
+
+	//
+	// Full duplex and custom IOCTLs may write to the target.
+	//
+
+	PbcCacheInvalidate(pTarget);
+
 
 	if (IoControlCode == IOCTL_SPB_FULL_DUPLEX)
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_SPBDDI,
-			"Received Full Duplex SpbRequest %p in: %lu out: %lu",
+			"Received Full Duplex SpbRequest %p txn %I64u in: %lu out: %lu",
 			SpbRequest,
+			PbcTransactionId(SpbRequest),
 			(unsigned long)InputBufferLength,
 			(unsigned long)OutputBufferLength
 		);
@@ -1015,10 +1698,25 @@ OnOther(
 		Trace(
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_SPBDDI,
-			"Received Other SpbRequest %p ControlCode: %d",
+			"Received Other SpbRequest %p txn %I64u ControlCode: 0x%lx in: %lu out: %lu",
 			SpbRequest,
-			IoControlCode
+			PbcTransactionId(SpbRequest),
+			IoControlCode,
+			(unsigned long)InputBufferLength,
+			(unsigned long)OutputBufferLength
 		);
+
+		//
+		// The allow-list was checked in OnOtherInCallerContext,
+		// and the transfer list is captured.
+		//
+
+		SpbPeripheralOther(
+			GetDeviceContext(SpbController),
+			SpbRequest,
+			IoControlCode);
+
+		status = STATUS_SUCCESS;
 	}
 
 	if (!NT_SUCCESS(status))
@@ -1034,6 +1732,93 @@ OnOther(
 //
 /////////////////////////////////////////////////
 
+VOID
+PbcRequestRedispatch(
+	_In_  PPBC_DEVICE  pDevice,
+	_In_  SPBREQUEST   SpbRequest
+)
+/*++
+
+Routine Description:
+
+This routine dispatches again a client request whose
+processing was deferred by the probe.
+
+Arguments:
+
+pDevice - a pointer to the device context
+SpbRequest - a handle to the SPBREQUEST object
+
+Return Value:
+
+None.  The request is completed asynchronously.
+
+--*/
+{
+	SPBTARGET spbTarget = SpbRequestGetTarget(SpbRequest);
+	SPB_REQUEST_PARAMETERS params;
+
+	SPB_REQUEST_PARAMETERS_INIT(&params);
+	SpbRequestGetParameters(SpbRequest, &params);
+
+	switch (params.Type)
+	{
+	case SpbRequestTypeRead:
+		OnRead(pDevice->FxDevice, spbTarget, SpbRequest, params.Length);
+		break;
+
+	case SpbRequestTypeWrite:
+		OnWrite(pDevice->FxDevice, spbTarget, SpbRequest, params.Length);
+		break;
+
+	case SpbRequestTypeSequence:
+		OnSequence(pDevice->FxDevice, spbTarget, SpbRequest,
+			params.SequenceTransferCount);
+		break;
+
+	case SpbRequestTypeLockController:
+		OnControllerLock(pDevice->FxDevice, spbTarget, SpbRequest);
+		break;
+
+	case SpbRequestTypeUnlockController:
+		OnControllerUnlock(pDevice->FxDevice, spbTarget, SpbRequest);
+		break;
+
+	case SpbRequestTypeLockConnection:
+		OnConnectionLock(pDevice->FxDevice, spbTarget, SpbRequest);
+		break;
+
+	case SpbRequestTypeUnlockConnection:
+		OnConnectionUnlock(pDevice->FxDevice, spbTarget, SpbRequest);
+		break;
+
+	case SpbRequestTypeOther:
+	{
+		WDF_REQUEST_PARAMETERS fxParams;
+		WDF_REQUEST_PARAMETERS_INIT(&fxParams);
+		WdfRequestGetParameters(SpbRequest, &fxParams);
+
+		OnOther(pDevice->FxDevice, spbTarget, SpbRequest,
+			fxParams.Parameters.DeviceIoControl.OutputBufferLength,
+			fxParams.Parameters.DeviceIoControl.InputBufferLength,
+			fxParams.Parameters.DeviceIoControl.IoControlCode);
+		break;
+	}
+
+	default:
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBDDI,
+			"Cannot dispatch SpbRequest %p txn %I64u of type %d",
+			SpbRequest,
+			PbcTransactionId(SpbRequest),
+			params.Type);
+
+		SpbRequestComplete(SpbRequest, STATUS_INVALID_DEVICE_REQUEST);
+		break;
+	}
+}
+
 NTSTATUS
 PbcTargetGetSettings(
 	_In_  PPBC_DEVICE                pDevice,
@@ -1067,6 +1852,8 @@ Status
 	NT_ASSERT(ConnectionParameters != nullptr);
 	NT_ASSERT(pSettings != nullptr);
 
+	RtlZeroMemory(pSettings, sizeof(PBC_TARGET_SETTINGS));
+
 	PRH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER connection;
 	PPNP_SERIAL_BUS_DESCRIPTOR descriptor;
 	PPNP_I2C_SERIAL_BUS_DESCRIPTOR i2cDescriptor;
@@ -1106,6 +1893,8 @@ Status
 			i2cDescriptor->ConnectionSpeed,
 			i2cDescriptor->SlaveAddress);
 
+		pSettings->BusType = I2C_SERIAL_BUS_TYPE;
+
 		// Target address
 		pSettings->Address = (ULONG)i2cDescriptor->SlaveAddress;
 
@@ -1122,6 +1911,19 @@ Status
 
 	if (descriptor->SerialBusType == SPI_SERIAL_BUS_TYPE)
 	{
+		if (connection->PropertiesLength < sizeof(PNP_SPI_SERIAL_BUS_DESCRIPTOR))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_FLAG_PBCLOADING,
+				"Invalid SPI connection properties (length = %lu, "
+				"expected = %Iu)",
+				connection->PropertiesLength,
+				sizeof(PNP_SPI_SERIAL_BUS_DESCRIPTOR));
+
+			return STATUS_INVALID_PARAMETER;
+		}
+
 		spiDescriptor = (PPNP_SPI_SERIAL_BUS_DESCRIPTOR)
 			connection->ConnectionProperties;
 
@@ -1129,13 +1931,41 @@ Status
 			TRACE_LEVEL_INFORMATION,
 			TRACE_FLAG_PBCLOADING,
 			"SPI Connection Descriptor %p "
-			"ConnectionSpeed:%lu ",
+			"ConnectionSpeed:%lu "
+			"DataBitLength:%u "
+			"Phase:%u "
+			"Polarity:%u "
+			"DeviceSelection:0x%hx "
+			"Flags:0x%hx",
 			spiDescriptor,
-			spiDescriptor->ConnectionSpeed
+			spiDescriptor->ConnectionSpeed,
+			spiDescriptor->DataBitLength,
+			spiDescriptor->Phase,
+			spiDescriptor->Polarity,
+			spiDescriptor->DeviceSelection,
+			spiDescriptor->SerialBusDescriptor.TypeSpecificFlags
 		);
 
+		pSettings->BusType = SPI_SERIAL_BUS_TYPE;
+
+		// Chip select
+		pSettings->Address = spiDescriptor->DeviceSelection;
+		pSettings->AddressMode = AddressMode7Bit;
+
 		// Clock speed
 		pSettings->ConnectionSpeed = spiDescriptor->ConnectionSpeed;
+
+		// Word size and SPI mode
+		pSettings->DataBitLength = spiDescriptor->DataBitLength;
+		pSettings->Phase = spiDescriptor->Phase;
+		pSettings->Polarity = spiDescriptor->Polarity;
+
+		USHORT spiFlags = spiDescriptor->SerialBusDescriptor.TypeSpecificFlags;
+		pSettings->ChipSelectActiveHigh =
+			((spiFlags & SPI_SERIAL_BUS_SPECIFIC_FLAG_DEVICE_POLARITY_HIGH) != 0);
+		pSettings->ThreeWire =
+			((spiFlags & SPI_SERIAL_BUS_SPECIFIC_FLAG_3WIRE) != 0);
+
 		status = STATUS_SUCCESS;
 	}
 
@@ -44,6 +44,8 @@ EVT_SPB_TARGET_CONNECT               OnTargetConnect;
 EVT_SPB_TARGET_DISCONNECT            OnTargetDisconnect;
 EVT_SPB_CONTROLLER_LOCK              OnControllerLock;
 EVT_SPB_CONTROLLER_UNLOCK            OnControllerUnlock;
+EVT_SPB_CONNECTION_LOCK              OnConnectionLock;
+EVT_SPB_CONNECTION_UNLOCK            OnConnectionUnlock;
 EVT_SPB_CONTROLLER_READ              OnRead;
 EVT_SPB_CONTROLLER_WRITE             OnWrite;
 EVT_SPB_CONTROLLER_SEQUENCE          OnSequence;
@@ -61,6 +63,11 @@ PbcTargetGetSettings(
 	_In_     PVOID                   ConnectionParameters,
 	_Out_    PPBC_TARGET_SETTINGS    pSettings);
 
+VOID
+PbcRequestRedispatch(
+	_In_  PPBC_DEVICE  pDevice,
+	_In_  SPBREQUEST   SpbRequest);
+
 #if 0
 NTSTATUS
 FORCEINLINE
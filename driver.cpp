@@ -22,6 +22,14 @@ Revision History:
 #include "internal.h"
 #include "driver.h"
 #include "device.h"
+#include "stats.h"
+#include "config.h"
+#include "inject.h"
+#include "control.h"
+#include "idle.h"
+#include "event.h"
+#include "capture.h"
+#include "recorder.h"
 #include "ntstrsafe.h"
 
 #include "driver.tmh"
@@ -44,6 +52,14 @@ DriverEntry(
 
     FuncEntry(TRACE_FLAG_WDFLOADING);
 
+    //
+    // The transfer events are optional.
+    //
+
+    (VOID)PbcEventRegister();
+
+    PbcStatsInitialize();
+
     WDF_DRIVER_CONFIG_INIT(&driverConfig, OnDeviceAdd);
     driverConfig.DriverPoolTag = SI2C_POOL_TAG;
 
@@ -65,6 +81,8 @@ DriverEntry(
             "Error creating WDF driver object - %!STATUS!", 
             status);
 
+        PbcEventUnregister();
+
         goto exit;
     }
 
@@ -74,6 +92,18 @@ DriverEntry(
         "Created WDFDRIVER %p",
         fxDriver);
 
+    //
+    // The timeline queries are optional.
+    //
+
+    (VOID)PbcControlInitialize(fxDriver);
+
+    //
+    // So is the capture of the transfers.
+    //
+
+    (VOID)PbcCaptureInitialize(fxDriver);
+
 exit:
 
     FuncExit(TRACE_FLAG_WDFLOADING);
@@ -89,10 +119,43 @@ OnDriverCleanup(
 	FuncEntry(TRACE_FLAG_WDFLOADING);
     UNREFERENCED_PARAMETER(Object);
 
+	PbcCaptureCleanup();
+
+	PbcEventUnregister();
+
 	FuncExit(TRACE_FLAG_WDFLOADING);
 	WPP_CLEANUP(NULL);
 }
 
+VOID
+OnDeviceCleanup(
+    _In_ WDFOBJECT Object
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine removes the device from the control
+    device list.
+
+  Arguments:
+
+    Object - the WDF device object handle
+
+  Return Value:
+
+    None
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_WDFLOADING);
+
+    PbcIdleUninitialize(GetDeviceContext((WDFDEVICE)Object));
+    PbcControlUnregisterDevice(GetDeviceContext((WDFDEVICE)Object));
+
+    FuncExit(TRACE_FLAG_WDFLOADING);
+}
+
 NTSTATUS
 OnDeviceAdd(
     _In_    WDFDRIVER       FxDriver,
@@ -119,9 +182,8 @@ OnDeviceAdd(
     FuncEntry(TRACE_FLAG_WDFLOADING);
 
     PPBC_DEVICE pDevice;
+    LONGLONG startTime = PbcQueryTimestamp();
     NTSTATUS status;
-    
-    UNREFERENCED_PARAMETER(FxDriver);
 
 	//
 	// Setup PNP/Power callbacks.
@@ -175,6 +237,7 @@ OnDeviceAdd(
     {
         WDF_OBJECT_ATTRIBUTES deviceAttributes;
         WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, PBC_DEVICE);
+        deviceAttributes.EvtCleanupCallback = OnDeviceCleanup;
         WDFDEVICE fxDevice;
 
         status = WdfDeviceCreate(
@@ -198,6 +261,48 @@ OnDeviceAdd(
         NT_ASSERT(pDevice != NULL);
 
         pDevice->FxDevice = fxDevice;
+        pDevice->TimelineBase = startTime;
+        pDevice->Timeline.PhaseCount = SpbProbePhaseMax;
+    }
+
+    //
+    // Create the lock serializing the opens of the SPB target
+    // retried on target connect.
+    //
+
+    {
+        WDF_OBJECT_ATTRIBUTES lockAttributes;
+        WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+        lockAttributes.ParentObject = pDevice->FxDevice;
+
+        status = WdfWaitLockCreate(&lockAttributes, &pDevice->SpbTargetLock);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR, 
+                TRACE_FLAG_WDFLOADING,
+                "Failed to create SPB target lock for WDFDEVICE %p - %!STATUS!", 
+                pDevice->FxDevice,
+                status);
+
+            goto exit;
+        }
+    }
+
+    //
+    // Read the device configuration.
+    //
+
+    PbcDeviceLoadConfiguration(pDevice);
+
+    pDevice->CapturePolicy = pDevice->Config.CapturePolicy;
+
+    status = PbcInjectionInitialize(pDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
     }
         
     //
@@ -238,6 +343,8 @@ OnDeviceAdd(
         spbConfig.EvtSpbIoSequence       = OnSequence;
         spbConfig.EvtSpbControllerLock   = OnControllerLock;
         spbConfig.EvtSpbControllerUnlock = OnControllerUnlock;
+        spbConfig.EvtSpbConnectionLock   = OnConnectionLock;
+        spbConfig.EvtSpbConnectionUnlock = OnConnectionUnlock;
 
         status = SpbDeviceInitialize(pDevice->FxDevice, &spbConfig);
        
@@ -295,7 +402,8 @@ OnDeviceAdd(
  
     //
     // Configure idle settings to use system
-    // managed idle timeout.
+    // managed idle timeout. The timeout is switched
+    // with the monitor state, see idle.cpp.
     //
     {    
         WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS idleSettings;
@@ -327,6 +435,40 @@ OnDeviceAdd(
         }
     }
 
+    status = PbcIdleInitialize(pDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    status = PbcRecorderInitialize(pDevice);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    PbcControlRegisterDevice(FxDriver, pDevice);
+
+    //
+    // The capture buffers are shared by the devices. Without
+    // them, the device runs without capture. The flight
+    // recorder dumps into them as well.
+    //
+
+    if ((pDevice->Config.TraceBuffers & PBC_TRACE_BUFFERS_CAPTURE) ||
+        (pDevice->Recorder.pRecords != NULL))
+    {
+        (VOID)PbcCaptureEnable();
+    }
+
+    PbcTimelineRecord(
+        pDevice,
+        SpbProbePhaseDeviceAdd,
+        startTime,
+        PbcQueryTimestamp());
+
 exit:
 
     FuncExit(TRACE_FLAG_WDFLOADING);
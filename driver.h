@@ -32,5 +32,6 @@ DriverEntry(
 
 EVT_WDF_DRIVER_DEVICE_ADD       OnDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP  OnDriverCleanup;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP  OnDeviceCleanup;
 
 #endif
@@ -0,0 +1,388 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    event.cpp
+
+Abstract:
+
+    This module writes one TraceLogging event per transfer of
+    the requests, with typed fields and the payload as a binary
+    field, as an alternative to the text dump of
+    SpbTraceBuffers. The writes are traced when the request is
+    sent, the reads when it completes, and one more event per
+    request gives its final status.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "event.h"
+
+#include "event.tmh"
+
+//
+// SpbProbe provider, {ec3e316d-c244-469d-bce6-fb9ce42b4c1c}.
+//
+
+TRACELOGGING_DEFINE_PROVIDER(
+    g_PbcEventProvider,
+    "SpbProbe",
+    (0xec3e316d, 0xc244, 0x469d, 0xbc, 0xe6, 0xfb, 0x9c, 0xe4, 0x2b, 0x4c, 0x1c));
+
+NTSTATUS
+PbcEventRegister(VOID)
+/*++
+
+  Routine Description:
+
+    This routine registers the TraceLogging provider.
+
+  Arguments:
+
+    None
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    NTSTATUS status;
+
+    status = TraceLoggingRegister(g_PbcEventProvider);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to register the TraceLogging provider - %!STATUS!",
+            status);
+    }
+
+    return status;
+}
+
+VOID
+PbcEventUnregister(VOID)
+/*++
+
+  Routine Description:
+
+    This routine unregisters the TraceLogging provider.
+
+  Arguments:
+
+    None
+
+  Return Value:
+
+    None
+
+--*/
+{
+    TraceLoggingUnregister(g_PbcEventProvider);
+}
+
+static
+VOID
+PbcEventWriteTransfer(
+    _In_      PPBC_DEVICE       pDevice,
+    _In_opt_  PPBC_TARGET       pTarget,
+    _In_      ULONGLONG         TransactionId,
+    _In_      ULONG             Index,
+    _In_      ULONG             TransferCount,
+    _In_      SPB_TRANSFER_DIRECTION Direction,
+    _In_      ULONG             Length,
+    _In_      ULONG             Offset,
+    _In_      NTSTATUS          Status,
+    _In_reads_bytes_(PayloadLength) const VOID *pPayload,
+    _In_      USHORT            PayloadLength
+    )
+/*++
+
+  Routine Description:
+
+    This routine writes the event of one transfer, or of the
+    part of it starting at Offset.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - the target of the request
+    TransactionId - the transaction ID of the request
+    Index - the index of the transfer in the request
+    TransferCount - the number of transfers of the request
+    Direction - the direction of the transfer
+    Length - the length of the transfer
+    Offset - the offset of the payload in the transfer
+    Status - the completion status of the request
+    pPayload - the payload
+    PayloadLength - the length of the payload
+
+  Return Value:
+
+    None
+
+--*/
+{
+    UCHAR busType = 0;
+    USHORT address = 0;
+
+    if (pTarget != NULL)
+    {
+        busType = pTarget->Settings.BusType;
+        address = pTarget->Settings.Address;
+    }
+
+    TraceLoggingWrite(
+        g_PbcEventProvider,
+        "Transfer",
+        TraceLoggingLevel(PBC_EVENT_LEVEL_TRANSFER),
+        TraceLoggingKeyword(PBC_EVENT_KEYWORD_TRANSFER),
+        TraceLoggingInt64(pDevice->PeripheralId.QuadPart, "DeviceId"),
+        TraceLoggingUInt8(busType, "BusType"),
+        TraceLoggingUInt16(address, "Address"),
+        TraceLoggingUInt64(TransactionId, "TransactionId"),
+        TraceLoggingUInt32(Index, "Index"),
+        TraceLoggingUInt32(TransferCount, "TransferCount"),
+        TraceLoggingUInt8((UCHAR)Direction, "Direction"),
+        TraceLoggingUInt32(Length, "Length"),
+        TraceLoggingUInt32(Offset, "Offset"),
+        TraceLoggingNTStatus(Status, "Status"),
+        TraceLoggingBinary(pPayload, PayloadLength, "Payload"));
+}
+
+VOID
+PbcEventWriteTransfers(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status,
+    _In_  SPB_TRANSFER_DIRECTION Direction
+    )
+/*++
+
+  Routine Description:
+
+    This routine writes one event per transfer of a client
+    request in one direction, or of all of them with
+    SpbTransferDirectionNone. The payload is read in place
+    from the client buffers, and nothing is done while no
+    session listens to the provider.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+    Status - the completion status of the request, or
+        STATUS_PENDING for the writes traced when it is sent
+    Direction - the direction of the transfers
+
+  Return Value:
+
+    None
+
+--*/
+{
+    SPB_REQUEST_PARAMETERS parameters;
+    PPBC_TARGET pTarget;
+    ULONGLONG transactionId;
+
+    if (!TraceLoggingProviderEnabled(
+            g_PbcEventProvider,
+            PBC_EVENT_LEVEL_TRANSFER,
+            PBC_EVENT_KEYWORD_TRANSFER))
+    {
+        return;
+    }
+
+    pTarget = GetRequestContext(ClientRequest)->pTarget;
+    transactionId = GetRequestContext(ClientRequest)->TransactionId;
+
+    SPB_REQUEST_PARAMETERS_INIT(&parameters);
+    SpbRequestGetParameters(ClientRequest, &parameters);
+
+    for (ULONG i = 0; i < parameters.SequenceTransferCount; i++)
+    {
+        SPB_TRANSFER_DESCRIPTOR descriptor;
+        PMDL pMdl;
+        ULONG length;
+        ULONG offset = 0;
+
+        SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+        SpbRequestGetTransferParameters(ClientRequest, i, &descriptor, &pMdl);
+
+        if ((Direction != SpbTransferDirectionNone) &&
+            (descriptor.Direction != Direction))
+        {
+            continue;
+        }
+
+        length = (ULONG)descriptor.TransferLength;
+
+        if (length == 0)
+        {
+            PbcEventWriteTransfer(pDevice, pTarget, transactionId, i,
+                parameters.SequenceTransferCount, descriptor.Direction,
+                0, 0, Status, NULL, 0);
+
+            continue;
+        }
+
+        //
+        // Buffers made of several MDLs give one event per
+        // MDL at least.
+        //
+
+        for (; (pMdl != NULL) && (offset < length); pMdl = pMdl->Next)
+        {
+            ULONG mdlLength = min(MmGetMdlByteCount(pMdl), length - offset);
+            PUCHAR pBuffer = (PUCHAR)MmGetSystemAddressForMdlSafe(
+                pMdl,
+                NormalPagePriority | MdlMappingNoExecute);
+
+            if (pBuffer == NULL)
+            {
+                break;
+            }
+
+            for (ULONG chunk = 0; chunk < mdlLength; chunk += PBC_EVENT_MAX_PAYLOAD)
+            {
+                PbcEventWriteTransfer(pDevice, pTarget, transactionId, i,
+                    parameters.SequenceTransferCount, descriptor.Direction,
+                    length, offset + chunk, Status, pBuffer + chunk,
+                    (USHORT)min(mdlLength - chunk, (ULONG)PBC_EVENT_MAX_PAYLOAD));
+            }
+
+            offset += mdlLength;
+        }
+    }
+}
+
+VOID
+PbcEventWriteCompletion(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status
+    )
+/*++
+
+  Routine Description:
+
+    This routine writes the completion event of a client
+    request, with no payload. The writes were traced with
+    STATUS_PENDING when the request was sent, so this is the
+    only event carrying their final status.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+    Status - the completion status of the request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    SPB_REQUEST_PARAMETERS parameters;
+    PPBC_TARGET pTarget;
+    UCHAR busType = 0;
+    USHORT address = 0;
+
+    if (!TraceLoggingProviderEnabled(
+            g_PbcEventProvider,
+            PBC_EVENT_LEVEL_TRANSFER,
+            PBC_EVENT_KEYWORD_TRANSFER))
+    {
+        return;
+    }
+
+    pTarget = GetRequestContext(ClientRequest)->pTarget;
+
+    if (pTarget != NULL)
+    {
+        busType = pTarget->Settings.BusType;
+        address = pTarget->Settings.Address;
+    }
+
+    SPB_REQUEST_PARAMETERS_INIT(&parameters);
+    SpbRequestGetParameters(ClientRequest, &parameters);
+
+    TraceLoggingWrite(
+        g_PbcEventProvider,
+        "Completion",
+        TraceLoggingLevel(PBC_EVENT_LEVEL_TRANSFER),
+        TraceLoggingKeyword(PBC_EVENT_KEYWORD_TRANSFER),
+        TraceLoggingInt64(pDevice->PeripheralId.QuadPart, "DeviceId"),
+        TraceLoggingUInt8(busType, "BusType"),
+        TraceLoggingUInt16(address, "Address"),
+        TraceLoggingUInt64(GetRequestContext(ClientRequest)->TransactionId, "TransactionId"),
+        TraceLoggingUInt32(parameters.SequenceTransferCount, "TransferCount"),
+        TraceLoggingNTStatus(Status, "Status"));
+}
+
+VOID
+PbcEventWriteRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  const SPBPROBE_CAPTURE_RECORD *pRecord,
+    _In_  ULONGLONG         TriggerTransactionId
+    )
+/*++
+
+  Routine Description:
+
+    This routine writes the event of one record dumped by the
+    flight recorder, with the transaction ID of the completion
+    that triggered the dump, while a session listens to the
+    provider.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pRecord - the record
+    TriggerTransactionId - the transaction ID of the request
+        that triggered the dump
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (!TraceLoggingProviderEnabled(
+            g_PbcEventProvider,
+            PBC_EVENT_LEVEL_RECORDER,
+            PBC_EVENT_KEYWORD_RECORDER))
+    {
+        return;
+    }
+
+    TraceLoggingWrite(
+        g_PbcEventProvider,
+        "FlightRecord",
+        TraceLoggingLevel(PBC_EVENT_LEVEL_RECORDER),
+        TraceLoggingKeyword(PBC_EVENT_KEYWORD_RECORDER),
+        TraceLoggingInt64(pDevice->PeripheralId.QuadPart, "DeviceId"),
+        TraceLoggingUInt64(TriggerTransactionId, "TriggerTransactionId"),
+        TraceLoggingInt64(pRecord->Timestamp, "Timestamp"),
+        TraceLoggingUInt8(pRecord->BusType, "BusType"),
+        TraceLoggingUInt16(pRecord->Address, "Address"),
+        TraceLoggingUInt64(pRecord->TransactionId, "TransactionId"),
+        TraceLoggingUInt32(pRecord->Index, "Index"),
+        TraceLoggingUInt32(pRecord->TransferCount, "TransferCount"),
+        TraceLoggingUInt8(pRecord->Direction, "Direction"),
+        TraceLoggingUInt8(pRecord->Flags, "Flags"),
+        TraceLoggingUInt32(pRecord->Length, "Length"),
+        TraceLoggingNTStatus(pRecord->Status, "Status"),
+        TraceLoggingBinary(pRecord->Payload, pRecord->PayloadLength, "Payload"));
+}
@@ -0,0 +1,79 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    event.h
+
+Abstract:
+
+    This module contains the function definitions for the
+    TraceLogging events of the transfers.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+
+TRACELOGGING_DECLARE_PROVIDER(g_PbcEventProvider);
+
+//
+// Keyword and level of the transfer events. They are
+// verbose, so that a session at the error level does not get
+// a payload per transfer; sessions select them by keyword.
+//
+
+#define PBC_EVENT_KEYWORD_TRANSFER  0x1
+#define PBC_EVENT_LEVEL_TRANSFER    WINEVENT_LEVEL_VERBOSE
+
+//
+// Keyword and level of the records dumped by the flight
+// recorder.
+//
+
+#define PBC_EVENT_KEYWORD_RECORDER  0x2
+#define PBC_EVENT_LEVEL_RECORDER    WINEVENT_LEVEL_INFO
+
+//
+// Largest payload of one event. Longer transfers are split
+// into several events, each with the offset of its payload.
+//
+
+#define PBC_EVENT_MAX_PAYLOAD       4096
+
+NTSTATUS
+PbcEventRegister(VOID);
+
+VOID
+PbcEventUnregister(VOID);
+
+VOID
+PbcEventWriteTransfers(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status,
+    _In_  SPB_TRANSFER_DIRECTION Direction);
+
+VOID
+PbcEventWriteCompletion(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status);
+
+VOID
+PbcEventWriteRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  const SPBPROBE_CAPTURE_RECORD *pRecord,
+    _In_  ULONGLONG         TriggerTransactionId);
+
+#endif // _EVENT_H_
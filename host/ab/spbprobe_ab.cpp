@@ -0,0 +1,722 @@
+/*++
+
+Module Name:
+
+    spbprobe_ab.cpp
+
+Abstract:
+
+    This module measures the overhead of the probe: the same
+    workload runs against one simulated controller through a
+    probe device and directly, through an I/O target opened on
+    the connection of the controller as a client driver without
+    the probe would. The probe path runs on two probe devices,
+    with and without TraceBuffers, to split the CPU cost added
+    by the probe between forwarding and SpbTraceBuffers.
+
+    The three paths are interleaved request by request so that
+    they see the same machine state. For each request type and
+    transfer size, the tool prints the latency percentiles of
+    each path, the latency the probe adds at each percentile,
+    and the CPU time per request of forwarding and of the
+    buffer dumps. Built once per trace policy of the driver
+    (spbprobe_ab, spbprobe_ab_capture, spbprobe_ab_forward), it
+    compares what each policy leaves on the forwarding path.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostsim.h>
+#include <hostwpp.h>
+
+#define RESHUB_USE_HELPER_ROUTINES
+#include <reshub.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#define AB_PROBE_CONNECTION_ID    0x1
+#define AB_FORWARD_CONNECTION_ID  0x2
+#define AB_ADDRESS                0x2c
+#define AB_SPEED                  400000
+#define AB_MAX_SIZE               4096
+
+//
+// Trace policy the probe sources were built with.
+//
+
+#ifndef AB_TRACE_POLICY
+#define AB_TRACE_POLICY           "full"
+#endif
+
+//
+// A controller completing every request after a fixed delay,
+// at once by default.
+//
+
+class AbController : public HostSpbController
+{
+public:
+
+    ULONG  CompletionDelayUs = 0;
+
+    NTSTATUS
+    Execute(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override
+    {
+        Operation->CompletionDelayUs = CompletionDelayUs;
+
+        return STATUS_SUCCESS;
+    }
+};
+
+typedef enum _AB_PATH
+{
+    AbPathDirect = 0,
+    AbPathForward,
+    AbPathProbe,
+    AbPathMax
+}
+AB_PATH;
+
+static const PCSTR s_PathNames[AbPathMax] = {"direct", "forward", "probe"};
+
+typedef struct _AB_CASE
+{
+    SPB_REQUEST_TYPE  Type;
+    ULONG             IoControlCode;
+    PCSTR             Name;
+    size_t            Size;
+}
+AB_CASE, *PAB_CASE;
+
+//
+// Latencies and CPU time of the requests of one path.
+//
+
+typedef struct _AB_SAMPLES
+{
+    std::vector<ULONGLONG>  LatencyNs;
+    ULONGLONG               CpuNs = 0;
+    NTSTATUS                Status = STATUS_SUCCESS;
+}
+AB_SAMPLES, *PAB_SAMPLES;
+
+//
+// The direct client: an I/O target on the controller, one
+// reused request, and memory objects over the client buffers
+// and the transfer list, as a client driver keeps them.
+//
+
+typedef struct _AB_DIRECT_CLIENT
+{
+    WDFIOTARGET             IoTarget;
+    WDFREQUEST              Request;
+    WDFMEMORY               Memory[2];
+    WDFMEMORY               ListMemory;
+    UCHAR                   List[FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) +
+                                 2 * sizeof(SPB_TRANSFER_LIST_ENTRY)];
+    std::promise<NTSTATUS> *Completion;
+}
+AB_DIRECT_CLIENT, *PAB_DIRECT_CLIENT;
+
+static UCHAR s_Buffers[2][AB_MAX_SIZE];
+
+static
+VOID
+AbDiscardTrace(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+    UNREFERENCED_PARAMETER(Message);
+}
+
+static
+ULONGLONG
+AbCpuNs(VOID)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+    return (ULONGLONG)now.tv_sec * 1000000000ULL + (ULONGLONG)now.tv_nsec;
+}
+
+static
+ULONGLONG
+AbWallNs(VOID)
+{
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//
+// Runs Routine with the framework lock held, as a callback of
+// the client driver would, and waits for it.
+//
+
+static
+VOID
+AbRunLocked(
+    _In_  std::function<VOID()>  Routine)
+{
+    std::promise<VOID> done;
+    std::future<VOID> doneFuture = done.get_future();
+
+    HostSimScheduleEvent(0, [&]()
+    {
+        Routine();
+        done.set_value();
+    });
+
+    doneFuture.wait();
+}
+
+static
+VOID
+AbDirectCompletion(
+    _In_  WDFREQUEST                      Request,
+    _In_  WDFIOTARGET                     Target,
+    _In_  PWDF_REQUEST_COMPLETION_PARAMS  Params,
+    _In_  WDFCONTEXT                      Context)
+{
+    PAB_DIRECT_CLIENT client = (PAB_DIRECT_CLIENT)Context;
+
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(Target);
+
+    client->Completion->set_value(Params->IoStatus.Status);
+}
+
+static
+NTSTATUS
+AbDirectOpen(
+    _In_   PHOST_SIM_DEVICE   Device,
+    _In_   LONGLONG           ConnectionId,
+    _Out_  PAB_DIRECT_CLIENT  Client)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    RtlZeroMemory(Client, sizeof(*Client));
+
+    AbRunLocked([&]()
+    {
+        WDF_IO_TARGET_OPEN_PARAMS openParams;
+        DECLARE_UNICODE_STRING_SIZE(devicePath, RESOURCE_HUB_PATH_SIZE);
+
+        RESOURCE_HUB_CREATE_PATH_FROM_ID(
+            &devicePath,
+            (ULONG)ConnectionId,
+            (ULONG)(ConnectionId >> 32));
+
+        WDF_IO_TARGET_OPEN_PARAMS_INIT_OPEN_BY_NAME(
+            &openParams,
+            &devicePath,
+            (GENERIC_READ | GENERIC_WRITE));
+
+        status = WdfIoTargetCreate(
+            HostSimGetWdfDevice(Device),
+            WDF_NO_OBJECT_ATTRIBUTES,
+            &Client->IoTarget);
+
+        if (NT_SUCCESS(status))
+        {
+            status = WdfIoTargetOpen(Client->IoTarget, &openParams);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            status = WdfRequestCreate(
+                WDF_NO_OBJECT_ATTRIBUTES,
+                Client->IoTarget,
+                &Client->Request);
+        }
+
+        for (ULONG i = 0; NT_SUCCESS(status) && (i < ARRAYSIZE(Client->Memory)); i++)
+        {
+            status = WdfMemoryCreatePreallocated(
+                WDF_NO_OBJECT_ATTRIBUTES,
+                s_Buffers[i],
+                AB_MAX_SIZE,
+                &Client->Memory[i]);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            status = WdfMemoryCreatePreallocated(
+                WDF_NO_OBJECT_ATTRIBUTES,
+                Client->List,
+                sizeof(Client->List),
+                &Client->ListMemory);
+        }
+    });
+
+    return status;
+}
+
+static
+VOID
+AbDirectClose(
+    _In_  PAB_DIRECT_CLIENT  Client)
+{
+    AbRunLocked([&]()
+    {
+        if (Client->IoTarget != WDF_NO_HANDLE)
+        {
+            WdfIoTargetClose(Client->IoTarget);
+            WdfObjectDelete(Client->IoTarget);
+        }
+    });
+}
+
+//
+// Sends one request of Case to the controller, without the
+// probe.
+//
+
+static
+NTSTATUS
+AbDirectTransaction(
+    _In_  PAB_DIRECT_CLIENT  Client,
+    _In_  PAB_CASE           Case)
+{
+    PSPB_TRANSFER_LIST list = (PSPB_TRANSFER_LIST)Client->List;
+    std::promise<NTSTATUS> completion;
+    std::future<NTSTATUS> completionFuture = completion.get_future();
+    WDF_REQUEST_REUSE_PARAMS reuseParams;
+    WDFMEMORY_OFFSET offset = {0, Case->Size};
+    NTSTATUS status;
+
+    WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+    WdfRequestReuse(Client->Request, &reuseParams);
+
+    switch (Case->Type)
+    {
+    case SpbRequestTypeRead:
+        status = WdfIoTargetFormatRequestForRead(
+            Client->IoTarget, Client->Request, Client->Memory[0], &offset, nullptr);
+        break;
+
+    case SpbRequestTypeWrite:
+        status = WdfIoTargetFormatRequestForWrite(
+            Client->IoTarget, Client->Request, Client->Memory[0], &offset, nullptr);
+        break;
+
+    default:
+        SPB_TRANSFER_LIST_INIT(list, 2);
+        list->Transfers[0] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+            SpbTransferDirectionToDevice, 0, s_Buffers[0], (ULONG)Case->Size);
+        list->Transfers[1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+            SpbTransferDirectionFromDevice, 0, s_Buffers[1], (ULONG)Case->Size);
+
+        status = WdfIoTargetFormatRequestForIoctl(
+            Client->IoTarget,
+            Client->Request,
+            (Case->Type == SpbRequestTypeSequence) ?
+                IOCTL_SPB_EXECUTE_SEQUENCE : Case->IoControlCode,
+            Client->ListMemory,
+            nullptr,
+            WDF_NO_HANDLE,
+            nullptr);
+        break;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    Client->Completion = &completion;
+    WdfRequestSetCompletionRoutine(Client->Request, AbDirectCompletion, Client);
+
+    if (!WdfRequestSend(Client->Request, Client->IoTarget, WDF_NO_SEND_OPTIONS))
+    {
+        return WdfRequestGetStatus(Client->Request);
+    }
+
+    return completionFuture.get();
+}
+
+//
+// Sends one request of Case through a probe device.
+//
+
+static
+NTSTATUS
+AbProbeTransaction(
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  PAB_CASE          Case)
+{
+    HOST_SPB_TRANSFER transfers[2] =
+    {
+        {SpbTransferDirectionToDevice, 0, s_Buffers[0], Case->Size},
+        {SpbTransferDirectionFromDevice, 0, s_Buffers[1], Case->Size}
+    };
+
+    switch (Case->Type)
+    {
+    case SpbRequestTypeRead:
+        return HostSimWait(HostSimSubmit(Target, Case->Type, 0, &transfers[1], 1), nullptr);
+
+    case SpbRequestTypeWrite:
+        return HostSimWait(HostSimSubmit(Target, Case->Type, 0, &transfers[0], 1), nullptr);
+
+    default:
+        return HostSimWait(
+            HostSimSubmit(Target, Case->Type, Case->IoControlCode, transfers, 2),
+            nullptr);
+    }
+}
+
+static
+VOID
+AbRecord(
+    _Inout_  PAB_SAMPLES  Samples,
+    _In_     NTSTATUS     Status,
+    _In_     ULONGLONG    CpuStart,
+    _In_     ULONGLONG    WallStart)
+{
+    ULONGLONG wallEnd = AbWallNs();
+    ULONGLONG cpuEnd = AbCpuNs();
+
+    Samples->LatencyNs.push_back(wallEnd - WallStart);
+    Samples->CpuNs += cpuEnd - CpuStart;
+
+    if (!NT_SUCCESS(Status))
+    {
+        Samples->Status = Status;
+    }
+}
+
+static
+VOID
+AbRun(
+    _In_   PAB_DIRECT_CLIENT  Client,
+    _In_   PHOST_SIM_TARGET   ForwardTarget,
+    _In_   PHOST_SIM_TARGET   ProbeTarget,
+    _In_   PAB_CASE           Case,
+    _In_   ULONG              Iterations,
+    _Out_  AB_SAMPLES         (&Samples)[AbPathMax])
+{
+    for (ULONG i = 0; i < Iterations / 10 + 1; i++)
+    {
+        AbDirectTransaction(Client, Case);
+        AbProbeTransaction(ForwardTarget, Case);
+        AbProbeTransaction(ProbeTarget, Case);
+    }
+
+    for (AB_SAMPLES &samples : Samples)
+    {
+        samples.LatencyNs.clear();
+        samples.LatencyNs.reserve(Iterations);
+        samples.CpuNs = 0;
+        samples.Status = STATUS_SUCCESS;
+    }
+
+    //
+    // Rotate the order of the paths so that none always runs
+    // first, on a cold cache.
+    //
+
+    for (ULONG i = 0; i < Iterations; i++)
+    {
+        for (ULONG j = 0; j < AbPathMax; j++)
+        {
+            AB_PATH path = (AB_PATH)((i + j) % AbPathMax);
+            ULONGLONG cpuStart = AbCpuNs();
+            ULONGLONG wallStart = AbWallNs();
+            NTSTATUS status;
+
+            switch (path)
+            {
+            case AbPathDirect:
+                status = AbDirectTransaction(Client, Case);
+                break;
+
+            case AbPathForward:
+                status = AbProbeTransaction(ForwardTarget, Case);
+                break;
+
+            default:
+                status = AbProbeTransaction(ProbeTarget, Case);
+                break;
+            }
+
+            AbRecord(&Samples[path], status, cpuStart, wallStart);
+        }
+    }
+
+    for (AB_SAMPLES &samples : Samples)
+    {
+        std::sort(samples.LatencyNs.begin(), samples.LatencyNs.end());
+    }
+}
+
+static
+double
+AbPercentileUs(
+    _In_  const AB_SAMPLES  &Samples,
+    _In_  double             Percentile)
+{
+    size_t index;
+
+    if (Samples.LatencyNs.empty())
+    {
+        return 0;
+    }
+
+    index = (size_t)(Percentile / 100 * (Samples.LatencyNs.size() - 1) + 0.5);
+
+    return Samples.LatencyNs[index] / 1000.0;
+}
+
+static
+VOID
+AbPrint(
+    _In_  BOOLEAN           Json,
+    _In_  PAB_CASE          Case,
+    _In_  ULONG             Iterations,
+    _In_  const AB_SAMPLES  (&Samples)[AbPathMax])
+{
+    static const double percentiles[] = {50, 90, 99, 100};
+    static const PCSTR percentileNames[] = {"p50", "p90", "p99", "max"};
+
+    double cpuUs[AbPathMax];
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (ULONG i = 0; i < AbPathMax; i++)
+    {
+        cpuUs[i] = Samples[i].CpuNs / 1000.0 / Iterations;
+
+        if (!NT_SUCCESS(Samples[i].Status))
+        {
+            status = Samples[i].Status;
+        }
+    }
+
+    //
+    // The added latency at a percentile is the difference of
+    // the percentiles of both paths. The maximum is only a
+    // single sample and is not compared.
+    //
+
+    if (Json)
+    {
+        printf("{\"policy\":\"%s\",\"type\":\"%s\",\"size\":%zu,\"iterations\":%lu,"
+            "\"status\":\"0x%08x\"",
+            AB_TRACE_POLICY,
+            Case->Name, Case->Size, (unsigned long)Iterations, (unsigned)status);
+
+        for (ULONG i = 0; i < AbPathMax; i++)
+        {
+            printf(",\"%s\":{", s_PathNames[i]);
+
+            for (ULONG j = 0; j < ARRAYSIZE(percentiles); j++)
+            {
+                printf("%s\"%s_us\":%.2f", (j == 0) ? "" : ",",
+                    percentileNames[j], AbPercentileUs(Samples[i], percentiles[j]));
+            }
+
+            printf(",\"cpu_us\":%.2f}", cpuUs[i]);
+        }
+
+        printf(",\"added\":{");
+
+        for (ULONG j = 0; j < ARRAYSIZE(percentiles) - 1; j++)
+        {
+            printf("%s\"%s_us\":%.2f", (j == 0) ? "" : ",", percentileNames[j],
+                AbPercentileUs(Samples[AbPathProbe], percentiles[j]) -
+                    AbPercentileUs(Samples[AbPathDirect], percentiles[j]));
+        }
+
+        printf("},\"cpu_forwarding_us\":%.2f,\"cpu_trace_buffers_us\":%.2f}\n",
+            cpuUs[AbPathForward] - cpuUs[AbPathDirect],
+            cpuUs[AbPathProbe] - cpuUs[AbPathForward]);
+    }
+    else
+    {
+        printf("%-10s %5zu  %7.2f %7.2f  %7.2f %7.2f %7.2f  %7.2f %7.2f %7.2f %7.2f  0x%08x\n",
+            Case->Name,
+            Case->Size,
+            AbPercentileUs(Samples[AbPathDirect], 50),
+            AbPercentileUs(Samples[AbPathProbe], 50),
+            AbPercentileUs(Samples[AbPathProbe], 50) -
+                AbPercentileUs(Samples[AbPathDirect], 50),
+            AbPercentileUs(Samples[AbPathProbe], 90) -
+                AbPercentileUs(Samples[AbPathDirect], 90),
+            AbPercentileUs(Samples[AbPathProbe], 99) -
+                AbPercentileUs(Samples[AbPathDirect], 99),
+            cpuUs[AbPathDirect],
+            cpuUs[AbPathProbe],
+            cpuUs[AbPathForward] - cpuUs[AbPathDirect],
+            cpuUs[AbPathProbe] - cpuUs[AbPathForward],
+            (unsigned)status);
+    }
+
+    fflush(stdout);
+}
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    static const size_t sizes[] = {1, 16, 256, AB_MAX_SIZE};
+
+    AbController controller;
+    AB_DIRECT_CLIENT client;
+    std::vector<AB_CASE> cases;
+    PHOST_SIM_DEVICE probeDevice;
+    PHOST_SIM_DEVICE forwardDevice;
+    PHOST_SIM_TARGET probeTarget;
+    PHOST_SIM_TARGET forwardTarget;
+    ULONG iterations = 2000;
+    ULONG traceLevel = TRACE_LEVEL_ERROR;
+    BOOLEAN json = FALSE;
+    PCSTR filter = nullptr;
+    NTSTATUS status;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+        {
+            iterations = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-d") == 0) && (i + 1 < argc))
+        {
+            controller.CompletionDelayUs = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-l") == 0) && (i + 1 < argc))
+        {
+            traceLevel = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc))
+        {
+            filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "-json") == 0)
+        {
+            json = TRUE;
+        }
+        else
+        {
+            fprintf(stderr,
+                "usage: %s [-n iterations] [-d delay us] [-l trace level] "
+                "[-t read|write|sequence|fullduplex] [-json]\n",
+                argv[0]);
+            return 2;
+        }
+    }
+
+    if (iterations == 0)
+    {
+        iterations = 1;
+    }
+
+    for (size_t size : sizes)
+    {
+        cases.push_back({SpbRequestTypeRead, 0, "read", size});
+        cases.push_back({SpbRequestTypeWrite, 0, "write", size});
+        cases.push_back({SpbRequestTypeSequence, 0, "sequence", size});
+        cases.push_back({SpbRequestTypeOther, IOCTL_SPB_FULL_DUPLEX, "fullduplex", size});
+    }
+
+    //
+    // Traces are formatted at the level given and discarded,
+    // as with a trace session running.
+    //
+
+    HostTraceSetSink(AbDiscardTrace);
+    HostTraceSetLevel(0, 0);
+
+    status = HostSimLoadDriver();
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "DriverEntry failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    probeDevice = HostSimCreateDevice(AB_PROBE_CONNECTION_ID, &controller);
+    forwardDevice = HostSimCreateDevice(AB_FORWARD_CONNECTION_ID, &controller);
+    HostSimSetRegistryULong(forwardDevice, nullptr, L"TraceBuffers", 0);
+
+    status = HostSimStartDevice(probeDevice);
+
+    if (NT_SUCCESS(status))
+    {
+        status = HostSimStartDevice(forwardDevice);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "device start failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    status = AbDirectOpen(probeDevice, AB_PROBE_CONNECTION_ID, &client);
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "controller open failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    probeTarget = HostSimOpenTarget(probeDevice,
+        HostSimI2cConnection(AB_ADDRESS, AB_SPEED));
+    forwardTarget = HostSimOpenTarget(forwardDevice,
+        HostSimI2cConnection(AB_ADDRESS, AB_SPEED));
+
+    HostTraceSetLevel(traceLevel, 0xffffffff);
+
+    if (!json)
+    {
+        printf("trace policy %s\n", AB_TRACE_POLICY);
+        printf("%-10s %5s  %7s %7s  %7s %7s %7s  %7s %7s %7s %7s  %s\n",
+            "", "", "direct", "probe", "added", "added", "added",
+            "direct", "probe", "forward", "buffers", "");
+        printf("%-10s %5s  %7s %7s  %7s %7s %7s  %7s %7s %7s %7s  %s\n",
+            "type", "size", "p50 us", "p50 us", "p50 us", "p90 us", "p99 us",
+            "cpu us", "cpu us", "cpu us", "cpu us", "status");
+    }
+
+    for (AB_CASE &abCase : cases)
+    {
+        AB_SAMPLES samples[AbPathMax];
+
+        if ((filter != nullptr) && (strcmp(filter, abCase.Name) != 0))
+        {
+            continue;
+        }
+
+        AbRun(&client, forwardTarget, probeTarget, &abCase, iterations, samples);
+        AbPrint(json, &abCase, iterations, samples);
+    }
+
+    HostTraceSetLevel(0, 0);
+
+    HostSimCloseTarget(probeTarget);
+    HostSimCloseTarget(forwardTarget);
+    AbDirectClose(&client);
+    HostSimRemoveDevice(forwardDevice);
+    HostSimRemoveDevice(probeDevice);
+    HostSimUnloadDriver();
+    HostTraceSetSink(nullptr);
+
+    return 0;
+}
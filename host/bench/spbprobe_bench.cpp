@@ -0,0 +1,356 @@
+/*++
+
+Module Name:
+
+    spbprobe_bench.cpp
+
+Abstract:
+
+    This module measures the cost of one transaction through
+    the probe on the host emulation: the SPBCx callback, the
+    formatting of the forwarded request, the send, the
+    completion and SpbTraceBuffers. The controller completes
+    every request immediately, so the time measured is the time
+    spent in the probe, the emulated framework and the harness
+    submitting the client request.
+
+    Each case varies the request type, the transfer size, the
+    number of transfers of sequences and the trace level, and
+    prints one line with the CPU and wall time and the driver
+    allocations per transaction, as JSON lines or CSV.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostsim.h>
+#include <hostwpp.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#define BENCH_CONNECTION_ID   0x1
+#define BENCH_ADDRESS         0x2c
+#define BENCH_SPEED           400000
+#define BENCH_MAX_SIZE        4096
+
+//
+// A controller completing every request at once.
+//
+
+class BenchController : public HostSpbController
+{
+public:
+
+    NTSTATUS
+    Execute(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override
+    {
+        UNREFERENCED_PARAMETER(Operation);
+
+        return STATUS_SUCCESS;
+    }
+};
+
+typedef enum _BENCH_OUTPUT_FORMAT
+{
+    BenchOutputJson = 0,
+    BenchOutputCsv
+}
+BENCH_OUTPUT_FORMAT;
+
+typedef struct _BENCH_CASE
+{
+    SPB_REQUEST_TYPE  Type;
+    PCSTR             Name;
+    ULONG             TransferCount;
+    size_t            Size;
+    ULONG             TraceLevel;
+}
+BENCH_CASE, *PBENCH_CASE;
+
+typedef struct _BENCH_RESULT
+{
+    NTSTATUS          Status;
+    double            CpuNs;
+    double            WallNs;
+    double            PoolAllocations;
+    double            ObjectCreations;
+}
+BENCH_RESULT, *PBENCH_RESULT;
+
+static UCHAR s_Buffers[HOST_SPB_MAX_TRANSFERS][BENCH_MAX_SIZE];
+
+static
+VOID
+BenchDiscardTrace(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+    UNREFERENCED_PARAMETER(Message);
+}
+
+static
+ULONGLONG
+BenchCpuNs(VOID)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+    return (ULONGLONG)now.tv_sec * 1000000000ULL + (ULONGLONG)now.tv_nsec;
+}
+
+static
+ULONGLONG
+BenchWallNs(VOID)
+{
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static
+NTSTATUS
+BenchTransaction(
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  PBENCH_CASE       Case)
+{
+    HOST_SPB_TRANSFER transfers[HOST_SPB_MAX_TRANSFERS] = {};
+
+    //
+    // Sequences alternate writes and reads, as register
+    // accesses do.
+    //
+
+    for (ULONG i = 0; i < Case->TransferCount; i++)
+    {
+        transfers[i].Direction =
+            ((Case->Type == SpbRequestTypeRead) ||
+             ((Case->Type == SpbRequestTypeSequence) && ((i % 2) == 1))) ?
+                SpbTransferDirectionFromDevice :
+                SpbTransferDirectionToDevice;
+        transfers[i].Buffer = s_Buffers[i];
+        transfers[i].Length = Case->Size;
+    }
+
+    return HostSimWait(
+        HostSimSubmit(Target, Case->Type, 0, transfers, Case->TransferCount),
+        nullptr);
+}
+
+static
+VOID
+BenchRun(
+    _In_   PHOST_SIM_TARGET  Target,
+    _In_   PBENCH_CASE       Case,
+    _In_   ULONG             Iterations,
+    _Out_  PBENCH_RESULT     Result)
+{
+    HOST_SIM_ALLOCATIONS before;
+    HOST_SIM_ALLOCATIONS after;
+    ULONGLONG cpuStart;
+    ULONGLONG wallStart;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    HostTraceSetLevel(Case->TraceLevel, 0xffffffff);
+
+    for (ULONG i = 0; i < Iterations / 10 + 1; i++)
+    {
+        BenchTransaction(Target, Case);
+    }
+
+    HostSimGetAllocations(&before);
+    cpuStart = BenchCpuNs();
+    wallStart = BenchWallNs();
+
+    for (ULONG i = 0; i < Iterations; i++)
+    {
+        NTSTATUS transactionStatus = BenchTransaction(Target, Case);
+
+        if (!NT_SUCCESS(transactionStatus))
+        {
+            status = transactionStatus;
+        }
+    }
+
+    Result->WallNs = (double)(BenchWallNs() - wallStart) / Iterations;
+    Result->CpuNs = (double)(BenchCpuNs() - cpuStart) / Iterations;
+
+    HostSimGetAllocations(&after);
+
+    Result->Status = status;
+    Result->PoolAllocations =
+        (double)(after.PoolAllocations - before.PoolAllocations) / Iterations;
+    Result->ObjectCreations =
+        (double)(after.ObjectCreations - before.ObjectCreations) / Iterations;
+
+    HostTraceSetLevel(0, 0);
+}
+
+static
+VOID
+BenchPrint(
+    _In_  BENCH_OUTPUT_FORMAT  Format,
+    _In_  PBENCH_CASE          Case,
+    _In_  ULONG                Iterations,
+    _In_  PBENCH_RESULT        Result)
+{
+    if (Format == BenchOutputCsv)
+    {
+        printf("%s,%lu,%zu,%lu,%lu,0x%08x,%.1f,%.1f,%.2f,%.2f,%.2f\n",
+            Case->Name,
+            (unsigned long)Case->TransferCount,
+            Case->Size,
+            (unsigned long)Case->TraceLevel,
+            (unsigned long)Iterations,
+            (unsigned)Result->Status,
+            Result->CpuNs,
+            Result->WallNs,
+            Result->PoolAllocations + Result->ObjectCreations,
+            Result->PoolAllocations,
+            Result->ObjectCreations);
+    }
+    else
+    {
+        printf("{\"type\":\"%s\",\"transfers\":%lu,\"size\":%zu,\"trace_level\":%lu,"
+            "\"iterations\":%lu,\"status\":\"0x%08x\",\"ns_per_transaction\":%.1f,"
+            "\"wall_ns_per_transaction\":%.1f,\"allocations_per_transaction\":%.2f,"
+            "\"pool_allocations_per_transaction\":%.2f,"
+            "\"object_creations_per_transaction\":%.2f}\n",
+            Case->Name,
+            (unsigned long)Case->TransferCount,
+            Case->Size,
+            (unsigned long)Case->TraceLevel,
+            (unsigned long)Iterations,
+            (unsigned)Result->Status,
+            Result->CpuNs,
+            Result->WallNs,
+            Result->PoolAllocations + Result->ObjectCreations,
+            Result->PoolAllocations,
+            Result->ObjectCreations);
+    }
+
+    fflush(stdout);
+}
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    static const size_t sizes[] = {1, 16, 256, BENCH_MAX_SIZE};
+    static const ULONG sequenceLengths[] = {1, 2, 4, 8, 16};
+    static const ULONG traceLevels[] = {0, TRACE_LEVEL_ERROR, TRACE_LEVEL_VERBOSE};
+
+    BenchController controller;
+    BENCH_OUTPUT_FORMAT format = BenchOutputJson;
+    std::vector<BENCH_CASE> cases;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    ULONG iterations = 2000;
+    PCSTR filter = nullptr;
+    NTSTATUS status;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+        {
+            iterations = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc))
+        {
+            filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "-csv") == 0)
+        {
+            format = BenchOutputCsv;
+        }
+        else
+        {
+            fprintf(stderr,
+                "usage: %s [-n iterations] [-t read|write|sequence] [-csv]\n",
+                argv[0]);
+            return 2;
+        }
+    }
+
+    if (iterations == 0)
+    {
+        iterations = 1;
+    }
+
+    for (ULONG level : traceLevels)
+    {
+        for (size_t size : sizes)
+        {
+            cases.push_back({SpbRequestTypeRead, "read", 1, size, level});
+            cases.push_back({SpbRequestTypeWrite, "write", 1, size, level});
+
+            for (ULONG length : sequenceLengths)
+            {
+                cases.push_back({SpbRequestTypeSequence, "sequence", length, size, level});
+            }
+        }
+    }
+
+    HostTraceSetSink(BenchDiscardTrace);
+    HostTraceSetLevel(0, 0);
+
+    status = HostSimLoadDriver();
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "DriverEntry failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    device = HostSimCreateDevice(BENCH_CONNECTION_ID, &controller);
+    status = HostSimStartDevice(device);
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "device start failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(BENCH_ADDRESS, BENCH_SPEED));
+
+    if (format == BenchOutputCsv)
+    {
+        printf("type,transfers,size,trace_level,iterations,status,"
+            "ns_per_transaction,wall_ns_per_transaction,allocations_per_transaction,"
+            "pool_allocations_per_transaction,object_creations_per_transaction\n");
+    }
+
+    for (BENCH_CASE &benchCase : cases)
+    {
+        BENCH_RESULT result;
+
+        if ((filter != nullptr) && (strcmp(filter, benchCase.Name) != 0))
+        {
+            continue;
+        }
+
+        BenchRun(target, &benchCase, iterations, &result);
+        BenchPrint(format, &benchCase, iterations, &result);
+    }
+
+    HostSimCloseTarget(target);
+    HostSimRemoveDevice(device);
+    HostSimUnloadDriver();
+    HostTraceSetSink(nullptr);
+
+    return 0;
+}
@@ -0,0 +1,467 @@
+/*++
+
+Module Name:
+
+    spbprobe_capture.cpp
+
+Abstract:
+
+    This module measures how the capture of the transfer records
+    scales with the number of processors completing requests.
+    One producer thread per processor writes records through
+    PbcCaptureWrite, into the ring of its processor, while a
+    collector thread merges them back with PbcCaptureRead and
+    checks that the sequence numbers only increase. A producer
+    finding its ring full yields until the collector frees a
+    slot, so the rate printed is that of the whole pipeline,
+    and "full" counts these waits.
+
+    The same producers then write into a single ring shared by
+    all the processors, which takes a slot with an interlocked
+    update of its head, as the baseline the per-processor rings
+    replace.
+
+    Producers are pinned, one per processor: the emulation
+    does not keep a thread on its processor while it writes as
+    DISPATCH_LEVEL does on Windows.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostsim.h>
+
+#include "internal.h"
+#include "capture.h"
+
+#include <hostwpp.h>
+
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define CAPTURE_CONNECTION_ID   0x1
+#define CAPTURE_READ_RECORDS    4096
+
+static
+VOID
+CaptureDiscardTrace(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+    UNREFERENCED_PARAMETER(Message);
+}
+
+class CaptureController : public HostSpbController
+{
+public:
+
+    NTSTATUS
+    Execute(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override
+    {
+        UNREFERENCED_PARAMETER(Operation);
+
+        return STATUS_SUCCESS;
+    }
+};
+
+typedef struct _CAPTURE_RESULT
+{
+    double      WallNs;
+    ULONGLONG   Written;
+    ULONGLONG   Full;
+    ULONGLONG   Read;
+    ULONGLONG   OutOfOrder;
+}
+CAPTURE_RESULT, *PCAPTURE_RESULT;
+
+//
+// The baseline: one ring for all the processors. A producer
+// takes a slot by incrementing the head, and publishes the
+// record through the sequence number of the slot.
+//
+
+typedef struct _CAPTURE_SHARED_SLOT
+{
+    std::atomic<ULONGLONG>   Ready;
+    SPBPROBE_CAPTURE_RECORD  Record;
+}
+CAPTURE_SHARED_SLOT;
+
+class CaptureSharedRing
+{
+public:
+
+    CaptureSharedRing(
+        ) : m_Slots(PBC_CAPTURE_RING_RECORDS)
+    {
+        for (ULONG i = 0; i < PBC_CAPTURE_RING_RECORDS; i++)
+        {
+            m_Slots[i].Ready = i;
+        }
+    }
+
+    BOOLEAN
+    Write(
+        _In_  const SPBPROBE_CAPTURE_RECORD *Record)
+    {
+        ULONGLONG head = m_Head.load(std::memory_order_relaxed);
+        CAPTURE_SHARED_SLOT *slot;
+
+        for (;;)
+        {
+            slot = &m_Slots[head & (PBC_CAPTURE_RING_RECORDS - 1)];
+
+            ULONGLONG ready = slot->Ready.load(std::memory_order_acquire);
+
+            if (ready == head)
+            {
+                if (m_Head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (ready < head)
+            {
+                return FALSE;
+            }
+            else
+            {
+                head = m_Head.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->Record = *Record;
+        slot->Record.Sequence = head + 1;
+        slot->Record.Timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+        slot->Ready.store(head + 1, std::memory_order_release);
+
+        return TRUE;
+    }
+
+    ULONG
+    Read(
+        _Out_  PSPBPROBE_CAPTURE_RECORD  Records,
+        _In_   ULONG                     Count)
+    {
+        ULONG count = 0;
+
+        while (count < Count)
+        {
+            CAPTURE_SHARED_SLOT *slot = &m_Slots[m_Tail & (PBC_CAPTURE_RING_RECORDS - 1)];
+
+            if (slot->Ready.load(std::memory_order_acquire) != m_Tail + 1)
+            {
+                break;
+            }
+
+            Records[count++] = slot->Record;
+            slot->Ready.store(m_Tail + PBC_CAPTURE_RING_RECORDS, std::memory_order_release);
+            m_Tail++;
+        }
+
+        return count;
+    }
+
+private:
+
+    std::vector<CAPTURE_SHARED_SLOT>  m_Slots;
+    alignas(64) std::atomic<ULONGLONG> m_Head{0};
+    alignas(64) ULONGLONG m_Tail = 0;
+};
+
+static
+ULONGLONG
+CaptureWallNs(VOID)
+{
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static
+VOID
+CapturePin(
+    _In_  ULONG  Processor)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(Processor, &set);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+//
+// Runs Producers threads writing Records each through Write,
+// and one collector reading through Read until all the
+// records written were read.
+//
+
+template <typename WRITE, typename READ>
+static
+VOID
+CaptureRun(
+    _In_   ULONG            Producers,
+    _In_   ULONG            Records,
+    _In_   WRITE            Write,
+    _In_   READ             Read,
+    _Out_  PCAPTURE_RESULT  Result)
+{
+    std::vector<std::thread> threads;
+    std::atomic<ULONG> ready(0);
+    std::atomic<BOOLEAN> start(FALSE);
+    std::atomic<ULONG> done(0);
+    std::atomic<ULONGLONG> written(0);
+    std::atomic<ULONGLONG> full(0);
+    ULONGLONG startNs;
+
+    memset(Result, 0, sizeof(*Result));
+
+    for (ULONG p = 0; p < Producers; p++)
+    {
+        threads.emplace_back([&, p]()
+        {
+            SPBPROBE_CAPTURE_RECORD record = {};
+            ULONGLONG retries = 0;
+
+            CapturePin(p);
+
+            record.PeripheralId = p;
+            record.Length = SPBPROBE_CAPTURE_PAYLOAD;
+            record.PayloadLength = SPBPROBE_CAPTURE_PAYLOAD;
+
+            ready++;
+
+            while (!start.load())
+            {
+            }
+
+            //
+            // A full ring waits for the collector, so that every
+            // record goes through the merge.
+            //
+
+            for (ULONG i = 0; i < Records; i++)
+            {
+                record.Index = (UCHAR)i;
+
+                while (!Write(&record))
+                {
+                    retries++;
+                    std::this_thread::yield();
+                }
+            }
+
+            written += Records;
+            full += retries;
+            done++;
+        });
+    }
+
+    while (ready.load() != Producers)
+    {
+        std::this_thread::yield();
+    }
+
+    std::vector<SPBPROBE_CAPTURE_RECORD> buffer(CAPTURE_READ_RECORDS);
+    ULONGLONG last = 0;
+
+    startNs = CaptureWallNs();
+    start = TRUE;
+
+    for (;;)
+    {
+        BOOLEAN finished = (done.load() == Producers);
+        ULONG count = Read(buffer.data(), CAPTURE_READ_RECORDS);
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            Result->OutOfOrder += (buffer[i].Sequence <= last) ? 1 : 0;
+            last = buffer[i].Sequence;
+        }
+
+        Result->Read += count;
+
+        if (finished && (count == 0))
+        {
+            break;
+        }
+
+        if (count == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    Result->WallNs = (double)(CaptureWallNs() - startNs);
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    Result->Written = written;
+    Result->Full = full;
+}
+
+static
+VOID
+CapturePrint(
+    _In_  PCSTR                  Ring,
+    _In_  ULONG                  Producers,
+    _In_  const CAPTURE_RESULT  &Result,
+    _In_  BOOLEAN                Json)
+{
+    double rate = (Result.WallNs > 0) ? (Result.Written * 1e9) / Result.WallNs : 0;
+    double nsPerRecord = (Result.Written > 0) ? (Result.WallNs * Producers) / Result.Written : 0;
+
+    if (Json)
+    {
+        printf("{\"ring\":\"%s\",\"producers\":%u,\"written\":%llu,\"full\":%llu,"
+            "\"read\":%llu,\"out_of_order\":%llu,\"records_per_s\":%.0f,\"ns_per_record\":%.1f}\n",
+            Ring, Producers, Result.Written, Result.Full, Result.Read,
+            Result.OutOfOrder, rate, nsPerRecord);
+    }
+    else
+    {
+        printf("%-8s %9u %12.0f %13.1f %10llu %10llu %12llu\n",
+            Ring, Producers, rate, nsPerRecord, Result.Full,
+            Result.Written - Result.Read, Result.OutOfOrder);
+    }
+}
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    CaptureController controller;
+    PHOST_SIM_DEVICE device;
+    ULONG processors = (ULONG)std::thread::hardware_concurrency();
+    ULONG maxProducers = processors;
+    ULONG records = 1000000;
+    BOOLEAN json = FALSE;
+    NTSTATUS status;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-p") == 0) && (i + 1 < argc))
+        {
+            maxProducers = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+        {
+            records = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "-json") == 0)
+        {
+            json = TRUE;
+        }
+        else
+        {
+            fprintf(stderr,
+                "usage: %s [-p max producers] [-n records per producer] [-json]\n",
+                argv[0]);
+            return 2;
+        }
+    }
+
+    //
+    // One producer per processor at most, see above.
+    //
+
+    maxProducers = std::max(1U, std::min(maxProducers, processors));
+
+    HostTraceSetSink(CaptureDiscardTrace);
+
+    status = HostSimLoadDriver();
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "DriverEntry failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    //
+    // A device with the capture enabled allocates the rings.
+    //
+
+    device = HostSimCreateDevice(CAPTURE_CONNECTION_ID, &controller);
+    HostSimSetRegistryULong(device, nullptr, L"TraceBuffers", PBC_TRACE_BUFFERS_CAPTURE);
+
+    status = HostSimStartDevice(device);
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "device start failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    if (!json)
+    {
+        printf("%lu records per producer, rings of %lu records\n",
+            (unsigned long)records, (unsigned long)PBC_CAPTURE_RING_RECORDS);
+        printf("%-8s %9s %12s %13s %10s %10s %12s\n",
+            "ring", "producers", "records/s", "ns/record", "full", "lost", "out of order");
+    }
+
+    //
+    // Powers of 2, then all the processors.
+    //
+
+    std::vector<ULONG> steps;
+
+    for (ULONG producers = 1; producers < maxProducers; producers *= 2)
+    {
+        steps.push_back(producers);
+    }
+
+    steps.push_back(maxProducers);
+
+    //
+    // The producers wait on a full ring themselves, so the
+    // records that do not fit are never dropped.
+    //
+
+    SPBPROBE_CAPTURE_POLICY policy = {SpbProbeCaptureDropNewest, 1, 100};
+
+    for (ULONG producers : steps)
+    {
+        CaptureSharedRing shared;
+        CAPTURE_RESULT result;
+
+        CaptureRun(producers, records,
+            [&](const SPBPROBE_CAPTURE_RECORD *Record) { return PbcCaptureWrite(Record, 1, &policy); },
+            [](PSPBPROBE_CAPTURE_RECORD Records, ULONG Count) { return PbcCaptureRead(Records, Count); },
+            &result);
+
+        CapturePrint("percpu", producers, result, json);
+
+        CaptureRun(producers, records,
+            [&](const SPBPROBE_CAPTURE_RECORD *Record) { return shared.Write(Record); },
+            [&](PSPBPROBE_CAPTURE_RECORD Records, ULONG Count) { return shared.Read(Records, Count); },
+            &result);
+
+        CapturePrint("shared", producers, result, json);
+    }
+
+    HostSimRemoveDevice(device);
+    HostSimUnloadDriver();
+
+    return 0;
+}
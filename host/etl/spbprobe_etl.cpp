@@ -0,0 +1,2141 @@
+/*++
+
+Module Name:
+
+    spbprobe_etl.cpp
+
+Abstract:
+
+    This module reads the ETL files recorded from the probe's
+    WPP provider (PbcTraceGuid) on Linux, without traceview.
+
+    The file is mapped and walked buffer by buffer, and event
+    by event within each buffer. WPP events are trace messages
+    carrying the GUID of the TMF of their source file and a
+    message number; the TMF files extracted once from the
+    probe's PDB (tracepdb -f spbProbe.pdb -p <dir>) give the
+    format string and the types of the arguments of each
+    message. Events of other providers are skipped.
+
+    The buffer dumps of SpbTraceBufferIndex are decoded into one
+    record per transfer, its 16-byte lines joined back into the
+    payload, and printed as JSON lines. The other messages of
+    the probe are printed as formatted text records with -all.
+
+    The "Transfer" events of the probe's TraceLogging provider
+    (TraceBuffers bit 0x2) describe themselves: their fields are
+    decoded from the metadata carried by each event, and give
+    the same transfer records, with the completion status, or
+    STATUS_PENDING for the writes traced when the request was
+    sent. The "Completion" event of each request gives its
+    final status as a completion record. They need no TMF.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostddk.h>
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+//
+// ETL layout: the file is a sequence of buffers of BufferSize
+// bytes, each starting with a WMI_BUFFER_HEADER followed by
+// events aligned on 8 bytes, up to the filled offset.
+//
+
+#define ETL_BUFFER_HEADER_SIZE              0x48
+#define ETL_BUFFER_SIZE_OFFSET              0x00
+#define ETL_BUFFER_SAVED_OFFSET_OFFSET      0x04
+#define ETL_BUFFER_PROCESSOR_OFFSET         0x28
+#define ETL_BUFFER_FILLED_OFFSET            0x30
+
+#define ETL_EVENT_ALIGNMENT                 8
+
+//
+// The marker of every event: flags in the high byte, header
+// type in the next one.
+//
+
+#define ETL_MARKER_HEADER_FLAG              0x80
+#define ETL_MARKER_EVENT_TRACE_FLAG         0x40
+#define ETL_MARKER_MESSAGE_FLAG             0x10
+
+#define ETL_HEADER_TYPE_SYSTEM32            1
+#define ETL_HEADER_TYPE_SYSTEM64            2
+#define ETL_HEADER_TYPE_COMPACT32           3
+#define ETL_HEADER_TYPE_COMPACT64           4
+#define ETL_HEADER_TYPE_MESSAGE             15
+#define ETL_HEADER_TYPE_PERFINFO32          16
+#define ETL_HEADER_TYPE_PERFINFO64          17
+#define ETL_HEADER_TYPE_EVENT32             18
+#define ETL_HEADER_TYPE_EVENT64             19
+
+//
+// EVENT_HEADER of manifest and TraceLogging events, followed
+// by the extended data items when flagged, each with an
+// 8-byte header (size, type, linkage, data size) and its data
+// aligned on 8 bytes, then by the user data.
+//
+
+#define ETL_EVENT_HEADER_SIZE               80
+#define ETL_EVENT_FLAGS_OFFSET              4
+#define ETL_EVENT_THREAD_OFFSET             8
+#define ETL_EVENT_PROCESS_OFFSET            12
+#define ETL_EVENT_TIMESTAMP_OFFSET          16
+#define ETL_EVENT_PROVIDER_OFFSET           24
+#define ETL_EVENT_LEVEL_OFFSET              44
+
+#define ETL_EVENT_FLAG_EXTENDED_INFO        0x0001
+
+#define ETL_EXTENDED_ITEM_HEADER_SIZE       8
+#define ETL_EXTENDED_ITEM_LINKAGE           0x0001
+#define ETL_EXTENDED_TYPE_EVENT_SCHEMA_TL   11
+
+//
+// TraceLogging field types: the low 5 bits of the input type,
+// and the flags of the input and output type bytes.
+//
+
+#define ETL_TLG_IN_TYPE_MASK                0x1f
+#define ETL_TLG_IN_CCOUNT                   0x20
+#define ETL_TLG_IN_VCOUNT                   0x40
+#define ETL_TLG_IN_CHAIN                    0x80
+#define ETL_TLG_OUT_CHAIN                   0x80
+
+#define ETL_TLG_IN_UNICODESTRING            1
+#define ETL_TLG_IN_ANSISTRING               2
+#define ETL_TLG_IN_INT8                     3
+#define ETL_TLG_IN_UINT8                    4
+#define ETL_TLG_IN_INT16                    5
+#define ETL_TLG_IN_UINT16                   6
+#define ETL_TLG_IN_INT32                    7
+#define ETL_TLG_IN_UINT32                   8
+#define ETL_TLG_IN_INT64                    9
+#define ETL_TLG_IN_UINT64                   10
+#define ETL_TLG_IN_FLOAT                    11
+#define ETL_TLG_IN_DOUBLE                   12
+#define ETL_TLG_IN_BOOL32                   13
+#define ETL_TLG_IN_BINARY                   14
+#define ETL_TLG_IN_GUID                     15
+#define ETL_TLG_IN_FILETIME                 17
+#define ETL_TLG_IN_SYSTEMTIME               18
+#define ETL_TLG_IN_HEXINT32                 20
+#define ETL_TLG_IN_HEXINT64                 21
+#define ETL_TLG_IN_COUNTEDSTRING            22
+#define ETL_TLG_IN_COUNTEDANSISTRING        23
+#define ETL_TLG_IN_STRUCT                   24
+#define ETL_TLG_IN_COUNTEDBINARY            25
+
+//
+// SpbProbe provider of event.cpp.
+//
+
+#define ETL_PROBE_PROVIDER                  "ec3e316d-c244-469d-bce6-fb9ce42b4c1c"
+#define ETL_PROBE_TRANSFER_EVENT            "Transfer"
+#define ETL_PROBE_COMPLETION_EVENT          "Completion"
+
+//
+// SpbTransferDirectionToDevice, the writes; the reads are
+// SpbTransferDirectionFromDevice (1).
+//
+
+#define ETL_PROBE_DIRECTION_TO_DEVICE       2
+
+//
+// Optional fields of trace messages, in this order.
+//
+
+#define ETL_MESSAGE_SEQUENCE                0x0001
+#define ETL_MESSAGE_GUID                    0x0002
+#define ETL_MESSAGE_COMPONENTID             0x0004
+#define ETL_MESSAGE_TIMESTAMP               0x0008
+#define ETL_MESSAGE_SYSTEMINFO              0x0020
+
+#define ETL_DUMP_FUNCTION                   "SpbTraceBufferIndex"
+
+/////////////////////////////////////////////////
+//
+// TMF.
+//
+/////////////////////////////////////////////////
+
+typedef enum _ETL_ITEM
+{
+    EtlItemUnknown = 0,
+    EtlItemChar,
+    EtlItemUChar,
+    EtlItemShort,
+    EtlItemUShort,
+    EtlItemLong,
+    EtlItemULong,
+    EtlItemLongLong,
+    EtlItemULongLong,
+    EtlItemPtr,
+    EtlItemNtStatus,
+    EtlItemDouble,
+    EtlItemString,
+    EtlItemWString,
+    EtlItemPString,
+    EtlItemPWString,
+    EtlItemGuid
+}
+ETL_ITEM;
+
+static const struct
+{
+    PCSTR     Name;
+    ETL_ITEM  Item;
+}
+s_ItemTypes[] =
+{
+    {"ItemChar",         EtlItemChar},
+    {"ItemUChar",        EtlItemUChar},
+    {"ItemShort",        EtlItemShort},
+    {"ItemUShort",       EtlItemUShort},
+    {"ItemLong",         EtlItemLong},
+    {"ItemULong",        EtlItemULong},
+    {"ItemULongX",       EtlItemULong},
+    {"ItemLongX",        EtlItemULong},
+    {"ItemEnum",         EtlItemULong},
+    {"ItemChar4",        EtlItemULong},
+    {"ItemWINERROR",     EtlItemULong},
+    {"ItemHRESULT",      EtlItemNtStatus},
+    {"ItemNTSTATUS",     EtlItemNtStatus},
+    {"ItemLongLong",     EtlItemLongLong},
+    {"ItemLongLongX",    EtlItemULongLong},
+    {"ItemLongLongXX",   EtlItemULongLong},
+    {"ItemULongLong",    EtlItemULongLong},
+    {"ItemULongLongX",   EtlItemULongLong},
+    {"ItemULongLongXX",  EtlItemULongLong},
+    {"ItemPtr",          EtlItemPtr},
+    {"ItemDouble",       EtlItemDouble},
+    {"ItemString",       EtlItemString},
+    {"ItemRString",      EtlItemString},
+    {"ItemWString",      EtlItemWString},
+    {"ItemPString",      EtlItemPString},
+    {"ItemPWString",     EtlItemPWString},
+    {"ItemGuid",         EtlItemGuid},
+};
+
+//
+// One message of a TMF: the format string, the types of its
+// arguments %10, %11, ..., and the attributes of its comment.
+//
+
+typedef struct _ETL_MESSAGE
+{
+    std::string            Format;
+    std::vector<ETL_ITEM>  Items;
+    std::string            Function;
+    std::string            Level;
+    std::string            Flags;
+}
+ETL_MESSAGE, *PETL_MESSAGE;
+
+//
+// Messages by TMF GUID and message number.
+//
+
+typedef std::map<std::pair<std::string, USHORT>, ETL_MESSAGE> ETL_DICTIONARY;
+
+static
+BOOLEAN
+EtlIsGuid(
+    _In_  const std::string  &Text)
+{
+    static const char pattern[] = "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx";
+
+    if (Text.size() < sizeof(pattern) - 1)
+    {
+        return FALSE;
+    }
+
+    for (size_t i = 0; i < sizeof(pattern) - 1; i++)
+    {
+        if ((pattern[i] == '-') ? (Text[i] != '-') : !isxdigit((unsigned char)Text[i]))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static
+std::string
+EtlLower(
+    _In_  std::string  Text)
+{
+    for (char &c : Text)
+    {
+        c = (char)tolower((unsigned char)c);
+    }
+
+    return Text;
+}
+
+static
+std::string
+EtlAttribute(
+    _In_  const std::string  &Comment,
+    _In_  PCSTR               Name)
+{
+    std::string key = std::string(Name) + "=";
+    size_t start = Comment.find(key);
+    size_t end;
+
+    if (start == std::string::npos)
+    {
+        return std::string();
+    }
+
+    start += key.size();
+    end = Comment.find_first_of(" \t", start);
+
+    return Comment.substr(start, (end == std::string::npos) ? std::string::npos : end - start);
+}
+
+static
+ETL_ITEM
+EtlItemFromName(
+    _In_  const std::string  &Name)
+{
+    for (const auto &itemType : s_ItemTypes)
+    {
+        if (Name == itemType.Name)
+        {
+            return itemType.Item;
+        }
+    }
+
+    return EtlItemUnknown;
+}
+
+//
+// Loads one TMF file:
+//
+//   <guid> <module> // SRC=<file> ...
+//   #typev <name> <number> "<format>" // LEVEL=... FLAGS=... FUNC=...
+//   {
+//   <argument>, <ItemType> -- <index>
+//   }
+//
+
+static
+BOOLEAN
+EtlLoadTmf(
+    _In_     PCSTR            Path,
+    _Inout_  ETL_DICTIONARY  &Dictionary)
+{
+    FILE *file = fopen(Path, "r");
+    std::string guid;
+    ETL_MESSAGE *message = nullptr;
+    BOOLEAN inArguments = FALSE;
+    char line[4096];
+
+    if (file == nullptr)
+    {
+        return FALSE;
+    }
+
+    while (fgets(line, sizeof(line), file) != nullptr)
+    {
+        std::string text(line);
+        size_t start = text.find_first_not_of(" \t");
+
+        text.erase(text.find_last_not_of(" \t\r\n") + 1);
+
+        if (start == std::string::npos)
+        {
+            continue;
+        }
+
+        text = text.substr(start);
+
+        if (EtlIsGuid(text))
+        {
+            guid = EtlLower(text.substr(0, 36));
+            message = nullptr;
+            inArguments = FALSE;
+        }
+        else if ((text.compare(0, 6, "#typev") == 0) && !guid.empty())
+        {
+            size_t formatStart = text.find('"');
+            size_t formatEnd = text.rfind('"');
+            size_t comment = text.find("//", formatEnd);
+            char name[256];
+            unsigned number;
+
+            if ((formatStart == std::string::npos) ||
+                (formatEnd <= formatStart) ||
+                (sscanf(text.c_str() + 6, "%255s %u", name, &number) != 2))
+            {
+                message = nullptr;
+                continue;
+            }
+
+            message = &Dictionary[std::make_pair(guid, (USHORT)number)];
+            *message = ETL_MESSAGE();
+            message->Format = text.substr(formatStart + 1, formatEnd - formatStart - 1);
+
+            if (comment != std::string::npos)
+            {
+                std::string attributes = text.substr(comment);
+
+                message->Function = EtlAttribute(attributes, "FUNC");
+                message->Level = EtlAttribute(attributes, "LEVEL");
+                message->Flags = EtlAttribute(attributes, "FLAGS");
+            }
+        }
+        else if ((text == "{") && (message != nullptr))
+        {
+            inArguments = TRUE;
+        }
+        else if (text == "}")
+        {
+            inArguments = FALSE;
+            message = nullptr;
+        }
+        else if (inArguments)
+        {
+            size_t comma = text.rfind(',', text.find("--"));
+            size_t index = text.find("--");
+            size_t typeStart;
+            size_t typeEnd;
+            unsigned argument;
+
+            if ((comma == std::string::npos) || (index == std::string::npos))
+            {
+                continue;
+            }
+
+            typeStart = text.find_first_not_of(" \t", comma + 1);
+            typeEnd = text.find_first_of(" \t(", typeStart);
+            argument = (unsigned)strtoul(text.c_str() + index + 2, nullptr, 10);
+
+            //
+            // Arguments are numbered from 10.
+            //
+
+            if (argument >= 10)
+            {
+                if (message->Items.size() < argument - 9)
+                {
+                    message->Items.resize(argument - 9, EtlItemUnknown);
+                }
+
+                message->Items[argument - 10] =
+                    EtlItemFromName(text.substr(typeStart, typeEnd - typeStart));
+            }
+        }
+    }
+
+    fclose(file);
+
+    return TRUE;
+}
+
+static
+ULONG
+EtlLoadTmfPath(
+    _In_     PCSTR            Path,
+    _Inout_  ETL_DICTIONARY  &Dictionary)
+{
+    struct stat status;
+    ULONG count = 0;
+    DIR *directory;
+
+    if (stat(Path, &status) != 0)
+    {
+        return 0;
+    }
+
+    if (!S_ISDIR(status.st_mode))
+    {
+        return EtlLoadTmf(Path, Dictionary) ? 1 : 0;
+    }
+
+    directory = opendir(Path);
+
+    if (directory == nullptr)
+    {
+        return 0;
+    }
+
+    for (struct dirent *entry = readdir(directory); entry != nullptr; entry = readdir(directory))
+    {
+        size_t length = strlen(entry->d_name);
+
+        if ((length > 4) && (strcasecmp(entry->d_name + length - 4, ".tmf") == 0))
+        {
+            std::string file = std::string(Path) + "/" + entry->d_name;
+
+            count += EtlLoadTmf(file.c_str(), Dictionary) ? 1 : 0;
+        }
+    }
+
+    closedir(directory);
+
+    return count;
+}
+
+/////////////////////////////////////////////////
+//
+// Arguments and formatting.
+//
+/////////////////////////////////////////////////
+
+typedef struct _ETL_ARGUMENT
+{
+    ETL_ITEM     Item;
+    ULONGLONG    Value;
+    double       Double;
+    std::string  String;
+}
+ETL_ARGUMENT, *PETL_ARGUMENT;
+
+template <typename T>
+static
+T
+EtlRead(
+    _In_  const UCHAR  *Data)
+{
+    T value;
+
+    memcpy(&value, Data, sizeof(value));
+
+    return value;
+}
+
+static
+std::string
+EtlUtf16ToUtf8(
+    _In_  const UCHAR  *Data,
+    _In_  size_t        Characters)
+{
+    std::string text;
+
+    for (size_t i = 0; i < Characters; i++)
+    {
+        ULONG c = EtlRead<USHORT>(Data + 2 * i);
+
+        if ((c >= 0xd800) && (c < 0xdc00) && (i + 1 < Characters))
+        {
+            ULONG low = EtlRead<USHORT>(Data + 2 * (i + 1));
+
+            if ((low >= 0xdc00) && (low < 0xe000))
+            {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i++;
+            }
+        }
+
+        if (c < 0x80)
+        {
+            text += (char)c;
+        }
+        else if (c < 0x800)
+        {
+            text += (char)(0xc0 | (c >> 6));
+            text += (char)(0x80 | (c & 0x3f));
+        }
+        else if (c < 0x10000)
+        {
+            text += (char)(0xe0 | (c >> 12));
+            text += (char)(0x80 | ((c >> 6) & 0x3f));
+            text += (char)(0x80 | (c & 0x3f));
+        }
+        else
+        {
+            text += (char)(0xf0 | (c >> 18));
+            text += (char)(0x80 | ((c >> 12) & 0x3f));
+            text += (char)(0x80 | ((c >> 6) & 0x3f));
+            text += (char)(0x80 | (c & 0x3f));
+        }
+    }
+
+    return text;
+}
+
+static
+std::string
+EtlFormatGuid(
+    _In_  const UCHAR  *Data)
+{
+    char text[40];
+
+    snprintf(text, sizeof(text),
+        "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        EtlRead<ULONG>(Data),
+        EtlRead<USHORT>(Data + 4),
+        EtlRead<USHORT>(Data + 6),
+        Data[8], Data[9], Data[10], Data[11],
+        Data[12], Data[13], Data[14], Data[15]);
+
+    return text;
+}
+
+//
+// Decodes the arguments of a message. Returns FALSE when the
+// payload is shorter than the TMF says, or holds a type the
+// reader does not know.
+//
+
+static
+BOOLEAN
+EtlDecodeArguments(
+    _In_   const ETL_MESSAGE          *Message,
+    _In_   const UCHAR                *Data,
+    _In_   size_t                      Length,
+    _Out_  std::vector<ETL_ARGUMENT>  &Arguments)
+{
+    size_t offset = 0;
+
+    Arguments.clear();
+
+    for (ETL_ITEM item : Message->Items)
+    {
+        ETL_ARGUMENT argument = {item, 0, 0, std::string()};
+        size_t size = 0;
+
+        switch (item)
+        {
+        case EtlItemChar:
+        case EtlItemUChar:
+            size = 1;
+            break;
+
+        case EtlItemShort:
+        case EtlItemUShort:
+            size = 2;
+            break;
+
+        case EtlItemLong:
+        case EtlItemULong:
+        case EtlItemNtStatus:
+            size = 4;
+            break;
+
+        case EtlItemLongLong:
+        case EtlItemULongLong:
+        case EtlItemPtr:
+        case EtlItemDouble:
+            size = 8;
+            break;
+
+        case EtlItemGuid:
+            size = 16;
+            break;
+
+        case EtlItemString:
+        {
+            const UCHAR *end = (const UCHAR *)memchr(Data + offset, 0, Length - offset);
+
+            if (end == nullptr)
+            {
+                return FALSE;
+            }
+
+            argument.String.assign((PCSTR)Data + offset, end - (Data + offset));
+            size = (end - (Data + offset)) + 1;
+            break;
+        }
+
+        case EtlItemWString:
+        {
+            size_t characters = 0;
+
+            while (TRUE)
+            {
+                if (offset + 2 * characters + 2 > Length)
+                {
+                    return FALSE;
+                }
+
+                if (EtlRead<USHORT>(Data + offset + 2 * characters) == 0)
+                {
+                    break;
+                }
+
+                characters++;
+            }
+
+            argument.String = EtlUtf16ToUtf8(Data + offset, characters);
+            size = 2 * characters + 2;
+            break;
+        }
+
+        case EtlItemPString:
+        case EtlItemPWString:
+        {
+            //
+            // Counted strings are logged as their length in
+            // bytes followed by the characters.
+            //
+
+            USHORT bytes;
+
+            if (offset + 2 > Length)
+            {
+                return FALSE;
+            }
+
+            bytes = EtlRead<USHORT>(Data + offset);
+
+            if (offset + 2 + bytes > Length)
+            {
+                return FALSE;
+            }
+
+            argument.String = (item == EtlItemPString) ?
+                std::string((PCSTR)Data + offset + 2, bytes) :
+                EtlUtf16ToUtf8(Data + offset + 2, bytes / 2);
+            size = 2 + bytes;
+            break;
+        }
+
+        default:
+            return FALSE;
+        }
+
+        if (offset + size > Length)
+        {
+            return FALSE;
+        }
+
+        switch (item)
+        {
+        case EtlItemChar:
+            argument.Value = (ULONGLONG)(LONGLONG)(CHAR)Data[offset];
+            break;
+
+        case EtlItemUChar:
+            argument.Value = Data[offset];
+            break;
+
+        case EtlItemShort:
+            argument.Value = (ULONGLONG)(LONGLONG)EtlRead<SHORT>(Data + offset);
+            break;
+
+        case EtlItemUShort:
+            argument.Value = EtlRead<USHORT>(Data + offset);
+            break;
+
+        case EtlItemLong:
+            argument.Value = (ULONGLONG)(LONGLONG)EtlRead<LONG>(Data + offset);
+            break;
+
+        case EtlItemULong:
+        case EtlItemNtStatus:
+            argument.Value = EtlRead<ULONG>(Data + offset);
+            break;
+
+        case EtlItemLongLong:
+        case EtlItemULongLong:
+        case EtlItemPtr:
+            argument.Value = EtlRead<ULONGLONG>(Data + offset);
+            break;
+
+        case EtlItemDouble:
+            argument.Double = EtlRead<double>(Data + offset);
+            break;
+
+        case EtlItemGuid:
+            argument.String = EtlFormatGuid(Data + offset);
+            break;
+
+        default:
+            break;
+        }
+
+        Arguments.push_back(argument);
+        offset += size;
+    }
+
+    return TRUE;
+}
+
+//
+// Formats one argument with the printf specification of the
+// format string (%10!04x!, %11!s!, ...), with the length
+// modifiers adapted to the decoded value.
+//
+
+static
+std::string
+EtlFormatArgument(
+    _In_  const std::string   &Specification,
+    _In_  const ETL_ARGUMENT  &Argument)
+{
+    std::string flags;
+    char conversion = Specification.empty() ? 's' : Specification.back();
+    char text[512];
+
+    for (size_t i = 0; i + 1 < Specification.size(); i++)
+    {
+        //
+        // Skip the length modifiers, I64 and I32 included.
+        //
+
+        if (Specification[i] == 'I')
+        {
+            while ((i + 2 < Specification.size()) && isdigit((unsigned char)Specification[i + 1]))
+            {
+                i++;
+            }
+        }
+        else if (strchr("-+ #0123456789.", Specification[i]) != nullptr)
+        {
+            flags += Specification[i];
+        }
+    }
+
+    switch (Argument.Item)
+    {
+    case EtlItemString:
+    case EtlItemWString:
+    case EtlItemPString:
+    case EtlItemPWString:
+    case EtlItemGuid:
+        snprintf(text, sizeof(text), ("%" + flags + "s").c_str(), Argument.String.c_str());
+        break;
+
+    case EtlItemNtStatus:
+        snprintf(text, sizeof(text), "0x%08llx", Argument.Value);
+        break;
+
+    case EtlItemPtr:
+        snprintf(text, sizeof(text), "0x%016llx", Argument.Value);
+        break;
+
+    case EtlItemDouble:
+        snprintf(text, sizeof(text), ("%" + flags + "f").c_str(), Argument.Double);
+        break;
+
+    default:
+        if (strchr("diuxXoc", conversion) == nullptr)
+        {
+            conversion = 'd';
+        }
+
+        if (conversion == 'c')
+        {
+            snprintf(text, sizeof(text), "%c", (char)Argument.Value);
+        }
+        else
+        {
+            snprintf(text, sizeof(text), ("%" + flags + "ll" + conversion).c_str(),
+                Argument.Value);
+        }
+
+        break;
+    }
+
+    return text;
+}
+
+static
+std::string
+EtlFormatMessage(
+    _In_  const ETL_MESSAGE                *Message,
+    _In_  const std::vector<ETL_ARGUMENT>  &Arguments)
+{
+    const std::string &format = Message->Format;
+    std::string text;
+
+    for (size_t i = 0; i < format.size(); i++)
+    {
+        size_t end;
+        ULONG index;
+
+        if ((format[i] != '%') || (i + 1 == format.size()))
+        {
+            text += format[i];
+            continue;
+        }
+
+        if (format[i + 1] == '%')
+        {
+            text += '%';
+            i++;
+            continue;
+        }
+
+        if (!isdigit((unsigned char)format[i + 1]))
+        {
+            text += format[i];
+            continue;
+        }
+
+        index = (ULONG)strtoul(format.c_str() + i + 1, nullptr, 10);
+        end = format.find_first_not_of("0123456789", i + 1);
+
+        //
+        // %0 to %9 are the prefix fields (module, source line,
+        // thread, ...), not logged in the event.
+        //
+
+        std::string specification;
+
+        if ((end != std::string::npos) && (format[end] == '!'))
+        {
+            size_t close = format.find('!', end + 1);
+
+            if (close != std::string::npos)
+            {
+                specification = format.substr(end + 1, close - end - 1);
+                end = close + 1;
+            }
+        }
+
+        if ((index >= 10) && (index - 10 < Arguments.size()))
+        {
+            text += EtlFormatArgument(specification, Arguments[index - 10]);
+        }
+
+        i = ((end == std::string::npos) ? format.size() : end) - 1;
+    }
+
+    return text;
+}
+
+static
+std::string
+EtlJsonString(
+    _In_  const std::string  &Text)
+{
+    std::string json = "\"";
+
+    for (char c : Text)
+    {
+        if ((c == '"') || (c == '\\'))
+        {
+            json += '\\';
+            json += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char escape[8];
+
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)c);
+            json += escape;
+        }
+        else
+        {
+            json += c;
+        }
+    }
+
+    return json + "\"";
+}
+
+/////////////////////////////////////////////////
+//
+// Buffer dumps.
+//
+/////////////////////////////////////////////////
+
+//
+// Context of one event.
+//
+
+typedef struct _ETL_EVENT
+{
+    ULONGLONG  Timestamp;
+    ULONG      Sequence;
+    ULONG      Processor;
+    ULONG      ThreadId;
+    ULONG      ProcessId;
+}
+ETL_EVENT, *PETL_EVENT;
+
+//
+// A transfer being reassembled from the dump lines of
+// SpbTraceBufferIndex, logged one after the other by one
+// thread:
+//
+//   device   1 i2c 0x2c: ##00 write    5 txn 7 -  0000: 10 a1 a2 a3 a4
+//
+// The transaction ID is 0 when the dump has none.
+//
+
+typedef struct _ETL_TRANSFER
+{
+    ETL_EVENT           Event;
+    LONGLONG            Device;
+    std::string         Target;
+    ULONG               Index;
+    BOOLEAN             First;
+    std::string         Direction;
+    ULONG               Length;
+    ULONGLONG           Transaction;
+    std::vector<UCHAR>  Data;
+
+    // Only known from the TraceLogging events.
+    BOOLEAN             HasStatus;
+    NTSTATUS            Status;
+}
+ETL_TRANSFER, *PETL_TRANSFER;
+
+typedef struct _ETL_READER
+{
+    ETL_DICTIONARY                 Dictionary;
+    BOOLEAN                        All = FALSE;
+    std::map<ULONG, ETL_TRANSFER>  Transfers;
+
+    ULONGLONG                      Buffers = 0;
+    ULONGLONG                      Events = 0;
+    ULONGLONG                      Messages = 0;
+    ULONGLONG                      Decoded = 0;
+    ULONGLONG                      Undecodable = 0;
+    ULONGLONG                      TransferEvents = 0;
+    ULONGLONG                      TransferRecords = 0;
+    ULONGLONG                      CompletionRecords = 0;
+}
+ETL_READER, *PETL_READER;
+
+static
+VOID
+EtlPrintTransfer(
+    _Inout_  PETL_READER           Reader,
+    _In_     const ETL_TRANSFER   &Transfer)
+{
+    std::string data;
+    char status[32] = "";
+    char transaction[48] = "";
+    char byte[4];
+
+    for (UCHAR value : Transfer.Data)
+    {
+        snprintf(byte, sizeof(byte), "%02x", value);
+        data += byte;
+    }
+
+    if (Transfer.HasStatus)
+    {
+        snprintf(status, sizeof(status), ",\"status\":\"0x%08x\"", (unsigned)Transfer.Status);
+    }
+
+    if (Transfer.Transaction != 0)
+    {
+        snprintf(transaction, sizeof(transaction), ",\"transaction\":%llu", Transfer.Transaction);
+    }
+
+    printf("{\"record\":\"transfer\",\"timestamp\":%llu,\"cpu\":%u,\"thread\":%u,"
+        "\"device\":%lld%s,\"target\":%s,\"index\":%u,\"first\":%s,\"direction\":%s,"
+        "\"length\":%u,\"complete\":%s%s,\"data\":\"%s\"}\n",
+        Transfer.Event.Timestamp,
+        Transfer.Event.Processor,
+        Transfer.Event.ThreadId,
+        Transfer.Device,
+        transaction,
+        EtlJsonString(Transfer.Target).c_str(),
+        Transfer.Index,
+        Transfer.First ? "true" : "false",
+        EtlJsonString(Transfer.Direction).c_str(),
+        Transfer.Length,
+        (Transfer.Data.size() == Transfer.Length) ? "true" : "false",
+        status,
+        data.c_str());
+
+    Reader->TransferRecords++;
+}
+
+static
+VOID
+EtlFlushTransfer(
+    _Inout_  PETL_READER  Reader,
+    _In_     ULONG        ThreadId)
+{
+    auto pending = Reader->Transfers.find(ThreadId);
+
+    if (pending != Reader->Transfers.end())
+    {
+        EtlPrintTransfer(Reader, pending->second);
+        Reader->Transfers.erase(pending);
+    }
+}
+
+//
+// Adds the part of a transfer starting at Offset. A part at
+// offset 0 starts a transfer; the following parts logged by
+// the same thread continue it.
+//
+
+static
+VOID
+EtlAppendTransfer(
+    _Inout_  PETL_READER          Reader,
+    _In_     const ETL_TRANSFER  &Part,
+    _In_     ULONG                Offset)
+{
+    ULONG threadId = Part.Event.ThreadId;
+    auto pending = Reader->Transfers.find(threadId);
+
+    if ((pending != Reader->Transfers.end()) &&
+        ((Offset == 0) ||
+         (pending->second.Data.size() != Offset) ||
+         (pending->second.Device != Part.Device) ||
+         (pending->second.Transaction != Part.Transaction) ||
+         (pending->second.Index != Part.Index)))
+    {
+        EtlFlushTransfer(Reader, threadId);
+        pending = Reader->Transfers.end();
+    }
+
+    if (pending == Reader->Transfers.end())
+    {
+        pending = Reader->Transfers.emplace(threadId, Part).first;
+
+        if (Offset != 0)
+        {
+            //
+            // The start of the transfer was lost.
+            //
+
+            pending->second.Data.insert(pending->second.Data.begin(), Offset, 0);
+        }
+    }
+    else
+    {
+        pending->second.Data.insert(pending->second.Data.end(),
+            Part.Data.begin(), Part.Data.end());
+    }
+
+    if (pending->second.Data.size() >= pending->second.Length)
+    {
+        EtlFlushTransfer(Reader, threadId);
+    }
+}
+
+//
+// Parses the prefix "device %3I64d %s: %c#%02d %5s %4lu txn %I64u - ",
+// without the transaction in the dumps of older probes, and
+// the line "%04x: %02x %02x ..." of a dump line.
+//
+
+static
+BOOLEAN
+EtlDecodeDumpLine(
+    _Inout_  PETL_READER                       Reader,
+    _In_     const ETL_EVENT                  &Event,
+    _In_     const std::vector<ETL_ARGUMENT>  &Arguments)
+{
+    ETL_TRANSFER line = {};
+    const char *prefix;
+    const char *cursor;
+    const char *colon;
+    char marker;
+    char direction[8];
+    unsigned index;
+    unsigned long length;
+    unsigned long offset;
+    int consumed;
+    const char *fields;
+
+    if ((Arguments.size() < 2) ||
+        (Arguments[0].Item != EtlItemString) ||
+        (Arguments[1].Item != EtlItemString))
+    {
+        return FALSE;
+    }
+
+    prefix = Arguments[0].String.c_str();
+
+    if (sscanf(prefix, "device %lld %n", &line.Device, &consumed) != 1)
+    {
+        return FALSE;
+    }
+
+    cursor = prefix + consumed;
+    colon = strstr(cursor, ": ");
+
+    if (colon == nullptr)
+    {
+        return FALSE;
+    }
+
+    line.Target.assign(cursor, colon - cursor);
+
+    fields = colon + 2;
+
+    if (sscanf(fields, "%c#%u %7s %lu%n", &marker, &index, direction, &length, &consumed) != 4)
+    {
+        return FALSE;
+    }
+
+    if (sscanf(fields + consumed, " txn %llu", &line.Transaction) != 1)
+    {
+        line.Transaction = 0;
+    }
+
+    line.Event = Event;
+    line.Index = index;
+    line.First = (marker == '#');
+    line.Direction = direction;
+    line.Length = (ULONG)length;
+
+    cursor = Arguments[1].String.c_str();
+
+    if (sscanf(cursor, "%lx:%n", &offset, &consumed) != 1)
+    {
+        return FALSE;
+    }
+
+    cursor += consumed;
+
+    for (unsigned value; sscanf(cursor, " %2x%n", &value, &consumed) == 1; cursor += consumed)
+    {
+        line.Data.push_back((UCHAR)value);
+    }
+
+    EtlAppendTransfer(Reader, line, (ULONG)offset);
+
+    return TRUE;
+}
+
+/////////////////////////////////////////////////
+//
+// TraceLogging events.
+//
+/////////////////////////////////////////////////
+
+//
+// One decoded field: integers in Value, strings, GUIDs and
+// binary data in Bytes (strings in UTF-8).
+//
+
+typedef struct _ETL_TLG_FIELD
+{
+    std::string         Name;
+    UCHAR               InType;
+    BOOLEAN             Integer;
+    BOOLEAN             Signed;
+    ULONGLONG           Value;
+    std::vector<UCHAR>  Bytes;
+}
+ETL_TLG_FIELD, *PETL_TLG_FIELD;
+
+static
+const ETL_TLG_FIELD *
+EtlFindField(
+    _In_  const std::vector<ETL_TLG_FIELD>  &Fields,
+    _In_  PCSTR                             Name)
+{
+    for (const ETL_TLG_FIELD &field : Fields)
+    {
+        if (field.Name == Name)
+        {
+            return &field;
+        }
+    }
+
+    return nullptr;
+}
+
+static
+BOOLEAN
+EtlReadCString(
+    _In_     const UCHAR   *Data,
+    _In_     size_t         Size,
+    _Inout_  size_t        *pOffset,
+    _Out_    std::string   &Text)
+{
+    const UCHAR *end;
+
+    if (*pOffset >= Size)
+    {
+        return FALSE;
+    }
+
+    end = (const UCHAR *)memchr(Data + *pOffset, 0, Size - *pOffset);
+
+    if (end == nullptr)
+    {
+        return FALSE;
+    }
+
+    Text.assign((const char *)Data + *pOffset, end - (Data + *pOffset));
+    *pOffset = (end - Data) + 1;
+
+    return TRUE;
+}
+
+//
+// Decodes the fields of a TraceLogging event: its metadata
+// (size, tags, event name, then per field its name, input
+// type, optional output type and tags, and constant count)
+// walked alongside the user data.
+//
+
+static
+BOOLEAN
+EtlDecodeTraceLogging(
+    _In_   const UCHAR                 *Metadata,
+    _In_   size_t                       MetadataSize,
+    _In_   const UCHAR                 *Data,
+    _In_   size_t                       DataSize,
+    _Out_  std::string                 &EventName,
+    _Out_  std::vector<ETL_TLG_FIELD>  &Fields)
+{
+    size_t meta = 2;
+    size_t offset = 0;
+
+    if (MetadataSize < 2)
+    {
+        return FALSE;
+    }
+
+    MetadataSize = std::min<size_t>(MetadataSize, EtlRead<USHORT>(Metadata));
+
+    while ((meta < MetadataSize) && (Metadata[meta++] & 0x80))
+    {
+    }
+
+    if (!EtlReadCString(Metadata, MetadataSize, &meta, EventName))
+    {
+        return FALSE;
+    }
+
+    while (meta < MetadataSize)
+    {
+        ETL_TLG_FIELD field = {};
+        UCHAR inType;
+        ULONG count = 1;
+        size_t elementSize = 0;
+
+        if (!EtlReadCString(Metadata, MetadataSize, &meta, field.Name) ||
+            (meta >= MetadataSize))
+        {
+            return FALSE;
+        }
+
+        inType = Metadata[meta++];
+        field.InType = inType & ETL_TLG_IN_TYPE_MASK;
+
+        if (inType & ETL_TLG_IN_CHAIN)
+        {
+            if (meta >= MetadataSize)
+            {
+                return FALSE;
+            }
+
+            if (Metadata[meta++] & ETL_TLG_OUT_CHAIN)
+            {
+                while ((meta < MetadataSize) && (Metadata[meta++] & 0x80))
+                {
+                }
+            }
+        }
+
+        if ((inType & (ETL_TLG_IN_CCOUNT | ETL_TLG_IN_VCOUNT)) == ETL_TLG_IN_CCOUNT)
+        {
+            if (meta + 2 > MetadataSize)
+            {
+                return FALSE;
+            }
+
+            count = EtlRead<USHORT>(Metadata + meta);
+            meta += 2;
+        }
+        else if (inType & ETL_TLG_IN_VCOUNT)
+        {
+            if (offset + 2 > DataSize)
+            {
+                return FALSE;
+            }
+
+            count = EtlRead<USHORT>(Data + offset);
+            offset += 2;
+        }
+
+        switch (field.InType)
+        {
+        case ETL_TLG_IN_INT8:
+        case ETL_TLG_IN_UINT8:
+            elementSize = 1;
+            break;
+
+        case ETL_TLG_IN_INT16:
+        case ETL_TLG_IN_UINT16:
+            elementSize = 2;
+            break;
+
+        case ETL_TLG_IN_INT32:
+        case ETL_TLG_IN_UINT32:
+        case ETL_TLG_IN_HEXINT32:
+        case ETL_TLG_IN_BOOL32:
+        case ETL_TLG_IN_FLOAT:
+            elementSize = 4;
+            break;
+
+        case ETL_TLG_IN_INT64:
+        case ETL_TLG_IN_UINT64:
+        case ETL_TLG_IN_HEXINT64:
+        case ETL_TLG_IN_DOUBLE:
+        case ETL_TLG_IN_FILETIME:
+            elementSize = 8;
+            break;
+
+        case ETL_TLG_IN_GUID:
+        case ETL_TLG_IN_SYSTEMTIME:
+            elementSize = 16;
+            break;
+
+        default:
+            break;
+        }
+
+        for (ULONG element = 0; element < count; element++)
+        {
+            if (elementSize != 0)
+            {
+                if (offset + elementSize > DataSize)
+                {
+                    return FALSE;
+                }
+
+                if (elementSize <= 8)
+                {
+                    field.Integer = TRUE;
+                    field.Value = 0;
+                    memcpy(&field.Value, Data + offset, elementSize);
+
+                    field.Signed = ((field.InType == ETL_TLG_IN_INT8) ||
+                        (field.InType == ETL_TLG_IN_INT16) ||
+                        (field.InType == ETL_TLG_IN_INT32) ||
+                        (field.InType == ETL_TLG_IN_INT64));
+
+                    if (field.Signed && (elementSize < 8) &&
+                        (field.Value & (1ULL << (elementSize * 8 - 1))))
+                    {
+                        field.Value |= ~0ULL << (elementSize * 8);
+                    }
+                }
+
+                field.Bytes.insert(field.Bytes.end(), Data + offset, Data + offset + elementSize);
+                offset += elementSize;
+                continue;
+            }
+
+            switch (field.InType)
+            {
+            case ETL_TLG_IN_ANSISTRING:
+            {
+                std::string text;
+
+                if (!EtlReadCString(Data, DataSize, &offset, text))
+                {
+                    return FALSE;
+                }
+
+                field.Bytes.insert(field.Bytes.end(), text.begin(), text.end());
+                break;
+            }
+
+            case ETL_TLG_IN_UNICODESTRING:
+            {
+                size_t end = offset;
+
+                while ((end + 2 <= DataSize) && (EtlRead<USHORT>(Data + end) != 0))
+                {
+                    end += 2;
+                }
+
+                if (end + 2 > DataSize)
+                {
+                    return FALSE;
+                }
+
+                std::string text = EtlUtf16ToUtf8(Data + offset, (end - offset) / 2);
+
+                field.Bytes.insert(field.Bytes.end(), text.begin(), text.end());
+                offset = end + 2;
+                break;
+            }
+
+            case ETL_TLG_IN_BINARY:
+            case ETL_TLG_IN_COUNTEDBINARY:
+            case ETL_TLG_IN_COUNTEDANSISTRING:
+            case ETL_TLG_IN_COUNTEDSTRING:
+            {
+                USHORT length;
+
+                if (offset + 2 > DataSize)
+                {
+                    return FALSE;
+                }
+
+                length = EtlRead<USHORT>(Data + offset);
+                offset += 2;
+
+                if (offset + length > DataSize)
+                {
+                    return FALSE;
+                }
+
+                if (field.InType == ETL_TLG_IN_COUNTEDSTRING)
+                {
+                    std::string text = EtlUtf16ToUtf8(Data + offset, length / 2);
+
+                    field.Bytes.insert(field.Bytes.end(), text.begin(), text.end());
+                }
+                else
+                {
+                    field.Bytes.insert(field.Bytes.end(), Data + offset, Data + offset + length);
+                }
+
+                offset += length;
+                break;
+            }
+
+            default:
+                //
+                // Structures only group the fields that follow;
+                // unknown types leave the rest undecodable.
+                //
+
+                if (field.InType != ETL_TLG_IN_STRUCT)
+                {
+                    return FALSE;
+                }
+
+                break;
+            }
+        }
+
+        Fields.push_back(std::move(field));
+    }
+
+    return TRUE;
+}
+
+static
+VOID
+EtlPrintTraceLogging(
+    _In_  const ETL_EVENT                   &Event,
+    _In_  UCHAR                              Level,
+    _In_  const std::string                 &EventName,
+    _In_  const std::vector<ETL_TLG_FIELD>  &Fields)
+{
+    std::string fields;
+    char text[32];
+
+    for (const ETL_TLG_FIELD &field : Fields)
+    {
+        if (!fields.empty())
+        {
+            fields += ',';
+        }
+
+        fields += EtlJsonString(field.Name) + ':';
+
+        if (field.Integer && (field.Bytes.size() <= 8))
+        {
+            snprintf(text, sizeof(text), field.Signed ? "%lld" : "%llu", field.Value);
+            fields += text;
+        }
+        else if ((field.InType == ETL_TLG_IN_ANSISTRING) ||
+                 (field.InType == ETL_TLG_IN_UNICODESTRING) ||
+                 (field.InType == ETL_TLG_IN_COUNTEDSTRING) ||
+                 (field.InType == ETL_TLG_IN_COUNTEDANSISTRING))
+        {
+            fields += EtlJsonString(std::string(field.Bytes.begin(), field.Bytes.end()));
+        }
+        else
+        {
+            fields += '"';
+
+            for (UCHAR value : field.Bytes)
+            {
+                snprintf(text, sizeof(text), "%02x", value);
+                fields += text;
+            }
+
+            fields += '"';
+        }
+    }
+
+    printf("{\"record\":\"event\",\"timestamp\":%llu,\"cpu\":%u,\"thread\":%u,"
+        "\"level\":%u,\"event\":%s,\"fields\":{%s}}\n",
+        Event.Timestamp,
+        Event.Processor,
+        Event.ThreadId,
+        Level,
+        EtlJsonString(EventName).c_str(),
+        fields.c_str());
+}
+
+//
+// Turns a "Transfer" event of event.cpp into a part of a
+// transfer record.
+//
+
+static
+BOOLEAN
+EtlDecodeTransferEvent(
+    _Inout_  PETL_READER                        Reader,
+    _In_     const ETL_EVENT                   &Event,
+    _In_     const std::vector<ETL_TLG_FIELD>  &Fields)
+{
+    const ETL_TLG_FIELD *device = EtlFindField(Fields, "DeviceId");
+    const ETL_TLG_FIELD *busType = EtlFindField(Fields, "BusType");
+    const ETL_TLG_FIELD *address = EtlFindField(Fields, "Address");
+    const ETL_TLG_FIELD *transaction = EtlFindField(Fields, "TransactionId");
+    const ETL_TLG_FIELD *index = EtlFindField(Fields, "Index");
+    const ETL_TLG_FIELD *direction = EtlFindField(Fields, "Direction");
+    const ETL_TLG_FIELD *length = EtlFindField(Fields, "Length");
+    const ETL_TLG_FIELD *offset = EtlFindField(Fields, "Offset");
+    const ETL_TLG_FIELD *status = EtlFindField(Fields, "Status");
+    const ETL_TLG_FIELD *payload = EtlFindField(Fields, "Payload");
+    ETL_TRANSFER part = {};
+    char target[24];
+
+    if ((device == nullptr) || (index == nullptr) || (direction == nullptr) ||
+        (length == nullptr) || (offset == nullptr) || (payload == nullptr))
+    {
+        return FALSE;
+    }
+
+    //
+    // The SPI settings other than the chip select are not in
+    // the event.
+    //
+
+    if ((busType != nullptr) && (address != nullptr))
+    {
+        snprintf(target, sizeof(target),
+            (busType->Value == 0x02) ? "spi cs%llu" : "i2c 0x%02llx",
+            address->Value);
+    }
+    else
+    {
+        snprintf(target, sizeof(target), "?");
+    }
+
+    part.Event = Event;
+    part.Device = (LONGLONG)device->Value;
+    part.Target = target;
+    part.Index = (ULONG)index->Value;
+    part.First = (part.Index == 0);
+    part.Direction = (direction->Value == ETL_PROBE_DIRECTION_TO_DEVICE) ? "write" : "read";
+    part.Length = (ULONG)length->Value;
+    part.Transaction = (transaction != nullptr) ? transaction->Value : 0;
+    part.Data = payload->Bytes;
+    part.HasStatus = (status != nullptr);
+    part.Status = (status != nullptr) ? (NTSTATUS)status->Value : 0;
+
+    Reader->TransferEvents++;
+
+    if (part.Length == 0)
+    {
+        EtlPrintTransfer(Reader, part);
+        return TRUE;
+    }
+
+    EtlAppendTransfer(Reader, part, (ULONG)offset->Value);
+
+    return TRUE;
+}
+
+//
+// Turns a "Completion" event of event.cpp into a completion
+// record, the final status of the transfers of its
+// transaction.
+//
+
+static
+BOOLEAN
+EtlDecodeCompletionEvent(
+    _Inout_  PETL_READER                        Reader,
+    _In_     const ETL_EVENT                   &Event,
+    _In_     const std::vector<ETL_TLG_FIELD>  &Fields)
+{
+    const ETL_TLG_FIELD *device = EtlFindField(Fields, "DeviceId");
+    const ETL_TLG_FIELD *transaction = EtlFindField(Fields, "TransactionId");
+    const ETL_TLG_FIELD *count = EtlFindField(Fields, "TransferCount");
+    const ETL_TLG_FIELD *status = EtlFindField(Fields, "Status");
+
+    if ((device == nullptr) || (transaction == nullptr) || (status == nullptr))
+    {
+        return FALSE;
+    }
+
+    printf("{\"record\":\"completion\",\"timestamp\":%llu,\"cpu\":%u,\"thread\":%u,"
+        "\"device\":%lld,\"transaction\":%llu,\"transfers\":%u,\"status\":\"0x%08x\"}\n",
+        Event.Timestamp,
+        Event.Processor,
+        Event.ThreadId,
+        (LONGLONG)device->Value,
+        transaction->Value,
+        (count != nullptr) ? (ULONG)count->Value : 0,
+        (unsigned)status->Value);
+
+    Reader->CompletionRecords++;
+
+    return TRUE;
+}
+
+static
+VOID
+EtlReadEvent(
+    _Inout_  PETL_READER   Reader,
+    _In_     const UCHAR  *Event,
+    _In_     size_t        Size,
+    _In_     ULONG         Processor)
+{
+    USHORT flags;
+    size_t offset = ETL_EVENT_HEADER_SIZE;
+    const UCHAR *metadata = nullptr;
+    size_t metadataSize = 0;
+    ETL_EVENT event = {};
+    UCHAR level;
+    std::string eventName;
+    std::vector<ETL_TLG_FIELD> fields;
+
+    if ((Size < ETL_EVENT_HEADER_SIZE) ||
+        (EtlFormatGuid(Event + ETL_EVENT_PROVIDER_OFFSET) != ETL_PROBE_PROVIDER))
+    {
+        return;
+    }
+
+    flags = EtlRead<USHORT>(Event + ETL_EVENT_FLAGS_OFFSET);
+    level = Event[ETL_EVENT_LEVEL_OFFSET];
+
+    event.Processor = Processor;
+    event.ThreadId = EtlRead<ULONG>(Event + ETL_EVENT_THREAD_OFFSET);
+    event.ProcessId = EtlRead<ULONG>(Event + ETL_EVENT_PROCESS_OFFSET);
+    event.Timestamp = EtlRead<ULONGLONG>(Event + ETL_EVENT_TIMESTAMP_OFFSET);
+
+    //
+    // The schema of TraceLogging events travels with each
+    // event, as an extended data item.
+    //
+
+    if (flags & ETL_EVENT_FLAG_EXTENDED_INFO)
+    {
+        for (;;)
+        {
+            USHORT type;
+            USHORT linkage;
+            USHORT dataSize;
+
+            if (offset + ETL_EXTENDED_ITEM_HEADER_SIZE > Size)
+            {
+                return;
+            }
+
+            type = EtlRead<USHORT>(Event + offset + 2);
+            linkage = EtlRead<USHORT>(Event + offset + 4);
+            dataSize = EtlRead<USHORT>(Event + offset + 6);
+            offset += ETL_EXTENDED_ITEM_HEADER_SIZE;
+
+            if (offset + dataSize > Size)
+            {
+                return;
+            }
+
+            if (type == ETL_EXTENDED_TYPE_EVENT_SCHEMA_TL)
+            {
+                metadata = Event + offset;
+                metadataSize = dataSize;
+            }
+
+            offset += (dataSize + ETL_EVENT_ALIGNMENT - 1) & ~(ETL_EVENT_ALIGNMENT - 1);
+
+            if (!(linkage & ETL_EXTENDED_ITEM_LINKAGE))
+            {
+                break;
+            }
+        }
+    }
+
+    if ((metadata == nullptr) || (offset > Size))
+    {
+        return;
+    }
+
+    if (!EtlDecodeTraceLogging(metadata, metadataSize, Event + offset, Size - offset,
+            eventName, fields))
+    {
+        Reader->Undecodable++;
+        return;
+    }
+
+    Reader->Decoded++;
+
+    if ((eventName == ETL_PROBE_TRANSFER_EVENT) &&
+        EtlDecodeTransferEvent(Reader, event, fields))
+    {
+        return;
+    }
+
+    if ((eventName == ETL_PROBE_COMPLETION_EVENT) &&
+        EtlDecodeCompletionEvent(Reader, event, fields))
+    {
+        return;
+    }
+
+    if (Reader->All)
+    {
+        EtlPrintTraceLogging(event, level, eventName, fields);
+    }
+}
+
+/////////////////////////////////////////////////
+//
+// Events and buffers.
+//
+/////////////////////////////////////////////////
+
+static
+VOID
+EtlReadMessage(
+    _Inout_  PETL_READER   Reader,
+    _In_     const UCHAR  *Event,
+    _In_     size_t        Size,
+    _In_     ULONG         Processor)
+{
+    USHORT number = EtlRead<USHORT>(Event + 4);
+    USHORT flags = EtlRead<USHORT>(Event + 6);
+    size_t offset = 8;
+    ETL_EVENT event = {};
+    std::vector<ETL_ARGUMENT> arguments;
+    std::string guid;
+
+    Reader->Messages++;
+    event.Processor = Processor;
+
+    if (flags & ETL_MESSAGE_SEQUENCE)
+    {
+        if (offset + 4 > Size)
+        {
+            return;
+        }
+
+        event.Sequence = EtlRead<ULONG>(Event + offset);
+        offset += 4;
+    }
+
+    if (flags & ETL_MESSAGE_GUID)
+    {
+        if (offset + 16 > Size)
+        {
+            return;
+        }
+
+        guid = EtlFormatGuid(Event + offset);
+        offset += 16;
+    }
+    else if (flags & ETL_MESSAGE_COMPONENTID)
+    {
+        offset += 4;
+    }
+
+    if (flags & ETL_MESSAGE_TIMESTAMP)
+    {
+        if (offset + 8 > Size)
+        {
+            return;
+        }
+
+        event.Timestamp = EtlRead<ULONGLONG>(Event + offset);
+        offset += 8;
+    }
+
+    if (flags & ETL_MESSAGE_SYSTEMINFO)
+    {
+        if (offset + 8 > Size)
+        {
+            return;
+        }
+
+        event.ThreadId = EtlRead<ULONG>(Event + offset);
+        event.ProcessId = EtlRead<ULONG>(Event + offset + 4);
+        offset += 8;
+    }
+
+    //
+    // Messages without a TMF of the probe come from other
+    // providers of the session.
+    //
+
+    auto message = Reader->Dictionary.find(std::make_pair(guid, number));
+
+    if ((guid.empty()) || (message == Reader->Dictionary.end()) || (offset > Size))
+    {
+        return;
+    }
+
+    if (!EtlDecodeArguments(&message->second, Event + offset, Size - offset, arguments))
+    {
+        Reader->Undecodable++;
+        return;
+    }
+
+    Reader->Decoded++;
+
+    if ((message->second.Function == ETL_DUMP_FUNCTION) &&
+        EtlDecodeDumpLine(Reader, event, arguments))
+    {
+        return;
+    }
+
+    if (Reader->All)
+    {
+        printf("{\"record\":\"message\",\"timestamp\":%llu,\"cpu\":%u,\"thread\":%u,"
+            "\"sequence\":%u,\"level\":%s,\"flags\":%s,\"function\":%s,\"message\":%s}\n",
+            event.Timestamp,
+            event.Processor,
+            event.ThreadId,
+            event.Sequence,
+            EtlJsonString(message->second.Level).c_str(),
+            EtlJsonString(message->second.Flags).c_str(),
+            EtlJsonString(message->second.Function).c_str(),
+            EtlJsonString(EtlFormatMessage(&message->second, arguments)).c_str());
+    }
+}
+
+static
+VOID
+EtlReadBuffer(
+    _Inout_  PETL_READER   Reader,
+    _In_     const UCHAR  *Buffer,
+    _In_     ULONG         BufferSize)
+{
+    ULONG filled = EtlRead<ULONG>(Buffer + ETL_BUFFER_FILLED_OFFSET);
+    ULONG processor = Buffer[ETL_BUFFER_PROCESSOR_OFFSET];
+    ULONG offset = ETL_BUFFER_HEADER_SIZE;
+
+    if ((filled < ETL_BUFFER_HEADER_SIZE) || (filled > BufferSize))
+    {
+        filled = EtlRead<ULONG>(Buffer + ETL_BUFFER_SAVED_OFFSET_OFFSET);
+    }
+
+    if ((filled < ETL_BUFFER_HEADER_SIZE) || (filled > BufferSize))
+    {
+        filled = BufferSize;
+    }
+
+    Reader->Buffers++;
+
+    while (offset + 8 <= filled)
+    {
+        const UCHAR *event = Buffer + offset;
+        ULONG marker = EtlRead<ULONG>(event);
+        UCHAR markerFlags = (UCHAR)(marker >> 24);
+        UCHAR headerType = (UCHAR)(marker >> 16);
+        BOOLEAN message = FALSE;
+        ULONG size;
+
+        //
+        // The rest of a buffer is filled with 0xff, or zeroes.
+        //
+
+        if ((marker == 0xffffffff) || (marker == 0) ||
+            !(markerFlags & ETL_MARKER_HEADER_FLAG))
+        {
+            break;
+        }
+
+        if (markerFlags & ETL_MARKER_EVENT_TRACE_FLAG)
+        {
+            message = (headerType == ETL_HEADER_TYPE_MESSAGE);
+        }
+        else
+        {
+            message = ((markerFlags & ETL_MARKER_MESSAGE_FLAG) != 0);
+        }
+
+        //
+        // The system headers keep the version in the first
+        // word and the size in the third.
+        //
+
+        switch (headerType)
+        {
+        case ETL_HEADER_TYPE_SYSTEM32:
+        case ETL_HEADER_TYPE_SYSTEM64:
+        case ETL_HEADER_TYPE_COMPACT32:
+        case ETL_HEADER_TYPE_COMPACT64:
+        case ETL_HEADER_TYPE_PERFINFO32:
+        case ETL_HEADER_TYPE_PERFINFO64:
+            size = message ? EtlRead<USHORT>(event) : EtlRead<USHORT>(event + 4);
+            break;
+
+        default:
+            size = EtlRead<USHORT>(event);
+            break;
+        }
+
+        if ((size < 8) || (offset + size > filled))
+        {
+            break;
+        }
+
+        Reader->Events++;
+
+        if (message)
+        {
+            EtlReadMessage(Reader, event, size, processor);
+        }
+        else if ((headerType == ETL_HEADER_TYPE_EVENT32) ||
+                 (headerType == ETL_HEADER_TYPE_EVENT64))
+        {
+            EtlReadEvent(Reader, event, size, processor);
+        }
+
+        offset += (size + ETL_EVENT_ALIGNMENT - 1) & ~(ETL_EVENT_ALIGNMENT - 1);
+    }
+}
+
+static
+int
+EtlReadFile(
+    _Inout_  PETL_READER  Reader,
+    _In_     PCSTR        Path)
+{
+    struct stat status;
+    const UCHAR *file;
+    size_t offset = 0;
+    int fd;
+
+    fd = open(Path, O_RDONLY);
+
+    if ((fd < 0) || (fstat(fd, &status) != 0))
+    {
+        fprintf(stderr, "cannot open %s\n", Path);
+        return 1;
+    }
+
+    if (status.st_size < ETL_BUFFER_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s is not an ETL file\n", Path);
+        close(fd);
+        return 1;
+    }
+
+    file = (const UCHAR *)mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (file == MAP_FAILED)
+    {
+        fprintf(stderr, "cannot map %s\n", Path);
+        return 1;
+    }
+
+    madvise((PVOID)file, status.st_size, MADV_SEQUENTIAL);
+
+    while (offset + ETL_BUFFER_HEADER_SIZE <= (size_t)status.st_size)
+    {
+        ULONG bufferSize = EtlRead<ULONG>(file + offset + ETL_BUFFER_SIZE_OFFSET);
+
+        if ((bufferSize < ETL_BUFFER_HEADER_SIZE) ||
+            (offset + bufferSize > (size_t)status.st_size))
+        {
+            fprintf(stderr, "%s: truncated buffer at offset %zu\n", Path, offset);
+            break;
+        }
+
+        EtlReadBuffer(Reader, file + offset, bufferSize);
+
+        //
+        // Release the pages read, so that large files do not
+        // stay resident.
+        //
+
+        if ((offset & ~(size_t)0xffffff) != ((offset + bufferSize) & ~(size_t)0xffffff))
+        {
+            madvise((PVOID)file, (offset + bufferSize) & ~(size_t)0xffffff, MADV_DONTNEED);
+        }
+
+        offset += bufferSize;
+    }
+
+    munmap((PVOID)file, status.st_size);
+
+    return 0;
+}
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    ETL_READER reader;
+    std::vector<PCSTR> files;
+    ULONG tmfCount = 0;
+    int result = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-tmf") == 0) && (i + 1 < argc))
+        {
+            tmfCount += EtlLoadTmfPath(argv[++i], reader.Dictionary);
+        }
+        else if (strcmp(argv[i], "-all") == 0)
+        {
+            reader.All = TRUE;
+        }
+        else if (argv[i][0] != '-')
+        {
+            files.push_back(argv[i]);
+        }
+        else
+        {
+            files.clear();
+            break;
+        }
+    }
+
+    //
+    // Without TMF, only the TraceLogging events are decoded.
+    //
+
+    if (files.empty())
+    {
+        fprintf(stderr,
+            "usage: %s [-tmf <file or directory> ...] [-all] <file.etl> ...\n",
+            argv[0]);
+        return 2;
+    }
+
+    for (PCSTR file : files)
+    {
+        result |= EtlReadFile(&reader, file);
+    }
+
+    while (!reader.Transfers.empty())
+    {
+        EtlFlushTransfer(&reader, reader.Transfers.begin()->first);
+    }
+
+    fprintf(stderr,
+        "%u TMF, %llu buffers, %llu events, %llu messages, %llu decoded, "
+        "%llu undecodable, %llu transfer events, %llu transfers, %llu completions\n",
+        tmfCount,
+        reader.Buffers,
+        reader.Events,
+        reader.Messages,
+        reader.Decoded,
+        reader.Undecodable,
+        reader.TransferEvents,
+        reader.TransferRecords,
+        reader.CompletionRecords);
+
+    return result;
+}
@@ -0,0 +1,312 @@
+/*++
+
+Module Name:
+
+    SPBCx.h
+
+Abstract:
+
+    This module contains the user-mode emulation of the simple
+    peripheral bus class extension (SPBCx) interface and of the
+    SPB transfer list definitions from spb.h.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOST_SPBCX_H_
+#define _HOST_SPBCX_H_
+
+#include "wdf.h"
+
+/////////////////////////////////////////////////
+//
+// spb.h
+//
+/////////////////////////////////////////////////
+
+#define FILE_DEVICE_SPB 0x00000043
+
+#define IOCTL_SPB_LOCK_CONTROLLER \
+    CTL_CODE(FILE_DEVICE_SPB, 0x100, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_UNLOCK_CONTROLLER \
+    CTL_CODE(FILE_DEVICE_SPB, 0x101, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_EXECUTE_SEQUENCE \
+    CTL_CODE(FILE_DEVICE_SPB, 0x102, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_LOCK_CONNECTION \
+    CTL_CODE(FILE_DEVICE_SPB, 0x103, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_UNLOCK_CONNECTION \
+    CTL_CODE(FILE_DEVICE_SPB, 0x104, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SPB_FULL_DUPLEX \
+    CTL_CODE(FILE_DEVICE_SPB, 0x105, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+typedef enum SPB_TRANSFER_DIRECTION {
+    SpbTransferDirectionNone,
+    SpbTransferDirectionFromDevice,
+    SpbTransferDirectionToDevice,
+    SpbTransferDirectionMax
+} SPB_TRANSFER_DIRECTION, *PSPB_TRANSFER_DIRECTION;
+
+typedef enum SPB_TRANSFER_BUFFER_FORMAT {
+    SpbTransferBufferFormatInvalid = 0,
+    SpbTransferBufferFormatSimple,
+    SpbTransferBufferFormatList,
+    SpbTransferBufferFormatSimpleNonPaged,
+    SpbTransferBufferFormatMdl,
+    SpbTransferBufferFormatMax
+} SPB_TRANSFER_BUFFER_FORMAT, *PSPB_TRANSFER_BUFFER_FORMAT;
+
+typedef struct SPB_TRANSFER_BUFFER_LIST_ENTRY {
+    PVOID Buffer;
+    ULONG BufferCb;
+} SPB_TRANSFER_BUFFER_LIST_ENTRY, *PSPB_TRANSFER_BUFFER_LIST_ENTRY;
+
+typedef struct SPB_TRANSFER_BUFFER {
+    SPB_TRANSFER_BUFFER_FORMAT Format;
+    union {
+        SPB_TRANSFER_BUFFER_LIST_ENTRY Simple;
+        struct {
+            PSPB_TRANSFER_BUFFER_LIST_ENTRY List;
+            ULONG ListCe;
+        } BufferList;
+        PMDL Mdl;
+    };
+} SPB_TRANSFER_BUFFER, *PSPB_TRANSFER_BUFFER;
+
+typedef struct SPB_TRANSFER_LIST_ENTRY {
+    SPB_TRANSFER_DIRECTION Direction;
+    ULONG DelayInUs;
+    SPB_TRANSFER_BUFFER Buffer;
+} SPB_TRANSFER_LIST_ENTRY, *PSPB_TRANSFER_LIST_ENTRY;
+
+typedef struct SPB_TRANSFER_LIST {
+    ULONG Size;
+    ULONG Reserved;
+    ULONG TransferCount;
+    SPB_TRANSFER_LIST_ENTRY Transfers[ANYSIZE_ARRAY];
+} SPB_TRANSFER_LIST, *PSPB_TRANSFER_LIST;
+
+#define SPB_TRANSFER_LIST_AND_ENTRIES(n) \
+    struct { \
+        SPB_TRANSFER_LIST List; \
+        SPB_TRANSFER_LIST_ENTRY ExtraTransfers[(n) - 1]; \
+    }
+
+inline VOID
+SPB_TRANSFER_LIST_INIT(
+    PSPB_TRANSFER_LIST List,
+    ULONG TransferCount)
+{
+    ULONG size = FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) +
+        (TransferCount * sizeof(SPB_TRANSFER_LIST_ENTRY));
+
+    RtlZeroMemory(List, size);
+    List->Size = sizeof(SPB_TRANSFER_LIST);
+    List->TransferCount = TransferCount;
+}
+
+inline SPB_TRANSFER_LIST_ENTRY
+SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+    SPB_TRANSFER_DIRECTION Direction,
+    ULONG DelayInUs,
+    PVOID Buffer,
+    ULONG BufferCb)
+{
+    SPB_TRANSFER_LIST_ENTRY entry;
+
+    RtlZeroMemory(&entry, sizeof(entry));
+    entry.Direction = Direction;
+    entry.DelayInUs = DelayInUs;
+    entry.Buffer.Format = SpbTransferBufferFormatSimple;
+    entry.Buffer.Simple.Buffer = Buffer;
+    entry.Buffer.Simple.BufferCb = BufferCb;
+
+    return entry;
+}
+
+inline SPB_TRANSFER_LIST_ENTRY
+SPB_TRANSFER_LIST_ENTRY_INIT_NON_PAGED(
+    SPB_TRANSFER_DIRECTION Direction,
+    ULONG DelayInUs,
+    PVOID Buffer,
+    ULONG BufferCb)
+{
+    SPB_TRANSFER_LIST_ENTRY entry = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+        Direction, DelayInUs, Buffer, BufferCb);
+
+    entry.Buffer.Format = SpbTransferBufferFormatSimpleNonPaged;
+
+    return entry;
+}
+
+inline SPB_TRANSFER_LIST_ENTRY
+SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+    SPB_TRANSFER_DIRECTION Direction,
+    ULONG DelayInUs,
+    PMDL Mdl)
+{
+    SPB_TRANSFER_LIST_ENTRY entry;
+
+    RtlZeroMemory(&entry, sizeof(entry));
+    entry.Direction = Direction;
+    entry.DelayInUs = DelayInUs;
+    entry.Buffer.Format = SpbTransferBufferFormatMdl;
+    entry.Buffer.Mdl = Mdl;
+
+    return entry;
+}
+
+/////////////////////////////////////////////////
+//
+// SPBCx.h
+//
+/////////////////////////////////////////////////
+
+typedef WDFOBJECT SPBTARGET;
+typedef WDFREQUEST SPBREQUEST;
+
+typedef enum SPB_REQUEST_TYPE {
+    SpbRequestTypeUndefined = 0,
+    SpbRequestTypeRead,
+    SpbRequestTypeWrite,
+    SpbRequestTypeSequence,
+    SpbRequestTypeLockController,
+    SpbRequestTypeUnlockController,
+    SpbRequestTypeLockConnection,
+    SpbRequestTypeUnlockConnection,
+    SpbRequestTypeOther,
+    SpbRequestTypeMax
+} SPB_REQUEST_TYPE, *PSPB_REQUEST_TYPE;
+
+typedef enum SPB_REQUEST_SEQUENCE_POSITION {
+    SpbRequestSequencePositionInvalid = 0,
+    SpbRequestSequencePositionFirst,
+    SpbRequestSequencePositionContinue,
+    SpbRequestSequencePositionLast,
+    SpbRequestSequencePositionSingle,
+    SpbRequestSequencePositionMax
+} SPB_REQUEST_SEQUENCE_POSITION, *PSPB_REQUEST_SEQUENCE_POSITION;
+
+typedef struct SPB_REQUEST_PARAMETERS {
+    ULONG Size;
+    SPB_REQUEST_SEQUENCE_POSITION Position;
+    size_t Length;
+    SPB_REQUEST_TYPE Type;
+    ULONG SequenceTransferCount;
+} SPB_REQUEST_PARAMETERS, *PSPB_REQUEST_PARAMETERS;
+
+inline VOID
+SPB_REQUEST_PARAMETERS_INIT(
+    PSPB_REQUEST_PARAMETERS Parameters)
+{
+    RtlZeroMemory(Parameters, sizeof(SPB_REQUEST_PARAMETERS));
+    Parameters->Size = sizeof(SPB_REQUEST_PARAMETERS);
+}
+
+typedef struct SPB_TRANSFER_DESCRIPTOR {
+    ULONG Size;
+    SPB_TRANSFER_DIRECTION Direction;
+    size_t TransferLength;
+    ULONG DelayInUs;
+} SPB_TRANSFER_DESCRIPTOR, *PSPB_TRANSFER_DESCRIPTOR;
+
+inline VOID
+SPB_TRANSFER_DESCRIPTOR_INIT(
+    PSPB_TRANSFER_DESCRIPTOR Descriptor)
+{
+    RtlZeroMemory(Descriptor, sizeof(SPB_TRANSFER_DESCRIPTOR));
+    Descriptor->Size = sizeof(SPB_TRANSFER_DESCRIPTOR);
+}
+
+typedef struct SPB_CONNECTION_PARAMETERS {
+    ULONG Size;
+    PCWSTR ConnectionTag;
+    PVOID ConnectionParameters;
+} SPB_CONNECTION_PARAMETERS, *PSPB_CONNECTION_PARAMETERS;
+
+inline VOID
+SPB_CONNECTION_PARAMETERS_INIT(
+    PSPB_CONNECTION_PARAMETERS Parameters)
+{
+    RtlZeroMemory(Parameters, sizeof(SPB_CONNECTION_PARAMETERS));
+    Parameters->Size = sizeof(SPB_CONNECTION_PARAMETERS);
+}
+
+typedef NTSTATUS EVT_SPB_TARGET_CONNECT(WDFDEVICE Controller, SPBTARGET Target);
+typedef EVT_SPB_TARGET_CONNECT *PFN_SPB_TARGET_CONNECT;
+typedef VOID EVT_SPB_TARGET_DISCONNECT(WDFDEVICE Controller, SPBTARGET Target);
+typedef EVT_SPB_TARGET_DISCONNECT *PFN_SPB_TARGET_DISCONNECT;
+typedef VOID EVT_SPB_CONTROLLER_LOCK(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST LockRequest);
+typedef EVT_SPB_CONTROLLER_LOCK *PFN_SPB_CONTROLLER_LOCK;
+typedef VOID EVT_SPB_CONTROLLER_UNLOCK(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST UnlockRequest);
+typedef EVT_SPB_CONTROLLER_UNLOCK *PFN_SPB_CONTROLLER_UNLOCK;
+typedef VOID EVT_SPB_CONNECTION_LOCK(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST LockRequest);
+typedef EVT_SPB_CONNECTION_LOCK *PFN_SPB_CONNECTION_LOCK;
+typedef VOID EVT_SPB_CONNECTION_UNLOCK(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST UnlockRequest);
+typedef EVT_SPB_CONNECTION_UNLOCK *PFN_SPB_CONNECTION_UNLOCK;
+typedef VOID EVT_SPB_CONTROLLER_READ(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST Request, size_t Length);
+typedef EVT_SPB_CONTROLLER_READ *PFN_SPB_CONTROLLER_READ;
+typedef VOID EVT_SPB_CONTROLLER_WRITE(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST Request, size_t Length);
+typedef EVT_SPB_CONTROLLER_WRITE *PFN_SPB_CONTROLLER_WRITE;
+typedef VOID EVT_SPB_CONTROLLER_SEQUENCE(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST Request, ULONG TransferCount);
+typedef EVT_SPB_CONTROLLER_SEQUENCE *PFN_SPB_CONTROLLER_SEQUENCE;
+typedef VOID EVT_SPB_CONTROLLER_OTHER(WDFDEVICE Controller, SPBTARGET Target,
+    SPBREQUEST Request, size_t OutputBufferLength, size_t InputBufferLength,
+    ULONG IoControlCode);
+typedef EVT_SPB_CONTROLLER_OTHER *PFN_SPB_CONTROLLER_OTHER;
+
+typedef struct SPB_CONTROLLER_CONFIG {
+    ULONG Size;
+    WDF_IO_QUEUE_DISPATCH_TYPE ControllerDispatchType;
+    WDF_TRI_STATE PowerManaged;
+    BOOLEAN FullDuplexSupported;
+    PFN_SPB_TARGET_CONNECT EvtSpbTargetConnect;
+    PFN_SPB_TARGET_DISCONNECT EvtSpbTargetDisconnect;
+    PFN_SPB_CONTROLLER_READ EvtSpbIoRead;
+    PFN_SPB_CONTROLLER_WRITE EvtSpbIoWrite;
+    PFN_SPB_CONTROLLER_SEQUENCE EvtSpbIoSequence;
+    PFN_SPB_CONTROLLER_LOCK EvtSpbControllerLock;
+    PFN_SPB_CONTROLLER_UNLOCK EvtSpbControllerUnlock;
+    PFN_SPB_CONNECTION_LOCK EvtSpbConnectionLock;
+    PFN_SPB_CONNECTION_UNLOCK EvtSpbConnectionUnlock;
+} SPB_CONTROLLER_CONFIG, *PSPB_CONTROLLER_CONFIG;
+
+inline VOID
+SPB_CONTROLLER_CONFIG_INIT(
+    PSPB_CONTROLLER_CONFIG Config)
+{
+    RtlZeroMemory(Config, sizeof(SPB_CONTROLLER_CONFIG));
+    Config->Size = sizeof(SPB_CONTROLLER_CONFIG);
+    Config->ControllerDispatchType = WdfIoQueueDispatchSequential;
+    Config->PowerManaged = WdfUseDefault;
+}
+
+EXTERN_C NTSTATUS SpbDeviceInitConfig(PWDFDEVICE_INIT DeviceInit);
+EXTERN_C NTSTATUS SpbDeviceInitialize(WDFDEVICE FxDevice, PSPB_CONTROLLER_CONFIG Config);
+EXTERN_C VOID SpbControllerSetIoOtherCallback(WDFDEVICE FxDevice,
+    PFN_SPB_CONTROLLER_OTHER EvtSpbIoOther,
+    PFN_WDF_IO_IN_CALLER_CONTEXT EvtIoInCallerContext);
+EXTERN_C VOID SpbControllerSetTargetAttributes(WDFDEVICE FxDevice,
+    PWDF_OBJECT_ATTRIBUTES TargetAttributes);
+EXTERN_C VOID SpbControllerSetRequestAttributes(WDFDEVICE FxDevice,
+    PWDF_OBJECT_ATTRIBUTES RequestAttributes);
+EXTERN_C VOID SpbTargetGetConnectionParameters(SPBTARGET SpbTarget,
+    PSPB_CONNECTION_PARAMETERS ConnectionParameters);
+EXTERN_C SPBTARGET SpbRequestGetTarget(SPBREQUEST SpbRequest);
+EXTERN_C VOID SpbRequestGetParameters(SPBREQUEST SpbRequest,
+    PSPB_REQUEST_PARAMETERS Parameters);
+EXTERN_C VOID SpbRequestGetTransferParameters(SPBREQUEST SpbRequest, ULONG Index,
+    PSPB_TRANSFER_DESCRIPTOR TransferDescriptor, PMDL *TransferBuffer);
+EXTERN_C NTSTATUS SpbRequestCaptureIoOtherTransferList(SPBREQUEST SpbRequest);
+EXTERN_C VOID SpbRequestComplete(SPBREQUEST SpbRequest, NTSTATUS CompletionStatus);
+
+#endif // _HOST_SPBCX_H_
@@ -0,0 +1,123 @@
+/*++
+
+Module Name:
+
+    TraceLoggingProvider.h
+
+Abstract:
+
+    This module contains the user-mode replacement of the
+    TraceLogging provider macros. A provider is enabled while
+    the harness installed an event sink, and each event is
+    handed to the sink as a list of typed fields.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOST_TRACELOGGINGPROVIDER_H_
+#define _HOST_TRACELOGGINGPROVIDER_H_
+
+#include "hostddk.h"
+
+typedef struct _HOST_TLG_PROVIDER
+{
+    PCSTR                         Name;
+    GUID                          Id;
+}
+HOST_TLG_PROVIDER;
+
+typedef const HOST_TLG_PROVIDER *TraceLoggingHProvider;
+
+typedef enum _HOST_TLG_FIELD_TYPE
+{
+    HostTlgLevel = 0,
+    HostTlgKeyword,
+    HostTlgInt64,
+    HostTlgUInt8,
+    HostTlgUInt16,
+    HostTlgUInt32,
+    HostTlgUInt64,
+    HostTlgNTStatus,
+    HostTlgBinary
+}
+HOST_TLG_FIELD_TYPE;
+
+//
+// One field of an event. Integers are in Value, binary
+// fields point to the caller's buffer for the duration of
+// the sink call.
+//
+
+typedef struct _HOST_TLG_FIELD
+{
+    HOST_TLG_FIELD_TYPE           Type;
+    PCSTR                         Name;
+    ULONGLONG                     Value;
+    const VOID                   *Buffer;
+    ULONG                         Length;
+}
+HOST_TLG_FIELD, *PHOST_TLG_FIELD;
+
+BOOLEAN
+HostTraceLoggingEnabled(
+    _In_  TraceLoggingHProvider  Provider,
+    _In_  UCHAR                  Level,
+    _In_  ULONGLONG              Keyword);
+
+VOID
+HostTraceLoggingWrite(
+    _In_  TraceLoggingHProvider  Provider,
+    _In_  PCSTR                  Event,
+    _In_  const HOST_TLG_FIELD  *Fields,
+    _In_  ULONG                  FieldCount);
+
+#define HOST_TLG_GUID(l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+
+#define TRACELOGGING_DECLARE_PROVIDER(Handle) \
+    extern const TraceLoggingHProvider Handle
+
+#define TRACELOGGING_DEFINE_PROVIDER(Handle, Name, Id) \
+    static const HOST_TLG_PROVIDER Handle ## _Storage = { Name, HOST_TLG_GUID Id }; \
+    const TraceLoggingHProvider Handle = &Handle ## _Storage
+
+#define TraceLoggingRegister(Provider) \
+    ((VOID)(Provider), STATUS_SUCCESS)
+
+#define TraceLoggingUnregister(Provider) \
+    ((VOID)(Provider))
+
+#define TraceLoggingProviderEnabled(Provider, Level, Keyword) \
+    HostTraceLoggingEnabled((Provider), (UCHAR)(Level), (ULONGLONG)(Keyword))
+
+//
+// No standard header here: libstdc++ undefines the min and
+// max macros of hostddk.h.
+//
+
+#define TraceLoggingWrite(Provider, Event, ...) \
+    do { \
+        const HOST_TLG_FIELD _fields[] = { __VA_ARGS__ }; \
+        HostTraceLoggingWrite((Provider), (Event), _fields, \
+            (ULONG)(sizeof(_fields) / sizeof(_fields[0]))); \
+    } while (0)
+
+#define HOST_TLG_VALUE(Type, Value, Name) \
+    HOST_TLG_FIELD{ (Type), (Name), (ULONGLONG)(Value), nullptr, 0 }
+
+#define TraceLoggingLevel(Level)        HOST_TLG_VALUE(HostTlgLevel, (Level), "")
+#define TraceLoggingKeyword(Keyword)    HOST_TLG_VALUE(HostTlgKeyword, (Keyword), "")
+#define TraceLoggingInt64(Value, Name)  HOST_TLG_VALUE(HostTlgInt64, (LONGLONG)(Value), (Name))
+#define TraceLoggingUInt8(Value, Name)  HOST_TLG_VALUE(HostTlgUInt8, (UCHAR)(Value), (Name))
+#define TraceLoggingUInt16(Value, Name) HOST_TLG_VALUE(HostTlgUInt16, (USHORT)(Value), (Name))
+#define TraceLoggingUInt32(Value, Name) HOST_TLG_VALUE(HostTlgUInt32, (ULONG)(Value), (Name))
+#define TraceLoggingUInt64(Value, Name) HOST_TLG_VALUE(HostTlgUInt64, (ULONGLONG)(Value), (Name))
+#define TraceLoggingNTStatus(Value, Name) HOST_TLG_VALUE(HostTlgNTStatus, (ULONG)(Value), (Name))
+
+#define TraceLoggingBinary(Buffer, Length, Name) \
+    HOST_TLG_FIELD{ HostTlgBinary, (Name), 0, (const VOID *)(Buffer), (ULONG)(Length) }
+
+#endif // _HOST_TRACELOGGINGPROVIDER_H_
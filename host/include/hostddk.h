@@ -0,0 +1,549 @@
+/*++
+
+Module Name:
+
+    hostddk.h
+
+Abstract:
+
+    This module contains the user-mode emulation of the subset of
+    the NT kernel types and routines used by the probe, so that the
+    driver sources build unmodified on a POSIX host.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOSTDDK_H_
+#define _HOSTDDK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <wchar.h>
+
+/////////////////////////////////////////////////
+//
+// Annotations and compiler helpers.
+//
+/////////////////////////////////////////////////
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(x)
+#define _In_reads_bytes_(x)
+#define _In_reads_opt_(x)
+#define _Out_writes_(x)
+#define _Out_writes_to_(x, y)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_bytes_to_(x, y)
+#define _Inout_updates_(x)
+#define _Inout_updates_bytes_(x)
+#define _Must_inspect_result_
+#define _Use_decl_annotations_
+#define _IRQL_requires_(x)
+#define _IRQL_requires_max_(x)
+#define _IRQL_raises_(x)
+#define _IRQL_saves_
+#define _IRQL_restores_
+#define _Function_class_(x)
+#define _Requires_lock_held_(x)
+#define _Acquires_lock_(x)
+#define _Releases_lock_(x)
+#define _Analysis_assume_(x)
+#define _When_(x, y)
+#define _Success_(x)
+#define _Field_size_(x)
+#define _Field_size_bytes_(x)
+#define __drv_aliasesMem
+#define __drv_allocatesMem(x)
+#define __drv_freesMem(x)
+
+#define FORCEINLINE inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN DECLSPEC_ALIGN(64)
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define ANYSIZE_ARRAY 1
+#define NTAPI
+#define NTKERNELAPI
+#define CALLBACK
+#define EXTERN_C extern "C"
+#define C_ASSERT(e) static_assert(e, #e)
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define RTL_NUMBER_OF(a) ARRAYSIZE(a)
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((char *)(address) - offsetof(type, field)))
+#define ALIGN_UP_BY(length, alignment) \
+    (((ULONG_PTR)(length) + (alignment) - 1) & ~((ULONG_PTR)(alignment) - 1))
+
+/////////////////////////////////////////////////
+//
+// Basic types.
+//
+/////////////////////////////////////////////////
+
+#define VOID void
+typedef void *PVOID;
+typedef const void *PCVOID;
+typedef char CHAR, *PCHAR, *PSTR;
+typedef const char *PCSTR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef short SHORT;
+typedef unsigned short USHORT, *PUSHORT;
+typedef int LONG, *PLONG;
+typedef unsigned int ULONG, *PULONG;
+typedef long long LONGLONG, *PLONGLONG;
+typedef unsigned long long ULONGLONG, *PULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T;
+typedef ULONGLONG ULONG64, *PULONG64;
+typedef LONGLONG LONG64;
+typedef unsigned int UINT32;
+typedef unsigned long long UINT64;
+typedef unsigned char UINT8;
+typedef unsigned short UINT16;
+typedef unsigned char BYTE;
+typedef UCHAR BOOLEAN, *PBOOLEAN;
+typedef int BOOL;
+typedef wchar_t WCHAR, *PWCHAR, *PWSTR, *PWCH;
+typedef const wchar_t *PCWSTR;
+typedef PVOID HANDLE;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG ACCESS_MASK;
+typedef LONG NTSTATUS;
+typedef CHAR CCHAR;
+
+#define MAXUCHAR 0xff
+#define MAXUSHORT 0xffff
+#define MAXULONG 0xffffffff
+
+#define TRUE 1
+#define FALSE 0
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _GUID {
+    ULONG Data1;
+    USHORT Data2;
+    USHORT Data3;
+    UCHAR Data4[8];
+} GUID, *LPGUID;
+
+typedef const GUID *LPCGUID;
+
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    inline const GUID name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+
+inline bool
+IsEqualGUID(
+    const GUID &a,
+    const GUID &b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+/////////////////////////////////////////////////
+//
+// Status codes.
+//
+/////////////////////////////////////////////////
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+#define STATUS_SUCCESS                   ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                   ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                   ((NTSTATUS)0x00000103L)
+#define STATUS_MORE_ENTRIES              ((NTSTATUS)0x00000105L)
+#define STATUS_BUFFER_OVERFLOW           ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES           ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL              ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED           ((NTSTATUS)0xC0000002L)
+#define STATUS_INFO_LENGTH_MISMATCH      ((NTSTATUS)0xC0000004L)
+#define STATUS_INVALID_PARAMETER         ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE            ((NTSTATUS)0xC000000EL)
+#define STATUS_INVALID_DEVICE_REQUEST    ((NTSTATUS)0xC0000010L)
+#define STATUS_BUFFER_TOO_SMALL          ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_TYPE_MISMATCH      ((NTSTATUS)0xC0000024L)
+#define STATUS_OBJECT_NAME_NOT_FOUND     ((NTSTATUS)0xC0000034L)
+#define STATUS_INSUFFICIENT_RESOURCES    ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_NOT_READY          ((NTSTATUS)0xC00000A3L)
+#define STATUS_IO_TIMEOUT                ((NTSTATUS)0xC00000B5L)
+#define STATUS_NOT_SUPPORTED             ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_DEVICE_STATE      ((NTSTATUS)0xC0000184L)
+#define STATUS_DEVICE_BUSY               ((NTSTATUS)0x80000011L)
+#define STATUS_CANCELLED                 ((NTSTATUS)0xC0000120L)
+#define STATUS_NOT_FOUND                 ((NTSTATUS)0xC0000225L)
+#define STATUS_DEVICE_PROTOCOL_ERROR     ((NTSTATUS)0xC0000186L)
+#define STATUS_DATA_ERROR                ((NTSTATUS)0xC000003EL)
+#define STATUS_INVALID_BUFFER_SIZE       ((NTSTATUS)0xC0000206L)
+
+/////////////////////////////////////////////////
+//
+// Assertions.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C void HostAssertFailed(const char *Expression, const char *Message,
+    const char *File, int Line);
+
+#define NT_ASSERT(e) \
+    ((e) ? (void)0 : HostAssertFailed(#e, nullptr, __FILE__, __LINE__))
+#define NT_ASSERTMSG(m, e) \
+    ((e) ? (void)0 : HostAssertFailed(#e, m, __FILE__, __LINE__))
+#define NT_VERIFY(e) (NT_ASSERT(e), (e))
+#define ASSERT(e) NT_ASSERT(e)
+
+//
+// Trace levels, as in wdm.h.
+//
+
+#define TRACE_LEVEL_NONE        0
+#define TRACE_LEVEL_CRITICAL    1
+#define TRACE_LEVEL_FATAL       1
+#define TRACE_LEVEL_ERROR       2
+#define TRACE_LEVEL_WARNING     3
+#define TRACE_LEVEL_INFORMATION 4
+#define TRACE_LEVEL_VERBOSE     5
+
+/////////////////////////////////////////////////
+//
+// IRQL, processors and interlocked operations.
+//
+/////////////////////////////////////////////////
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+
+EXTERN_C KIRQL KeGetCurrentIrql(VOID);
+EXTERN_C VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql);
+EXTERN_C VOID KeLowerIrql(KIRQL NewIrql);
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR Number;
+    UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+EXTERN_C ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+EXTERN_C ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber);
+
+#define InterlockedIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedAdd(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr(p, v) __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+
+template <typename T, typename V, typename C>
+inline T
+HostInterlockedCompareExchange(
+    T *Destination,
+    V Exchange,
+    C Comparand)
+{
+    // Without the volatile of the destination.
+    __typeof__(+*Destination) expected = (T)Comparand;
+    __atomic_compare_exchange_n(Destination, &expected, (T)Exchange, false,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
+
+#define InterlockedCompareExchange(d, e, c) HostInterlockedCompareExchange((d), (e), (c))
+#define InterlockedCompareExchange64(d, e, c) HostInterlockedCompareExchange((d), (e), (c))
+#define InterlockedCompareExchangePointer(d, e, c) \
+    HostInterlockedCompareExchange((d), (e), (c))
+
+#define ReadAcquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadAcquire64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define WriteRelease(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteRelease64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ReadPointerAcquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define WritePointerRelease(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ReadNoFence64(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define YieldProcessor() __builtin_ia32_pause()
+
+/////////////////////////////////////////////////
+//
+// Time.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+EXTERN_C VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+#define KeQuerySystemTime(t) KeQuerySystemTimePrecise(t)
+
+#define WDF_REL_TIMEOUT_IN_MS(ms) (-((LONGLONG)(ms) * 10000))
+#define WDF_REL_TIMEOUT_IN_US(us) (-((LONGLONG)(us) * 10))
+
+/////////////////////////////////////////////////
+//
+// Memory.
+//
+/////////////////////////////////////////////////
+
+#define RtlZeroMemory(d, l) memset((d), 0, (l))
+#define RtlCopyMemory(d, s, l) memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l) memmove((d), (s), (l))
+#define RtlFillMemory(d, l, f) memset((d), (f), (l))
+#define RtlCompareMemory(a, b, l) HostCompareMemory((a), (b), (l))
+#define RtlEqualMemory(a, b, l) (memcmp((a), (b), (l)) == 0)
+
+EXTERN_C SIZE_T HostCompareMemory(const void *Source1, const void *Source2, SIZE_T Length);
+
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512,
+} POOL_TYPE;
+
+#define POOL_FLAG_NON_PAGED 0x40ULL
+typedef ULONG64 POOL_FLAGS;
+
+EXTERN_C PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+EXTERN_C PVOID ExAllocatePool2(POOL_FLAGS Flags, SIZE_T NumberOfBytes, ULONG Tag);
+EXTERN_C VOID ExFreePoolWithTag(PVOID P, ULONG Tag);
+#define ExFreePool(p) ExFreePoolWithTag((p), 0)
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MdlMappingNoExecute 0x40000000
+
+typedef struct _MDL {
+    struct _MDL *Next;
+    SHORT Size;
+    SHORT MdlFlags;
+    PVOID MappedSystemVa;
+    PVOID StartVa;
+    ULONG ByteCount;
+    ULONG ByteOffset;
+} MDL, *PMDL;
+
+#define MmGetMdlByteCount(Mdl) ((Mdl)->ByteCount)
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority) ((Mdl)->MappedSystemVa)
+#define MmGetMdlVirtualAddress(Mdl) ((Mdl)->StartVa)
+
+/////////////////////////////////////////////////
+//
+// Run time library.
+//
+/////////////////////////////////////////////////
+
+#define CCHAR_BITS 8
+
+inline CCHAR
+RtlFindMostSignificantBit(
+    ULONGLONG Set)
+{
+    return (Set == 0) ? -1 : (CCHAR)(63 - __builtin_clzll(Set));
+}
+
+inline CCHAR
+RtlFindLeastSignificantBit(
+    ULONGLONG Set)
+{
+    return (Set == 0) ? -1 : (CCHAR)__builtin_ctzll(Set);
+}
+
+inline VOID
+RtlInitUnicodeString(
+    PUNICODE_STRING DestinationString,
+    PCWSTR SourceString)
+{
+    size_t length = (SourceString != nullptr) ? wcslen(SourceString) : 0;
+
+    DestinationString->Buffer = (PWCH)SourceString;
+    DestinationString->Length = (USHORT)(length * sizeof(WCHAR));
+    DestinationString->MaximumLength =
+        (USHORT)((SourceString != nullptr) ? (length + 1) * sizeof(WCHAR) : 0);
+}
+
+EXTERN_C NTSTATUS RtlUnicodeStringToInteger(PCUNICODE_STRING String, ULONG Base, PULONG Value);
+
+#define DECLARE_CONST_UNICODE_STRING(_var, _string) \
+    const UNICODE_STRING _var = { sizeof(_string) - sizeof(WCHAR), sizeof(_string), (PWCH)(_string) }
+
+#define DECLARE_UNICODE_STRING_SIZE(_var, _size) \
+    WCHAR _var ## _buffer[_size]; \
+    UNICODE_STRING _var = { 0, (USHORT)((_size) * sizeof(WCHAR)), _var ## _buffer }
+
+#define RTL_CONSTANT_STRING(s) { sizeof(s) - sizeof((s)[0]), sizeof(s), (PWCH)(s) }
+
+//
+// The probe formats with the MSVC printf dialect (%I64d, %lu on a
+// 32-bit ULONG). These are translated before calling the C library.
+//
+
+EXTERN_C int HostFormatV(char *Buffer, size_t BufferSize, const char *Format, va_list Args);
+EXTERN_C int HostFormat(char *Buffer, size_t BufferSize, const char *Format, ...);
+
+#define sprintf_s HostFormat
+#define _snprintf_s(b, s, c, ...) HostFormat((b), (s), __VA_ARGS__)
+
+EXTERN_C NTSTATUS RtlStringCbPrintfA(PSTR Dest, size_t cbDest, PCSTR Format, ...);
+EXTERN_C NTSTATUS RtlUnicodeStringPrintf(PUNICODE_STRING Dest, PCWSTR Format, ...);
+
+/////////////////////////////////////////////////
+//
+// Resources.
+//
+/////////////////////////////////////////////////
+
+#define CmResourceTypeNull 0
+#define CmResourceTypePort 1
+#define CmResourceTypeInterrupt 2
+#define CmResourceTypeMemory 3
+#define CmResourceTypeConnection 132
+
+#define CM_RESOURCE_CONNECTION_CLASS_GPIO 0x01
+#define CM_RESOURCE_CONNECTION_CLASS_SERIAL 0x02
+#define CM_RESOURCE_CONNECTION_TYPE_GPIO_IO 0x02
+#define CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C 0x01
+#define CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI 0x02
+#define CM_RESOURCE_CONNECTION_TYPE_SERIAL_UART 0x03
+
+#define CM_RESOURCE_INTERRUPT_LEVEL_SENSITIVE 0x00
+#define CM_RESOURCE_INTERRUPT_LATCHED 0x01
+#define CM_RESOURCE_INTERRUPT_MESSAGE 0x02
+
+typedef struct _CM_PARTIAL_RESOURCE_DESCRIPTOR {
+    UCHAR Type;
+    UCHAR ShareDisposition;
+    USHORT Flags;
+    union {
+        struct {
+            USHORT Level;
+            USHORT Group;
+            ULONG Vector;
+            ULONG_PTR Affinity;
+        } Interrupt;
+        struct {
+            UCHAR Class;
+            UCHAR Type;
+            UCHAR Reserved1;
+            UCHAR Reserved2;
+            ULONG IdLowPart;
+            ULONG IdHighPart;
+        } Connection;
+    } u;
+} CM_PARTIAL_RESOURCE_DESCRIPTOR, *PCM_PARTIAL_RESOURCE_DESCRIPTOR;
+
+/////////////////////////////////////////////////
+//
+// I/O manager.
+//
+/////////////////////////////////////////////////
+
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define FILE_DEVICE_CONTROLLER 0x00000004
+#define METHOD_BUFFERED 0
+#define METHOD_IN_DIRECT 1
+#define METHOD_OUT_DIRECT 2
+#define METHOD_NEITHER 3
+#define FILE_ANY_ACCESS 0
+#define FILE_READ_ACCESS 0x0001
+#define FILE_WRITE_ACCESS 0x0002
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define GENERIC_READ 0x80000000L
+#define GENERIC_WRITE 0x40000000L
+#define FILE_OPEN 0x00000001
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define KEY_READ 0x20019
+#define KEY_WRITE 0x20006
+
+#define REG_NONE 0
+#define REG_SZ 1
+#define REG_BINARY 3
+#define REG_DWORD 4
+#define REG_MULTI_SZ 7
+
+/////////////////////////////////////////////////
+//
+// Power settings.
+//
+/////////////////////////////////////////////////
+
+typedef enum _POWER_ACTION {
+    PowerActionNone = 0,
+    PowerActionReserved,
+    PowerActionSleep,
+    PowerActionHibernate,
+    PowerActionShutdown,
+    PowerActionShutdownReset,
+    PowerActionShutdownOff,
+    PowerActionWarmEject,
+    PowerActionDisplayOff
+} POWER_ACTION, *PPOWER_ACTION;
+
+typedef NTSTATUS POWER_SETTING_CALLBACK(
+    LPCGUID SettingGuid,
+    PVOID Value,
+    ULONG ValueLength,
+    PVOID Context);
+typedef POWER_SETTING_CALLBACK *PPOWER_SETTING_CALLBACK;
+
+EXTERN_C NTSTATUS PoRegisterPowerSettingCallback(PDEVICE_OBJECT DeviceObject,
+    LPCGUID SettingGuid, PPOWER_SETTING_CALLBACK Callback, PVOID Context,
+    PVOID *Handle);
+EXTERN_C NTSTATUS PoUnregisterPowerSettingCallback(PVOID Handle);
+
+DEFINE_GUID(GUID_MONITOR_POWER_ON,
+    0x02731015, 0x4510, 0x4526, 0x99, 0xe6, 0xe5, 0xa1, 0x7e, 0xbd, 0x1a, 0xea);
+DEFINE_GUID(GUID_CONSOLE_DISPLAY_STATE,
+    0x6fe69556, 0x704a, 0x47a0, 0x8f, 0x24, 0xc2, 0x8d, 0x93, 0x6f, 0xda, 0x47);
+
+#endif // _HOSTDDK_H_
@@ -0,0 +1,389 @@
+/*++
+
+Module Name:
+
+    hostmodels.h
+
+Abstract:
+
+    This module contains the behavioral models of I2C and SPI
+    devices for the host simulation: a HID over I2C touchpad,
+    a 24Cxx EEPROM and a polled accelerometer. A model is the
+    simulated controller of a probe device, in place of the
+    controller the probe opens as TrueSpbController, and
+    completes each request after the wire time of its
+    transfers at the connection speed plus a response latency.
+
+    Models run under the framework lock, like the probe, so
+    their state needs no locking of its own.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOSTMODELS_H_
+#define _HOSTMODELS_H_
+
+#include <hostsim.h>
+
+#include <atomic>
+#include <deque>
+
+/////////////////////////////////////////////////
+//
+// Model base.
+//
+/////////////////////////////////////////////////
+
+//
+// Bus settings of a model, as the probe keeps them per target
+// in PBC_TARGET_SETTINGS, and its response latency.
+//
+
+typedef struct _HOST_MODEL_SETTINGS
+{
+    // CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C or _SPI.
+    UCHAR                         BusType;
+    BOOLEAN                       TenBitAddress;
+
+    // I2C slave address, or SPI device selection.
+    USHORT                        Address;
+    ULONG                         ConnectionSpeed;
+
+    // SPI only.
+    UCHAR                         DataBitLength;
+
+    // Time the device takes to respond to each request, on
+    // top of the wire time.
+    ULONG                         ResponseLatencyUs;
+}
+HOST_MODEL_SETTINGS, *PHOST_MODEL_SETTINGS;
+
+VOID
+HostModelI2cSettings(
+    _Out_  PHOST_MODEL_SETTINGS  Settings,
+    _In_   USHORT                Address,
+    _In_   ULONG                 ConnectionSpeed,
+    _In_   ULONG                 ResponseLatencyUs = 0);
+
+VOID
+HostModelSpiSettings(
+    _Out_  PHOST_MODEL_SETTINGS  Settings,
+    _In_   USHORT                DeviceSelection,
+    _In_   ULONG                 ConnectionSpeed,
+    _In_   ULONG                 ResponseLatencyUs = 0);
+
+class HostDeviceModel : public HostSpbController
+{
+public:
+
+    HostDeviceModel(
+        _In_  const HOST_MODEL_SETTINGS  &Settings);
+
+    //
+    // Runs the operation through the model and sets its
+    // completion delay.
+    //
+
+    NTSTATUS
+    Execute(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override;
+
+    //
+    // Connection descriptor of the device, for the client
+    // targets opened with HostSimOpenTarget.
+    //
+
+    std::vector<UCHAR>
+    Connection(
+        ) const;
+
+    //
+    // Time the operation takes on the wire, in nanoseconds.
+    //
+
+    ULONGLONG
+    WireTimeNs(
+        _In_  const HOST_SPB_OPERATION  *Operation
+        ) const;
+
+    const HOST_MODEL_SETTINGS &
+    Settings(
+        ) const
+    {
+        return m_Settings;
+    }
+
+    ULONGLONG                     Operations = 0;
+    ULONGLONG                     Nacks = 0;
+
+protected:
+
+    //
+    // Runs the transfers of the operation on the device.
+    // Returns STATUS_NO_SUCH_DEVICE when the device does not
+    // acknowledge its address.
+    //
+
+    virtual
+    NTSTATUS
+    Process(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) = 0;
+
+    HOST_MODEL_SETTINGS           m_Settings;
+};
+
+/////////////////////////////////////////////////
+//
+// HID over I2C touchpad.
+//
+/////////////////////////////////////////////////
+
+#define HOST_HIDI2C_DESCRIPTOR_REGISTER     0x0001
+#define HOST_HIDI2C_REPORT_DESC_REGISTER    0x0002
+#define HOST_HIDI2C_INPUT_REGISTER          0x0003
+#define HOST_HIDI2C_OUTPUT_REGISTER         0x0004
+#define HOST_HIDI2C_COMMAND_REGISTER        0x0005
+#define HOST_HIDI2C_DATA_REGISTER           0x0006
+
+#define HOST_HIDI2C_OPCODE_RESET            0x1
+#define HOST_HIDI2C_OPCODE_SET_POWER        0x8
+
+#define HOST_HIDI2C_POWER_ON                0x0
+#define HOST_HIDI2C_POWER_SLEEP             0x1
+
+//
+// Input report: report ID, tip switch, contact identifier,
+// X, Y (0 to 4095) and contact count, after the 2 bytes of
+// length of the HID over I2C input register.
+//
+
+#define HOST_HIDI2C_REPORT_ID               0x01
+#define HOST_HIDI2C_INPUT_LENGTH            10
+
+//
+// A single finger touchpad. The host fetches the HID
+// descriptor at HOST_HIDI2C_DESCRIPTOR_REGISTER, then the
+// report descriptor, and resets the device, which answers
+// with an empty input report. While a finger touches the pad,
+// the device queues an input report at ReportRateHz and holds
+// its interrupt line asserted until the host read them all.
+//
+
+typedef VOID HOST_MODEL_INTERRUPT(
+    _In_  BOOLEAN  Asserted);
+
+class HostHidI2cTouchpad : public HostDeviceModel
+{
+public:
+
+    HostHidI2cTouchpad(
+        _In_  const HOST_MODEL_SETTINGS  &Settings,
+        _In_  ULONG                       ReportRateHz = 125);
+
+    ~HostHidI2cTouchpad(
+        ) override;
+
+    //
+    // Called with the framework lock held whenever the
+    // interrupt line changes.
+    //
+
+    VOID
+    SetInterruptHandler(
+        _In_  std::function<HOST_MODEL_INTERRUPT>  Handler);
+
+    BOOLEAN
+    IsInterruptAsserted(
+        ) const;
+
+    //
+    // Puts a finger down for DurationMs, moving it around the
+    // pad, then lifts it.
+    //
+
+    VOID
+    Touch(
+        _In_  ULONG  DurationMs);
+
+    ULONGLONG                     ReportsGenerated = 0;
+    ULONGLONG                     ReportsDropped = 0;
+
+protected:
+
+    NTSTATUS
+    Process(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override;
+
+private:
+
+    VOID
+    QueueReport(
+        _In_  const std::vector<UCHAR>  &Report);
+
+    VOID
+    ReadInput(
+        _Out_  PUCHAR  Buffer,
+        _In_   size_t  Length);
+
+    VOID
+    ReadRegister(
+        _In_   USHORT  Register,
+        _Out_  PUCHAR  Buffer,
+        _In_   size_t  Length);
+
+    VOID
+    WriteRegister(
+        _In_  USHORT        Register,
+        _In_  const UCHAR  *Data,
+        _In_  size_t        Length);
+
+    VOID
+    SampleTouch(
+        );
+
+    VOID
+    UpdateInterrupt(
+        );
+
+    ULONG                                 m_ReportPeriodUs;
+    std::function<HOST_MODEL_INTERRUPT>   m_InterruptHandler;
+    std::atomic<BOOLEAN>                  m_Interrupt;
+    BOOLEAN                               m_Sleeping = FALSE;
+    std::deque<std::vector<UCHAR>>        m_Reports;
+    ULONGLONG                             m_TouchEndUs = 0;
+    ULONGLONG                             m_SampleEventId = 0;
+    ULONG                                 m_Sample = 0;
+};
+
+/////////////////////////////////////////////////
+//
+// 24Cxx EEPROM.
+//
+/////////////////////////////////////////////////
+
+//
+// An I2C EEPROM of Size bytes (a power of two), written by
+// pages of PageSize bytes. Parts up to 256 bytes take one
+// address byte, larger parts two, as 24C32 and up do.
+// Writes wrap around within their page, and a write starts a
+// write cycle of WriteCycleUs during which the device does
+// not acknowledge its address. Reads continue from the
+// current address and wrap around the memory.
+//
+
+class HostEeprom24Cxx : public HostDeviceModel
+{
+public:
+
+    HostEeprom24Cxx(
+        _In_  const HOST_MODEL_SETTINGS  &Settings,
+        _In_  ULONG                       Size = 256,
+        _In_  ULONG                       PageSize = 8,
+        _In_  ULONG                       WriteCycleUs = 5000);
+
+    std::vector<UCHAR>            Memory;
+    ULONGLONG                     WriteCycles = 0;
+
+protected:
+
+    NTSTATUS
+    Process(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override;
+
+private:
+
+    ULONG                         m_PageSize;
+    ULONG                         m_AddressBytes;
+    ULONG                         m_WriteCycleUs;
+    ULONG                         m_Address = 0;
+    ULONGLONG                     m_BusyUntilUs = 0;
+};
+
+/////////////////////////////////////////////////
+//
+// Polled accelerometer.
+//
+/////////////////////////////////////////////////
+
+#define HOST_ACCEL_WHO_AM_I                 0x0f
+#define HOST_ACCEL_WHO_AM_I_VALUE           0x33
+#define HOST_ACCEL_CTRL_REG1                0x20
+#define HOST_ACCEL_CTRL_REG4                0x23
+#define HOST_ACCEL_STATUS_REG               0x27
+#define HOST_ACCEL_OUT_X_L                  0x28
+#define HOST_ACCEL_OUT_Z_H                  0x2d
+
+#define HOST_ACCEL_STATUS_ZYXDA             0x08
+#define HOST_ACCEL_STATUS_ZYXOR             0x80
+
+//
+// Register address bit selecting auto-increment on I2C, and
+// read and auto-increment bits of the SPI command byte.
+//
+
+#define HOST_ACCEL_I2C_AUTO_INCREMENT       0x80
+#define HOST_ACCEL_SPI_READ                 0x80
+#define HOST_ACCEL_SPI_AUTO_INCREMENT       0x40
+
+//
+// A 3-axis accelerometer with a LIS3DH style register map,
+// on I2C or SPI. CTRL_REG1[7:4] selects the output data rate
+// (1 to 400 Hz, 0 powers it down); a new sample sets ZYXDA in
+// STATUS_REG until the outputs are read, and a sample
+// overwritten before being read sets ZYXOR. Samples follow a
+// slow rotation of 1 g, in 16-bit left-justified two's
+// complement at +/-2 g.
+//
+
+class HostAccelerometer : public HostDeviceModel
+{
+public:
+
+    HostAccelerometer(
+        _In_  const HOST_MODEL_SETTINGS  &Settings);
+
+    UCHAR                         Registers[0x40] = {};
+    ULONGLONG                     SamplesRead = 0;
+    ULONGLONG                     SamplesMissed = 0;
+
+protected:
+
+    NTSTATUS
+    Process(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override;
+
+private:
+
+    ULONG
+    DataRateHz(
+        ) const;
+
+    VOID
+    UpdateSample(
+        );
+
+    UCHAR
+    ReadRegister(
+        _In_  UCHAR  Register);
+
+    VOID
+    WriteRegister(
+        _In_  UCHAR  Register,
+        _In_  UCHAR  Value);
+
+    ULONGLONG                     m_EnabledUs = 0;
+    ULONGLONG                     m_Sample = 0;
+    ULONGLONG                     m_SampleRead = 0;
+    UCHAR                         m_Address = 0;
+    BOOLEAN                       m_AutoIncrement = FALSE;
+};
+
+#endif // _HOSTMODELS_H_
@@ -0,0 +1,461 @@
+/*++
+
+Module Name:
+
+    hostsim.h
+
+Abstract:
+
+    This module contains the interface of the host simulation
+    harness. It loads the probe through DriverEntry, adds probe
+    devices on top of simulated SPB controllers, opens targets
+    and sends client requests through the same SPBCx callbacks
+    as on Windows (OnRead, OnWrite, OnSequence, OnOther, ...).
+
+    Everything the framework would run (driver callbacks, timers,
+    work items, delayed completions) runs under one framework
+    lock, which stands in for the serialization of the sequential
+    SPBCx queue.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOSTSIM_H_
+#define _HOSTSIM_H_
+
+#include <wdf.h>
+#include <SPBCx.h>
+#include <TraceLoggingProvider.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/////////////////////////////////////////////////
+//
+// Simulated SPB controllers.
+//
+/////////////////////////////////////////////////
+
+#define HOST_SPB_MAX_TRANSFERS 16
+
+typedef enum _HOST_SPB_OPERATION_TYPE
+{
+    HostSpbOperationRead = 0,
+    HostSpbOperationWrite,
+    HostSpbOperationSequence,
+    HostSpbOperationFullDuplex,
+    HostSpbOperationLockController,
+    HostSpbOperationUnlockController,
+    HostSpbOperationLockConnection,
+    HostSpbOperationUnlockConnection,
+    HostSpbOperationIoctl,
+    HostSpbOperationMax
+}
+HOST_SPB_OPERATION_TYPE;
+
+typedef struct _HOST_SPB_TRANSFER
+{
+    SPB_TRANSFER_DIRECTION        Direction;
+    ULONG                         DelayInUs;
+    PUCHAR                        Buffer;
+    size_t                        Length;
+}
+HOST_SPB_TRANSFER, *PHOST_SPB_TRANSFER;
+
+//
+// One request received by a simulated controller. Buffers
+// point to flat copies of the client buffers, copied back once
+// the operation completes.
+//
+
+typedef struct _HOST_SPB_OPERATION
+{
+    HOST_SPB_OPERATION_TYPE       Type;
+    ULONG                         IoControlCode;
+    ULONG                         TransferCount;
+    HOST_SPB_TRANSFER             Transfers[HOST_SPB_MAX_TRANSFERS];
+
+    // Set by the controller. The operation completes
+    // synchronously unless CompletionDelayUs is set, or never
+    // when Pend is set, until the request is cancelled.
+    ULONG_PTR                     Information;
+    ULONG                         CompletionDelayUs;
+    BOOLEAN                       Pend;
+}
+HOST_SPB_OPERATION, *PHOST_SPB_OPERATION;
+
+class HostSpbController
+{
+public:
+
+    virtual
+    ~HostSpbController(
+        ) = default;
+
+    //
+    // Executes one operation and returns its status. The
+    // default Information is the number of bytes transferred.
+    //
+
+    virtual
+    NTSTATUS
+    Execute(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) = 0;
+};
+
+ULONG_PTR
+HostSpbOperationLength(
+    _In_  const HOST_SPB_OPERATION *Operation);
+
+/////////////////////////////////////////////////
+//
+// Connection descriptors.
+//
+/////////////////////////////////////////////////
+
+std::vector<UCHAR>
+HostSimI2cConnection(
+    _In_  USHORT  Address,
+    _In_  ULONG   ConnectionSpeed,
+    _In_  BOOLEAN TenBitAddress = FALSE);
+
+std::vector<UCHAR>
+HostSimSpiConnection(
+    _In_  USHORT  DeviceSelection,
+    _In_  ULONG   ConnectionSpeed,
+    _In_  UCHAR   DataBitLength = 8,
+    _In_  UCHAR   Phase = 0,
+    _In_  UCHAR   Polarity = 0,
+    _In_  USHORT  TypeSpecificFlags = 0);
+
+/////////////////////////////////////////////////
+//
+// Driver, devices, targets and client requests.
+//
+/////////////////////////////////////////////////
+
+struct HOST_SIM_DEVICE;
+struct HOST_SIM_TARGET;
+struct HOST_SIM_REQUEST;
+
+typedef HOST_SIM_DEVICE *PHOST_SIM_DEVICE;
+typedef HOST_SIM_TARGET *PHOST_SIM_TARGET;
+typedef HOST_SIM_REQUEST *PHOST_SIM_REQUEST;
+
+//
+// Calls DriverEntry, and deletes the driver object on unload.
+//
+
+NTSTATUS
+HostSimLoadDriver(VOID);
+
+VOID
+HostSimUnloadDriver(VOID);
+
+//
+// Creates a probe device on top of Controller, reachable by
+// the probe through the resource hub with ConnectionId. The
+// device parameters key can be filled before it is started.
+//
+
+PHOST_SIM_DEVICE
+HostSimCreateDevice(
+    _In_  LONGLONG            ConnectionId,
+    _In_  HostSpbController  *Controller);
+
+//
+// Replaces the controller behind the device. A device created
+// without one cannot open its SPB target until it is set.
+//
+
+VOID
+HostSimSetController(
+    _In_  PHOST_SIM_DEVICE    Device,
+    _In_  HostSpbController  *Controller);
+
+//
+// Adds a GPIO interrupt resource to the device, before it is
+// started. Signal raises it: the ISRs connected to it run
+// right away if the device is in D0, and their DPCs on the
+// dispatcher thread.
+//
+
+VOID
+HostSimAddInterrupt(
+    _In_  PHOST_SIM_DEVICE  Device);
+
+VOID
+HostSimSignalInterrupt(
+    _In_  PHOST_SIM_DEVICE  Device);
+
+VOID
+HostSimSetRegistryULong(
+    _In_      PHOST_SIM_DEVICE  Device,
+    _In_opt_  PCWSTR            SubKey,
+    _In_      PCWSTR            ValueName,
+    _In_      ULONG             Value);
+
+VOID
+HostSimSetRegistryMultiSz(
+    _In_      PHOST_SIM_DEVICE                 Device,
+    _In_opt_  PCWSTR                           SubKey,
+    _In_      PCWSTR                           ValueName,
+    _In_      const std::vector<std::wstring> &Strings);
+
+//
+// Runs device add, prepare hardware and D0 entry.
+//
+
+NTSTATUS
+HostSimStartDevice(
+    _In_  PHOST_SIM_DEVICE  Device);
+
+//
+// Runs D0 exit and release hardware, and deletes the device.
+//
+
+VOID
+HostSimRemoveDevice(
+    _In_  PHOST_SIM_DEVICE  Device);
+
+//
+// Lets the device go to D3 once its queue stayed empty for the
+// idle timeout assigned by the driver, and resumes it on the
+// next request. Disabled by default.
+//
+
+VOID
+HostSimEnableIdle(
+    _In_  PHOST_SIM_DEVICE  Device,
+    _In_  BOOLEAN           Enable);
+
+BOOLEAN
+HostSimIsDeviceInD0(
+    _In_  PHOST_SIM_DEVICE  Device);
+
+ULONG
+HostSimGetIdleTimeout(
+    _In_  PHOST_SIM_DEVICE  Device);
+
+WDFDEVICE
+HostSimGetWdfDevice(
+    _In_  PHOST_SIM_DEVICE  Device);
+
+//
+// Simulates power events delivered to all the devices.
+//
+
+VOID
+HostSimSetMonitorPower(
+    _In_  BOOLEAN       On);
+
+VOID
+HostSimSetSystemPowerAction(
+    _In_  POWER_ACTION  Action);
+
+//
+// Opens and closes a target of the device, as a client
+// driver opening the connection with a descriptor.
+//
+
+PHOST_SIM_TARGET
+HostSimOpenTarget(
+    _In_  PHOST_SIM_DEVICE           Device,
+    _In_  const std::vector<UCHAR>  &Connection);
+
+VOID
+HostSimCloseTarget(
+    _In_  PHOST_SIM_TARGET  Target);
+
+//
+// Client requests. Submit queues the request to the device
+// and returns; Wait blocks until it completes (TimeoutMs 0
+// waits forever) and frees it. Buffers must stay valid until
+// the request completes.
+//
+
+PHOST_SIM_REQUEST
+HostSimSubmit(
+    _In_      PHOST_SIM_TARGET          Target,
+    _In_      SPB_REQUEST_TYPE          Type,
+    _In_      ULONG                     IoControlCode,
+    _In_      const HOST_SPB_TRANSFER  *Transfers,
+    _In_      ULONG                     TransferCount);
+
+NTSTATUS
+HostSimWait(
+    _In_       PHOST_SIM_REQUEST  Request,
+    _Out_opt_  ULONG_PTR         *pInformation,
+    _In_       ULONG              TimeoutMs = 0);
+
+BOOLEAN
+HostSimIsComplete(
+    _In_  PHOST_SIM_REQUEST  Request);
+
+VOID
+HostSimCancel(
+    _In_  PHOST_SIM_REQUEST  Request);
+
+NTSTATUS
+HostSimRead(
+    _In_       PHOST_SIM_TARGET  Target,
+    _Out_      PVOID             Buffer,
+    _In_       size_t            Length,
+    _Out_opt_  ULONG_PTR        *pInformation = nullptr);
+
+NTSTATUS
+HostSimWrite(
+    _In_       PHOST_SIM_TARGET  Target,
+    _In_       const VOID       *Buffer,
+    _In_       size_t            Length,
+    _Out_opt_  ULONG_PTR        *pInformation = nullptr);
+
+NTSTATUS
+HostSimWriteRead(
+    _In_       PHOST_SIM_TARGET  Target,
+    _In_       const VOID       *WriteBuffer,
+    _In_       size_t            WriteLength,
+    _Out_      PVOID             ReadBuffer,
+    _In_       size_t            ReadLength,
+    _Out_opt_  ULONG_PTR        *pInformation = nullptr);
+
+NTSTATUS
+HostSimFullDuplex(
+    _In_       PHOST_SIM_TARGET  Target,
+    _In_       const VOID       *WriteBuffer,
+    _In_       size_t            WriteLength,
+    _Out_      PVOID             ReadBuffer,
+    _In_       size_t            ReadLength,
+    _Out_opt_  ULONG_PTR        *pInformation = nullptr);
+
+NTSTATUS
+HostSimLock(
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  SPB_REQUEST_TYPE  Type);
+
+//
+// Sends an IOCTL to the probe control device (\\.\SpbProbe).
+//
+
+NTSTATUS
+HostSimControlIoctl(
+    _In_       ULONG       IoControlCode,
+    _In_opt_   const VOID *InputBuffer,
+    _In_       size_t      InputLength,
+    _Out_opt_  PVOID       OutputBuffer,
+    _In_       size_t      OutputLength,
+    _Out_opt_  ULONG_PTR  *pInformation = nullptr);
+
+//
+// Waits until the timers, work items and delayed completions
+// due within DelayUs ran.
+//
+
+VOID
+HostSimRunFor(
+    _In_  ULONG  DelayUs);
+
+//
+// Runs Routine on the dispatcher thread with the framework
+// lock held, DelayUs from now, for the events of simulated
+// devices. The routine must not wait for client requests.
+// Returns an ID for HostSimCancelEvent.
+//
+
+ULONGLONG
+HostSimScheduleEvent(
+    _In_  ULONG                  DelayUs,
+    _In_  std::function<VOID()>  Routine);
+
+BOOLEAN
+HostSimCancelEvent(
+    _In_  ULONGLONG  EventId);
+
+//
+// Monotonic time of the simulation, in microseconds.
+//
+
+ULONGLONG
+HostSimNowUs(VOID);
+
+//
+// Allocations made by the driver since it was loaded: pool
+// allocations and framework objects created (memory objects,
+// requests, timers, ...). The harness' own objects, such as
+// client requests, are not counted.
+//
+
+typedef struct _HOST_SIM_ALLOCATIONS
+{
+    ULONGLONG  PoolAllocations;
+    ULONGLONG  ObjectCreations;
+}
+HOST_SIM_ALLOCATIONS, *PHOST_SIM_ALLOCATIONS;
+
+VOID
+HostSimGetAllocations(
+    _Out_  PHOST_SIM_ALLOCATIONS  Allocations);
+
+/////////////////////////////////////////////////
+//
+// Tracing.
+//
+/////////////////////////////////////////////////
+
+//
+// Traces at or below Level with a flag in Flags (bit n for
+// the nth WPP_DEFINE_BIT) are printed. Defaults to
+// TRACE_LEVEL_ERROR and all flags, overridden by the
+// SPBPROBE_TRACE_LEVEL and SPBPROBE_TRACE_FLAGS variables.
+//
+
+VOID
+HostTraceSetLevel(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flags);
+
+VOID
+HostTraceGetLevel(
+    _Out_  PULONG  Level,
+    _Out_  PULONG  Flags);
+
+typedef VOID HOST_TRACE_SINK(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message);
+
+typedef HOST_TRACE_SINK *PHOST_TRACE_SINK;
+
+//
+// Replaces the default sink (stderr). nullptr restores it.
+//
+
+VOID
+HostTraceSetSink(
+    _In_opt_  PHOST_TRACE_SINK  Sink);
+
+//
+// TraceLogging events. The providers of the driver are
+// enabled at every level and keyword while a sink is
+// installed, and disabled otherwise (the default).
+//
+
+typedef VOID HOST_EVENT_SINK(
+    _In_  PCSTR                  Provider,
+    _In_  PCSTR                  Event,
+    _In_  const HOST_TLG_FIELD  *Fields,
+    _In_  ULONG                  FieldCount);
+
+typedef HOST_EVENT_SINK *PHOST_EVENT_SINK;
+
+VOID
+HostEventSetSink(
+    _In_opt_  PHOST_EVENT_SINK  Sink);
+
+#endif // _HOSTSIM_H_
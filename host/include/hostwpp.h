@@ -0,0 +1,80 @@
+/*++
+
+Module Name:
+
+    hostwpp.h
+
+Abstract:
+
+    This module contains the user-mode replacement of the WPP
+    generated trace headers (*.tmh). Each trace call is turned into
+    a call to the host trace sink, which translates the WPP format
+    extensions (%!STATUS!, %!FUNC!, ...) and prints the message.
+    Arguments are only evaluated when the level and flag are enabled,
+    and the calls above the level compiled in by the trace policy
+    of the driver are dropped at build time.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOSTWPP_H_
+#define _HOSTWPP_H_
+
+#include "hostddk.h"
+
+//
+// Expand the control GUID of the including driver into
+// one enumerator per trace flag.
+//
+
+#ifdef WPP_CONTROL_GUIDS
+
+#define WPP_DEFINE_BIT(Name) WPP_BIT_ ## Name,
+#define WPP_DEFINE_CONTROL_GUID(Name, Guid, Bits) enum { Bits WPP_BIT_ ## Name ## _COUNT };
+
+WPP_CONTROL_GUIDS
+
+#undef WPP_DEFINE_BIT
+#undef WPP_DEFINE_CONTROL_GUID
+
+#endif
+
+EXTERN_C BOOLEAN HostTraceEnabled(ULONG Level, ULONG Flag);
+EXTERN_C VOID HostTraceMessage(ULONG Level, ULONG Flag, PCSTR Function,
+    PCSTR Format, ...);
+EXTERN_C VOID HostTraceInitialize(PVOID DriverObject, PVOID RegistryPath);
+EXTERN_C VOID HostTraceCleanup(PVOID DriverObject);
+
+#ifndef PBC_TRACE_LEVEL_MAX
+#define PBC_TRACE_LEVEL_MAX TRACE_LEVEL_VERBOSE
+#endif
+
+#undef WPP_LEVEL_FLAGS_ENABLED
+#define WPP_LEVEL_FLAGS_ENABLED(Level, Flag) \
+    (((Level) <= PBC_TRACE_LEVEL_MAX) && HostTraceEnabled((Level), WPP_BIT_ ## Flag))
+
+#define Trace(Level, Flag, Format, ...) \
+    do { \
+        if (WPP_LEVEL_FLAGS_ENABLED((Level), Flag)) \
+        { \
+            HostTraceMessage((Level), WPP_BIT_ ## Flag, __FUNCTION__, \
+                Format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define FuncEntry(Flag) \
+    Trace(TRACE_LEVEL_VERBOSE, Flag, "[%!FUNC!] --> entry")
+
+#define FuncExit(Flag) \
+    Trace(TRACE_LEVEL_VERBOSE, Flag, "[%!FUNC!] <--")
+
+#define WPP_INIT_TRACING(DriverObject, RegistryPath) \
+    HostTraceInitialize((PVOID)(DriverObject), (PVOID)(RegistryPath))
+
+#define WPP_CLEANUP(DriverObject) \
+    HostTraceCleanup((PVOID)(DriverObject))
+
+#endif // _HOSTWPP_H_
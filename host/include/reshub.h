@@ -0,0 +1,81 @@
+/*++
+
+Module Name:
+
+    reshub.h
+
+Abstract:
+
+    This module contains the user-mode emulation of the resource
+    hub definitions used to open a connection and to parse its
+    ACPI serial bus descriptor.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOST_RESHUB_H_
+#define _HOST_RESHUB_H_
+
+#include "hostddk.h"
+
+#pragma pack(push, 1)
+
+typedef struct _PNP_IO_DESCRIPTOR_RESOURCE_NAME {
+    UCHAR ResourceSourceIndex;
+    CHAR ResourceSource[ANYSIZE_ARRAY];
+} PNP_IO_DESCRIPTOR_RESOURCE_NAME, *PPNP_IO_DESCRIPTOR_RESOURCE_NAME;
+
+typedef struct _PNP_SERIAL_BUS_DESCRIPTOR {
+    UCHAR Tag;
+    USHORT Length;
+    UCHAR RevisionId;
+    UCHAR ResourceSourceIndex;
+    UCHAR SerialBusType;
+    UCHAR GeneralFlags;
+    USHORT TypeSpecificFlags;
+    UCHAR TypeSpecificRevisionId;
+    USHORT TypeDataLength;
+} PNP_SERIAL_BUS_DESCRIPTOR, *PPNP_SERIAL_BUS_DESCRIPTOR;
+
+typedef struct _PNP_GPIO_INTERRUPT_IO_DESCRIPTOR {
+    UCHAR Tag;
+    USHORT Length;
+    UCHAR RevisionId;
+    USHORT ConnectionType;
+    USHORT GeneralFlags;
+    USHORT InterruptIoFlags;
+    UCHAR PinConfiguration;
+    USHORT DriveStrength;
+    USHORT DebounceTimeout;
+    USHORT PinTableOffset;
+    UCHAR ResourceSourceIndex;
+    USHORT ResourceSourceOffset;
+    USHORT VendorDataOffset;
+    USHORT VendorDataLength;
+} PNP_GPIO_INTERRUPT_IO_DESCRIPTOR, *PPNP_GPIO_INTERRUPT_IO_DESCRIPTOR;
+
+#pragma pack(pop)
+
+typedef struct _RH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER {
+    ULONG PropertiesLength;
+    UCHAR ConnectionProperties[ANYSIZE_ARRAY];
+} RH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER, *PRH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER;
+
+#define RESOURCE_HUB_DEVICE_NAME L"\\Device\\RESOURCE_HUB"
+#define RESOURCE_HUB_PATH_CHARS 45
+#define RESOURCE_HUB_PATH_SIZE (RESOURCE_HUB_PATH_CHARS * sizeof(WCHAR))
+
+#ifdef RESHUB_USE_HELPER_ROUTINES
+
+EXTERN_C NTSTATUS HostResourceHubCreatePath(PUNICODE_STRING DevicePath,
+    ULONG IdLowPart, LONG IdHighPart);
+
+#define RESOURCE_HUB_CREATE_PATH_FROM_ID(path, low, high) \
+    HostResourceHubCreatePath((path), (low), (high))
+
+#endif
+
+#endif // _HOST_RESHUB_H_
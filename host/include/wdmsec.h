@@ -0,0 +1,10 @@
+#pragma once
+
+//
+// Host stand-in for wdmsec.h.
+//
+
+#include "hostddk.h"
+
+static const UNICODE_STRING SDDL_DEVOBJ_SYS_ALL_ADM_ALL =
+    RTL_CONSTANT_STRING(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)");
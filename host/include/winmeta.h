@@ -0,0 +1,7 @@
+#pragma once
+#define WINEVENT_LEVEL_LOG_ALWAYS 0
+#define WINEVENT_LEVEL_CRITICAL   1
+#define WINEVENT_LEVEL_ERROR      2
+#define WINEVENT_LEVEL_WARNING    3
+#define WINEVENT_LEVEL_INFO       4
+#define WINEVENT_LEVEL_VERBOSE    5
@@ -0,0 +1,529 @@
+/*++
+
+Module Name:
+
+    spbprobe_load.cpp
+
+Abstract:
+
+    This module generates concurrent load on one probe device
+    from several simulated clients, each with its own target
+    and its own mix of reads, writes and write-read sequences,
+    transfer size, think time and controller lock usage. All
+    the clients go through the sequential SPBCx queue of the
+    probe (OnRead, OnWrite, OnSequence, OnControllerLock) to a
+    device model completing each request after its wire time.
+
+    It reports per client the throughput, the latency
+    percentiles, the controller lock wait and the share of the
+    requests served, and Jain's fairness index of the request
+    throughput of the clients, 1 when they all get the same
+    throughput; it only means something for clients sharing a
+    profile.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostsim.h>
+#include <hostmodels.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOAD_CONNECTION_ID    0x1
+#define LOAD_ADDRESS          0x2c
+#define LOAD_MAX_SIZE         4096
+
+//
+// A device answering every read with a fixed pattern.
+//
+
+class LoadDevice : public HostDeviceModel
+{
+public:
+
+    LoadDevice(
+        _In_  const HOST_MODEL_SETTINGS  &Settings)
+        : HostDeviceModel(Settings)
+    {
+    }
+
+protected:
+
+    NTSTATUS
+    Process(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override
+    {
+        for (ULONG i = 0; i < Operation->TransferCount; i++)
+        {
+            if (Operation->Transfers[i].Direction == SpbTransferDirectionFromDevice)
+            {
+                memset(Operation->Transfers[i].Buffer, 0x5a, Operation->Transfers[i].Length);
+            }
+        }
+
+        return STATUS_SUCCESS;
+    }
+};
+
+//
+// Request mix of one client: relative weights of reads,
+// writes and sequences, percentage of iterations sending a
+// burst of requests under the controller lock, and think time
+// between iterations.
+//
+
+typedef struct _LOAD_PROFILE
+{
+    ULONG                         ReadWeight;
+    ULONG                         WriteWeight;
+    ULONG                         SequenceWeight;
+    ULONG                         Size;
+    ULONG                         LockPercent;
+    ULONG                         Burst;
+    ULONG                         ThinkUs;
+}
+LOAD_PROFILE, *PLOAD_PROFILE;
+
+typedef struct _LOAD_CLIENT
+{
+    LOAD_PROFILE                  Profile;
+    PHOST_SIM_TARGET              Target;
+    std::thread                   Thread;
+    std::vector<ULONGLONG>        LatenciesNs;
+    std::vector<ULONGLONG>        LockWaitsNs;
+    ULONGLONG                     Requests;
+    ULONGLONG                     Failures;
+    ULONGLONG                     Bytes;
+}
+LOAD_CLIENT, *PLOAD_CLIENT;
+
+static
+ULONGLONG
+LoadNowNs(VOID)
+{
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static
+BOOLEAN
+LoadParseProfile(
+    _In_     PCSTR          Spec,
+    _Inout_  PLOAD_PROFILE  Profile)
+{
+    std::string spec(Spec);
+    size_t start = 0;
+
+    //
+    // key=value pairs separated by commas, e.g.
+    // read=50,write=50,seq=0,size=64,lock=10,burst=4,think=100
+    //
+
+    while (start < spec.size())
+    {
+        size_t end = spec.find(',', start);
+        std::string pair = spec.substr(start, (end == std::string::npos) ? std::string::npos : end - start);
+        size_t equal = pair.find('=');
+        std::string key;
+        ULONG value;
+
+        start = (end == std::string::npos) ? spec.size() : end + 1;
+
+        if (equal == std::string::npos)
+        {
+            return FALSE;
+        }
+
+        key = pair.substr(0, equal);
+        value = (ULONG)strtoul(pair.c_str() + equal + 1, nullptr, 0);
+
+        if (key == "read")
+        {
+            Profile->ReadWeight = value;
+        }
+        else if (key == "write")
+        {
+            Profile->WriteWeight = value;
+        }
+        else if (key == "seq")
+        {
+            Profile->SequenceWeight = value;
+        }
+        else if (key == "size")
+        {
+            Profile->Size = std::min(std::max(value, (ULONG)1), (ULONG)LOAD_MAX_SIZE);
+        }
+        else if (key == "lock")
+        {
+            Profile->LockPercent = std::min(value, (ULONG)100);
+        }
+        else if (key == "burst")
+        {
+            Profile->Burst = std::max(value, (ULONG)1);
+        }
+        else if (key == "think")
+        {
+            Profile->ThinkUs = value;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+
+    return (Profile->ReadWeight + Profile->WriteWeight + Profile->SequenceWeight) != 0;
+}
+
+static
+VOID
+LoadRequest(
+    _Inout_  PLOAD_CLIENT   Client,
+    _Inout_  std::mt19937  &Random,
+    _Inout_  PUCHAR         Buffer)
+{
+    PLOAD_PROFILE profile = &Client->Profile;
+    ULONG pick = Random() % (profile->ReadWeight + profile->WriteWeight + profile->SequenceWeight);
+    UCHAR reg = (UCHAR)Random();
+    ULONGLONG start = LoadNowNs();
+    ULONGLONG latency;
+    NTSTATUS status;
+
+    if (pick < profile->ReadWeight)
+    {
+        status = HostSimRead(Client->Target, Buffer, profile->Size);
+    }
+    else if (pick < profile->ReadWeight + profile->WriteWeight)
+    {
+        status = HostSimWrite(Client->Target, Buffer, profile->Size);
+    }
+    else
+    {
+        status = HostSimWriteRead(Client->Target, &reg, 1, Buffer, profile->Size);
+    }
+
+    latency = LoadNowNs() - start;
+
+    Client->Requests++;
+    Client->LatenciesNs.push_back(latency);
+
+    if (NT_SUCCESS(status))
+    {
+        Client->Bytes += profile->Size;
+    }
+    else
+    {
+        Client->Failures++;
+    }
+}
+
+static
+VOID
+LoadClientRun(
+    _Inout_  PLOAD_CLIENT  Client,
+    _In_     ULONG         Seed,
+    _In_     ULONGLONG     DeadlineNs)
+{
+    std::mt19937 random(Seed);
+    std::vector<UCHAR> buffer(LOAD_MAX_SIZE, 0xa5);
+    PLOAD_PROFILE profile = &Client->Profile;
+
+    while (LoadNowNs() < DeadlineNs)
+    {
+        if ((profile->LockPercent != 0) && ((random() % 100) < profile->LockPercent))
+        {
+            ULONGLONG start = LoadNowNs();
+
+            //
+            // The lock request waits for the bursts of the
+            // other clients holding the controller.
+            //
+
+            HostSimLock(Client->Target, SpbRequestTypeLockController);
+            Client->LockWaitsNs.push_back(LoadNowNs() - start);
+
+            for (ULONG i = 0; i < profile->Burst; i++)
+            {
+                LoadRequest(Client, random, buffer.data());
+            }
+
+            HostSimLock(Client->Target, SpbRequestTypeUnlockController);
+        }
+        else
+        {
+            LoadRequest(Client, random, buffer.data());
+        }
+
+        if (profile->ThinkUs != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(profile->ThinkUs));
+        }
+    }
+}
+
+static
+double
+LoadPercentileUs(
+    _Inout_  std::vector<ULONGLONG>  &Values,
+    _In_     double                   Percentile)
+{
+    size_t index;
+
+    if (Values.empty())
+    {
+        return 0;
+    }
+
+    index = (size_t)((Percentile / 100.0) * (Values.size() - 1) + 0.5);
+
+    return Values[std::min(index, Values.size() - 1)] / 1000.0;
+}
+
+static
+VOID
+LoadUsage(
+    _In_  PCSTR  Program)
+{
+    fprintf(stderr,
+        "usage: %s [-c clients] [-p profile]... [-d duration ms] [-s bus speed Hz]\n"
+        "          [-l response latency us] [-r seed] [-json]\n"
+        "  -c adds clients with the default profile (2 without -p)\n"
+        "  -p adds a client with a profile, key=value pairs separated by commas:\n"
+        "     read, write, seq (weights), size (bytes), lock (%% of iterations\n"
+        "     sending a burst under the controller lock), burst, think (us)\n"
+        "     default: read=40,write=30,seq=30,size=16,lock=0,burst=4,think=0\n",
+        Program);
+}
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    LOAD_PROFILE defaultProfile = {40, 30, 30, 16, 0, 4, 0};
+    std::vector<LOAD_PROFILE> profiles;
+    std::vector<LOAD_CLIENT> clients;
+    HOST_MODEL_SETTINGS settings;
+    PHOST_SIM_DEVICE device;
+    ULONG defaultClients = 0;
+    ULONG durationMs = 2000;
+    ULONG speed = 1000000;
+    ULONG latencyUs = 0;
+    ULONG seed = 1;
+    BOOLEAN json = FALSE;
+    ULONGLONG startNs;
+    ULONGLONG elapsedNs;
+    ULONGLONG totalRequests = 0;
+    double fairnessSum = 0;
+    double fairnessSquares = 0;
+    NTSTATUS status;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-c") == 0) && (i + 1 < argc))
+        {
+            defaultClients += (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-p") == 0) && (i + 1 < argc))
+        {
+            LOAD_PROFILE profile = defaultProfile;
+
+            if (!LoadParseProfile(argv[++i], &profile))
+            {
+                LoadUsage(argv[0]);
+                return 2;
+            }
+
+            profiles.push_back(profile);
+        }
+        else if ((strcmp(argv[i], "-d") == 0) && (i + 1 < argc))
+        {
+            durationMs = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+        {
+            speed = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-l") == 0) && (i + 1 < argc))
+        {
+            latencyUs = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc))
+        {
+            seed = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "-json") == 0)
+        {
+            json = TRUE;
+        }
+        else
+        {
+            LoadUsage(argv[0]);
+            return 2;
+        }
+    }
+
+    if ((defaultClients == 0) && profiles.empty())
+    {
+        defaultClients = 2;
+    }
+
+    profiles.insert(profiles.end(), defaultClients, defaultProfile);
+
+    HostModelI2cSettings(&settings, LOAD_ADDRESS, speed, latencyUs);
+
+    LoadDevice loadDevice(settings);
+
+    status = HostSimLoadDriver();
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "DriverEntry failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    device = HostSimCreateDevice(LOAD_CONNECTION_ID, &loadDevice);
+    status = HostSimStartDevice(device);
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "device start failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    //
+    // Every client opens its own target, as separate client
+    // drivers of the same device would.
+    //
+
+    clients.resize(profiles.size());
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        clients[i].Profile = profiles[i];
+        clients[i].Target = HostSimOpenTarget(device, loadDevice.Connection());
+        clients[i].Requests = 0;
+        clients[i].Failures = 0;
+        clients[i].Bytes = 0;
+    }
+
+    startNs = LoadNowNs();
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        clients[i].Thread = std::thread(LoadClientRun, &clients[i],
+            seed + (ULONG)i, startNs + (ULONGLONG)durationMs * 1000000);
+    }
+
+    for (LOAD_CLIENT &client : clients)
+    {
+        client.Thread.join();
+        totalRequests += client.Requests;
+    }
+
+    elapsedNs = LoadNowNs() - startNs;
+
+    if (!json)
+    {
+        printf("%zu clients, %lu ms, bus %lu Hz, latency %lu us: %.0f requests/s\n\n",
+            clients.size(), (unsigned long)(elapsedNs / 1000000),
+            (unsigned long)speed, (unsigned long)latencyUs,
+            totalRequests * 1e9 / elapsedNs);
+        printf("client  mix(r/w/s)  size  lock%%  requests/s  share  "
+            "p50 us  p99 us  p99.9 us  max us  lock wait p99 us  failures\n");
+    }
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        LOAD_CLIENT &client = clients[i];
+        double throughput = client.Requests * 1e9 / elapsedNs;
+        double share = (totalRequests != 0) ? (100.0 * client.Requests / totalRequests) : 0;
+
+        std::sort(client.LatenciesNs.begin(), client.LatenciesNs.end());
+        std::sort(client.LockWaitsNs.begin(), client.LockWaitsNs.end());
+
+        fairnessSum += throughput;
+        fairnessSquares += throughput * throughput;
+
+        if (json)
+        {
+            printf("{\"client\":%zu,\"read\":%lu,\"write\":%lu,\"seq\":%lu,\"size\":%lu,"
+                "\"lock_percent\":%lu,\"burst\":%lu,\"think_us\":%lu,\"requests\":%llu,"
+                "\"failures\":%llu,\"requests_per_s\":%.1f,\"bytes_per_s\":%.1f,"
+                "\"share_percent\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+                "\"max_us\":%.1f,\"locks\":%zu,\"lock_wait_p99_us\":%.1f}\n",
+                i,
+                (unsigned long)client.Profile.ReadWeight,
+                (unsigned long)client.Profile.WriteWeight,
+                (unsigned long)client.Profile.SequenceWeight,
+                (unsigned long)client.Profile.Size,
+                (unsigned long)client.Profile.LockPercent,
+                (unsigned long)client.Profile.Burst,
+                (unsigned long)client.Profile.ThinkUs,
+                (unsigned long long)client.Requests,
+                (unsigned long long)client.Failures,
+                throughput,
+                client.Bytes * 1e9 / elapsedNs,
+                share,
+                LoadPercentileUs(client.LatenciesNs, 50),
+                LoadPercentileUs(client.LatenciesNs, 99),
+                LoadPercentileUs(client.LatenciesNs, 99.9),
+                LoadPercentileUs(client.LatenciesNs, 100),
+                client.LockWaitsNs.size(),
+                LoadPercentileUs(client.LockWaitsNs, 99));
+        }
+        else
+        {
+            printf("%6zu  %3lu/%3lu/%3lu  %4lu  %5lu  %10.0f  %4.1f%%  %6.1f  %6.1f  %8.1f  %6.1f  %16.1f  %8llu\n",
+                i,
+                (unsigned long)client.Profile.ReadWeight,
+                (unsigned long)client.Profile.WriteWeight,
+                (unsigned long)client.Profile.SequenceWeight,
+                (unsigned long)client.Profile.Size,
+                (unsigned long)client.Profile.LockPercent,
+                throughput,
+                share,
+                LoadPercentileUs(client.LatenciesNs, 50),
+                LoadPercentileUs(client.LatenciesNs, 99),
+                LoadPercentileUs(client.LatenciesNs, 99.9),
+                LoadPercentileUs(client.LatenciesNs, 100),
+                LoadPercentileUs(client.LockWaitsNs, 99),
+                (unsigned long long)client.Failures);
+        }
+    }
+
+    if (json)
+    {
+        printf("{\"clients\":%zu,\"elapsed_ms\":%llu,\"requests_per_s\":%.1f,\"fairness\":%.3f}\n",
+            clients.size(),
+            (unsigned long long)(elapsedNs / 1000000),
+            totalRequests * 1e9 / elapsedNs,
+            (fairnessSquares != 0) ? (fairnessSum * fairnessSum) / (clients.size() * fairnessSquares) : 1.0);
+    }
+    else
+    {
+        printf("\nJain's fairness index: %.3f\n",
+            (fairnessSquares != 0) ? (fairnessSum * fairnessSum) / (clients.size() * fairnessSquares) : 1.0);
+    }
+
+    for (LOAD_CLIENT &client : clients)
+    {
+        HostSimCloseTarget(client.Target);
+    }
+
+    HostSimRemoveDevice(device);
+    HostSimUnloadDriver();
+
+    return 0;
+}
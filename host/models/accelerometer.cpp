@@ -0,0 +1,258 @@
+/*++
+
+Module Name:
+
+    accelerometer.cpp
+
+Abstract:
+
+    This module implements the model of a polled 3-axis
+    accelerometer with a LIS3DH style register map, on I2C or
+    SPI: samples produced at the output data rate, data ready
+    and overrun status, and register auto-increment.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostmodels.h>
+
+#include <math.h>
+
+//
+// Output data rates selected by CTRL_REG1[7:4].
+//
+
+static const ULONG s_DataRatesHz[] = {0, 1, 10, 25, 50, 100, 200, 400};
+
+HostAccelerometer::HostAccelerometer(
+    _In_  const HOST_MODEL_SETTINGS  &Settings)
+    : HostDeviceModel(Settings)
+{
+    Registers[HOST_ACCEL_WHO_AM_I] = HOST_ACCEL_WHO_AM_I_VALUE;
+    Registers[HOST_ACCEL_CTRL_REG1] = 0x07;
+}
+
+ULONG
+HostAccelerometer::DataRateHz() const
+{
+    ULONG rate = Registers[HOST_ACCEL_CTRL_REG1] >> 4;
+
+    return (rate < ARRAYSIZE(s_DataRatesHz)) ? s_DataRatesHz[rate] : 0;
+}
+
+VOID
+HostAccelerometer::UpdateSample()
+{
+    ULONG rate = DataRateHz();
+    LONG lsbPerG = 16384 >> ((Registers[HOST_ACCEL_CTRL_REG4] >> 4) & 0x3);
+    ULONGLONG sample;
+    double angle;
+
+    if (rate == 0)
+    {
+        return;
+    }
+
+    sample = ((HostSimNowUs() - m_EnabledUs) * rate) / 1000000;
+
+    if (sample == m_Sample)
+    {
+        return;
+    }
+
+    m_Sample = sample;
+
+    //
+    // The device turns around its Z axis once every 10 s,
+    // tilted so that Z keeps 0.8 g. Outputs are 12-bit, left
+    // justified.
+    //
+
+    angle = (double)sample * 2 * M_PI / (10.0 * rate);
+
+    SHORT values[3] =
+    {
+        (SHORT)((LONG)(0.6 * sin(angle) * lsbPerG) & ~0xf),
+        (SHORT)((LONG)(0.6 * cos(angle) * lsbPerG) & ~0xf),
+        (SHORT)((LONG)(0.8 * lsbPerG) & ~0xf)
+    };
+
+    for (ULONG i = 0; i < 3; i++)
+    {
+        Registers[HOST_ACCEL_OUT_X_L + 2 * i] = (UCHAR)values[i];
+        Registers[HOST_ACCEL_OUT_X_L + 2 * i + 1] = (UCHAR)((USHORT)values[i] >> 8);
+    }
+}
+
+UCHAR
+HostAccelerometer::ReadRegister(
+    _In_  UCHAR  Register)
+{
+    Register &= (sizeof(Registers) - 1);
+
+    if (Register == HOST_ACCEL_STATUS_REG)
+    {
+        UCHAR status = 0;
+
+        if (m_Sample > m_SampleRead)
+        {
+            status |= HOST_ACCEL_STATUS_ZYXDA;
+        }
+
+        if (m_Sample > m_SampleRead + 1)
+        {
+            status |= HOST_ACCEL_STATUS_ZYXOR;
+        }
+
+        return status;
+    }
+
+    //
+    // Reading the last output consumes the sample.
+    //
+
+    if ((Register == HOST_ACCEL_OUT_Z_H) && (m_Sample > m_SampleRead))
+    {
+        SamplesRead++;
+        SamplesMissed += m_Sample - m_SampleRead - 1;
+        m_SampleRead = m_Sample;
+    }
+
+    return Registers[Register];
+}
+
+VOID
+HostAccelerometer::WriteRegister(
+    _In_  UCHAR  Register,
+    _In_  UCHAR  Value)
+{
+    Register &= (sizeof(Registers) - 1);
+
+    //
+    // Only the control registers are writable. Changing the
+    // data rate restarts the sampling.
+    //
+
+    if ((Register < HOST_ACCEL_CTRL_REG1) || (Register > HOST_ACCEL_CTRL_REG1 + 5))
+    {
+        return;
+    }
+
+    if ((Register == HOST_ACCEL_CTRL_REG1) &&
+        ((Value >> 4) != (Registers[HOST_ACCEL_CTRL_REG1] >> 4)))
+    {
+        m_EnabledUs = HostSimNowUs();
+        m_Sample = 0;
+        m_SampleRead = 0;
+    }
+
+    Registers[Register] = Value;
+}
+
+NTSTATUS
+HostAccelerometer::Process(
+    _Inout_  PHOST_SPB_OPERATION  Operation)
+{
+    BOOLEAN spi = (m_Settings.BusType == CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI);
+    BOOLEAN command = FALSE;
+    BOOLEAN read = FALSE;
+
+    UpdateSample();
+
+    if (Operation->Type == HostSpbOperationFullDuplex)
+    {
+        HOST_SPB_TRANSFER *write = &Operation->Transfers[0];
+        HOST_SPB_TRANSFER *response = &Operation->Transfers[1];
+
+        if (!spi)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        if (write->Length == 0)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        //
+        // The response to the command byte is clocked out
+        // while the command is clocked in.
+        //
+
+        m_Address = write->Buffer[0] & 0x3f;
+        m_AutoIncrement = ((write->Buffer[0] & HOST_ACCEL_SPI_AUTO_INCREMENT) != 0);
+        read = ((write->Buffer[0] & HOST_ACCEL_SPI_READ) != 0);
+
+        memset(response->Buffer, 0, response->Length);
+
+        for (size_t j = 1; j < write->Length; j++)
+        {
+            if (read)
+            {
+                if (j < response->Length)
+                {
+                    response->Buffer[j] = ReadRegister(m_Address);
+                }
+            }
+            else
+            {
+                WriteRegister(m_Address, write->Buffer[j]);
+            }
+
+            m_Address += m_AutoIncrement ? 1 : 0;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // On SPI the first byte of the request is the command,
+    // followed by the data in either direction. On I2C every
+    // write starts with the register address, and reads
+    // continue from the current address.
+    //
+
+    for (ULONG i = 0; i < Operation->TransferCount; i++)
+    {
+        HOST_SPB_TRANSFER *transfer = &Operation->Transfers[i];
+
+        for (size_t j = 0; j < transfer->Length; j++)
+        {
+            if (transfer->Direction == SpbTransferDirectionFromDevice)
+            {
+                transfer->Buffer[j] = (spi && !read) ? 0 : ReadRegister(m_Address);
+            }
+            else if (spi ? !command : (j == 0))
+            {
+                UCHAR value = transfer->Buffer[j];
+
+                command = TRUE;
+
+                if (spi)
+                {
+                    m_Address = value & 0x3f;
+                    m_AutoIncrement = ((value & HOST_ACCEL_SPI_AUTO_INCREMENT) != 0);
+                    read = ((value & HOST_ACCEL_SPI_READ) != 0);
+                }
+                else
+                {
+                    m_Address = value & 0x7f;
+                    m_AutoIncrement = ((value & HOST_ACCEL_I2C_AUTO_INCREMENT) != 0);
+                }
+
+                continue;
+            }
+            else if (!spi || !read)
+            {
+                WriteRegister(m_Address, transfer->Buffer[j]);
+            }
+
+            m_Address = (m_Address + (m_AutoIncrement ? 1 : 0)) & (sizeof(Registers) - 1);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
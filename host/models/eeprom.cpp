@@ -0,0 +1,113 @@
+/*++
+
+Module Name:
+
+    eeprom.cpp
+
+Abstract:
+
+    This module implements the model of a 24Cxx I2C EEPROM:
+    current address and random reads, page writes and the
+    write cycle during which the device does not acknowledge
+    its address.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostmodels.h>
+
+HostEeprom24Cxx::HostEeprom24Cxx(
+    _In_  const HOST_MODEL_SETTINGS  &Settings,
+    _In_  ULONG                       Size,
+    _In_  ULONG                       PageSize,
+    _In_  ULONG                       WriteCycleUs)
+    : HostDeviceModel(Settings),
+      Memory(Size, 0xff),
+      m_PageSize((PageSize != 0) ? PageSize : 1),
+      m_AddressBytes((Size <= 256) ? 1 : 2),
+      m_WriteCycleUs(WriteCycleUs)
+{
+}
+
+NTSTATUS
+HostEeprom24Cxx::Process(
+    _Inout_  PHOST_SPB_OPERATION  Operation)
+{
+    ULONG size = (ULONG)Memory.size();
+    BOOLEAN written = FALSE;
+
+    if (Operation->Type == HostSpbOperationFullDuplex)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if ((size == 0) || (HostSimNowUs() < m_BusyUntilUs))
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    for (ULONG i = 0; i < Operation->TransferCount; i++)
+    {
+        HOST_SPB_TRANSFER *transfer = &Operation->Transfers[i];
+
+        if (transfer->Direction == SpbTransferDirectionFromDevice)
+        {
+            for (size_t j = 0; j < transfer->Length; j++)
+            {
+                transfer->Buffer[j] = Memory[m_Address];
+                m_Address = (m_Address + 1) % size;
+            }
+
+            continue;
+        }
+
+        //
+        // A write carries the address, most significant byte
+        // first, then the data, which wraps around within the
+        // page of the address.
+        //
+
+        if (transfer->Length < m_AddressBytes)
+        {
+            continue;
+        }
+
+        m_Address = 0;
+
+        for (ULONG j = 0; j < m_AddressBytes; j++)
+        {
+            m_Address = (m_Address << 8) | transfer->Buffer[j];
+        }
+
+        m_Address %= size;
+
+        ULONG pageStart = m_Address - (m_Address % m_PageSize);
+        ULONG offset = m_Address - pageStart;
+
+        for (size_t j = m_AddressBytes; j < transfer->Length; j++)
+        {
+            Memory[(pageStart + offset) % size] = transfer->Buffer[j];
+            offset = (offset + 1) % m_PageSize;
+            written = TRUE;
+        }
+
+        m_Address = (pageStart + offset) % size;
+    }
+
+    //
+    // The write cycle starts with the stop condition.
+    //
+
+    if (written)
+    {
+        WriteCycles++;
+        m_BusyUntilUs = HostSimNowUs() +
+            ((WireTimeNs(Operation) + 999) / 1000) +
+            m_WriteCycleUs;
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,357 @@
+/*++
+
+Module Name:
+
+    hidi2c.cpp
+
+Abstract:
+
+    This module implements the model of a single finger HID
+    over I2C touchpad: HID and report descriptors, RESET and
+    SET_POWER commands, and input reports queued at the report
+    rate while a finger touches the pad, signaled by a level
+    interrupt.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostmodels.h>
+
+#include <math.h>
+
+#define HOST_HIDI2C_MAX_QUEUED_REPORTS  16
+
+static const UCHAR s_ReportDescriptor[] =
+{
+    0x05, 0x0d,             // Usage Page (Digitizer)
+    0x09, 0x05,             // Usage (Touch Pad)
+    0xa1, 0x01,             // Collection (Application)
+    0x85, HOST_HIDI2C_REPORT_ID, //   Report ID
+    0x09, 0x22,             //   Usage (Finger)
+    0xa1, 0x02,             //   Collection (Logical)
+    0x09, 0x42,             //     Usage (Tip Switch)
+    0x15, 0x00,             //     Logical Minimum (0)
+    0x25, 0x01,             //     Logical Maximum (1)
+    0x75, 0x01,             //     Report Size (1)
+    0x95, 0x01,             //     Report Count (1)
+    0x81, 0x02,             //     Input (Data, Variable, Absolute)
+    0x95, 0x07,             //     Report Count (7)
+    0x81, 0x03,             //     Input (Constant)
+    0x09, 0x51,             //     Usage (Contact Identifier)
+    0x25, 0x0f,             //     Logical Maximum (15)
+    0x75, 0x08,             //     Report Size (8)
+    0x95, 0x01,             //     Report Count (1)
+    0x81, 0x02,             //     Input (Data, Variable, Absolute)
+    0x05, 0x01,             //     Usage Page (Generic Desktop)
+    0x09, 0x30,             //     Usage (X)
+    0x26, 0xff, 0x0f,       //     Logical Maximum (4095)
+    0x75, 0x10,             //     Report Size (16)
+    0x81, 0x02,             //     Input (Data, Variable, Absolute)
+    0x09, 0x31,             //     Usage (Y)
+    0x81, 0x02,             //     Input (Data, Variable, Absolute)
+    0xc0,                   //   End Collection
+    0x05, 0x0d,             //   Usage Page (Digitizer)
+    0x09, 0x54,             //   Usage (Contact Count)
+    0x25, 0x01,             //   Logical Maximum (1)
+    0x75, 0x08,             //   Report Size (8)
+    0x81, 0x02,             //   Input (Data, Variable, Absolute)
+    0xc0                    // End Collection
+};
+
+static
+VOID
+HostHidI2cPutUshort(
+    _Out_  PUCHAR  Buffer,
+    _In_   USHORT  Value)
+{
+    Buffer[0] = (UCHAR)Value;
+    Buffer[1] = (UCHAR)(Value >> 8);
+}
+
+static
+VOID
+HostHidI2cCopy(
+    _Out_  PUCHAR       Buffer,
+    _In_   size_t       Length,
+    _In_   const UCHAR *Source,
+    _In_   size_t       SourceLength)
+{
+    size_t length = (SourceLength < Length) ? SourceLength : Length;
+
+    memcpy(Buffer, Source, length);
+    memset(Buffer + length, 0, Length - length);
+}
+
+HostHidI2cTouchpad::HostHidI2cTouchpad(
+    _In_  const HOST_MODEL_SETTINGS  &Settings,
+    _In_  ULONG                       ReportRateHz)
+    : HostDeviceModel(Settings),
+      m_ReportPeriodUs(1000000 / ((ReportRateHz != 0) ? ReportRateHz : 1)),
+      m_Interrupt(FALSE)
+{
+}
+
+HostHidI2cTouchpad::~HostHidI2cTouchpad()
+{
+    if (m_SampleEventId != 0)
+    {
+        HostSimCancelEvent(m_SampleEventId);
+    }
+}
+
+VOID
+HostHidI2cTouchpad::SetInterruptHandler(
+    _In_  std::function<HOST_MODEL_INTERRUPT>  Handler)
+{
+    m_InterruptHandler = std::move(Handler);
+}
+
+BOOLEAN
+HostHidI2cTouchpad::IsInterruptAsserted() const
+{
+    return m_Interrupt;
+}
+
+VOID
+HostHidI2cTouchpad::Touch(
+    _In_  ULONG  DurationMs)
+{
+    //
+    // The touch starts on the dispatcher thread, with the
+    // framework lock held like the requests.
+    //
+
+    HostSimScheduleEvent(0, [this, DurationMs]()
+    {
+        m_TouchEndUs = HostSimNowUs() + (ULONGLONG)DurationMs * 1000;
+
+        if (m_SampleEventId == 0)
+        {
+            SampleTouch();
+        }
+    });
+}
+
+VOID
+HostHidI2cTouchpad::SampleTouch()
+{
+    std::vector<UCHAR> report(HOST_HIDI2C_INPUT_LENGTH, 0);
+    BOOLEAN touching = (HostSimNowUs() < m_TouchEndUs);
+
+    m_SampleEventId = 0;
+
+    HostHidI2cPutUshort(&report[0], HOST_HIDI2C_INPUT_LENGTH);
+    report[2] = HOST_HIDI2C_REPORT_ID;
+
+    if (touching)
+    {
+        //
+        // The finger circles the center of the pad, a turn
+        // every 256 reports.
+        //
+
+        double angle = (m_Sample++ % 256) * (2 * M_PI / 256);
+
+        report[3] = 1;
+        HostHidI2cPutUshort(&report[5], (USHORT)(2048 + 1500 * cos(angle)));
+        HostHidI2cPutUshort(&report[7], (USHORT)(2048 + 1500 * sin(angle)));
+        report[9] = 1;
+    }
+
+    //
+    // A sleeping device does not report, and the last report
+    // lifts the finger.
+    //
+
+    if (!m_Sleeping)
+    {
+        QueueReport(report);
+    }
+
+    if (touching)
+    {
+        m_SampleEventId = HostSimScheduleEvent(m_ReportPeriodUs, [this]()
+        {
+            SampleTouch();
+        });
+    }
+}
+
+VOID
+HostHidI2cTouchpad::QueueReport(
+    _In_  const std::vector<UCHAR>  &Report)
+{
+    if (m_Reports.size() >= HOST_HIDI2C_MAX_QUEUED_REPORTS)
+    {
+        m_Reports.pop_front();
+        ReportsDropped++;
+    }
+
+    m_Reports.push_back(Report);
+    ReportsGenerated++;
+
+    UpdateInterrupt();
+}
+
+VOID
+HostHidI2cTouchpad::UpdateInterrupt()
+{
+    BOOLEAN asserted = !m_Reports.empty();
+
+    if (asserted != m_Interrupt)
+    {
+        m_Interrupt = asserted;
+
+        if (m_InterruptHandler)
+        {
+            m_InterruptHandler(asserted);
+        }
+    }
+}
+
+VOID
+HostHidI2cTouchpad::ReadInput(
+    _Out_  PUCHAR  Buffer,
+    _In_   size_t  Length)
+{
+    //
+    // Without a pending report, the input register reads as
+    // an empty report.
+    //
+
+    if (m_Reports.empty())
+    {
+        memset(Buffer, 0, Length);
+        return;
+    }
+
+    HostHidI2cCopy(Buffer, Length, m_Reports.front().data(), m_Reports.front().size());
+    m_Reports.pop_front();
+
+    UpdateInterrupt();
+}
+
+VOID
+HostHidI2cTouchpad::ReadRegister(
+    _In_   USHORT  Register,
+    _Out_  PUCHAR  Buffer,
+    _In_   size_t  Length)
+{
+    UCHAR descriptor[30] = {};
+
+    switch (Register)
+    {
+    case HOST_HIDI2C_DESCRIPTOR_REGISTER:
+        HostHidI2cPutUshort(&descriptor[0], sizeof(descriptor));
+        HostHidI2cPutUshort(&descriptor[2], 0x0100);
+        HostHidI2cPutUshort(&descriptor[4], sizeof(s_ReportDescriptor));
+        HostHidI2cPutUshort(&descriptor[6], HOST_HIDI2C_REPORT_DESC_REGISTER);
+        HostHidI2cPutUshort(&descriptor[8], HOST_HIDI2C_INPUT_REGISTER);
+        HostHidI2cPutUshort(&descriptor[10], HOST_HIDI2C_INPUT_LENGTH);
+        HostHidI2cPutUshort(&descriptor[12], HOST_HIDI2C_OUTPUT_REGISTER);
+        HostHidI2cPutUshort(&descriptor[14], 0);
+        HostHidI2cPutUshort(&descriptor[16], HOST_HIDI2C_COMMAND_REGISTER);
+        HostHidI2cPutUshort(&descriptor[18], HOST_HIDI2C_DATA_REGISTER);
+        HostHidI2cPutUshort(&descriptor[20], 0x1209);
+        HostHidI2cPutUshort(&descriptor[22], 0x0001);
+        HostHidI2cPutUshort(&descriptor[24], 0x0100);
+        HostHidI2cCopy(Buffer, Length, descriptor, sizeof(descriptor));
+        break;
+
+    case HOST_HIDI2C_REPORT_DESC_REGISTER:
+        HostHidI2cCopy(Buffer, Length, s_ReportDescriptor, sizeof(s_ReportDescriptor));
+        break;
+
+    case HOST_HIDI2C_INPUT_REGISTER:
+        ReadInput(Buffer, Length);
+        break;
+
+    default:
+        memset(Buffer, 0, Length);
+        break;
+    }
+}
+
+VOID
+HostHidI2cTouchpad::WriteRegister(
+    _In_  USHORT        Register,
+    _In_  const UCHAR  *Data,
+    _In_  size_t        Length)
+{
+    if ((Register != HOST_HIDI2C_COMMAND_REGISTER) || (Length < 2))
+    {
+        return;
+    }
+
+    switch (Data[1] & 0x0f)
+    {
+    case HOST_HIDI2C_OPCODE_RESET:
+
+        //
+        // The device answers a reset with an empty report.
+        //
+
+        m_Reports.clear();
+        m_Sleeping = FALSE;
+        m_TouchEndUs = 0;
+        QueueReport(std::vector<UCHAR>(2, 0));
+        break;
+
+    case HOST_HIDI2C_OPCODE_SET_POWER:
+        m_Sleeping = ((Data[0] & 0x3) == HOST_HIDI2C_POWER_SLEEP);
+        break;
+
+    default:
+        break;
+    }
+}
+
+NTSTATUS
+HostHidI2cTouchpad::Process(
+    _Inout_  PHOST_SPB_OPERATION  Operation)
+{
+    BOOLEAN addressed = FALSE;
+    USHORT reg = 0;
+
+    if (Operation->Type == HostSpbOperationFullDuplex)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    //
+    // A write starts with the register; a read following it
+    // in the same sequence reads the register, and a read on
+    // its own reads the input register.
+    //
+
+    for (ULONG i = 0; i < Operation->TransferCount; i++)
+    {
+        HOST_SPB_TRANSFER *transfer = &Operation->Transfers[i];
+
+        if (transfer->Direction == SpbTransferDirectionToDevice)
+        {
+            if (transfer->Length < 2)
+            {
+                continue;
+            }
+
+            reg = (USHORT)(transfer->Buffer[0] | (transfer->Buffer[1] << 8));
+            addressed = TRUE;
+
+            WriteRegister(reg, transfer->Buffer + 2, transfer->Length - 2);
+        }
+        else if (addressed)
+        {
+            ReadRegister(reg, transfer->Buffer, transfer->Length);
+        }
+        else
+        {
+            ReadInput(transfer->Buffer, transfer->Length);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/*++
+
+Module Name:
+
+    hostmodel.cpp
+
+Abstract:
+
+    This module implements the base of the device models: bus
+    settings, wire time and completion delay of the operations,
+    and the connection descriptor of the device.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostmodels.h>
+
+//
+// I2C framing, in bit times, as bustime.cpp counts it.
+//
+
+#define HOST_I2C_START_BITS 1
+#define HOST_I2C_BYTE_BITS  9
+#define HOST_I2C_STOP_BITS  1
+
+VOID
+HostModelI2cSettings(
+    _Out_  PHOST_MODEL_SETTINGS  Settings,
+    _In_   USHORT                Address,
+    _In_   ULONG                 ConnectionSpeed,
+    _In_   ULONG                 ResponseLatencyUs)
+{
+    RtlZeroMemory(Settings, sizeof(*Settings));
+    Settings->BusType = CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C;
+    Settings->Address = Address;
+    Settings->ConnectionSpeed = ConnectionSpeed;
+    Settings->ResponseLatencyUs = ResponseLatencyUs;
+}
+
+VOID
+HostModelSpiSettings(
+    _Out_  PHOST_MODEL_SETTINGS  Settings,
+    _In_   USHORT                DeviceSelection,
+    _In_   ULONG                 ConnectionSpeed,
+    _In_   ULONG                 ResponseLatencyUs)
+{
+    RtlZeroMemory(Settings, sizeof(*Settings));
+    Settings->BusType = CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI;
+    Settings->Address = DeviceSelection;
+    Settings->ConnectionSpeed = ConnectionSpeed;
+    Settings->DataBitLength = 8;
+    Settings->ResponseLatencyUs = ResponseLatencyUs;
+}
+
+HostDeviceModel::HostDeviceModel(
+    _In_  const HOST_MODEL_SETTINGS  &Settings)
+    : m_Settings(Settings)
+{
+}
+
+NTSTATUS
+HostDeviceModel::Execute(
+    _Inout_  PHOST_SPB_OPERATION  Operation)
+{
+    ULONGLONG wireNs;
+    NTSTATUS status;
+
+    Operations++;
+
+    switch (Operation->Type)
+    {
+    case HostSpbOperationRead:
+    case HostSpbOperationWrite:
+    case HostSpbOperationSequence:
+    case HostSpbOperationFullDuplex:
+        break;
+
+    case HostSpbOperationIoctl:
+        return STATUS_NOT_SUPPORTED;
+
+    default:
+
+        //
+        // Locks only change the state of the controller.
+        //
+
+        return STATUS_SUCCESS;
+    }
+
+    status = Process(Operation);
+
+    if (status == STATUS_NO_SUCH_DEVICE)
+    {
+        //
+        // Only the address went on the wire.
+        //
+
+        Nacks++;
+        Operation->Information = 0;
+        wireNs = (m_Settings.ConnectionSpeed == 0) ? 0 :
+            ((ULONGLONG)(HOST_I2C_START_BITS + HOST_I2C_BYTE_BITS + HOST_I2C_STOP_BITS) *
+                1000000000) / m_Settings.ConnectionSpeed;
+    }
+    else
+    {
+        wireNs = WireTimeNs(Operation);
+    }
+
+    Operation->CompletionDelayUs =
+        m_Settings.ResponseLatencyUs + (ULONG)((wireNs + 999) / 1000);
+
+    return status;
+}
+
+ULONGLONG
+HostDeviceModel::WireTimeNs(
+    _In_  const HOST_SPB_OPERATION  *Operation) const
+{
+    ULONGLONG bits = 0;
+    ULONGLONG delayNs = 0;
+
+    if (m_Settings.ConnectionSpeed == 0)
+    {
+        return 0;
+    }
+
+    for (ULONG i = 0; i < Operation->TransferCount; i++)
+    {
+        const HOST_SPB_TRANSFER *transfer = &Operation->Transfers[i];
+        ULONGLONG transferBits;
+
+        if (m_Settings.BusType == CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C)
+        {
+            //
+            // Every transfer starts with a start or repeated
+            // start and the address.
+            //
+
+            transferBits = HOST_I2C_START_BITS + HOST_I2C_BYTE_BITS;
+
+            if (m_Settings.TenBitAddress)
+            {
+                transferBits += HOST_I2C_BYTE_BITS;
+
+                if (transfer->Direction == SpbTransferDirectionFromDevice)
+                {
+                    transferBits += HOST_I2C_START_BITS + HOST_I2C_BYTE_BITS;
+                }
+            }
+
+            transferBits += (ULONGLONG)transfer->Length * HOST_I2C_BYTE_BITS;
+        }
+        else
+        {
+            ULONG wordBits = (m_Settings.DataBitLength != 0) ? m_Settings.DataBitLength : 8;
+            ULONG wordBytes = (wordBits <= 8) ? 1 : ((wordBits <= 16) ? 2 : 4);
+
+            transferBits = ((ULONGLONG)transfer->Length / wordBytes) * wordBits;
+        }
+
+        //
+        // Both buffers of a full duplex transfer are clocked
+        // at the same time.
+        //
+
+        if (Operation->Type == HostSpbOperationFullDuplex)
+        {
+            bits = (transferBits > bits) ? transferBits : bits;
+        }
+        else
+        {
+            bits += transferBits;
+            delayNs += (ULONGLONG)transfer->DelayInUs * 1000;
+        }
+    }
+
+    if ((bits != 0) && (m_Settings.BusType == CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C))
+    {
+        bits += HOST_I2C_STOP_BITS;
+    }
+
+    return ((bits * 1000000000) / m_Settings.ConnectionSpeed) + delayNs;
+}
+
+std::vector<UCHAR>
+HostDeviceModel::Connection() const
+{
+    if (m_Settings.BusType == CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI)
+    {
+        return HostSimSpiConnection(
+            m_Settings.Address,
+            m_Settings.ConnectionSpeed,
+            m_Settings.DataBitLength);
+    }
+
+    return HostSimI2cConnection(
+        m_Settings.Address,
+        m_Settings.ConnectionSpeed,
+        m_Settings.TenBitAddress);
+}
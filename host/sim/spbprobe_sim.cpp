@@ -0,0 +1,2072 @@
+/*++
+
+Module Name:
+
+    spbprobe_sim.cpp
+
+Abstract:
+
+    This module drives the probe on the host emulation: it
+    loads the driver, adds a probe device on top of a simulated
+    I2C register file and runs client requests through it,
+    checking what comes back, then runs the device models of
+    hostmodels.h behind probe devices. With -n it then loops
+    over reads,
+    writes and write-reads, to be profiled with perf:
+
+        perf record -g ./spbprobe_sim -n 1000000
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include <hostsim.h>
+#include <hostmodels.h>
+
+#include "spbprobeioctl.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#define SIM_CONNECTION_ID   0x1234
+#define SIM_ADDRESS         0x2c
+#define SIM_SLOW_ADDRESS    0x2d
+#define SIM_SPEED           400000
+#define SIM_LATENCY_US      2000
+
+#define SIM_TOUCHPAD_ID     0x2001
+#define SIM_EEPROM_ID       0x2002
+#define SIM_ACCEL_ID        0x2003
+#define SIM_EVENTS_ID       0x2004
+#define SIM_CAPTURE_ID      0x2005
+#define SIM_RECORDER_ID     0x2006
+#define SIM_CACHE_ID        0x2007
+#define SIM_INJECTION_ID    0x2008
+#define SIM_COALESCE_ID     0x2009
+#define SIM_BUSTIME_ID      0x200a
+#define SIM_DEFERRED_ID     0x200b
+
+//
+// An I2C device with 256 byte-wide registers: the first byte
+// written selects the register, reads continue from the
+// selected register. Full duplex transfers loop the written
+// bytes back.
+//
+
+class SimRegisterFile : public HostSpbController
+{
+public:
+
+    NTSTATUS
+    Execute(
+        _Inout_  PHOST_SPB_OPERATION  Operation
+        ) override
+    {
+        Operations++;
+        LastTransferCount = Operation->TransferCount;
+        Operation->CompletionDelayUs = CompletionDelayUs;
+
+        if (!NT_SUCCESS(FailNext))
+        {
+            NTSTATUS status = FailNext;
+
+            FailNext = STATUS_SUCCESS;
+            return status;
+        }
+
+        switch (Operation->Type)
+        {
+        case HostSpbOperationFullDuplex:
+        {
+            HOST_SPB_TRANSFER *write = &Operation->Transfers[0];
+            HOST_SPB_TRANSFER *read = &Operation->Transfers[1];
+            size_t length = (write->Length < read->Length) ? write->Length : read->Length;
+
+            memcpy(read->Buffer, write->Buffer, length);
+            return STATUS_SUCCESS;
+        }
+
+        case HostSpbOperationIoctl:
+            Operation->Information = 0;
+            return STATUS_SUCCESS;
+
+        default:
+            break;
+        }
+
+        for (ULONG i = 0; i < Operation->TransferCount; i++)
+        {
+            HOST_SPB_TRANSFER *transfer = &Operation->Transfers[i];
+
+            for (size_t j = 0; j < transfer->Length; j++)
+            {
+                if (transfer->Direction == SpbTransferDirectionFromDevice)
+                {
+                    transfer->Buffer[j] = Registers[Pointer++];
+                }
+                else if (j == 0)
+                {
+                    Pointer = transfer->Buffer[0];
+                }
+                else
+                {
+                    Registers[Pointer++] = transfer->Buffer[j];
+                }
+            }
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    UCHAR     Registers[256] = {};
+    UCHAR     Pointer = 0;
+    ULONG     Operations = 0;
+    ULONG     LastTransferCount = 0;
+    ULONG     CompletionDelayUs = 0;
+    NTSTATUS  FailNext = STATUS_SUCCESS;
+};
+
+static ULONG s_Failures = 0;
+
+#define SIM_CHECK(condition) \
+    SimCheck((condition), #condition, __LINE__)
+
+static
+VOID
+SimCheck(
+    _In_  bool   Condition,
+    _In_  PCSTR  Text,
+    _In_  int    Line)
+{
+    if (!Condition)
+    {
+        fprintf(stderr, "FAIL line %d: %s\n", Line, Text);
+        s_Failures++;
+    }
+}
+
+static
+ULONGLONG
+SimNowUs(VOID)
+{
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static
+ULONG
+SimTraceValue(
+    _In_  PCSTR  Message,
+    _In_  PCSTR  Name)
+{
+    PCSTR value = strstr(Message, Name);
+
+    return (value != nullptr) ? (ULONG)strtoul(value + strlen(Name), nullptr, 0) : 0;
+}
+
+static
+VOID
+SimCheckTransfers(
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  SimRegisterFile  *Controller)
+{
+    UCHAR write[] = {0x10, 0xa1, 0xa2, 0xa3, 0xa4};
+    UCHAR address = 0x10;
+    UCHAR read[4] = {};
+    UCHAR duplexOut[3] = {9, 8, 7};
+    UCHAR duplexIn[3] = {};
+    ULONG_PTR information = 0;
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(Target, write, sizeof(write), &information)));
+    SIM_CHECK(information == sizeof(write));
+    SIM_CHECK(memcmp(&Controller->Registers[0x10], &write[1], 4) == 0);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &address, 1, read, sizeof(read), &information)));
+    SIM_CHECK(information == 1 + sizeof(read));
+    SIM_CHECK(memcmp(read, &write[1], sizeof(read)) == 0);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(Target, &address, 1)));
+    SIM_CHECK(NT_SUCCESS(HostSimRead(Target, read, 2, &information)));
+    SIM_CHECK((information == 2) && (read[0] == 0xa1) && (read[1] == 0xa2));
+
+    SIM_CHECK(NT_SUCCESS(HostSimFullDuplex(Target,
+        duplexOut, sizeof(duplexOut), duplexIn, sizeof(duplexIn))));
+    SIM_CHECK(memcmp(duplexIn, duplexOut, sizeof(duplexIn)) == 0);
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(Target, SpbRequestTypeLockController)));
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(Target, write, sizeof(write))));
+    SIM_CHECK(NT_SUCCESS(HostSimLock(Target, SpbRequestTypeUnlockController)));
+
+    //
+    // Sequences longer than a write-read, in the transfer list
+    // of the device (3) and in the pooled one (6).
+    //
+
+    UCHAR first[] = {0x20, 0x51, 0x52};
+    UCHAR second[] = {0x30, 0x53};
+    UCHAR firstAddress = 0x20;
+    UCHAR secondAddress = 0x30;
+    UCHAR firstRead[2] = {};
+    UCHAR secondRead[1] = {};
+    HOST_SPB_TRANSFER transfers[6] =
+    {
+        {SpbTransferDirectionToDevice, 0, first, sizeof(first)},
+        {SpbTransferDirectionToDevice, 0, second, sizeof(second)},
+        {SpbTransferDirectionToDevice, 0, &firstAddress, 1},
+        {SpbTransferDirectionFromDevice, 0, firstRead, sizeof(firstRead)},
+        {SpbTransferDirectionToDevice, 0, &secondAddress, 1},
+        {SpbTransferDirectionFromDevice, 0, secondRead, sizeof(secondRead)}
+    };
+
+    HOST_SPB_TRANSFER shortTransfers[3] = {transfers[1], transfers[4], transfers[5]};
+
+    SIM_CHECK(NT_SUCCESS(HostSimWait(
+        HostSimSubmit(Target, SpbRequestTypeSequence, 0, shortTransfers, 3), nullptr)));
+    SIM_CHECK(secondRead[0] == 0x53);
+
+    secondRead[0] = 0;
+
+    SIM_CHECK(NT_SUCCESS(HostSimWait(
+        HostSimSubmit(Target, SpbRequestTypeSequence, 0, transfers, 6), nullptr)));
+    SIM_CHECK((firstRead[0] == 0x51) && (firstRead[1] == 0x52) && (secondRead[0] == 0x53));
+}
+
+static
+VOID
+SimCheckCache(
+    _In_  PHOST_SIM_DEVICE  Device,
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  SimRegisterFile  *Controller)
+{
+    UCHAR reg = 0x01;
+    UCHAR first[2] = {};
+    UCHAR second[2] = {};
+    ULONG operations;
+
+    Controller->Registers[1] = 0x5a;
+    Controller->Registers[2] = 0xa5;
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &reg, 1, first, sizeof(first))));
+    SIM_CHECK((first[0] == 0x5a) && (first[1] == 0xa5));
+
+    //
+    // The second read of the cached register does not reach
+    // the controller.
+    //
+
+    operations = Controller->Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &reg, 1, second, sizeof(second))));
+    SIM_CHECK(Controller->Operations == operations);
+    SIM_CHECK(memcmp(first, second, sizeof(first)) == 0);
+
+    //
+    // A write to the target drops the cached response, so the
+    // next read reaches the controller again.
+    //
+
+    UCHAR data[] = {0x01, 0x66, 0x99};
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(Target, data, sizeof(data))));
+
+    operations = Controller->Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &reg, 1, second, sizeof(second))));
+    SIM_CHECK(Controller->Operations == operations + 1);
+    SIM_CHECK((second[0] == 0x66) && (second[1] == 0x99));
+
+    //
+    // Neither a read of a register not cached nor a register
+    // address select drops the cached response.
+    //
+
+    UCHAR other = 0x02;
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &other, 1, second, sizeof(second))));
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(Target, &reg, 1)));
+
+    operations = Controller->Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &reg, 1, second, sizeof(second))));
+    SIM_CHECK(Controller->Operations == operations);
+    SIM_CHECK((second[0] == 0x66) && (second[1] == 0x99));
+
+    //
+    // Another target opened on the address shares the cache,
+    // and a write through it drops the response read through
+    // the first one.
+    //
+
+    PHOST_SIM_TARGET peer = HostSimOpenTarget(Device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+
+    SIM_CHECK(peer != nullptr);
+
+    if (peer == nullptr)
+    {
+        return;
+    }
+
+    operations = Controller->Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(peer, &reg, 1, second, sizeof(second))));
+    SIM_CHECK(Controller->Operations == operations);
+
+    data[1] = 0x67;
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(peer, data, sizeof(data))));
+
+    operations = Controller->Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &reg, 1, second, sizeof(second))));
+    SIM_CHECK(Controller->Operations == operations + 1);
+    SIM_CHECK((second[0] == 0x67) && (second[1] == 0x99));
+
+    HostSimCloseTarget(peer);
+}
+
+static
+VOID
+SimCheckCacheCoalesced(VOID)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR reg = 0x01;
+    UCHAR data[] = {0x01, 0x77, 0x78};
+    UCHAR shortData[] = {0x01, 0x55};
+    UCHAR read[2] = {};
+    ULONG operations;
+
+    //
+    // Cached register 0x01 with a short lifetime, on a target
+    // whose writes under the controller lock are posted.
+    //
+
+    device = HostSimCreateDevice(SIM_CACHE_ID, &controller);
+    HostSimSetRegistryMultiSz(device, nullptr, L"CachedRegisters", {L"0x002C0001"});
+    HostSimSetRegistryMultiSz(device, nullptr, L"CoalescedTargets", {L"0x2c"});
+    HostSimSetRegistryULong(device, nullptr, L"CacheTtlMs", 100);
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    controller.Registers[1] = 0x5a;
+    controller.Registers[2] = 0xa5;
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, &reg, 1, read, sizeof(read))));
+
+    //
+    // A posted select of the cached register is consumed by
+    // the hit of the read.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeLockController)));
+
+    operations = controller.Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, &reg, 1)));
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations);
+    SIM_CHECK((read[0] == 0x5a) && (read[1] == 0xa5));
+
+    //
+    // A data write is never posted: it goes to the controller
+    // at once, and drops the cached response.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, data, sizeof(data))));
+    SIM_CHECK(controller.Operations == operations + 1);
+    SIM_CHECK((controller.Registers[1] == 0x77) && (controller.Registers[2] == 0x78));
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, &reg, 1)));
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations + 2);
+    SIM_CHECK((read[0] == 0x77) && (read[1] == 0x78));
+
+    //
+    // So does a write as short as a select that does not
+    // select a cached register.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, shortData, sizeof(shortData))));
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations + 3);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, &reg, 1)));
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations + 4);
+    SIM_CHECK((read[0] == 0x55) && (read[1] == 0x78));
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeUnlockController)));
+
+    //
+    // The cached response expires after CacheTtlMs.
+    //
+
+    operations = controller.Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, &reg, 1, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations);
+
+    HostSimRunFor(150 * 1000);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, &reg, 1, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations + 1);
+    SIM_CHECK((read[0] == 0x55) && (read[1] == 0x78));
+
+    HostSimCloseTarget(target);
+    HostSimRemoveDevice(device);
+}
+
+//
+// Posted writes that failed when sent alone, traced by the
+// target closed while SimCoalesceSink is installed.
+//
+
+static ULONG s_FailedPostedWrites = 0;
+
+static
+VOID
+SimCoalesceSink(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+
+    if (strstr(Message, "failed alone=") != nullptr)
+    {
+        s_FailedPostedWrites = SimTraceValue(Message, "failed alone=");
+    }
+}
+
+static
+VOID
+SimCheckCoalesce(VOID)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    PHOST_SIM_REQUEST request;
+    UCHAR data[] = {0x10, 0xc1, 0xc2};
+    UCHAR select[] = {0x10};
+    UCHAR other[] = {0x20, 0xd1, 0xd2};
+    UCHAR failed[] = {0x31, 0xe1, 0xe2};
+    UCHAR cancelled[] = {0x40, 0xf1, 0xf2};
+    UCHAR read[2] = {};
+    HOST_SPB_TRANSFER transfer = {SpbTransferDirectionToDevice, 0, cancelled, sizeof(cancelled)};
+    ULONG_PTR information = 0;
+    ULONG operations;
+    ULONG level;
+    ULONG flags;
+
+    device = HostSimCreateDevice(SIM_COALESCE_ID, &controller);
+    HostSimSetRegistryMultiSz(device, nullptr, L"CoalescedTargets", {L"0x2c"});
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeLockController)));
+
+    //
+    // A data write under the controller lock is sent at once.
+    //
+
+    operations = controller.Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, data, sizeof(data), &information)));
+    SIM_CHECK(information == sizeof(data));
+    SIM_CHECK(controller.Operations == operations + 1);
+
+    //
+    // A register address write completes at once, without
+    // reaching the controller, and goes out with the read as
+    // one sequence.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, select, sizeof(select), &information)));
+    SIM_CHECK(information == sizeof(select));
+    SIM_CHECK(controller.Operations == operations + 1);
+
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations + 2);
+    SIM_CHECK(controller.LastTransferCount == 2);
+    SIM_CHECK((read[0] == 0xc1) && (read[1] == 0xc2));
+
+    //
+    // Any other request is dispatched again once the posted
+    // write is sent on its own.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, select, sizeof(select))));
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, other, sizeof(other))));
+    SIM_CHECK(controller.Operations == operations + 4);
+    SIM_CHECK((controller.Registers[0x20] == 0xd1) && (controller.Registers[0x21] == 0xd2));
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, select, sizeof(select))));
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeUnlockController)));
+    SIM_CHECK(controller.Operations == operations + 6);
+
+    //
+    // A posted write failing on its own is counted, and the
+    // request behind it still goes on, an unlock included.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeLockController)));
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, select, sizeof(select))));
+
+    operations = controller.Operations;
+    controller.FailNext = STATUS_IO_TIMEOUT;
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, failed, sizeof(failed))));
+    SIM_CHECK(controller.Operations == operations + 2);
+    SIM_CHECK((controller.Registers[0x31] == 0xe1) && (controller.Registers[0x32] == 0xe2));
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, select, sizeof(select))));
+
+    controller.FailNext = STATUS_IO_TIMEOUT;
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeUnlockController)));
+    SIM_CHECK(controller.Operations == operations + 4);
+
+    //
+    // A request waiting for a posted write can be cancelled;
+    // the posted write still goes out.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeLockController)));
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, select, sizeof(select))));
+
+    operations = controller.Operations;
+    controller.CompletionDelayUs = 50 * 1000;
+
+    request = HostSimSubmit(target, SpbRequestTypeWrite, 0, &transfer, 1);
+
+    HostSimRunFor(10 * 1000);
+    SIM_CHECK(!HostSimIsComplete(request));
+
+    HostSimCancel(request);
+    SIM_CHECK(HostSimWait(request, nullptr, 1000) == STATUS_CANCELLED);
+    SIM_CHECK(controller.Operations == operations + 1);
+    SIM_CHECK(controller.Registers[0x40] == 0);
+
+    controller.CompletionDelayUs = 0;
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeUnlockController)));
+
+    //
+    // Without the lock, nothing is posted.
+    //
+
+    operations = controller.Operations;
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, select, sizeof(select))));
+    SIM_CHECK(controller.Operations == operations + 1);
+
+    HostTraceGetLevel(&level, &flags);
+    HostTraceSetLevel(TRACE_LEVEL_ERROR, 0xffffffff);
+    HostTraceSetSink(SimCoalesceSink);
+
+    HostSimCloseTarget(target);
+
+    HostTraceSetSink(nullptr);
+    HostTraceSetLevel(level, flags);
+
+    SIM_CHECK(s_FailedPostedWrites == 2);
+
+    HostSimRemoveDevice(device);
+}
+
+static
+VOID
+SimCheckInjectedLatency(
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  SimRegisterFile  *Controller)
+{
+    UCHAR address = 0x10;
+    UCHAR read[4] = {};
+    ULONGLONG start = SimNowUs();
+
+    //
+    // The sequence is sent from a timer once the routine that
+    // built its transfer list returned.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(Target, &address, 1, read, sizeof(read))));
+    SIM_CHECK(SimNowUs() - start >= SIM_LATENCY_US);
+    SIM_CHECK(read[0] == 0xa1);
+
+    //
+    // A request cancelled during the latency is completed
+    // at once and never reaches the controller.
+    //
+
+    HOST_SPB_TRANSFER transfers[2] =
+    {
+        {SpbTransferDirectionToDevice, 0, &address, 1},
+        {SpbTransferDirectionFromDevice, 0, read, sizeof(read)},
+    };
+    PHOST_SIM_REQUEST request;
+    ULONG operations = Controller->Operations;
+
+    request = HostSimSubmit(Target, SpbRequestTypeSequence, 0, transfers, 2);
+
+    HostSimRunFor(SIM_LATENCY_US / 4);
+    SIM_CHECK(!HostSimIsComplete(request));
+
+    HostSimCancel(request);
+    SIM_CHECK(HostSimWait(request, nullptr, 1000) == STATUS_CANCELLED);
+
+    HostSimRunFor(2 * SIM_LATENCY_US);
+    SIM_CHECK(Controller->Operations == operations);
+}
+
+//
+// Injections traced while SimInjectionSink is installed,
+// without the request pointer and transaction ID.
+//
+
+static std::vector<std::string> s_Injections;
+
+static
+VOID
+SimInjectionSink(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    PCSTR sequence = strstr(Message, "injection #");
+    PCSTR request = strstr(Message, " on client request ");
+    PCSTR verdict = strstr(Message, "latency ");
+
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+
+    if ((sequence != nullptr) && (request > sequence) && (verdict != nullptr))
+    {
+        s_Injections.push_back(std::string(sequence, request) + " " + verdict);
+    }
+}
+
+//
+// Runs reads and writes on a device with jittered latency on
+// every other read, truncated, and a failure on every third
+// write. Returns the injections traced, and what the client
+// saw of each request in Results.
+//
+
+static
+std::vector<std::string>
+SimRunInjection(
+    _In_   ULONG                    Seed,
+    _Out_  std::vector<ULONG_PTR>  *Results)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR write[] = {0x10, 0xb1};
+    UCHAR read[4] = {};
+    ULONG_PTR information;
+    ULONG level;
+    ULONG flags;
+
+    Results->clear();
+    s_Injections.clear();
+
+    device = HostSimCreateDevice(SIM_INJECTION_ID, &controller);
+    HostSimSetRegistryULong(device, nullptr, L"InjectionSeed", Seed);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Types", 0x2);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Every", 2);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"LatencyUs", 100);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"JitterUs", 400);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"TruncateBytes", 1);
+    HostSimSetRegistryULong(device, L"Injection\\1", L"Types", 0x4);
+    HostSimSetRegistryULong(device, L"Injection\\1", L"Every", 3);
+    HostSimSetRegistryULong(device, L"Injection\\1", L"FailStatus", (ULONG)STATUS_IO_TIMEOUT);
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    HostTraceGetLevel(&level, &flags);
+    HostTraceSetLevel(TRACE_LEVEL_WARNING, 0xffffffff);
+    HostTraceSetSink(SimInjectionSink);
+
+    for (ULONG i = 0; i < 12; i++)
+    {
+        information = 0;
+        Results->push_back((ULONG_PTR)HostSimWrite(target, write, sizeof(write)));
+        Results->push_back((ULONG_PTR)HostSimRead(target, read, sizeof(read), &information));
+        Results->push_back(information);
+    }
+
+    HostTraceSetSink(nullptr);
+    HostTraceSetLevel(level, flags);
+
+    HostSimCloseTarget(target);
+    HostSimRemoveDevice(device);
+
+    return s_Injections;
+}
+
+static
+VOID
+SimCheckInjectionReplay(VOID)
+{
+    std::vector<ULONG_PTR> first;
+    std::vector<ULONG_PTR> second;
+    std::vector<ULONG_PTR> other;
+    std::vector<std::string> schedule;
+    ULONG failures = 0;
+    ULONG truncated = 0;
+
+    //
+    // The same seed and request order give the same schedule,
+    // jitter included: 6 delayed reads and 4 failed writes.
+    //
+
+    schedule = SimRunInjection(7, &first);
+
+    SIM_CHECK(schedule.size() == 10);
+    SIM_CHECK(SimRunInjection(7, &second) == schedule);
+    SIM_CHECK(first == second);
+    SIM_CHECK(SimRunInjection(8, &other) != schedule);
+
+    for (size_t i = 0; i + 2 < first.size(); i += 3)
+    {
+        failures += ((NTSTATUS)first[i] == STATUS_IO_TIMEOUT);
+        truncated += (first[i + 2] == 3);
+        SIM_CHECK(NT_SUCCESS((NTSTATUS)first[i + 1]));
+    }
+
+    SIM_CHECK((failures == 4) && (truncated == 6));
+}
+
+static
+VOID
+SimCheckDroppedCompletion(VOID)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    PHOST_SIM_REQUEST request;
+    UCHAR write[] = {0x10, 0xb1};
+    UCHAR read[2] = {};
+    HOST_SPB_TRANSFER transfer = {SpbTransferDirectionFromDevice, 0, read, sizeof(read)};
+
+    device = HostSimCreateDevice(SIM_INJECTION_ID, &controller);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Types", 0x2);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Every", 2);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"DropCompletion", 1);
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, read, sizeof(read))));
+
+    //
+    // The second read reaches the controller, but its
+    // completion is withheld until the client cancels it.
+    //
+
+    request = HostSimSubmit(target, SpbRequestTypeRead, 0, &transfer, 1);
+
+    HostSimRunFor(20 * 1000);
+    SIM_CHECK(!HostSimIsComplete(request));
+    SIM_CHECK(controller.Operations == 2);
+
+    HostSimCancel(request);
+    SIM_CHECK(HostSimWait(request, nullptr, 1000) == STATUS_CANCELLED);
+
+    //
+    // The device goes on with the next request.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+    SIM_CHECK(controller.Registers[0x10] == 0xb1);
+
+    HostSimCloseTarget(target);
+    HostSimRemoveDevice(device);
+}
+
+//
+// A device started before its controller is reachable opens
+// the SPB target on the first target connect that finds it.
+//
+
+static
+VOID
+SimCheckDeferredOpen(VOID)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR write[] = {0x20, 0x5a};
+    UCHAR read[1] = {};
+
+    device = HostSimCreateDevice(SIM_DEFERRED_ID, nullptr);
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target == nullptr);
+
+    HostSimSetController(device, &controller);
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    if (target != nullptr)
+    {
+        SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+        SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, 1)));
+        SIM_CHECK(NT_SUCCESS(HostSimRead(target, read, sizeof(read))));
+        SIM_CHECK(read[0] == 0x5a);
+
+        HostSimCloseTarget(target);
+    }
+
+    HostSimRemoveDevice(device);
+}
+
+//
+// Bus efficiency traced by the target closed while
+// SimBusTimeSink is installed.
+//
+
+static ULONG s_WireTimeUs = 0;
+static ULONG s_BusyTimeUs = 0;
+static ULONG s_Efficiency = 0;
+static BOOLEAN s_WireAboveBusy = FALSE;
+
+static
+VOID
+SimBusTimeSink(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+
+    if (strstr(Message, "efficiency=") != nullptr)
+    {
+        s_WireTimeUs = SimTraceValue(Message, "wire time=");
+        s_BusyTimeUs = SimTraceValue(Message, "busy time=");
+        s_Efficiency = SimTraceValue(Message, "efficiency=");
+    }
+
+    if (strstr(Message, "wire time above busy time") != nullptr)
+    {
+        s_WireAboveBusy = TRUE;
+    }
+}
+
+static
+VOID
+SimRunBusTime(
+    _In_  ULONG  Speed,
+    _In_  ULONG  CompletionDelayUs)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR write[11] = {0x40};
+    ULONG level;
+    ULONG flags;
+
+    controller.CompletionDelayUs = CompletionDelayUs;
+
+    device = HostSimCreateDevice(SIM_BUSTIME_ID, &controller);
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, Speed));
+    SIM_CHECK(target != nullptr);
+
+    for (ULONG i = 0; i < 10; i++)
+    {
+        SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+    }
+
+    s_WireTimeUs = 0;
+    s_BusyTimeUs = 0;
+    s_Efficiency = 0;
+    s_WireAboveBusy = FALSE;
+
+    HostTraceGetLevel(&level, &flags);
+    HostTraceSetLevel(TRACE_LEVEL_WARNING, 0xffffffff);
+    HostTraceSetSink(SimBusTimeSink);
+
+    HostSimCloseTarget(target);
+
+    HostTraceSetSink(nullptr);
+    HostTraceSetLevel(level, flags);
+
+    HostSimRemoveDevice(device);
+}
+
+static
+VOID
+SimCheckBusTime(VOID)
+{
+    //
+    // An 11-byte write is a start, the address byte, 11 data
+    // bytes of 9 bits each and a stop: 110 bits, 110 us at
+    // 1 MHz. The controller completes each one after 1 ms.
+    //
+
+    SimRunBusTime(1000000, 1000);
+
+    SIM_CHECK(s_WireTimeUs == 10 * 110);
+    SIM_CHECK(s_BusyTimeUs >= 10 * 1000);
+    SIM_CHECK(s_Efficiency <= (s_WireTimeUs * 100) / s_BusyTimeUs + 1);
+    SIM_CHECK(s_Efficiency + 1 >= (s_WireTimeUs * 100) / s_BusyTimeUs);
+    SIM_CHECK(!s_WireAboveBusy);
+
+    //
+    // At 1 kHz the same writes would take 110 ms each. The
+    // controller completes them at once: the efficiency goes
+    // above 100% and a warning says so.
+    //
+
+    SimRunBusTime(1000, 0);
+
+    SIM_CHECK(s_WireTimeUs == 10 * 110000);
+    SIM_CHECK(s_BusyTimeUs < s_WireTimeUs);
+    SIM_CHECK(s_Efficiency > 100);
+    SIM_CHECK(s_WireAboveBusy);
+}
+
+#if defined(SIM_ETL_TOOL) && defined(SIM_ETL_FIXTURE)
+
+//
+// Reads a synthetic ETL file with spbprobe_etl and compares
+// the records with the expected ones. The file holds a buffer
+// of WPP messages (a write dumped on two lines, a read, a
+// formatted message and a message of another provider) and a
+// buffer of TraceLogging events (a write, a read split in two
+// events, the completion and an event of another provider).
+//
+
+static
+VOID
+SimCheckEtl(VOID)
+{
+    std::string command = std::string(SIM_ETL_TOOL) +
+        " -all -tmf " SIM_ETL_FIXTURE "/spbprobe.tmf " SIM_ETL_FIXTURE "/spbprobe.etl 2>/dev/null";
+    FILE *expected = fopen(SIM_ETL_FIXTURE "/spbprobe.jsonl", "r");
+    FILE *decoded = popen(command.c_str(), "r");
+    char expectedLine[1024];
+    char decodedLine[1024];
+    ULONG records = 0;
+
+    SIM_CHECK((expected != nullptr) && (decoded != nullptr));
+
+    if ((expected == nullptr) || (decoded == nullptr))
+    {
+        goto exit;
+    }
+
+    while (fgets(expectedLine, sizeof(expectedLine), expected) != nullptr)
+    {
+        if (fgets(decodedLine, sizeof(decodedLine), decoded) == nullptr)
+        {
+            decodedLine[0] = '\0';
+        }
+
+        if (strcmp(expectedLine, decodedLine) != 0)
+        {
+            fprintf(stderr, "expected %sdecoded  %s\n", expectedLine, decodedLine);
+        }
+
+        SIM_CHECK(strcmp(expectedLine, decodedLine) == 0);
+        records++;
+    }
+
+    SIM_CHECK(records == 6);
+    SIM_CHECK(fgets(decodedLine, sizeof(decodedLine), decoded) == nullptr);
+
+exit:
+
+    if (decoded != nullptr)
+    {
+        SIM_CHECK(pclose(decoded) == 0);
+    }
+
+    if (expected != nullptr)
+    {
+        fclose(expected);
+    }
+}
+
+#endif
+
+static
+VOID
+SimCheckTimeline(VOID)
+{
+    SPBPROBE_TIMELINE timeline = {};
+    ULONG index = 0;
+    ULONG_PTR information = 0;
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_QUERY_TIMELINE,
+        &index, sizeof(index), &timeline, sizeof(timeline), &information)));
+    SIM_CHECK(information == sizeof(timeline));
+    SIM_CHECK(timeline.PeripheralId == SIM_CONNECTION_ID);
+    SIM_CHECK(timeline.Phases[SpbProbePhaseFirstTransfer].Count != 0);
+
+    index = 1;
+    SIM_CHECK(HostSimControlIoctl(IOCTL_SPBPROBE_QUERY_TIMELINE,
+        &index, sizeof(index), &timeline, sizeof(timeline)) == STATUS_NO_MORE_ENTRIES);
+}
+
+static
+VOID
+SimCheckLockStatistics(VOID)
+{
+    SPBPROBE_LOCK_STATISTICS_INPUT input = {};
+    SPBPROBE_LOCK_STATISTICS statistics = {};
+    ULONG_PTR information = 0;
+
+    //
+    // The targets are listed in the order they connected,
+    // the controller lock of the transfers check is counted
+    // before the first target disconnects.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_QUERY_LOCK_STATISTICS,
+        &input, sizeof(input), &statistics, sizeof(statistics), &information)));
+    SIM_CHECK(information == sizeof(statistics));
+    SIM_CHECK(statistics.PeripheralId == SIM_CONNECTION_ID);
+    SIM_CHECK(statistics.Address == SIM_ADDRESS);
+    SIM_CHECK(statistics.ControllerLock.HoldTime.Count != 0);
+    SIM_CHECK(statistics.ControllerLock.WaitTime.Count == statistics.ControllerLock.HoldTime.Count);
+    SIM_CHECK(statistics.ControllerLock.TransfersPerLock.Max >= 1);
+    SIM_CHECK(statistics.ConnectionLock.HoldTime.Count == 0);
+
+    input.TargetIndex = 1;
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_QUERY_LOCK_STATISTICS,
+        &input, sizeof(input), &statistics, sizeof(statistics))));
+    SIM_CHECK(statistics.Address == SIM_SLOW_ADDRESS);
+    SIM_CHECK(statistics.ControllerLock.HoldTime.Count == 0);
+
+    input.TargetIndex = 2;
+    SIM_CHECK(HostSimControlIoctl(IOCTL_SPBPROBE_QUERY_LOCK_STATISTICS,
+        &input, sizeof(input), &statistics, sizeof(statistics)) == STATUS_NO_MORE_ENTRIES);
+
+    input.DeviceIndex = 1;
+    input.TargetIndex = 0;
+    SIM_CHECK(HostSimControlIoctl(IOCTL_SPBPROBE_QUERY_LOCK_STATISTICS,
+        &input, sizeof(input), &statistics, sizeof(statistics)) == STATUS_NO_MORE_ENTRIES);
+}
+
+//
+// Level of the last timeline traced, received by
+// SimTimelineSink.
+//
+
+static ULONG s_TimelineLevel;
+
+static
+VOID
+SimTimelineSink(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+
+    if (strstr(Message, ": timeline us ") != nullptr)
+    {
+        s_TimelineLevel = Level;
+    }
+}
+
+static
+VOID
+SimCheckIdle(
+    _In_  PHOST_SIM_DEVICE  Device,
+    _In_  PHOST_SIM_TARGET  Target)
+{
+    UCHAR read[1];
+    ULONG timeout;
+    ULONG level;
+    ULONG flags;
+
+    HostSimEnableIdle(Device, TRUE);
+    HostSimSetMonitorPower(FALSE);
+
+    timeout = HostSimGetIdleTimeout(Device);
+    SIM_CHECK(timeout < 1000);
+
+    HostSimRunFor((timeout * 2 + 10) * 1000);
+    SIM_CHECK(!HostSimIsDeviceInD0(Device));
+
+    //
+    // The first transfer after the resume traces the timeline
+    // at the information level, not as an error.
+    //
+
+    HostTraceGetLevel(&level, &flags);
+    HostTraceSetLevel(TRACE_LEVEL_INFORMATION, 0xffffffff);
+    HostTraceSetSink(SimTimelineSink);
+    s_TimelineLevel = 0;
+
+    SIM_CHECK(NT_SUCCESS(HostSimRead(Target, read, sizeof(read))));
+    SIM_CHECK(HostSimIsDeviceInD0(Device));
+
+    HostTraceSetSink(nullptr);
+    HostTraceSetLevel(level, flags);
+
+    SIM_CHECK(s_TimelineLevel == TRACE_LEVEL_INFORMATION);
+
+    HostSimSetMonitorPower(TRUE);
+    HostSimEnableIdle(Device, FALSE);
+}
+
+//
+// Transfer events received by SimEventSink.
+//
+
+typedef struct _SIM_EVENT
+{
+    LONGLONG             DeviceId;
+    ULONGLONG            TransactionId;
+    ULONG                Index;
+    ULONG                Direction;
+    ULONG                Length;
+    ULONG                Offset;
+    NTSTATUS             Status;
+    std::vector<UCHAR>   Payload;
+}
+SIM_EVENT;
+
+static std::vector<SIM_EVENT> s_Events;
+static std::vector<SIM_EVENT> s_Completions;
+
+static
+VOID
+SimEventSink(
+    _In_  PCSTR                  Provider,
+    _In_  PCSTR                  Event,
+    _In_  const HOST_TLG_FIELD  *Fields,
+    _In_  ULONG                  FieldCount)
+{
+    SIM_EVENT event = {};
+    BOOLEAN completion = (strcmp(Event, "Completion") == 0);
+
+    if ((strcmp(Provider, "SpbProbe") != 0) ||
+        ((strcmp(Event, "Transfer") != 0) && !completion))
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < FieldCount; i++)
+    {
+        const HOST_TLG_FIELD *field = &Fields[i];
+
+        if (strcmp(field->Name, "DeviceId") == 0)
+        {
+            event.DeviceId = (LONGLONG)field->Value;
+        }
+        else if (strcmp(field->Name, "TransactionId") == 0)
+        {
+            event.TransactionId = field->Value;
+        }
+        else if (strcmp(field->Name, "Index") == 0)
+        {
+            event.Index = (ULONG)field->Value;
+        }
+        else if (strcmp(field->Name, "Direction") == 0)
+        {
+            event.Direction = (ULONG)field->Value;
+        }
+        else if (strcmp(field->Name, "Length") == 0)
+        {
+            event.Length = (ULONG)field->Value;
+        }
+        else if (strcmp(field->Name, "Offset") == 0)
+        {
+            event.Offset = (ULONG)field->Value;
+        }
+        else if (strcmp(field->Name, "Status") == 0)
+        {
+            event.Status = (NTSTATUS)field->Value;
+        }
+        else if (strcmp(field->Name, "Payload") == 0)
+        {
+            const UCHAR *payload = (const UCHAR *)field->Buffer;
+
+            event.Payload.assign(payload, payload + field->Length);
+        }
+    }
+
+    (completion ? s_Completions : s_Events).push_back(std::move(event));
+}
+
+static
+VOID
+SimCheckEvents(VOID)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR write[] = {0x20, 0x51, 0x52, 0x53};
+    UCHAR read[3] = {};
+    std::vector<UCHAR> large(5000);
+
+    //
+    // Events only, one per transfer, and larger transfers
+    // split at PBC_EVENT_MAX_PAYLOAD.
+    //
+
+    device = HostSimCreateDevice(SIM_EVENTS_ID, &controller);
+    HostSimSetRegistryULong(device, nullptr, L"TraceBuffers", 0x2);
+    HostSimSetRegistryMultiSz(device, nullptr, L"CachedRegisters", {L"0x002C0020"});
+    HostSimSetRegistryMultiSz(device, nullptr, L"CoalescedTargets", {L"0x2c"});
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+    SIM_CHECK(s_Events.empty());
+
+    HostEventSetSink(SimEventSink);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, write, 1, read, sizeof(read))));
+    SIM_CHECK(s_Events.size() == 2);
+
+    if (s_Events.size() == 2)
+    {
+        SIM_CHECK(s_Events[0].DeviceId == SIM_EVENTS_ID);
+        SIM_CHECK((s_Events[0].Index == 0) && (s_Events[1].Index == 1));
+        SIM_CHECK((s_Events[0].TransactionId != 0) &&
+            (s_Events[0].TransactionId == s_Events[1].TransactionId));
+        SIM_CHECK(s_Events[0].Direction == SpbTransferDirectionToDevice);
+        SIM_CHECK(s_Events[1].Direction == SpbTransferDirectionFromDevice);
+        SIM_CHECK(s_Events[0].Payload == std::vector<UCHAR>(write, write + 1));
+        SIM_CHECK(s_Events[1].Payload == std::vector<UCHAR>(&write[1], &write[4]));
+        SIM_CHECK(NT_SUCCESS(s_Events[1].Status));
+    }
+
+    SIM_CHECK((s_Completions.size() == 1) &&
+        (s_Completions[0].TransactionId == s_Events[0].TransactionId) &&
+        NT_SUCCESS(s_Completions[0].Status));
+
+    //
+    // A write is traced pending when it is sent; its final
+    // status is in the completion event.
+    //
+
+    s_Events.clear();
+    s_Completions.clear();
+
+    controller.FailNext = STATUS_IO_TIMEOUT;
+    SIM_CHECK(HostSimWrite(target, write, sizeof(write)) == STATUS_IO_TIMEOUT);
+    SIM_CHECK((s_Events.size() == 1) && (s_Events[0].Status == STATUS_PENDING));
+    SIM_CHECK((s_Completions.size() == 1) &&
+        (s_Completions[0].TransactionId == s_Events[0].TransactionId) &&
+        (s_Completions[0].Status == STATUS_IO_TIMEOUT) &&
+        s_Completions[0].Payload.empty());
+
+    //
+    // A read served from the register cache and a posted
+    // write are traced like the requests sent to the
+    // controller, with their final status.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, write, 1, read, sizeof(read))));
+
+    s_Events.clear();
+    s_Completions.clear();
+
+    ULONG operations = controller.Operations;
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, write, 1, read, sizeof(read))));
+    SIM_CHECK(controller.Operations == operations);
+    SIM_CHECK((s_Events.size() == 2) && (s_Completions.size() == 1));
+
+    if (s_Events.size() == 2)
+    {
+        SIM_CHECK(NT_SUCCESS(s_Events[0].Status) && NT_SUCCESS(s_Events[1].Status));
+        SIM_CHECK(s_Events[1].Payload == std::vector<UCHAR>(&write[1], &write[4]));
+    }
+
+    s_Events.clear();
+    s_Completions.clear();
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeLockController)));
+
+    s_Events.clear();
+    s_Completions.clear();
+    operations = controller.Operations;
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, 1)));
+    SIM_CHECK(controller.Operations == operations);
+    SIM_CHECK((s_Events.size() == 1) && (s_Completions.size() == 1));
+
+    if (s_Events.size() == 1)
+    {
+        SIM_CHECK(NT_SUCCESS(s_Events[0].Status));
+        SIM_CHECK(s_Events[0].Payload == std::vector<UCHAR>(write, write + 1));
+    }
+
+    SIM_CHECK(NT_SUCCESS(HostSimLock(target, SpbRequestTypeUnlockController)));
+
+    s_Events.clear();
+    s_Completions.clear();
+
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, large.data(), large.size())));
+    SIM_CHECK(s_Events.size() == 2);
+
+    if (s_Events.size() == 2)
+    {
+        SIM_CHECK((s_Events[0].Length == 5000) && (s_Events[1].Length == 5000));
+        SIM_CHECK((s_Events[0].Offset == 0) && (s_Events[1].Offset == 4096));
+        SIM_CHECK(s_Events[0].Payload.size() + s_Events[1].Payload.size() == 5000);
+    }
+
+    HostEventSetSink(nullptr);
+    s_Events.clear();
+    s_Completions.clear();
+
+    HostSimCloseTarget(target);
+    HostSimRemoveDevice(device);
+}
+
+static
+VOID
+SimCheckCapture(VOID)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR write[] = {0x30, 0x61, 0x62};
+    UCHAR read[2] = {};
+    SPBPROBE_CAPTURE_RECORD records[8] = {};
+    ULONG_PTR information = 0;
+
+    device = HostSimCreateDevice(SIM_CAPTURE_ID, &controller);
+    HostSimSetRegistryULong(device, nullptr, L"TraceBuffers", 0x4);
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, write, 1, read, sizeof(read))));
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+        nullptr, 0, records, sizeof(records), &information)));
+    SIM_CHECK(information == 3 * sizeof(SPBPROBE_CAPTURE_RECORD));
+
+    if (information == 3 * sizeof(SPBPROBE_CAPTURE_RECORD))
+    {
+        SIM_CHECK((records[0].Sequence < records[1].Sequence) &&
+            (records[1].Sequence < records[2].Sequence));
+        SIM_CHECK(records[0].PeripheralId == SIM_CAPTURE_ID);
+        SIM_CHECK((records[0].Length == sizeof(write)) &&
+            (memcmp(records[0].Payload, write, sizeof(write)) == 0));
+        SIM_CHECK((records[2].Index == 1) && (records[2].TransferCount == 2));
+        SIM_CHECK(records[2].Direction == SpbTransferDirectionFromDevice);
+        SIM_CHECK(memcmp(records[2].Payload, &write[1], sizeof(read)) == 0);
+
+        //
+        // Writes are taken when sent, reads at the completion.
+        //
+
+        SIM_CHECK((records[1].Flags & SPBPROBE_CAPTURE_FLAG_SUBMIT) != 0);
+        SIM_CHECK((records[2].Flags & SPBPROBE_CAPTURE_FLAG_SUBMIT) == 0);
+        SIM_CHECK(records[1].Timestamp <= records[2].Timestamp);
+
+        //
+        // The records of a request share its transaction.
+        //
+
+        SIM_CHECK((records[0].TransactionId != 0) &&
+            (records[0].TransactionId < records[1].TransactionId));
+        SIM_CHECK(records[1].TransactionId == records[2].TransactionId);
+    }
+
+    //
+    // Read records are gone.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+        nullptr, 0, records, sizeof(records), &information)));
+    SIM_CHECK(information == 0);
+
+    //
+    // The halves of a full duplex transfer come as a pair
+    // with consecutive sequence numbers.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimFullDuplex(target, write, sizeof(write), read, sizeof(read))));
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+        nullptr, 0, records, sizeof(records), &information)));
+    SIM_CHECK(information == 2 * sizeof(SPBPROBE_CAPTURE_RECORD));
+
+    if (information == 2 * sizeof(SPBPROBE_CAPTURE_RECORD))
+    {
+        SIM_CHECK(records[1].Sequence == records[0].Sequence + 1);
+        SIM_CHECK(records[1].TransactionId == records[0].TransactionId);
+        SIM_CHECK((records[0].Flags & records[1].Flags & SPBPROBE_CAPTURE_FLAG_FULL_DUPLEX) != 0);
+        SIM_CHECK(records[0].Direction == SpbTransferDirectionToDevice);
+        SIM_CHECK(records[1].Direction == SpbTransferDirectionFromDevice);
+        SIM_CHECK((records[0].PayloadLength == sizeof(write)) &&
+            (memcmp(records[0].Payload, write, sizeof(write)) == 0));
+        SIM_CHECK(records[1].PayloadLength == sizeof(read));
+        SIM_CHECK(NT_SUCCESS(records[1].Status) && (records[0].Status == records[1].Status));
+    }
+
+    //
+    // Overwriting the oldest records of a full ring (1024
+    // records) keeps the newest ones, and every record is
+    // either read or counted as dropped.
+    //
+
+    SPBPROBE_TIMELINE timeline = {};
+    SPBPROBE_CAPTURE_POLICY_INPUT policy = {};
+    ULONG written = 1536;
+    ULONGLONG total = 0;
+    ULONGLONG last = 0;
+
+    policy.DeviceIndex = 1;
+    policy.Policy.Mode = SpbProbeCaptureModeMax;
+    policy.Policy.SampleRate = 1;
+    policy.Policy.WatermarkPercent = 100;
+
+    SIM_CHECK(HostSimControlIoctl(IOCTL_SPBPROBE_SET_CAPTURE_POLICY,
+        &policy, sizeof(policy), nullptr, 0) == STATUS_INVALID_PARAMETER);
+
+    policy.Policy.Mode = SpbProbeCaptureOverwriteOldest;
+    policy.DeviceIndex = 2;
+
+    SIM_CHECK(HostSimControlIoctl(IOCTL_SPBPROBE_SET_CAPTURE_POLICY,
+        &policy, sizeof(policy), nullptr, 0) == STATUS_NO_MORE_ENTRIES);
+
+    policy.DeviceIndex = 1;
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_QUERY_TIMELINE,
+        &policy.DeviceIndex, sizeof(ULONG), &timeline, sizeof(timeline))));
+    SIM_CHECK(timeline.PeripheralId == SIM_CAPTURE_ID);
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_SET_CAPTURE_POLICY,
+        &policy, sizeof(policy), nullptr, 0)));
+
+    for (ULONG i = 0; i < written; i++)
+    {
+        SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+    }
+
+    do
+    {
+        SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+            nullptr, 0, records, sizeof(records), &information)));
+
+        for (ULONG i = 0; i < information / sizeof(SPBPROBE_CAPTURE_RECORD); i++)
+        {
+            SIM_CHECK(records[i].Sequence > last);
+            last = records[i].Sequence;
+            total += 1 + records[i].Dropped;
+        }
+    }
+    while (information != 0);
+
+    SIM_CHECK(total == written);
+
+    HostSimCloseTarget(target);
+    HostSimRemoveDevice(device);
+}
+
+//
+// Transaction IDs of the triggers of the FlightRecord events
+// received by SimRecordSink.
+//
+
+static std::vector<ULONGLONG> s_RecordTriggers;
+
+static
+VOID
+SimRecordSink(
+    _In_  PCSTR                  Provider,
+    _In_  PCSTR                  Event,
+    _In_  const HOST_TLG_FIELD  *Fields,
+    _In_  ULONG                  FieldCount)
+{
+    if ((strcmp(Provider, "SpbProbe") != 0) || (strcmp(Event, "FlightRecord") != 0))
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < FieldCount; i++)
+    {
+        if (strcmp(Fields[i].Name, "TriggerTransactionId") == 0)
+        {
+            s_RecordTriggers.push_back(Fields[i].Value);
+        }
+    }
+}
+
+static
+VOID
+SimCheckRecorder(VOID)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR write[] = {0x40, 0x71};
+    UCHAR pattern[] = {0x40, 0xEE};
+    SPBPROBE_CAPTURE_RECORD records[8] = {};
+    ULONG_PTR information = 0;
+
+    //
+    // Recorder only, with every third write failing and a
+    // pattern of 0xEE at byte 1.
+    //
+
+    device = HostSimCreateDevice(SIM_RECORDER_ID, &controller);
+    HostSimSetRegistryULong(device, nullptr, L"TraceBuffers", 0);
+    HostSimSetRegistryULong(device, L"FlightRecorder", L"WindowMs", 1000);
+    HostSimSetRegistryULong(device, L"FlightRecorder", L"PatternOffset", 1);
+    HostSimSetRegistryULong(device, L"FlightRecorder", L"PatternMask", 0xFF);
+    HostSimSetRegistryULong(device, L"FlightRecorder", L"PatternValue", 0xEE);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Types", 0x4);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Every", 3);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"FailStatus", (ULONG)STATUS_IO_TIMEOUT);
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    SIM_CHECK(target != nullptr);
+
+    HostEventSetSink(SimRecordSink);
+
+    //
+    // Nothing leaves the recorder until a trigger fires.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+        nullptr, 0, records, sizeof(records), &information)));
+    SIM_CHECK((information == 0) && s_RecordTriggers.empty());
+
+    //
+    // The failure dumps the transfers that led to it.
+    //
+
+    SIM_CHECK(HostSimWrite(target, write, sizeof(write)) == STATUS_IO_TIMEOUT);
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+        nullptr, 0, records, sizeof(records), &information)));
+    SIM_CHECK(information == 3 * sizeof(SPBPROBE_CAPTURE_RECORD));
+
+    if (information == 3 * sizeof(SPBPROBE_CAPTURE_RECORD))
+    {
+        for (ULONG i = 0; i < 3; i++)
+        {
+            SIM_CHECK(records[i].PeripheralId == SIM_RECORDER_ID);
+            SIM_CHECK((records[i].Flags & SPBPROBE_CAPTURE_FLAG_RECORDED) != 0);
+            SIM_CHECK((records[i].Length == sizeof(write)) &&
+                (memcmp(records[i].Payload, write, sizeof(write)) == 0));
+        }
+
+        SIM_CHECK(NT_SUCCESS(records[0].Status) && NT_SUCCESS(records[1].Status));
+        SIM_CHECK(records[2].Status == STATUS_IO_TIMEOUT);
+        SIM_CHECK((records[0].TransactionId < records[1].TransactionId) &&
+            (records[1].TransactionId < records[2].TransactionId));
+        SIM_CHECK(records[0].Timestamp <= records[2].Timestamp);
+
+        SIM_CHECK((s_RecordTriggers.size() == 3) &&
+            (s_RecordTriggers[0] == records[2].TransactionId) &&
+            (s_RecordTriggers[2] == records[2].TransactionId));
+    }
+
+    //
+    // The dump empties the recorder, and a pattern fires the
+    // next one.
+    //
+
+    s_RecordTriggers.clear();
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, write, sizeof(write))));
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, pattern, sizeof(pattern))));
+
+    SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+        nullptr, 0, records, sizeof(records), &information)));
+    SIM_CHECK(information == 2 * sizeof(SPBPROBE_CAPTURE_RECORD));
+
+    if (information == 2 * sizeof(SPBPROBE_CAPTURE_RECORD))
+    {
+        SIM_CHECK(memcmp(records[0].Payload, write, sizeof(write)) == 0);
+        SIM_CHECK(memcmp(records[1].Payload, pattern, sizeof(pattern)) == 0);
+        SIM_CHECK(NT_SUCCESS(records[1].Status));
+        SIM_CHECK(s_RecordTriggers.size() == 2);
+    }
+
+    HostEventSetSink(nullptr);
+    s_RecordTriggers.clear();
+
+    //
+    // Leave the shared capture empty.
+    //
+
+    SIM_CHECK(HostSimWrite(target, write, sizeof(write)) == STATUS_IO_TIMEOUT);
+
+    do
+    {
+        SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+            nullptr, 0, records, sizeof(records), &information)));
+    }
+    while (information != 0);
+
+    HostSimCloseTarget(target);
+    HostSimRemoveDevice(device);
+}
+
+static
+PHOST_SIM_DEVICE
+SimStartModel(
+    _In_   LONGLONG           ConnectionId,
+    _In_   HostDeviceModel   *Model,
+    _Out_  PHOST_SIM_TARGET  *pTarget)
+{
+    PHOST_SIM_DEVICE device = HostSimCreateDevice(ConnectionId, Model);
+
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    *pTarget = HostSimOpenTarget(device, Model->Connection());
+    SIM_CHECK(*pTarget != nullptr);
+
+    return device;
+}
+
+static
+VOID
+SimStopModel(
+    _In_  PHOST_SIM_DEVICE  Device,
+    _In_  PHOST_SIM_TARGET  Target)
+{
+    HostSimCloseTarget(Target);
+    HostSimRemoveDevice(Device);
+}
+
+//
+// Interrupt to read histograms and interrupt counts traced by
+// the devices removed while SimTraceSink is installed.
+//
+
+static ULONG s_InterruptToReadTraces = 0;
+static ULONG s_Interrupts = 0;
+static ULONG s_InterruptReads = 0;
+static ULONG s_UnsignaledReads = 0;
+
+static
+VOID
+SimTraceSink(
+    _In_  ULONG  Level,
+    _In_  ULONG  Flag,
+    _In_  PCSTR  Function,
+    _In_  PCSTR  Message)
+{
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Flag);
+    UNREFERENCED_PARAMETER(Function);
+
+    if (strstr(Message, "interrupt to read count=") != nullptr)
+    {
+        s_InterruptToReadTraces++;
+    }
+
+    if (strstr(Message, "without an interrupt=") != nullptr)
+    {
+        s_Interrupts = SimTraceValue(Message, "interrupts=");
+        s_InterruptReads = SimTraceValue(Message, "reads=");
+        s_UnsignaledReads = SimTraceValue(Message, "without an interrupt=");
+    }
+}
+
+static
+VOID
+SimCheckTouchpad(VOID)
+{
+    HOST_MODEL_SETTINGS settings;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    std::mutex lock;
+    std::condition_variable changed;
+    UCHAR reg[2] = {HOST_HIDI2C_DESCRIPTOR_REGISTER, 0};
+    UCHAR reset[4] = {HOST_HIDI2C_COMMAND_REGISTER, 0, 0, HOST_HIDI2C_OPCODE_RESET};
+    UCHAR descriptor[30] = {};
+    UCHAR report[HOST_HIDI2C_INPUT_LENGTH];
+    std::vector<UCHAR> reportDescriptor;
+    SPBPROBE_CAPTURE_RECORD records[16] = {};
+    ULONG_PTR information = 0;
+    ULONG interrupts = 0;
+    ULONG touches = 0;
+    LONGLONG lastInterrupt = 0;
+    BOOLEAN readAfterInterrupt = FALSE;
+    ULONGLONG start;
+
+    HostModelI2cSettings(&settings, 0x2c, 400000, 50);
+
+    HostHidI2cTouchpad touchpad(settings, 200);
+
+    //
+    // The interrupt line of the touchpad is a resource of the
+    // probe device, whose edges are captured.
+    //
+
+    device = HostSimCreateDevice(SIM_TOUCHPAD_ID, &touchpad);
+    HostSimAddInterrupt(device);
+    HostSimSetRegistryULong(device, nullptr, L"TraceBuffers", 0x4);
+
+    touchpad.SetInterruptHandler([&lock, &changed, device](BOOLEAN Asserted)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (Asserted)
+        {
+            HostSimSignalInterrupt(device);
+        }
+
+        changed.notify_all();
+    });
+
+    SIM_CHECK(NT_SUCCESS(HostSimStartDevice(device)));
+
+    target = HostSimOpenTarget(device, touchpad.Connection());
+    SIM_CHECK(target != nullptr);
+
+    //
+    // Enumeration: HID descriptor, report descriptor, reset.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, reg, sizeof(reg), descriptor, sizeof(descriptor))));
+    SIM_CHECK(descriptor[0] == sizeof(descriptor));
+
+    reportDescriptor.resize(descriptor[4] | (descriptor[5] << 8));
+    reg[0] = descriptor[6];
+    reg[1] = descriptor[7];
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, reg, sizeof(reg),
+        reportDescriptor.data(), reportDescriptor.size())));
+    SIM_CHECK((reportDescriptor[0] == 0x05) && (reportDescriptor.back() == 0xc0));
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, reset, sizeof(reset))));
+    SIM_CHECK(touchpad.IsInterruptAsserted());
+    SIM_CHECK(NT_SUCCESS(HostSimRead(target, report, sizeof(report))));
+    SIM_CHECK((report[0] == 0) && (report[1] == 0) && !touchpad.IsInterruptAsserted());
+
+    //
+    // Input reports, read on interrupt. Each read takes at
+    // least its wire time at 400 kHz plus the latency.
+    //
+
+    touchpad.Touch(100);
+    start = SimNowUs();
+
+    while ((touches < 10) && (SimNowUs() - start < 2000000))
+    {
+        std::unique_lock<std::mutex> guard(lock);
+
+        if (!changed.wait_for(guard, std::chrono::milliseconds(50),
+                [&touchpad]() { return touchpad.IsInterruptAsserted(); }))
+        {
+            continue;
+        }
+
+        guard.unlock();
+
+        ULONGLONG readStart = SimNowUs();
+
+        SIM_CHECK(NT_SUCCESS(HostSimRead(target, report, sizeof(report))));
+        SIM_CHECK(SimNowUs() - readStart >= 50 + 252);
+
+        if ((report[2] == HOST_HIDI2C_REPORT_ID) && (report[3] == 1))
+        {
+            touches++;
+        }
+    }
+
+    SIM_CHECK(touches >= 10);
+
+    //
+    // Every edge is in the capture, before the read serving
+    // it. The capture is drained for the checks that follow.
+    //
+
+    HostSimRunFor(0);
+
+    do
+    {
+        SIM_CHECK(NT_SUCCESS(HostSimControlIoctl(IOCTL_SPBPROBE_READ_CAPTURE,
+            nullptr, 0, records, sizeof(records), &information)));
+
+        for (ULONG i = 0; i < information / sizeof(SPBPROBE_CAPTURE_RECORD); i++)
+        {
+            if (records[i].Flags & SPBPROBE_CAPTURE_FLAG_INTERRUPT)
+            {
+                SIM_CHECK((records[i].TransactionId == 0) && (records[i].Length == 0));
+                SIM_CHECK(records[i].PeripheralId == SIM_TOUCHPAD_ID);
+
+                lastInterrupt = records[i].Timestamp;
+                interrupts++;
+            }
+            else if ((lastInterrupt != 0) &&
+                     (records[i].Direction == SpbTransferDirectionFromDevice))
+            {
+                SIM_CHECK(records[i].Timestamp >= lastInterrupt);
+                readAfterInterrupt = TRUE;
+            }
+        }
+    }
+    while (information != 0);
+
+    SIM_CHECK(interrupts >= touches);
+    SIM_CHECK(readAfterInterrupt);
+
+    //
+    // The removal reports the interrupt to read latency.
+    //
+
+    HostTraceSetSink(SimTraceSink);
+    SimStopModel(device, target);
+    HostTraceSetSink(nullptr);
+
+    SIM_CHECK(s_InterruptToReadTraces == 1);
+
+    //
+    // The reads of the descriptors come before any edge, the
+    // others each follow one.
+    //
+
+    SIM_CHECK(s_Interrupts >= touches);
+    SIM_CHECK(s_InterruptReads >= touches + 3);
+    SIM_CHECK(s_UnsignaledReads == 2);
+}
+
+static
+VOID
+SimCheckEeprom(VOID)
+{
+    HOST_MODEL_SETTINGS settings;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR page[] = {0x00, 0x1c, 1, 2, 3, 4, 5, 6, 7, 8};
+    UCHAR address[2] = {0x00, 0x1c};
+    UCHAR read[4] = {};
+
+    HostModelI2cSettings(&settings, 0x50, 400000);
+
+    //
+    // A 24C32: 4 KB, 32-byte pages.
+    //
+
+    HostEeprom24Cxx eeprom(settings, 4096, 32, 5000);
+
+    device = SimStartModel(SIM_EEPROM_ID, &eeprom, &target);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, page, sizeof(page))));
+
+    //
+    // The device does not answer during the write cycle, and
+    // the write wrapped around the end of the page.
+    //
+
+    SIM_CHECK(HostSimWriteRead(target, address, sizeof(address), read, sizeof(read)) ==
+        STATUS_NO_SUCH_DEVICE);
+
+    HostSimRunFor(6000);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, address, sizeof(address), read, sizeof(read))));
+    SIM_CHECK((read[0] == 1) && (read[3] == 4));
+
+    address[1] = 0x00;
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, address, sizeof(address), read, sizeof(read))));
+    SIM_CHECK((read[0] == 5) && (read[3] == 8));
+    SIM_CHECK((eeprom.WriteCycles == 1) && (eeprom.Nacks == 1));
+
+    SimStopModel(device, target);
+}
+
+static
+VOID
+SimCheckAccelerometer(VOID)
+{
+    HOST_MODEL_SETTINGS settings;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    UCHAR whoAmI[2] = {HOST_ACCEL_SPI_READ | HOST_ACCEL_WHO_AM_I, 0};
+    UCHAR enable[2] = {HOST_ACCEL_CTRL_REG1, 0x77};
+    UCHAR status = HOST_ACCEL_SPI_READ | HOST_ACCEL_STATUS_REG;
+    UCHAR outputs = HOST_ACCEL_SPI_READ | HOST_ACCEL_SPI_AUTO_INCREMENT | HOST_ACCEL_OUT_X_L;
+    UCHAR response[6] = {};
+    SHORT z;
+
+    HostModelSpiSettings(&settings, 0, 4000000);
+
+    HostAccelerometer accelerometer(settings);
+
+    device = SimStartModel(SIM_ACCEL_ID, &accelerometer, &target);
+
+    SIM_CHECK(NT_SUCCESS(HostSimFullDuplex(target, whoAmI, sizeof(whoAmI), response, 2)));
+    SIM_CHECK(response[1] == HOST_ACCEL_WHO_AM_I_VALUE);
+
+    //
+    // 400 Hz: a few samples are ready 10 ms later, and all
+    // but the last one were overwritten.
+    //
+
+    SIM_CHECK(NT_SUCCESS(HostSimWrite(target, enable, sizeof(enable))));
+
+    HostSimRunFor(10000);
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, &status, 1, response, 1)));
+    SIM_CHECK(response[0] == (HOST_ACCEL_STATUS_ZYXDA | HOST_ACCEL_STATUS_ZYXOR));
+
+    SIM_CHECK(NT_SUCCESS(HostSimWriteRead(target, &outputs, 1, response, sizeof(response))));
+    z = (SHORT)(response[4] | (response[5] << 8));
+    SIM_CHECK((z > 12800) && (z < 13400));
+    SIM_CHECK((accelerometer.SamplesRead == 1) && (accelerometer.SamplesMissed != 0));
+
+    SimStopModel(device, target);
+}
+
+static
+VOID
+SimLoop(
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  ULONG             Iterations)
+{
+    UCHAR write[] = {0x40, 1, 2, 3, 4, 5, 6, 7, 8};
+    UCHAR address = 0x40;
+    UCHAR read[8];
+    ULONGLONG start = SimNowUs();
+    ULONGLONG elapsed;
+
+    for (ULONG i = 0; i < Iterations; i++)
+    {
+        HostSimWrite(Target, write, sizeof(write));
+        HostSimRead(Target, read, sizeof(read));
+        HostSimWriteRead(Target, &address, 1, read, sizeof(read));
+    }
+
+    elapsed = SimNowUs() - start;
+
+    printf("%lu iterations, 3 requests each: %.0f ns/request\n",
+        (unsigned long)Iterations,
+        (Iterations != 0) ? (elapsed * 1000.0) / (Iterations * 3.0) : 0.0);
+}
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    SimRegisterFile controller;
+    PHOST_SIM_DEVICE device;
+    PHOST_SIM_TARGET target;
+    PHOST_SIM_TARGET slowTarget;
+    ULONG iterations = 0;
+    NTSTATUS status;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+        {
+            iterations = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else if ((strcmp(argv[i], "-d") == 0) && (i + 1 < argc))
+        {
+            controller.CompletionDelayUs = (ULONG)strtoul(argv[++i], nullptr, 0);
+        }
+        else
+        {
+            fprintf(stderr,
+                "usage: %s [-n iterations] [-d completion delay us]\n"
+                "  SPBPROBE_TRACE_LEVEL and SPBPROBE_TRACE_FLAGS select the traces\n",
+                argv[0]);
+            return 2;
+        }
+    }
+
+    status = HostSimLoadDriver();
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "DriverEntry failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    device = HostSimCreateDevice(SIM_CONNECTION_ID, &controller);
+
+    HostSimSetRegistryMultiSz(device, nullptr, L"CachedRegisters", {L"0x002C0001"});
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Target", SIM_SLOW_ADDRESS);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"Types", 0x8);
+    HostSimSetRegistryULong(device, L"Injection\\0", L"LatencyUs", SIM_LATENCY_US);
+
+    status = HostSimStartDevice(device);
+
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "device start failed: 0x%08x\n", (unsigned)status);
+        return 1;
+    }
+
+    target = HostSimOpenTarget(device, HostSimI2cConnection(SIM_ADDRESS, SIM_SPEED));
+    slowTarget = HostSimOpenTarget(device, HostSimI2cConnection(SIM_SLOW_ADDRESS, SIM_SPEED));
+    SIM_CHECK((target != nullptr) && (slowTarget != nullptr));
+
+    if ((target != nullptr) && (slowTarget != nullptr))
+    {
+        SimCheckTransfers(target, &controller);
+        SimCheckCache(device, target, &controller);
+        SimCheckInjectedLatency(slowTarget, &controller);
+        SimCheckTimeline();
+        SimCheckLockStatistics();
+
+        if (controller.CompletionDelayUs == 0)
+        {
+            SimCheckIdle(device, target);
+        }
+
+        SimCheckTouchpad();
+        SimCheckEeprom();
+        SimCheckAccelerometer();
+        SimCheckEvents();
+        SimCheckCapture();
+        SimCheckRecorder();
+        SimCheckCacheCoalesced();
+        SimCheckCoalesce();
+        SimCheckInjectionReplay();
+        SimCheckDroppedCompletion();
+        SimCheckDeferredOpen();
+        SimCheckBusTime();
+#if defined(SIM_ETL_TOOL) && defined(SIM_ETL_FIXTURE)
+        SimCheckEtl();
+#endif
+
+        SimLoop(target, iterations);
+
+        HostSimCloseTarget(slowTarget);
+        HostSimCloseTarget(target);
+    }
+
+    HostSimRemoveDevice(device);
+    HostSimUnloadDriver();
+
+    printf("%s\n", (s_Failures == 0) ? "PASS" : "FAIL");
+
+    return (s_Failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,987 @@
+/*++
+
+Module Name:
+
+    hostddk.cpp
+
+Abstract:
+
+    This module implements the kernel routines used by the probe
+    on top of the C library: time, pool, interlocked helpers,
+    string formatting with the MSVC and WPP printf dialect, and
+    the power setting notifications.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include "hostinternal.h"
+
+#include <reshub.h>
+
+#include <atomic>
+
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////
+//
+// Assertions and IRQL.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+void
+HostAssertFailed(
+    const char *Expression,
+    const char *Message,
+    const char *File,
+    int Line)
+{
+    fprintf(stderr, "%s:%d: assertion failed: %s%s%s\n",
+        File,
+        Line,
+        Expression,
+        (Message != nullptr) ? " - " : "",
+        (Message != nullptr) ? Message : "");
+
+    abort();
+}
+
+static thread_local KIRQL s_Irql = PASSIVE_LEVEL;
+
+EXTERN_C
+KIRQL
+KeGetCurrentIrql(VOID)
+{
+    return s_Irql;
+}
+
+EXTERN_C
+VOID
+KeRaiseIrql(
+    KIRQL NewIrql,
+    PKIRQL OldIrql)
+{
+    *OldIrql = s_Irql;
+    s_Irql = NewIrql;
+}
+
+EXTERN_C
+VOID
+KeLowerIrql(
+    KIRQL NewIrql)
+{
+    s_Irql = NewIrql;
+}
+
+EXTERN_C
+ULONG
+KeGetCurrentProcessorNumberEx(
+    PPROCESSOR_NUMBER ProcNumber)
+{
+    int cpu = sched_getcpu();
+
+    if (cpu < 0)
+    {
+        cpu = 0;
+    }
+
+    if (ProcNumber != nullptr)
+    {
+        ProcNumber->Group = 0;
+        ProcNumber->Number = (UCHAR)cpu;
+        ProcNumber->Reserved = 0;
+    }
+
+    return (ULONG)cpu;
+}
+
+EXTERN_C
+ULONG
+KeQueryActiveProcessorCountEx(
+    USHORT GroupNumber)
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0) ? (ULONG)count : 1;
+}
+
+/////////////////////////////////////////////////
+//
+// Time.
+//
+/////////////////////////////////////////////////
+
+//
+// The performance counter runs at 10 MHz, as on most Windows
+// systems, so that tick conversions in the probe see the same
+// magnitudes.
+//
+
+#define HOST_PERFORMANCE_FREQUENCY 10000000LL
+
+EXTERN_C
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    PLARGE_INTEGER PerformanceFrequency)
+{
+    struct timespec now;
+    LARGE_INTEGER counter;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    counter.QuadPart = ((LONGLONG)now.tv_sec * HOST_PERFORMANCE_FREQUENCY) +
+        (now.tv_nsec / 100);
+
+    if (PerformanceFrequency != nullptr)
+    {
+        PerformanceFrequency->QuadPart = HOST_PERFORMANCE_FREQUENCY;
+    }
+
+    return counter;
+}
+
+EXTERN_C
+VOID
+KeQuerySystemTimePrecise(
+    PLARGE_INTEGER CurrentTime)
+{
+    //
+    // 100 ns intervals since January 1, 1601.
+    //
+
+    const LONGLONG epochDelta = 116444736000000000LL;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    CurrentTime->QuadPart = epochDelta +
+        ((LONGLONG)now.tv_sec * 10000000) + (now.tv_nsec / 100);
+}
+
+ULONGLONG
+HostNowUs(VOID)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((ULONGLONG)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/////////////////////////////////////////////////
+//
+// Memory.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+SIZE_T
+HostCompareMemory(
+    const void *Source1,
+    const void *Source2,
+    SIZE_T Length)
+{
+    const UCHAR *p1 = (const UCHAR *)Source1;
+    const UCHAR *p2 = (const UCHAR *)Source2;
+    SIZE_T i = 0;
+
+    while ((i < Length) && (p1[i] == p2[i]))
+    {
+        i++;
+    }
+
+    return i;
+}
+
+//
+// Allocations made by the driver, counted with the framework
+// objects it creates for HostSimGetAllocations.
+//
+
+static std::atomic<ULONGLONG> s_PoolAllocations(0);
+static std::atomic<ULONGLONG> s_ObjectCreations(0);
+
+VOID
+HostCountObjectCreation(VOID)
+{
+    s_ObjectCreations.fetch_add(1, std::memory_order_relaxed);
+}
+
+VOID
+HostSimGetAllocations(
+    _Out_  PHOST_SIM_ALLOCATIONS  Allocations)
+{
+    Allocations->PoolAllocations = s_PoolAllocations.load(std::memory_order_relaxed);
+    Allocations->ObjectCreations = s_ObjectCreations.load(std::memory_order_relaxed);
+}
+
+EXTERN_C
+PVOID
+ExAllocatePoolWithTag(
+    POOL_TYPE PoolType,
+    SIZE_T NumberOfBytes,
+    ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+
+    s_PoolAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    return malloc(NumberOfBytes);
+}
+
+EXTERN_C
+PVOID
+ExAllocatePool2(
+    POOL_FLAGS Flags,
+    SIZE_T NumberOfBytes,
+    ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Flags);
+    UNREFERENCED_PARAMETER(Tag);
+
+    s_PoolAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    return calloc(1, NumberOfBytes);
+}
+
+EXTERN_C
+VOID
+ExFreePoolWithTag(
+    PVOID P,
+    ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    free(P);
+}
+
+/////////////////////////////////////////////////
+//
+// Formatting.
+//
+/////////////////////////////////////////////////
+
+static
+PCSTR
+HostStatusName(
+    NTSTATUS Status)
+{
+    switch (Status)
+    {
+#define HOST_STATUS_NAME(s) case s: return #s;
+    HOST_STATUS_NAME(STATUS_SUCCESS)
+    HOST_STATUS_NAME(STATUS_PENDING)
+    HOST_STATUS_NAME(STATUS_MORE_ENTRIES)
+    HOST_STATUS_NAME(STATUS_BUFFER_OVERFLOW)
+    HOST_STATUS_NAME(STATUS_NO_MORE_ENTRIES)
+    HOST_STATUS_NAME(STATUS_DEVICE_BUSY)
+    HOST_STATUS_NAME(STATUS_UNSUCCESSFUL)
+    HOST_STATUS_NAME(STATUS_NOT_IMPLEMENTED)
+    HOST_STATUS_NAME(STATUS_INFO_LENGTH_MISMATCH)
+    HOST_STATUS_NAME(STATUS_INVALID_PARAMETER)
+    HOST_STATUS_NAME(STATUS_NO_SUCH_DEVICE)
+    HOST_STATUS_NAME(STATUS_INVALID_DEVICE_REQUEST)
+    HOST_STATUS_NAME(STATUS_BUFFER_TOO_SMALL)
+    HOST_STATUS_NAME(STATUS_OBJECT_TYPE_MISMATCH)
+    HOST_STATUS_NAME(STATUS_OBJECT_NAME_NOT_FOUND)
+    HOST_STATUS_NAME(STATUS_INSUFFICIENT_RESOURCES)
+    HOST_STATUS_NAME(STATUS_DEVICE_NOT_READY)
+    HOST_STATUS_NAME(STATUS_IO_TIMEOUT)
+    HOST_STATUS_NAME(STATUS_NOT_SUPPORTED)
+    HOST_STATUS_NAME(STATUS_INVALID_DEVICE_STATE)
+    HOST_STATUS_NAME(STATUS_CANCELLED)
+    HOST_STATUS_NAME(STATUS_NOT_FOUND)
+    HOST_STATUS_NAME(STATUS_DEVICE_PROTOCOL_ERROR)
+    HOST_STATUS_NAME(STATUS_DATA_ERROR)
+    HOST_STATUS_NAME(STATUS_INVALID_BUFFER_SIZE)
+#undef HOST_STATUS_NAME
+    default:
+        return nullptr;
+    }
+}
+
+static
+VOID
+HostAppendWide(
+    std::string &Output,
+    const WCHAR *String,
+    size_t Length)
+{
+    for (size_t i = 0; i < Length; i++)
+    {
+        Output += (String[i] < 0x80) ? (char)String[i] : '?';
+    }
+}
+
+VOID
+HostFormatAppend(
+    std::string &Output,
+    PCSTR Function,
+    PCSTR Format,
+    va_list Arguments)
+/*++
+
+  Routine Description:
+
+    This routine formats one message. Each conversion is
+    handed to the C library on its own, with its length
+    modifier translated: ULONG is 32 bits (%lu), %I64 and %I
+    are the MSVC sizes, %ws and %wZ take wide strings, and the
+    WPP extensions %!STATUS! and %!FUNC! are expanded here.
+
+--*/
+{
+    va_list arguments;
+    char buffer[512];
+    PCSTR p = Format;
+
+    va_copy(arguments, Arguments);
+
+    while (*p != '\0')
+    {
+        if (*p != '%')
+        {
+            Output += *p++;
+            continue;
+        }
+
+        PCSTR start = p++;
+
+        if (*p == '%')
+        {
+            Output += '%';
+            p++;
+            continue;
+        }
+
+        //
+        // WPP extensions.
+        //
+
+        if (*p == '!')
+        {
+            PCSTR end = strchr(p + 1, '!');
+
+            if (end == nullptr)
+            {
+                Output += start;
+                break;
+            }
+
+            std::string name(p + 1, end - p - 1);
+            p = end + 1;
+
+            if (name == "FUNC")
+            {
+                Output += (Function != nullptr) ? Function : "?";
+            }
+            else if (name == "STATUS")
+            {
+                NTSTATUS status = va_arg(arguments, int);
+                PCSTR statusName = HostStatusName(status);
+
+                if (statusName != nullptr)
+                {
+                    Output += statusName;
+                }
+                else
+                {
+                    snprintf(buffer, sizeof(buffer), "0x%08x", (unsigned int)status);
+                    Output += buffer;
+                }
+            }
+            else
+            {
+                snprintf(buffer, sizeof(buffer), "0x%x", va_arg(arguments, unsigned int));
+                Output += buffer;
+            }
+
+            continue;
+        }
+
+        //
+        // Flags, width and precision.
+        //
+
+        std::string spec("%");
+        int width = 0;
+        int precision = -1;
+        bool hasWidth = false;
+
+        while ((*p != '\0') && (strchr("-+ #0", *p) != nullptr))
+        {
+            spec += *p++;
+        }
+
+        if (*p == '*')
+        {
+            width = va_arg(arguments, int);
+            hasWidth = true;
+            p++;
+        }
+        else
+        {
+            while ((*p >= '0') && (*p <= '9'))
+            {
+                spec += *p++;
+            }
+        }
+
+        if (hasWidth)
+        {
+            spec += std::to_string(width);
+        }
+
+        if (*p == '.')
+        {
+            p++;
+
+            if (*p == '*')
+            {
+                precision = va_arg(arguments, int);
+                p++;
+            }
+            else
+            {
+                precision = 0;
+
+                while ((*p >= '0') && (*p <= '9'))
+                {
+                    precision = (precision * 10) + (*p++ - '0');
+                }
+            }
+
+            spec += "." + std::to_string(precision);
+        }
+
+        //
+        // Length modifiers, normalized to 32 bits (none),
+        // 64 bits (ll), pointer size (z), short (h), wide (w).
+        //
+
+        enum { Int32, Int64, IntPtr, Short, Char } size = Int32;
+        bool wide = false;
+
+        for (;;)
+        {
+            if (strncmp(p, "I64", 3) == 0)
+            {
+                size = Int64;
+                p += 3;
+            }
+            else if (strncmp(p, "I32", 3) == 0)
+            {
+                size = Int32;
+                p += 3;
+            }
+            else if (strncmp(p, "ll", 2) == 0)
+            {
+                size = Int64;
+                p += 2;
+            }
+            else if (strncmp(p, "hh", 2) == 0)
+            {
+                size = Char;
+                p += 2;
+            }
+            else if ((*p == 'I') || (*p == 'z') || (*p == 'j') || (*p == 't'))
+            {
+                size = IntPtr;
+                p++;
+            }
+            else if (*p == 'l')
+            {
+                wide = true;
+                p++;
+            }
+            else if (*p == 'h')
+            {
+                size = Short;
+                p++;
+            }
+            else if (*p == 'w')
+            {
+                wide = true;
+                p++;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        char conversion = *p;
+
+        if (conversion == '\0')
+        {
+            break;
+        }
+
+        p++;
+
+        switch (conversion)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        {
+            bool isSigned = (conversion == 'd') || (conversion == 'i');
+
+            if ((size == Int64) || (size == IntPtr))
+            {
+                spec += "ll";
+                spec += conversion;
+
+                if (isSigned)
+                {
+                    long long value = (size == Int64) ?
+                        va_arg(arguments, long long) :
+                        (long long)va_arg(arguments, intptr_t);
+                    snprintf(buffer, sizeof(buffer), spec.c_str(), value);
+                }
+                else
+                {
+                    unsigned long long value = (size == Int64) ?
+                        va_arg(arguments, unsigned long long) :
+                        (unsigned long long)va_arg(arguments, uintptr_t);
+                    snprintf(buffer, sizeof(buffer), spec.c_str(), value);
+                }
+            }
+            else
+            {
+                if (size == Short)
+                {
+                    spec += "h";
+                }
+                else if (size == Char)
+                {
+                    spec += "hh";
+                }
+
+                spec += conversion;
+
+                //
+                // ULONG is passed as 32 bits, including with %l.
+                //
+
+                if (isSigned)
+                {
+                    snprintf(buffer, sizeof(buffer), spec.c_str(), va_arg(arguments, int));
+                }
+                else
+                {
+                    snprintf(buffer, sizeof(buffer), spec.c_str(), va_arg(arguments, unsigned int));
+                }
+            }
+
+            Output += buffer;
+            break;
+        }
+
+        case 'c':
+        case 'C':
+        {
+            int value = va_arg(arguments, int);
+
+            if (wide || (conversion == 'C'))
+            {
+                value = (value < 0x80) ? value : '?';
+            }
+
+            spec += 'c';
+            snprintf(buffer, sizeof(buffer), spec.c_str(), value);
+            Output += buffer;
+            break;
+        }
+
+        case 's':
+        case 'S':
+        {
+            std::string string;
+
+            if (wide || (conversion == 'S'))
+            {
+                const WCHAR *value = va_arg(arguments, const WCHAR *);
+
+                if (value == nullptr)
+                {
+                    string = "(null)";
+                }
+                else
+                {
+                    HostAppendWide(string, value, wcslen(value));
+                }
+            }
+            else
+            {
+                const char *value = va_arg(arguments, const char *);
+                string = (value != nullptr) ? value : "(null)";
+            }
+
+            spec += 's';
+            snprintf(buffer, sizeof(buffer), spec.c_str(), string.c_str());
+            Output += buffer;
+            break;
+        }
+
+        case 'Z':
+        {
+            PCUNICODE_STRING value = va_arg(arguments, PCUNICODE_STRING);
+
+            if ((value == nullptr) || (value->Buffer == nullptr))
+            {
+                Output += "(null)";
+            }
+            else
+            {
+                HostAppendWide(Output, value->Buffer, value->Length / sizeof(WCHAR));
+            }
+
+            break;
+        }
+
+        case 'p':
+            spec += 'p';
+            snprintf(buffer, sizeof(buffer), spec.c_str(), va_arg(arguments, void *));
+            Output += buffer;
+            break;
+
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+            spec += conversion;
+            snprintf(buffer, sizeof(buffer), spec.c_str(), va_arg(arguments, double));
+            Output += buffer;
+            break;
+
+        default:
+            Output.append(start, p - start);
+            break;
+        }
+    }
+
+    va_end(arguments);
+}
+
+EXTERN_C
+int
+HostFormatV(
+    char *Buffer,
+    size_t BufferSize,
+    const char *Format,
+    va_list Args)
+{
+    std::string output;
+
+    if (BufferSize == 0)
+    {
+        return -1;
+    }
+
+    HostFormatAppend(output, nullptr, Format, Args);
+
+    size_t length = std::min(output.size(), BufferSize - 1);
+
+    memcpy(Buffer, output.data(), length);
+    Buffer[length] = '\0';
+
+    return (int)length;
+}
+
+EXTERN_C
+int
+HostFormat(
+    char *Buffer,
+    size_t BufferSize,
+    const char *Format,
+    ...)
+{
+    va_list args;
+    int length;
+
+    va_start(args, Format);
+    length = HostFormatV(Buffer, BufferSize, Format, args);
+    va_end(args);
+
+    return length;
+}
+
+EXTERN_C
+NTSTATUS
+RtlStringCbPrintfA(
+    PSTR Dest,
+    size_t cbDest,
+    PCSTR Format,
+    ...)
+{
+    std::string output;
+    va_list args;
+
+    if (cbDest == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    va_start(args, Format);
+    HostFormatAppend(output, nullptr, Format, args);
+    va_end(args);
+
+    size_t length = std::min(output.size(), cbDest - 1);
+
+    memcpy(Dest, output.data(), length);
+    Dest[length] = '\0';
+
+    return (length < output.size()) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+RtlUnicodeStringPrintf(
+    PUNICODE_STRING Dest,
+    PCWSTR Format,
+    ...)
+{
+    std::string format;
+    std::string output;
+    va_list args;
+
+    HostAppendWide(format, Format, wcslen(Format));
+
+    va_start(args, Format);
+    HostFormatAppend(output, nullptr, format.c_str(), args);
+    va_end(args);
+
+    size_t capacity = Dest->MaximumLength / sizeof(WCHAR);
+    size_t length = std::min(output.size(), capacity);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        Dest->Buffer[i] = (WCHAR)(UCHAR)output[i];
+    }
+
+    Dest->Length = (USHORT)(length * sizeof(WCHAR));
+
+    return (length < output.size()) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+RtlUnicodeStringToInteger(
+    PCUNICODE_STRING String,
+    ULONG Base,
+    PULONG Value)
+/*++
+
+  Routine Description:
+
+    This routine parses a number as the kernel does: a base of
+    0 takes 0x, 0o and 0b prefixes, and parsing stops at the
+    first character that is not a digit of the base.
+
+--*/
+{
+    size_t length = String->Length / sizeof(WCHAR);
+    const WCHAR *p = String->Buffer;
+    const WCHAR *end = p + length;
+    bool negative = false;
+    ULONG value = 0;
+
+    while ((p < end) && (*p <= L' '))
+    {
+        p++;
+    }
+
+    if ((p < end) && ((*p == L'+') || (*p == L'-')))
+    {
+        negative = (*p == L'-');
+        p++;
+    }
+
+    if (Base == 0)
+    {
+        Base = 10;
+
+        if (((end - p) >= 2) && (p[0] == L'0'))
+        {
+            switch (p[1])
+            {
+            case L'x': case L'X': Base = 16; p += 2; break;
+            case L'o': case L'O': Base = 8; p += 2; break;
+            case L'b': case L'B': Base = 2; p += 2; break;
+            default: break;
+            }
+        }
+    }
+    else if ((Base != 2) && (Base != 8) && (Base != 10) && (Base != 16))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (; p < end; p++)
+    {
+        ULONG digit;
+
+        if ((*p >= L'0') && (*p <= L'9'))
+        {
+            digit = *p - L'0';
+        }
+        else if ((*p >= L'a') && (*p <= L'f'))
+        {
+            digit = *p - L'a' + 10;
+        }
+        else if ((*p >= L'A') && (*p <= L'F'))
+        {
+            digit = *p - L'A' + 10;
+        }
+        else
+        {
+            break;
+        }
+
+        if (digit >= Base)
+        {
+            break;
+        }
+
+        value = (value * Base) + digit;
+    }
+
+    *Value = negative ? (ULONG)(-(LONG)value) : value;
+
+    return STATUS_SUCCESS;
+}
+
+/////////////////////////////////////////////////
+//
+// Resource hub.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+NTSTATUS
+HostResourceHubCreatePath(
+    PUNICODE_STRING DevicePath,
+    ULONG IdLowPart,
+    LONG IdHighPart)
+{
+    return RtlUnicodeStringPrintf(
+        DevicePath,
+        L"%ws\\%0*I64x",
+        RESOURCE_HUB_DEVICE_NAME,
+        (unsigned int)(sizeof(LARGE_INTEGER) * 2),
+        ((ULONGLONG)(ULONG)IdHighPart << 32) | IdLowPart);
+}
+
+/////////////////////////////////////////////////
+//
+// Power settings.
+//
+/////////////////////////////////////////////////
+
+typedef struct _HOST_POWER_SETTING_CALLBACK
+{
+    GUID                        SettingGuid;
+    PPOWER_SETTING_CALLBACK     Callback;
+    PVOID                       Context;
+}
+HOST_POWER_SETTING_CALLBACK, *PHOST_POWER_SETTING_CALLBACK;
+
+static std::vector<PHOST_POWER_SETTING_CALLBACK> s_PowerSettingCallbacks;
+static ULONG s_MonitorPowerOn = 1;
+
+POWER_ACTION g_HostSystemPowerAction = PowerActionNone;
+
+EXTERN_C
+NTSTATUS
+PoRegisterPowerSettingCallback(
+    PDEVICE_OBJECT DeviceObject,
+    LPCGUID SettingGuid,
+    PPOWER_SETTING_CALLBACK Callback,
+    PVOID Context,
+    PVOID *Handle)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    HOST_LOCK lock(HostFrameworkLock());
+    PHOST_POWER_SETTING_CALLBACK pRegistration =
+        new HOST_POWER_SETTING_CALLBACK{ *SettingGuid, Callback, Context };
+
+    s_PowerSettingCallbacks.push_back(pRegistration);
+    *Handle = pRegistration;
+
+    //
+    // The current value is delivered right away.
+    //
+
+    if (IsEqualGUID(*SettingGuid, GUID_MONITOR_POWER_ON))
+    {
+        ULONG value = s_MonitorPowerOn;
+        Callback(SettingGuid, &value, sizeof(value), Context);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+PoUnregisterPowerSettingCallback(
+    PVOID Handle)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    for (auto it = s_PowerSettingCallbacks.begin();
+         it != s_PowerSettingCallbacks.end();
+         ++it)
+    {
+        if (*it == Handle)
+        {
+            delete *it;
+            s_PowerSettingCallbacks.erase(it);
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_INVALID_PARAMETER;
+}
+
+VOID
+HostPowerSettingNotify(
+    LPCGUID SettingGuid,
+    ULONG Value)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    if (IsEqualGUID(*SettingGuid, GUID_MONITOR_POWER_ON))
+    {
+        s_MonitorPowerOn = Value;
+    }
+
+    std::vector<PHOST_POWER_SETTING_CALLBACK> callbacks(s_PowerSettingCallbacks);
+
+    for (PHOST_POWER_SETTING_CALLBACK pRegistration : callbacks)
+    {
+        if (IsEqualGUID(pRegistration->SettingGuid, *SettingGuid))
+        {
+            pRegistration->Callback(
+                SettingGuid,
+                &Value,
+                sizeof(Value),
+                pRegistration->Context);
+        }
+    }
+}
@@ -0,0 +1,458 @@
+/*++
+
+Module Name:
+
+    hostinternal.h
+
+Abstract:
+
+    This module contains the object model shared by the host
+    runtime: the framework objects behind the WDF handles, the
+    in-memory registry, the dispatcher thread running timers,
+    work items and delayed completions, and the framework lock.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#ifndef _HOSTINTERNAL_H_
+#define _HOSTINTERNAL_H_
+
+#include "hostsim.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/////////////////////////////////////////////////
+//
+// Framework lock and dispatcher.
+//
+/////////////////////////////////////////////////
+
+std::recursive_mutex &
+HostFrameworkLock(VOID);
+
+typedef std::unique_lock<std::recursive_mutex> HOST_LOCK;
+
+//
+// Runs Routine with the framework lock held on the dispatcher
+// thread, DelayUs from now. Returns an ID for HostCancelEvent.
+//
+
+ULONGLONG
+HostScheduleEvent(
+    _In_  ULONGLONG              DelayUs,
+    _In_  std::function<VOID()>  Routine);
+
+BOOLEAN
+HostCancelEvent(
+    _In_  ULONGLONG  EventId);
+
+VOID
+HostDispatcherStop(VOID);
+
+ULONGLONG
+HostNowUs(VOID);
+
+//
+// Counts a framework object created by the driver, see
+// HostSimGetAllocations.
+//
+
+VOID
+HostCountObjectCreation(VOID);
+
+//
+// Formats with the MSVC and WPP printf dialect, see
+// hostddk.cpp. Function replaces %!FUNC!.
+//
+
+VOID
+HostFormatAppend(
+    _Inout_   std::string  &Output,
+    _In_opt_  PCSTR         Function,
+    _In_      PCSTR         Format,
+    _In_      va_list       Arguments);
+
+/////////////////////////////////////////////////
+//
+// Objects.
+//
+/////////////////////////////////////////////////
+
+typedef enum _HOST_OBJECT_TYPE
+{
+    HostObjectTypeGeneric = 0,
+    HostObjectTypeDriver,
+    HostObjectTypeDevice,
+    HostObjectTypeQueue,
+    HostObjectTypeRequest,
+    HostObjectTypeMemory,
+    HostObjectTypeIoTarget,
+    HostObjectTypeTimer,
+    HostObjectTypeWorkItem,
+    HostObjectTypeWaitLock,
+    HostObjectTypeSpinLock,
+    HostObjectTypeCollection,
+    HostObjectTypeKey,
+    HostObjectTypeSpbTarget,
+    HostObjectTypeInterrupt
+}
+HOST_OBJECT_TYPE;
+
+struct HOST_OBJECT
+{
+    HOST_OBJECT(
+        _In_  HOST_OBJECT_TYPE  ObjectType
+        ) : Type(ObjectType)
+    {
+    }
+
+    virtual
+    ~HOST_OBJECT(
+        );
+
+    HOST_OBJECT_TYPE                Type;
+    HOST_OBJECT                    *Parent = nullptr;
+    std::vector<HOST_OBJECT *>      Children;
+    PFN_WDF_OBJECT_CONTEXT_CLEANUP  EvtCleanupCallback = nullptr;
+    PFN_WDF_OBJECT_CONTEXT_DESTROY  EvtDestroyCallback = nullptr;
+    PCWDF_OBJECT_CONTEXT_TYPE_INFO  ContextTypeInfo = nullptr;
+    PVOID                           Context = nullptr;
+    LONG                            References = 0;
+    BOOLEAN                         Deleted = FALSE;
+};
+
+//
+// Allocates the context and links the object to its parent,
+// Attributes->ParentObject or DefaultParent.
+//
+
+NTSTATUS
+HostObjectInitialize(
+    _In_      HOST_OBJECT             *Object,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES   Attributes,
+    _In_opt_  HOST_OBJECT             *DefaultParent);
+
+VOID
+HostObjectDelete(
+    _In_  HOST_OBJECT  *Object);
+
+template <typename T>
+inline T *
+HostObjectCast(
+    _In_  WDFOBJECT         Handle,
+    _In_  HOST_OBJECT_TYPE  ObjectType)
+{
+    NT_ASSERT((Handle != nullptr) && (Handle->Type == ObjectType));
+
+    return static_cast<T *>(Handle);
+}
+
+/////////////////////////////////////////////////
+//
+// Registry.
+//
+/////////////////////////////////////////////////
+
+struct HOST_REGISTRY_VALUE
+{
+    ULONG                           Type = REG_NONE;
+    std::vector<UCHAR>              Data;
+};
+
+struct HOST_REGISTRY_NODE
+{
+    std::map<std::wstring, HOST_REGISTRY_VALUE>                  Values;
+    std::map<std::wstring, std::unique_ptr<HOST_REGISTRY_NODE>>  SubKeys;
+
+    HOST_REGISTRY_NODE *
+    Open(
+        _In_opt_  PCWSTR  Path,
+        _In_      BOOLEAN Create);
+};
+
+struct HOST_KEY : HOST_OBJECT
+{
+    HOST_KEY() : HOST_OBJECT(HostObjectTypeKey) {}
+
+    HOST_REGISTRY_NODE             *Node = nullptr;
+};
+
+/////////////////////////////////////////////////
+//
+// Driver, devices and queues.
+//
+/////////////////////////////////////////////////
+
+struct HOST_DRIVER : HOST_OBJECT
+{
+    HOST_DRIVER() : HOST_OBJECT(HostObjectTypeDriver) {}
+
+    WDF_DRIVER_CONFIG               Config;
+    HOST_REGISTRY_NODE              Parameters;
+};
+
+HOST_DRIVER *
+HostGetDriver(VOID);
+
+//
+// Calls EvtDriverUnload and deletes the driver object.
+//
+
+VOID
+HostDriverDelete(VOID);
+
+struct HOST_DEVICE;
+struct HOST_REQUEST;
+struct HOST_SPB_TARGET_OBJECT;
+
+struct _DRIVER_OBJECT
+{
+    ULONG                           Reserved;
+};
+
+struct _DEVICE_OBJECT
+{
+    HOST_DEVICE                    *Device;
+};
+
+struct HOST_DEVICE_INIT
+{
+    WDF_PNPPOWER_EVENT_CALLBACKS    PnpPowerCallbacks;
+    BOOLEAN                         Control = FALSE;
+    BOOLEAN                         SpbConfigured = FALSE;
+    std::wstring                    Name;
+    HOST_SIM_DEVICE                *SimDevice = nullptr;
+};
+
+struct HOST_QUEUE : HOST_OBJECT
+{
+    HOST_QUEUE() : HOST_OBJECT(HostObjectTypeQueue) {}
+
+    WDF_IO_QUEUE_CONFIG             Config;
+};
+
+struct HOST_DEVICE : HOST_OBJECT
+{
+    HOST_DEVICE() : HOST_OBJECT(HostObjectTypeDevice) {}
+
+    ~HOST_DEVICE(
+        ) override;
+
+    WDF_PNPPOWER_EVENT_CALLBACKS    PnpPowerCallbacks;
+    BOOLEAN                         Control = FALSE;
+    std::wstring                    Name;
+    std::wstring                    SymbolicLink;
+    HOST_QUEUE                     *DefaultQueue = nullptr;
+    HOST_SIM_DEVICE                *SimDevice = nullptr;
+    DEVICE_OBJECT                  *WdmDevice = nullptr;
+
+    // SPBCx controller.
+    BOOLEAN                         SpbInitialized = FALSE;
+    SPB_CONTROLLER_CONFIG           SpbConfig;
+    PFN_SPB_CONTROLLER_OTHER        EvtSpbIoOther = nullptr;
+    PFN_WDF_IO_IN_CALLER_CONTEXT    EvtIoInCallerContext = nullptr;
+    WDF_OBJECT_ATTRIBUTES           TargetAttributes;
+    WDF_OBJECT_ATTRIBUTES           RequestAttributes;
+
+    // Power.
+    WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS IdleSettings;
+    BOOLEAN                         InD0 = FALSE;
+    BOOLEAN                         IdleEnabled = FALSE;
+    ULONG                           PowerReferences = 0;
+    ULONGLONG                       IdleEventId = 0;
+
+    // Sequential queue of the SPBCx controller, and the target
+    // holding the controller lock.
+    std::deque<HOST_REQUEST *>      Pending;
+    HOST_REQUEST                   *Presented = nullptr;
+    BOOLEAN                         Dispatching = FALSE;
+    HOST_SPB_TARGET_OBJECT         *LockOwner = nullptr;
+};
+
+//
+// Presents the next pending request when the queue is idle,
+// resuming the device first if needed.
+//
+
+VOID
+HostDeviceDispatch(
+    _In_  HOST_DEVICE  *Device);
+
+VOID
+HostDeviceScheduleIdle(
+    _In_  HOST_DEVICE  *Device);
+
+//
+// Runs the ISRs of the interrupts created on the device, and
+// queues the DPCs they ask for. Nothing while out of D0, when
+// the interrupts are disconnected.
+//
+
+VOID
+HostDeviceSignalInterrupts(
+    _In_  HOST_DEVICE  *Device);
+
+NTSTATUS
+HostDeviceSetPower(
+    _In_  HOST_DEVICE  *Device,
+    _In_  BOOLEAN       D0);
+
+/////////////////////////////////////////////////
+//
+// Memory and requests.
+//
+/////////////////////////////////////////////////
+
+struct HOST_MEMORY : HOST_OBJECT
+{
+    HOST_MEMORY() : HOST_OBJECT(HostObjectTypeMemory) {}
+
+    ~HOST_MEMORY(
+        ) override;
+
+    PVOID                           Buffer = nullptr;
+    size_t                          Size = 0;
+    BOOLEAN                         Owned = FALSE;
+};
+
+HOST_MEMORY *
+HostMemoryCreate(
+    _In_opt_  HOST_OBJECT  *Parent,
+    _In_      PVOID         Buffer,
+    _In_      size_t        Size,
+    _In_      BOOLEAN       Copy);
+
+struct HOST_IO_TARGET;
+
+struct HOST_REQUEST : HOST_OBJECT
+{
+    HOST_REQUEST() : HOST_OBJECT(HostObjectTypeRequest) {}
+
+    ~HOST_REQUEST(
+        ) override;
+
+    //
+    // Client side: a request received by the SPBCx queue.
+    //
+
+    BOOLEAN                         Client = FALSE;
+    HOST_DEVICE                    *Device = nullptr;
+    HOST_SPB_TARGET_OBJECT         *Target = nullptr;
+    WDF_REQUEST_PARAMETERS          Parameters;
+    SPB_REQUEST_TYPE                SpbType = SpbRequestTypeUndefined;
+    std::vector<HOST_SPB_TRANSFER>  Transfers;
+    std::vector<MDL>                Mdls;
+    std::vector<UCHAR>              TransferList;
+    BOOLEAN                         TransferListCaptured = FALSE;
+    HOST_MEMORY                    *InputMemory = nullptr;
+    HOST_MEMORY                    *OutputMemory = nullptr;
+    PFN_WDF_REQUEST_CANCEL          EvtCancel = nullptr;
+    BOOLEAN                         Cancelled = FALSE;
+    BOOLEAN                         CancelRoutineCalled = FALSE;
+    BOOLEAN                         Completed = FALSE;
+    NTSTATUS                        Status = STATUS_SUCCESS;
+    ULONG_PTR                       Information = 0;
+    std::condition_variable_any     CompletedEvent;
+
+    //
+    // Sent side: a request formatted for an I/O target.
+    //
+
+    HOST_IO_TARGET                 *FormattedTarget = nullptr;
+    HOST_SPB_OPERATION              Operation;
+    std::vector<UCHAR>              FormattedInput;
+    std::vector<std::vector<UCHAR>> Bounce;
+    std::vector<PMDL>               BounceMdls;
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionRoutine = nullptr;
+    WDFCONTEXT                      CompletionContext = nullptr;
+    BOOLEAN                         Sent = FALSE;
+    ULONGLONG                       CompletionEventId = 0;
+};
+
+VOID
+HostRequestComplete(
+    _In_  HOST_REQUEST  *Request,
+    _In_  NTSTATUS       Status,
+    _In_  ULONG_PTR      Information);
+
+/////////////////////////////////////////////////
+//
+// I/O targets and SPB targets.
+//
+/////////////////////////////////////////////////
+
+struct HOST_IO_TARGET : HOST_OBJECT
+{
+    HOST_IO_TARGET() : HOST_OBJECT(HostObjectTypeIoTarget) {}
+
+    HOST_DEVICE                    *Device = nullptr;
+    BOOLEAN                         Opened = FALSE;
+    BOOLEAN                         Started = FALSE;
+    HostSpbController              *Controller = nullptr;
+};
+
+HostSpbController *
+HostFindController(
+    _In_  LONGLONG  ConnectionId);
+
+struct HOST_SPB_TARGET_OBJECT : HOST_OBJECT
+{
+    HOST_SPB_TARGET_OBJECT() : HOST_OBJECT(HostObjectTypeSpbTarget) {}
+
+    HOST_DEVICE                    *Device = nullptr;
+    std::vector<UCHAR>              ConnectionProperties;
+    std::wstring                    ConnectionTag;
+};
+
+/////////////////////////////////////////////////
+//
+// Harness objects.
+//
+/////////////////////////////////////////////////
+
+struct HOST_SIM_DEVICE
+{
+    LONGLONG                        ConnectionId = 0;
+    HostSpbController              *Controller = nullptr;
+    HOST_REGISTRY_NODE              Registry;
+    HOST_DEVICE                    *Device = nullptr;
+    std::vector<CM_PARTIAL_RESOURCE_DESCRIPTOR> Resources;
+    BOOLEAN                         IdleEnabled = FALSE;
+};
+
+struct HOST_SIM_TARGET
+{
+    HOST_SIM_DEVICE                *SimDevice = nullptr;
+    HOST_SPB_TARGET_OBJECT         *Target = nullptr;
+};
+
+struct HOST_SIM_REQUEST
+{
+    HOST_REQUEST                   *Request = nullptr;
+};
+
+//
+// Power setting callbacks registered by the driver.
+//
+
+VOID
+HostPowerSettingNotify(
+    _In_  LPCGUID  SettingGuid,
+    _In_  ULONG    Value);
+
+extern POWER_ACTION g_HostSystemPowerAction;
+
+std::vector<HOST_SIM_DEVICE *> &
+HostSimDevices(VOID);
+
+#endif // _HOSTINTERNAL_H_
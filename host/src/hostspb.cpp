@@ -0,0 +1,1166 @@
+/*++
+
+Module Name:
+
+    hostspb.cpp
+
+Abstract:
+
+    This module implements the SPBCx interface on top of the
+    host framework, and the harness driving it: simulated
+    devices and their resources, targets opened with a
+    connection descriptor and client requests presented to the
+    controller callbacks of the probe.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include "hostinternal.h"
+
+#include <reshub.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <thread>
+
+EXTERN_C DRIVER_INITIALIZE DriverEntry;
+
+/////////////////////////////////////////////////
+//
+// SPBCx.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+NTSTATUS
+SpbDeviceInitConfig(
+    PWDFDEVICE_INIT DeviceInit)
+{
+    DeviceInit->SpbConfigured = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+SpbDeviceInitialize(
+    WDFDEVICE               FxDevice,
+    PSPB_CONTROLLER_CONFIG  Config)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(FxDevice, HostObjectTypeDevice);
+
+    if ((Config->EvtSpbTargetConnect == nullptr) ||
+        (Config->EvtSpbIoRead == nullptr) ||
+        (Config->EvtSpbIoWrite == nullptr) ||
+        (Config->EvtSpbIoSequence == nullptr))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    device->SpbConfig = *Config;
+    device->SpbInitialized = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+SpbControllerSetIoOtherCallback(
+    WDFDEVICE                       FxDevice,
+    PFN_SPB_CONTROLLER_OTHER        EvtSpbIoOther,
+    PFN_WDF_IO_IN_CALLER_CONTEXT    EvtIoInCallerContext)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(FxDevice, HostObjectTypeDevice);
+
+    device->EvtSpbIoOther = EvtSpbIoOther;
+    device->EvtIoInCallerContext = EvtIoInCallerContext;
+}
+
+EXTERN_C
+VOID
+SpbControllerSetTargetAttributes(
+    WDFDEVICE               FxDevice,
+    PWDF_OBJECT_ATTRIBUTES  TargetAttributes)
+{
+    HostObjectCast<HOST_DEVICE>(FxDevice, HostObjectTypeDevice)->TargetAttributes =
+        *TargetAttributes;
+}
+
+EXTERN_C
+VOID
+SpbControllerSetRequestAttributes(
+    WDFDEVICE               FxDevice,
+    PWDF_OBJECT_ATTRIBUTES  RequestAttributes)
+{
+    HostObjectCast<HOST_DEVICE>(FxDevice, HostObjectTypeDevice)->RequestAttributes =
+        *RequestAttributes;
+}
+
+EXTERN_C
+VOID
+SpbTargetGetConnectionParameters(
+    SPBTARGET                   SpbTarget,
+    PSPB_CONNECTION_PARAMETERS  ConnectionParameters)
+{
+    HOST_SPB_TARGET_OBJECT *target =
+        HostObjectCast<HOST_SPB_TARGET_OBJECT>(SpbTarget, HostObjectTypeSpbTarget);
+
+    ConnectionParameters->ConnectionTag = target->ConnectionTag.c_str();
+    ConnectionParameters->ConnectionParameters = target->ConnectionProperties.data();
+}
+
+EXTERN_C
+SPBTARGET
+SpbRequestGetTarget(
+    SPBREQUEST SpbRequest)
+{
+    return HostObjectCast<HOST_REQUEST>(SpbRequest, HostObjectTypeRequest)->Target;
+}
+
+//
+// The transfers visible to the controller. Custom IOCTLs only
+// expose theirs once the transfer list was captured.
+//
+
+static
+ULONG
+HostRequestTransferCount(
+    _In_  HOST_REQUEST  *Request)
+{
+    if ((Request->SpbType == SpbRequestTypeOther) && !Request->TransferListCaptured)
+    {
+        return 0;
+    }
+
+    return (ULONG)Request->Transfers.size();
+}
+
+EXTERN_C
+VOID
+SpbRequestGetParameters(
+    SPBREQUEST              SpbRequest,
+    PSPB_REQUEST_PARAMETERS Parameters)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(SpbRequest, HostObjectTypeRequest);
+    ULONG count = HostRequestTransferCount(request);
+
+    Parameters->Position = SpbRequestSequencePositionSingle;
+    Parameters->Type = request->SpbType;
+    Parameters->SequenceTransferCount = count;
+    Parameters->Length = 0;
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        Parameters->Length += request->Transfers[i].Length;
+    }
+}
+
+EXTERN_C
+VOID
+SpbRequestGetTransferParameters(
+    SPBREQUEST                  SpbRequest,
+    ULONG                       Index,
+    PSPB_TRANSFER_DESCRIPTOR    TransferDescriptor,
+    PMDL                       *TransferBuffer)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(SpbRequest, HostObjectTypeRequest);
+
+    NT_ASSERT(Index < HostRequestTransferCount(request));
+
+    if (TransferDescriptor != nullptr)
+    {
+        TransferDescriptor->Direction = request->Transfers[Index].Direction;
+        TransferDescriptor->TransferLength = request->Transfers[Index].Length;
+        TransferDescriptor->DelayInUs = request->Transfers[Index].DelayInUs;
+    }
+
+    if (TransferBuffer != nullptr)
+    {
+        *TransferBuffer = &request->Mdls[Index];
+    }
+}
+
+EXTERN_C
+NTSTATUS
+SpbRequestCaptureIoOtherTransferList(
+    SPBREQUEST SpbRequest)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(SpbRequest, HostObjectTypeRequest);
+
+    if ((request->SpbType != SpbRequestTypeOther) || request->Transfers.empty())
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    request->TransferListCaptured = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+SpbRequestComplete(
+    SPBREQUEST  SpbRequest,
+    NTSTATUS    CompletionStatus)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(SpbRequest, HostObjectTypeRequest);
+
+    HostRequestComplete(request, CompletionStatus, request->Information);
+}
+
+/////////////////////////////////////////////////
+//
+// Connection descriptors.
+//
+/////////////////////////////////////////////////
+
+#include "pshpack1.h"
+
+typedef struct _HOST_I2C_DESCRIPTOR {
+    PNP_SERIAL_BUS_DESCRIPTOR SerialBusDescriptor;
+    ULONG ConnectionSpeed;
+    USHORT SlaveAddress;
+} HOST_I2C_DESCRIPTOR;
+
+typedef struct _HOST_SPI_DESCRIPTOR {
+    PNP_SERIAL_BUS_DESCRIPTOR SerialBusDescriptor;
+    ULONG ConnectionSpeed;
+    UCHAR DataBitLength;
+    UCHAR Phase;
+    UCHAR Polarity;
+    USHORT DeviceSelection;
+} HOST_SPI_DESCRIPTOR;
+
+#include "poppack.h"
+
+#define HOST_SERIAL_BUS_TAG 0x8e
+
+template <typename T>
+static
+std::vector<UCHAR>
+HostSimConnection(
+    _In_  const T  &Descriptor)
+{
+    return std::vector<UCHAR>((const UCHAR *)&Descriptor,
+        (const UCHAR *)&Descriptor + sizeof(Descriptor));
+}
+
+static
+VOID
+HostSimInitSerialBus(
+    _Out_  PNP_SERIAL_BUS_DESCRIPTOR  *Descriptor,
+    _In_   size_t                      Size,
+    _In_   UCHAR                       SerialBusType,
+    _In_   USHORT                      TypeSpecificFlags)
+{
+    Descriptor->Tag = HOST_SERIAL_BUS_TAG;
+    Descriptor->Length = (USHORT)(Size - 3);
+    Descriptor->RevisionId = 1;
+    Descriptor->SerialBusType = SerialBusType;
+    Descriptor->TypeSpecificFlags = TypeSpecificFlags;
+    Descriptor->TypeSpecificRevisionId = 1;
+    Descriptor->TypeDataLength = (USHORT)(Size - sizeof(PNP_SERIAL_BUS_DESCRIPTOR));
+}
+
+std::vector<UCHAR>
+HostSimI2cConnection(
+    _In_  USHORT  Address,
+    _In_  ULONG   ConnectionSpeed,
+    _In_  BOOLEAN TenBitAddress)
+{
+    HOST_I2C_DESCRIPTOR descriptor;
+
+    RtlZeroMemory(&descriptor, sizeof(descriptor));
+    HostSimInitSerialBus(&descriptor.SerialBusDescriptor, sizeof(descriptor),
+        CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C, TenBitAddress ? 0x0001 : 0);
+    descriptor.ConnectionSpeed = ConnectionSpeed;
+    descriptor.SlaveAddress = Address;
+
+    return HostSimConnection(descriptor);
+}
+
+std::vector<UCHAR>
+HostSimSpiConnection(
+    _In_  USHORT  DeviceSelection,
+    _In_  ULONG   ConnectionSpeed,
+    _In_  UCHAR   DataBitLength,
+    _In_  UCHAR   Phase,
+    _In_  UCHAR   Polarity,
+    _In_  USHORT  TypeSpecificFlags)
+{
+    HOST_SPI_DESCRIPTOR descriptor;
+
+    RtlZeroMemory(&descriptor, sizeof(descriptor));
+    HostSimInitSerialBus(&descriptor.SerialBusDescriptor, sizeof(descriptor),
+        CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI, TypeSpecificFlags);
+    descriptor.ConnectionSpeed = ConnectionSpeed;
+    descriptor.DataBitLength = DataBitLength;
+    descriptor.Phase = Phase;
+    descriptor.Polarity = Polarity;
+    descriptor.DeviceSelection = DeviceSelection;
+
+    return HostSimConnection(descriptor);
+}
+
+/////////////////////////////////////////////////
+//
+// Driver and devices.
+//
+/////////////////////////////////////////////////
+
+static DRIVER_OBJECT s_DriverObject;
+
+std::vector<HOST_SIM_DEVICE *> &
+HostSimDevices(VOID)
+{
+    static std::vector<HOST_SIM_DEVICE *> devices;
+
+    return devices;
+}
+
+HostSpbController *
+HostFindController(
+    _In_  LONGLONG  ConnectionId)
+{
+    for (HOST_SIM_DEVICE *simDevice : HostSimDevices())
+    {
+        if (simDevice->ConnectionId == ConnectionId)
+        {
+            return simDevice->Controller;
+        }
+    }
+
+    return nullptr;
+}
+
+NTSTATUS
+HostSimLoadDriver(VOID)
+{
+    DECLARE_CONST_UNICODE_STRING(registryPath,
+        L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\SpbProbe");
+    HOST_LOCK lock(HostFrameworkLock());
+
+    return DriverEntry(&s_DriverObject, (PUNICODE_STRING)&registryPath);
+}
+
+VOID
+HostSimUnloadDriver(VOID)
+{
+    {
+        HOST_LOCK lock(HostFrameworkLock());
+
+        HostDriverDelete();
+    }
+
+    HostDispatcherStop();
+}
+
+PHOST_SIM_DEVICE
+HostSimCreateDevice(
+    _In_  LONGLONG            ConnectionId,
+    _In_  HostSpbController  *Controller)
+{
+    HOST_SIM_DEVICE *simDevice = new HOST_SIM_DEVICE();
+    HOST_LOCK lock(HostFrameworkLock());
+
+    simDevice->ConnectionId = ConnectionId;
+    simDevice->Controller = Controller;
+
+    CM_PARTIAL_RESOURCE_DESCRIPTOR resource;
+
+    RtlZeroMemory(&resource, sizeof(resource));
+    resource.Type = CmResourceTypeConnection;
+    resource.u.Connection.Class = CM_RESOURCE_CONNECTION_CLASS_SERIAL;
+    resource.u.Connection.Type = CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C;
+    resource.u.Connection.IdLowPart = (ULONG)ConnectionId;
+    resource.u.Connection.IdHighPart = (ULONG)(ConnectionId >> 32);
+
+    simDevice->Resources.push_back(resource);
+
+    HostSimDevices().push_back(simDevice);
+
+    return simDevice;
+}
+
+VOID
+HostSimSetController(
+    _In_  PHOST_SIM_DEVICE    Device,
+    _In_  HostSpbController  *Controller)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    Device->Controller = Controller;
+}
+
+VOID
+HostSimAddInterrupt(
+    _In_  PHOST_SIM_DEVICE  Device)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    CM_PARTIAL_RESOURCE_DESCRIPTOR resource;
+
+    //
+    // A level triggered GPIO interrupt, shared with the client
+    // driver of the peripheral.
+    //
+
+    RtlZeroMemory(&resource, sizeof(resource));
+    resource.Type = CmResourceTypeInterrupt;
+    resource.Flags = CM_RESOURCE_INTERRUPT_LEVEL_SENSITIVE;
+    resource.u.Interrupt.Vector = (ULONG)Device->Resources.size();
+    resource.u.Interrupt.Affinity = 1;
+
+    Device->Resources.push_back(resource);
+}
+
+VOID
+HostSimSignalInterrupt(
+    _In_  PHOST_SIM_DEVICE  Device)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    if (Device->Device != nullptr)
+    {
+        HostDeviceSignalInterrupts(Device->Device);
+    }
+}
+
+VOID
+HostSimSetRegistryULong(
+    _In_      PHOST_SIM_DEVICE  Device,
+    _In_opt_  PCWSTR            SubKey,
+    _In_      PCWSTR            ValueName,
+    _In_      ULONG             Value)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_REGISTRY_VALUE &value = Device->Registry.Open(SubKey, TRUE)->Values[ValueName];
+
+    value.Type = REG_DWORD;
+    value.Data.assign((PUCHAR)&Value, (PUCHAR)&Value + sizeof(Value));
+}
+
+VOID
+HostSimSetRegistryMultiSz(
+    _In_      PHOST_SIM_DEVICE                 Device,
+    _In_opt_  PCWSTR                           SubKey,
+    _In_      PCWSTR                           ValueName,
+    _In_      const std::vector<std::wstring> &Strings)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_REGISTRY_VALUE &value = Device->Registry.Open(SubKey, TRUE)->Values[ValueName];
+    std::vector<WCHAR> data;
+
+    //
+    // REG_MULTI_SZ: NUL terminated strings and a final NUL.
+    //
+
+    for (const std::wstring &string : Strings)
+    {
+        data.insert(data.end(), string.begin(), string.end());
+        data.push_back(L'\0');
+    }
+
+    data.push_back(L'\0');
+
+    value.Type = REG_MULTI_SZ;
+    value.Data.assign((PUCHAR)data.data(), (PUCHAR)(data.data() + data.size()));
+}
+
+NTSTATUS
+HostSimStartDevice(
+    _In_  PHOST_SIM_DEVICE  Device)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_DRIVER *driver = HostGetDriver();
+    PWDFDEVICE_INIT init;
+    HOST_DEVICE *device;
+    NTSTATUS status;
+
+    if ((driver == nullptr) || (Device->Device != nullptr))
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    init = new HOST_DEVICE_INIT();
+    RtlZeroMemory(&init->PnpPowerCallbacks, sizeof(init->PnpPowerCallbacks));
+    init->SimDevice = Device;
+
+    status = driver->Config.EvtDriverDeviceAdd(driver, init);
+
+    delete init;
+
+    device = Device->Device;
+
+    if (!NT_SUCCESS(status) || (device == nullptr))
+    {
+        if (device != nullptr)
+        {
+            HostObjectDelete(device);
+            Device->Device = nullptr;
+        }
+
+        return NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+    }
+
+    device->IdleEnabled = Device->IdleEnabled;
+
+    //
+    // The device is its own resource list, holding the
+    // connection resource of the simulated device.
+    //
+
+    if (device->PnpPowerCallbacks.EvtDevicePrepareHardware != nullptr)
+    {
+        status = device->PnpPowerCallbacks.EvtDevicePrepareHardware(
+            device, device, device);
+
+        if (!NT_SUCCESS(status))
+        {
+            HostObjectDelete(device);
+            Device->Device = nullptr;
+            return status;
+        }
+    }
+
+    status = HostDeviceSetPower(device, TRUE);
+
+    if (!NT_SUCCESS(status))
+    {
+        if (device->PnpPowerCallbacks.EvtDeviceReleaseHardware != nullptr)
+        {
+            device->PnpPowerCallbacks.EvtDeviceReleaseHardware(device, device);
+        }
+
+        HostObjectDelete(device);
+        Device->Device = nullptr;
+        return status;
+    }
+
+    HostDeviceScheduleIdle(device);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+HostSimRemoveDevice(
+    _In_  PHOST_SIM_DEVICE  Device)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_DEVICE *device = Device->Device;
+    std::vector<HOST_SIM_DEVICE *> &devices = HostSimDevices();
+
+    if (device != nullptr)
+    {
+        //
+        // Requests still queued are failed, targets still open
+        // are disconnected.
+        //
+
+        while (!device->Pending.empty())
+        {
+            HostRequestComplete(device->Pending.front(), STATUS_NO_SUCH_DEVICE, 0);
+        }
+
+        for (size_t i = device->Children.size(); i-- > 0;)
+        {
+            HOST_OBJECT *child = device->Children[i];
+
+            if ((child->Type == HostObjectTypeSpbTarget) &&
+                (device->SpbConfig.EvtSpbTargetDisconnect != nullptr))
+            {
+                device->SpbConfig.EvtSpbTargetDisconnect(device, child);
+            }
+        }
+
+        HostCancelEvent(device->IdleEventId);
+        device->IdleEventId = 0;
+        device->IdleEnabled = FALSE;
+
+        if (device->InD0 && (device->PnpPowerCallbacks.EvtDeviceD0Exit != nullptr))
+        {
+            device->PnpPowerCallbacks.EvtDeviceD0Exit(device, WdfPowerDeviceD3Final);
+        }
+
+        device->InD0 = FALSE;
+
+        if (device->PnpPowerCallbacks.EvtDeviceReleaseHardware != nullptr)
+        {
+            device->PnpPowerCallbacks.EvtDeviceReleaseHardware(device, device);
+        }
+
+        HostObjectDelete(device);
+    }
+
+    devices.erase(std::remove(devices.begin(), devices.end(), Device), devices.end());
+    delete Device;
+}
+
+VOID
+HostSimEnableIdle(
+    _In_  PHOST_SIM_DEVICE  Device,
+    _In_  BOOLEAN           Enable)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    Device->IdleEnabled = Enable;
+
+    if (Device->Device == nullptr)
+    {
+        return;
+    }
+
+    Device->Device->IdleEnabled = Enable;
+
+    if (Enable)
+    {
+        HostDeviceScheduleIdle(Device->Device);
+    }
+    else
+    {
+        HostCancelEvent(Device->Device->IdleEventId);
+        Device->Device->IdleEventId = 0;
+        HostDeviceSetPower(Device->Device, TRUE);
+    }
+}
+
+BOOLEAN
+HostSimIsDeviceInD0(
+    _In_  PHOST_SIM_DEVICE  Device)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    return (Device->Device != nullptr) && Device->Device->InD0;
+}
+
+ULONG
+HostSimGetIdleTimeout(
+    _In_  PHOST_SIM_DEVICE  Device)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    return (Device->Device != nullptr) ? Device->Device->IdleSettings.IdleTimeout : 0;
+}
+
+WDFDEVICE
+HostSimGetWdfDevice(
+    _In_  PHOST_SIM_DEVICE  Device)
+{
+    return Device->Device;
+}
+
+VOID
+HostSimSetMonitorPower(
+    _In_  BOOLEAN       On)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    HostPowerSettingNotify(&GUID_MONITOR_POWER_ON, On ? 1 : 0);
+}
+
+VOID
+HostSimSetSystemPowerAction(
+    _In_  POWER_ACTION  Action)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    g_HostSystemPowerAction = Action;
+}
+
+/////////////////////////////////////////////////
+//
+// Targets and client requests.
+//
+/////////////////////////////////////////////////
+
+PHOST_SIM_TARGET
+HostSimOpenTarget(
+    _In_  PHOST_SIM_DEVICE           Device,
+    _In_  const std::vector<UCHAR>  &Connection)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_DEVICE *device = Device->Device;
+    HOST_SPB_TARGET_OBJECT *target;
+    ULONG length = (ULONG)Connection.size();
+    NTSTATUS status;
+
+    if ((device == nullptr) || !device->SpbInitialized)
+    {
+        return nullptr;
+    }
+
+    target = new HOST_SPB_TARGET_OBJECT();
+    target->Device = device;
+    target->ConnectionProperties.resize(
+        FIELD_OFFSET(RH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER, ConnectionProperties) +
+        Connection.size());
+    RtlCopyMemory(target->ConnectionProperties.data(), &length, sizeof(length));
+    RtlCopyMemory(target->ConnectionProperties.data() +
+        FIELD_OFFSET(RH_QUERY_CONNECTION_PROPERTIES_OUTPUT_BUFFER, ConnectionProperties),
+        Connection.data(),
+        Connection.size());
+
+    status = HostObjectInitialize(target, &device->TargetAttributes, device);
+
+    if (NT_SUCCESS(status))
+    {
+        status = device->SpbConfig.EvtSpbTargetConnect(device, target);
+
+        if (!NT_SUCCESS(status))
+        {
+            HostObjectDelete(target);
+        }
+    }
+    else
+    {
+        delete target;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        return nullptr;
+    }
+
+    return new HOST_SIM_TARGET{Device, target};
+}
+
+VOID
+HostSimCloseTarget(
+    _In_  PHOST_SIM_TARGET  Target)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_DEVICE *device = Target->SimDevice->Device;
+
+    if (device->SpbConfig.EvtSpbTargetDisconnect != nullptr)
+    {
+        device->SpbConfig.EvtSpbTargetDisconnect(device, Target->Target);
+    }
+
+    //
+    // Closing the target releases the controller lock it holds.
+    //
+
+    if (device->LockOwner == Target->Target)
+    {
+        device->LockOwner = nullptr;
+    }
+
+    HostObjectDelete(Target->Target);
+    delete Target;
+
+    HostDeviceDispatch(device);
+}
+
+static
+ULONG
+HostSimIoctlCode(
+    _In_  SPB_REQUEST_TYPE  Type,
+    _In_  ULONG             IoControlCode)
+{
+    switch (Type)
+    {
+    case SpbRequestTypeSequence:
+        return IOCTL_SPB_EXECUTE_SEQUENCE;
+    case SpbRequestTypeLockController:
+        return IOCTL_SPB_LOCK_CONTROLLER;
+    case SpbRequestTypeUnlockController:
+        return IOCTL_SPB_UNLOCK_CONTROLLER;
+    case SpbRequestTypeLockConnection:
+        return IOCTL_SPB_LOCK_CONNECTION;
+    case SpbRequestTypeUnlockConnection:
+        return IOCTL_SPB_UNLOCK_CONNECTION;
+    default:
+        return IoControlCode;
+    }
+}
+
+PHOST_SIM_REQUEST
+HostSimSubmit(
+    _In_      PHOST_SIM_TARGET          Target,
+    _In_      SPB_REQUEST_TYPE          Type,
+    _In_      ULONG                     IoControlCode,
+    _In_      const HOST_SPB_TRANSFER  *Transfers,
+    _In_      ULONG                     TransferCount)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_DEVICE *device = Target->SimDevice->Device;
+    HOST_REQUEST *request = new HOST_REQUEST();
+    PSPB_TRANSFER_LIST list;
+
+    request->Client = TRUE;
+    request->Device = device;
+    request->Target = Target->Target;
+    request->SpbType = Type;
+    request->Transfers.assign(Transfers, Transfers + TransferCount);
+    request->Mdls.resize(TransferCount);
+    WDF_REQUEST_PARAMETERS_INIT(&request->Parameters);
+
+    HostObjectInitialize(request, &device->RequestAttributes, nullptr);
+
+    for (ULONG i = 0; i < TransferCount; i++)
+    {
+        PMDL mdl = &request->Mdls[i];
+
+        RtlZeroMemory(mdl, sizeof(*mdl));
+        mdl->MappedSystemVa = Transfers[i].Buffer;
+        mdl->StartVa = Transfers[i].Buffer;
+        mdl->ByteCount = (ULONG)Transfers[i].Length;
+    }
+
+    switch (Type)
+    {
+    case SpbRequestTypeRead:
+        NT_ASSERT(TransferCount == 1);
+        request->Parameters.Type = WdfRequestTypeRead;
+        request->Parameters.Parameters.Read.Length = Transfers[0].Length;
+        request->OutputMemory = HostMemoryCreate(request,
+            Transfers[0].Buffer, Transfers[0].Length, FALSE);
+        break;
+
+    case SpbRequestTypeWrite:
+        NT_ASSERT(TransferCount == 1);
+        request->Parameters.Type = WdfRequestTypeWrite;
+        request->Parameters.Parameters.Write.Length = Transfers[0].Length;
+        request->InputMemory = HostMemoryCreate(request,
+            Transfers[0].Buffer, Transfers[0].Length, FALSE);
+        break;
+
+    default:
+
+        //
+        // IOCTLs carry a client transfer list of simple
+        // buffers, METHOD_NEITHER.
+        //
+
+        request->Parameters.Type = WdfRequestTypeDeviceControl;
+        request->Parameters.Parameters.DeviceIoControl.IoControlCode =
+            HostSimIoctlCode(Type, IoControlCode);
+
+        if (TransferCount == 0)
+        {
+            break;
+        }
+
+        request->TransferList.resize(FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) +
+            TransferCount * sizeof(SPB_TRANSFER_LIST_ENTRY));
+        list = (PSPB_TRANSFER_LIST)request->TransferList.data();
+        SPB_TRANSFER_LIST_INIT(list, TransferCount);
+
+        for (ULONG i = 0; i < TransferCount; i++)
+        {
+            list->Transfers[i] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+                Transfers[i].Direction,
+                Transfers[i].DelayInUs,
+                Transfers[i].Buffer,
+                (ULONG)Transfers[i].Length);
+        }
+
+        request->Parameters.Parameters.DeviceIoControl.InputBufferLength =
+            request->TransferList.size();
+        request->Parameters.Parameters.DeviceIoControl.Type3InputBuffer = list;
+        request->InputMemory = HostMemoryCreate(request,
+            list, request->TransferList.size(), FALSE);
+        break;
+    }
+
+    //
+    // Custom IOCTLs go through the in-caller-context callback,
+    // which enqueues them to the controller queue.
+    //
+
+    if ((Type == SpbRequestTypeOther) && (device->EvtIoInCallerContext != nullptr))
+    {
+        device->EvtIoInCallerContext(device, request);
+    }
+    else
+    {
+        device->Pending.push_back(request);
+        HostDeviceDispatch(device);
+    }
+
+    return new HOST_SIM_REQUEST{request};
+}
+
+NTSTATUS
+HostSimWait(
+    _In_       PHOST_SIM_REQUEST  Request,
+    _Out_opt_  ULONG_PTR         *pInformation,
+    _In_       ULONG              TimeoutMs)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_REQUEST *request = Request->Request;
+    NTSTATUS status;
+
+    if (TimeoutMs == 0)
+    {
+        request->CompletedEvent.wait(lock, [request]() { return request->Completed != FALSE; });
+    }
+    else if (!request->CompletedEvent.wait_for(lock,
+        std::chrono::milliseconds(TimeoutMs),
+        [request]() { return request->Completed != FALSE; }))
+    {
+        return STATUS_TIMEOUT;
+    }
+
+    status = request->Status;
+
+    if (pInformation != nullptr)
+    {
+        *pInformation = request->Information;
+    }
+
+    HostObjectDelete(request);
+    delete Request;
+
+    return status;
+}
+
+BOOLEAN
+HostSimIsComplete(
+    _In_  PHOST_SIM_REQUEST  Request)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    return Request->Request->Completed;
+}
+
+VOID
+HostSimCancel(
+    _In_  PHOST_SIM_REQUEST  Request)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_REQUEST *request = Request->Request;
+    HOST_DEVICE *device = request->Device;
+
+    if (request->Completed || request->Cancelled)
+    {
+        return;
+    }
+
+    request->Cancelled = TRUE;
+
+    if (std::find(device->Pending.begin(), device->Pending.end(), request) !=
+        device->Pending.end())
+    {
+        HostRequestComplete(request, STATUS_CANCELLED, 0);
+    }
+    else if (request->EvtCancel != nullptr)
+    {
+        PFN_WDF_REQUEST_CANCEL routine = request->EvtCancel;
+
+        request->EvtCancel = nullptr;
+        request->CancelRoutineCalled = TRUE;
+        routine(request);
+    }
+}
+
+NTSTATUS
+HostSimRead(
+    _In_       PHOST_SIM_TARGET  Target,
+    _Out_      PVOID             Buffer,
+    _In_       size_t            Length,
+    _Out_opt_  ULONG_PTR        *pInformation)
+{
+    HOST_SPB_TRANSFER transfer = {SpbTransferDirectionFromDevice, 0, (PUCHAR)Buffer, Length};
+
+    return HostSimWait(HostSimSubmit(Target, SpbRequestTypeRead, 0, &transfer, 1),
+        pInformation);
+}
+
+NTSTATUS
+HostSimWrite(
+    _In_       PHOST_SIM_TARGET  Target,
+    _In_       const VOID       *Buffer,
+    _In_       size_t            Length,
+    _Out_opt_  ULONG_PTR        *pInformation)
+{
+    HOST_SPB_TRANSFER transfer = {SpbTransferDirectionToDevice, 0, (PUCHAR)Buffer, Length};
+
+    return HostSimWait(HostSimSubmit(Target, SpbRequestTypeWrite, 0, &transfer, 1),
+        pInformation);
+}
+
+NTSTATUS
+HostSimWriteRead(
+    _In_       PHOST_SIM_TARGET  Target,
+    _In_       const VOID       *WriteBuffer,
+    _In_       size_t            WriteLength,
+    _Out_      PVOID             ReadBuffer,
+    _In_       size_t            ReadLength,
+    _Out_opt_  ULONG_PTR        *pInformation)
+{
+    HOST_SPB_TRANSFER transfers[2] =
+    {
+        {SpbTransferDirectionToDevice, 0, (PUCHAR)WriteBuffer, WriteLength},
+        {SpbTransferDirectionFromDevice, 0, (PUCHAR)ReadBuffer, ReadLength}
+    };
+
+    return HostSimWait(HostSimSubmit(Target, SpbRequestTypeSequence, 0, transfers, 2),
+        pInformation);
+}
+
+NTSTATUS
+HostSimFullDuplex(
+    _In_       PHOST_SIM_TARGET  Target,
+    _In_       const VOID       *WriteBuffer,
+    _In_       size_t            WriteLength,
+    _Out_      PVOID             ReadBuffer,
+    _In_       size_t            ReadLength,
+    _Out_opt_  ULONG_PTR        *pInformation)
+{
+    HOST_SPB_TRANSFER transfers[2] =
+    {
+        {SpbTransferDirectionToDevice, 0, (PUCHAR)WriteBuffer, WriteLength},
+        {SpbTransferDirectionFromDevice, 0, (PUCHAR)ReadBuffer, ReadLength}
+    };
+
+    return HostSimWait(HostSimSubmit(Target, SpbRequestTypeOther,
+        IOCTL_SPB_FULL_DUPLEX, transfers, 2), pInformation);
+}
+
+NTSTATUS
+HostSimLock(
+    _In_  PHOST_SIM_TARGET  Target,
+    _In_  SPB_REQUEST_TYPE  Type)
+{
+    return HostSimWait(HostSimSubmit(Target, Type, 0, nullptr, 0), nullptr);
+}
+
+/////////////////////////////////////////////////
+//
+// Control device.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+HostSimControlIoctl(
+    _In_       ULONG       IoControlCode,
+    _In_opt_   const VOID *InputBuffer,
+    _In_       size_t      InputLength,
+    _Out_opt_  PVOID       OutputBuffer,
+    _In_       size_t      OutputLength,
+    _Out_opt_  ULONG_PTR  *pInformation)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    HOST_DRIVER *driver = HostGetDriver();
+    HOST_DEVICE *control = nullptr;
+    HOST_REQUEST *request;
+    HOST_QUEUE *queue;
+    NTSTATUS status;
+
+    if (driver == nullptr)
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    for (HOST_OBJECT *child : driver->Children)
+    {
+        if ((child->Type == HostObjectTypeDevice) &&
+            static_cast<HOST_DEVICE *>(child)->Control)
+        {
+            control = static_cast<HOST_DEVICE *>(child);
+        }
+    }
+
+    if ((control == nullptr) || (control->DefaultQueue == nullptr) ||
+        (control->DefaultQueue->Config.EvtIoDeviceControl == nullptr))
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    queue = control->DefaultQueue;
+
+    request = new HOST_REQUEST();
+    request->Client = TRUE;
+    WDF_REQUEST_PARAMETERS_INIT(&request->Parameters);
+    request->Parameters.Type = WdfRequestTypeDeviceControl;
+    request->Parameters.Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+    request->Parameters.Parameters.DeviceIoControl.InputBufferLength = InputLength;
+    request->Parameters.Parameters.DeviceIoControl.OutputBufferLength = OutputLength;
+
+    HostObjectInitialize(request, WDF_NO_OBJECT_ATTRIBUTES, nullptr);
+
+    if ((InputBuffer != nullptr) && (InputLength != 0))
+    {
+        request->InputMemory = HostMemoryCreate(request,
+            (PVOID)InputBuffer, InputLength, FALSE);
+    }
+
+    if ((OutputBuffer != nullptr) && (OutputLength != 0))
+    {
+        request->OutputMemory = HostMemoryCreate(request,
+            OutputBuffer, OutputLength, FALSE);
+    }
+
+    queue->Config.EvtIoDeviceControl(queue, request, OutputLength, InputLength, IoControlCode);
+
+    request->CompletedEvent.wait(lock, [request]() { return request->Completed != FALSE; });
+
+    status = request->Status;
+
+    if (pInformation != nullptr)
+    {
+        *pInformation = request->Information;
+    }
+
+    HostObjectDelete(request);
+
+    return status;
+}
+
+/////////////////////////////////////////////////
+//
+// Scheduling.
+//
+/////////////////////////////////////////////////
+
+VOID
+HostSimRunFor(
+    _In_  ULONG  DelayUs)
+{
+    std::promise<VOID> done;
+    std::future<VOID> doneFuture = done.get_future();
+
+    std::this_thread::sleep_for(std::chrono::microseconds(DelayUs));
+
+    //
+    // Events due at the same time run in order, so every event
+    // due by now has run once this one does.
+    //
+
+    {
+        HOST_LOCK lock(HostFrameworkLock());
+
+        HostScheduleEvent(0, [&done]() { done.set_value(); });
+    }
+
+    doneFuture.wait();
+}
+
+ULONGLONG
+HostSimScheduleEvent(
+    _In_  ULONG                  DelayUs,
+    _In_  std::function<VOID()>  Routine)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    return HostScheduleEvent(DelayUs, std::move(Routine));
+}
+
+BOOLEAN
+HostSimCancelEvent(
+    _In_  ULONGLONG  EventId)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    return HostCancelEvent(EventId);
+}
+
+ULONGLONG
+HostSimNowUs(VOID)
+{
+    return HostNowUs();
+}
@@ -0,0 +1,181 @@
+/*++
+
+Module Name:
+
+    hosttrace.cpp
+
+Abstract:
+
+    This module implements the host trace sink behind the Trace,
+    FuncEntry and FuncExit macros of hostwpp.h. Messages at or
+    below the enabled level are formatted and printed to stderr,
+    or handed to the sink installed by the harness. TraceLogging
+    events go to the event sink of the harness, if any.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include "hostinternal.h"
+#include "hostwpp.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+
+static ULONG s_TraceLevel = TRACE_LEVEL_ERROR;
+static ULONG s_TraceFlags = 0xffffffff;
+static PHOST_TRACE_SINK s_TraceSink = nullptr;
+static std::atomic<PHOST_EVENT_SINK> s_EventSink(nullptr);
+static std::mutex s_TraceLock;
+
+static
+VOID
+HostTraceReadEnvironment(VOID)
+{
+    static std::once_flag once;
+
+    std::call_once(once, []()
+    {
+        PCSTR level = getenv("SPBPROBE_TRACE_LEVEL");
+        PCSTR flags = getenv("SPBPROBE_TRACE_FLAGS");
+
+        if (level != nullptr)
+        {
+            s_TraceLevel = (ULONG)strtoul(level, nullptr, 0);
+        }
+
+        if (flags != nullptr)
+        {
+            s_TraceFlags = (ULONG)strtoul(flags, nullptr, 0);
+        }
+    });
+}
+
+VOID
+HostTraceSetLevel(
+    ULONG Level,
+    ULONG Flags)
+{
+    HostTraceReadEnvironment();
+
+    s_TraceLevel = Level;
+    s_TraceFlags = Flags;
+}
+
+VOID
+HostTraceGetLevel(
+    PULONG Level,
+    PULONG Flags)
+{
+    HostTraceReadEnvironment();
+
+    *Level = s_TraceLevel;
+    *Flags = s_TraceFlags;
+}
+
+VOID
+HostTraceSetSink(
+    PHOST_TRACE_SINK Sink)
+{
+    s_TraceSink = Sink;
+}
+
+VOID
+HostEventSetSink(
+    PHOST_EVENT_SINK Sink)
+{
+    s_EventSink = Sink;
+}
+
+BOOLEAN
+HostTraceLoggingEnabled(
+    TraceLoggingHProvider Provider,
+    UCHAR Level,
+    ULONGLONG Keyword)
+{
+    UNREFERENCED_PARAMETER(Provider);
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Keyword);
+
+    return (s_EventSink.load() != nullptr);
+}
+
+VOID
+HostTraceLoggingWrite(
+    TraceLoggingHProvider Provider,
+    PCSTR Event,
+    const HOST_TLG_FIELD *Fields,
+    ULONG FieldCount)
+{
+    PHOST_EVENT_SINK sink = s_EventSink.load();
+
+    if (sink != nullptr)
+    {
+        sink(Provider->Name, Event, Fields, FieldCount);
+    }
+}
+
+EXTERN_C
+BOOLEAN
+HostTraceEnabled(
+    ULONG Level,
+    ULONG Flag)
+{
+    return (Level <= s_TraceLevel) &&
+        ((s_TraceFlags & (1UL << Flag)) != 0);
+}
+
+EXTERN_C
+VOID
+HostTraceMessage(
+    ULONG Level,
+    ULONG Flag,
+    PCSTR Function,
+    PCSTR Format,
+    ...)
+{
+    static const char levels[] = "-CEWIV";
+    std::string message;
+    va_list args;
+
+    va_start(args, Format);
+    HostFormatAppend(message, Function, Format, args);
+    va_end(args);
+
+    if (s_TraceSink != nullptr)
+    {
+        s_TraceSink(Level, Flag, Function, message.c_str());
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(s_TraceLock);
+
+    fprintf(stderr, "%c %s\n",
+        (Level < sizeof(levels) - 1) ? levels[Level] : '?',
+        message.c_str());
+}
+
+EXTERN_C
+VOID
+HostTraceInitialize(
+    PVOID DriverObject,
+    PVOID RegistryPath)
+{
+    UNREFERENCED_PARAMETER(DriverObject);
+    UNREFERENCED_PARAMETER(RegistryPath);
+
+    HostTraceReadEnvironment();
+}
+
+EXTERN_C
+VOID
+HostTraceCleanup(
+    PVOID DriverObject)
+{
+    UNREFERENCED_PARAMETER(DriverObject);
+
+    fflush(stderr);
+}
@@ -0,0 +1,3045 @@
+/*++
+
+Module Name:
+
+    hostwdf.cpp
+
+Abstract:
+
+    This module implements the subset of KMDF used by the probe
+    on top of the host object model: object trees and contexts,
+    the driver and devices, the registry, memory objects, request
+    forwarding to the simulated controllers, the sequential queue
+    and idle power management, timers, work items and locks.
+
+    Framework callbacks run with the framework lock held, either
+    on the thread submitting a client request or on the
+    dispatcher thread for timers, work items, delayed completions
+    and idle transitions.
+
+Environment:
+
+    user-mode host emulation only
+
+--*/
+
+#include "hostinternal.h"
+
+#include <reshub.h>
+
+#include <algorithm>
+#include <thread>
+
+/////////////////////////////////////////////////
+//
+// Framework lock and dispatcher.
+//
+/////////////////////////////////////////////////
+
+struct HOST_EVENT
+{
+    ULONGLONG                       Id;
+    std::function<VOID()>           Routine;
+};
+
+//
+// Events are keyed by due time, then by ID so that events due
+// at the same time run in the order they were scheduled. The
+// dispatcher only pops an event with the framework lock held,
+// so an event cancelled under the lock never runs.
+//
+
+struct HOST_DISPATCHER
+{
+    std::recursive_mutex                                      FrameworkLock;
+    std::mutex                                                Lock;
+    std::condition_variable                                   Changed;
+    std::map<std::pair<ULONGLONG, ULONGLONG>, HOST_EVENT>     Events;
+    std::map<ULONGLONG, ULONGLONG>                            DueTimes;
+    ULONGLONG                                                 NextId = 1;
+    BOOLEAN                                                   Stopping = FALSE;
+    std::thread                                               Thread;
+
+    ~HOST_DISPATCHER()
+    {
+        Stop();
+    }
+
+    VOID
+    Start()
+    {
+        if (!Thread.joinable())
+        {
+            Stopping = FALSE;
+            Thread = std::thread([this]() { Run(); });
+        }
+    }
+
+    VOID
+    Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(Lock);
+            Stopping = TRUE;
+        }
+
+        Changed.notify_all();
+
+        if (Thread.joinable() &&
+            (Thread.get_id() != std::this_thread::get_id()))
+        {
+            Thread.join();
+        }
+    }
+
+    VOID
+    Run()
+    {
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(Lock);
+
+                for (;;)
+                {
+                    if (Stopping)
+                    {
+                        return;
+                    }
+
+                    if (Events.empty())
+                    {
+                        Changed.wait(lock);
+                        continue;
+                    }
+
+                    ULONGLONG now = HostNowUs();
+                    ULONGLONG due = Events.begin()->first.first;
+
+                    if (due <= now)
+                    {
+                        break;
+                    }
+
+                    Changed.wait_for(lock, std::chrono::microseconds(due - now));
+                }
+            }
+
+            HOST_LOCK frameworkLock(FrameworkLock);
+            HOST_EVENT event;
+
+            {
+                std::lock_guard<std::mutex> lock(Lock);
+
+                if (Events.empty() ||
+                    (Events.begin()->first.first > HostNowUs()))
+                {
+                    continue;
+                }
+
+                event = std::move(Events.begin()->second);
+                DueTimes.erase(event.Id);
+                Events.erase(Events.begin());
+            }
+
+            event.Routine();
+        }
+    }
+};
+
+static
+HOST_DISPATCHER &
+HostDispatcher(VOID)
+{
+    static HOST_DISPATCHER dispatcher;
+
+    return dispatcher;
+}
+
+std::recursive_mutex &
+HostFrameworkLock(VOID)
+{
+    return HostDispatcher().FrameworkLock;
+}
+
+ULONGLONG
+HostScheduleEvent(
+    _In_  ULONGLONG              DelayUs,
+    _In_  std::function<VOID()>  Routine)
+{
+    HOST_DISPATCHER &dispatcher = HostDispatcher();
+    ULONGLONG id;
+
+    {
+        std::lock_guard<std::mutex> lock(dispatcher.Lock);
+        ULONGLONG due = HostNowUs() + DelayUs;
+
+        id = dispatcher.NextId++;
+        dispatcher.Events[std::make_pair(due, id)] = HOST_EVENT{id, std::move(Routine)};
+        dispatcher.DueTimes[id] = due;
+        dispatcher.Start();
+    }
+
+    dispatcher.Changed.notify_all();
+
+    return id;
+}
+
+BOOLEAN
+HostCancelEvent(
+    _In_  ULONGLONG  EventId)
+{
+    HOST_DISPATCHER &dispatcher = HostDispatcher();
+    std::lock_guard<std::mutex> lock(dispatcher.Lock);
+
+    auto due = dispatcher.DueTimes.find(EventId);
+
+    if (due == dispatcher.DueTimes.end())
+    {
+        return FALSE;
+    }
+
+    dispatcher.Events.erase(std::make_pair(due->second, EventId));
+    dispatcher.DueTimes.erase(due);
+
+    return TRUE;
+}
+
+VOID
+HostDispatcherStop(VOID)
+{
+    HostDispatcher().Stop();
+}
+
+/////////////////////////////////////////////////
+//
+// Objects.
+//
+/////////////////////////////////////////////////
+
+HOST_OBJECT::~HOST_OBJECT()
+{
+    free(Context);
+}
+
+NTSTATUS
+HostObjectInitialize(
+    _In_      HOST_OBJECT             *Object,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES   Attributes,
+    _In_opt_  HOST_OBJECT             *DefaultParent)
+{
+    HOST_OBJECT *parent = DefaultParent;
+
+    if (Attributes != WDF_NO_OBJECT_ATTRIBUTES)
+    {
+        size_t contextSize = 0;
+
+        if (Attributes->ParentObject != nullptr)
+        {
+            parent = Attributes->ParentObject;
+        }
+
+        if (Attributes->ContextTypeInfo != nullptr)
+        {
+            contextSize = std::max(Attributes->ContextSizeOverride,
+                Attributes->ContextTypeInfo->ContextSize);
+
+            Object->Context = calloc(1, std::max(contextSize, (size_t)1));
+
+            if (Object->Context == nullptr)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        }
+
+        Object->ContextTypeInfo = Attributes->ContextTypeInfo;
+        Object->EvtCleanupCallback = Attributes->EvtCleanupCallback;
+        Object->EvtDestroyCallback = Attributes->EvtDestroyCallback;
+    }
+
+    if (parent != nullptr)
+    {
+        Object->Parent = parent;
+        parent->Children.push_back(Object);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+HostObjectDelete(
+    _In_  HOST_OBJECT  *Object)
+{
+    if (Object->Deleted)
+    {
+        return;
+    }
+
+    Object->Deleted = TRUE;
+
+    //
+    // Children go first, the most recent first, as with the
+    // framework.
+    //
+
+    while (!Object->Children.empty())
+    {
+        HostObjectDelete(Object->Children.back());
+    }
+
+    if (Object->EvtCleanupCallback != nullptr)
+    {
+        Object->EvtCleanupCallback(Object);
+    }
+
+    if (Object->Parent != nullptr)
+    {
+        std::vector<HOST_OBJECT *> &siblings = Object->Parent->Children;
+
+        siblings.erase(std::remove(siblings.begin(), siblings.end(), Object),
+            siblings.end());
+        Object->Parent = nullptr;
+    }
+
+    if (Object->EvtDestroyCallback != nullptr)
+    {
+        Object->EvtDestroyCallback(Object);
+    }
+
+    delete Object;
+}
+
+EXTERN_C
+PVOID
+HostObjectGetTypedContext(
+    WDFOBJECT                       Handle,
+    PCWDF_OBJECT_CONTEXT_TYPE_INFO  TypeInfo)
+{
+    NT_ASSERT(Handle != nullptr);
+    NT_ASSERT((Handle->ContextTypeInfo == TypeInfo) ||
+        ((Handle->ContextTypeInfo != nullptr) &&
+         (strcmp(Handle->ContextTypeInfo->ContextName, TypeInfo->ContextName) == 0)));
+
+    return Handle->Context;
+}
+
+EXTERN_C
+VOID
+WdfObjectDelete(
+    WDFOBJECT Object)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+
+    HostObjectDelete(Object);
+}
+
+EXTERN_C
+VOID
+WdfObjectReferenceActual(
+    WDFOBJECT   Handle,
+    PVOID       Tag,
+    LONG        Line,
+    PCSTR       File)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    UNREFERENCED_PARAMETER(Line);
+    UNREFERENCED_PARAMETER(File);
+
+    InterlockedIncrement(&Handle->References);
+}
+
+EXTERN_C
+VOID
+WdfObjectDereferenceActual(
+    WDFOBJECT   Handle,
+    PVOID       Tag,
+    LONG        Line,
+    PCSTR       File)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    UNREFERENCED_PARAMETER(Line);
+    UNREFERENCED_PARAMETER(File);
+
+    InterlockedDecrement(&Handle->References);
+}
+
+EXTERN_C
+NTSTATUS
+WdfObjectCreate(
+    PWDF_OBJECT_ATTRIBUTES  Attributes,
+    WDFOBJECT              *Object)
+{
+    HOST_OBJECT *object = new HOST_OBJECT(HostObjectTypeGeneric);
+    NTSTATUS status = HostObjectInitialize(object, Attributes, HostGetDriver());
+
+    HostCountObjectCreation();
+
+    if (!NT_SUCCESS(status))
+    {
+        delete object;
+        return status;
+    }
+
+    *Object = object;
+
+    return STATUS_SUCCESS;
+}
+
+/////////////////////////////////////////////////
+//
+// Driver.
+//
+/////////////////////////////////////////////////
+
+static HOST_DRIVER *s_Driver = nullptr;
+
+HOST_DRIVER *
+HostGetDriver(VOID)
+{
+    return s_Driver;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDriverCreate(
+    PDRIVER_OBJECT          DriverObject,
+    PCUNICODE_STRING        RegistryPath,
+    PWDF_OBJECT_ATTRIBUTES  DriverAttributes,
+    PWDF_DRIVER_CONFIG      DriverConfig,
+    WDFDRIVER              *Driver)
+{
+    HOST_DRIVER *driver;
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    UNREFERENCED_PARAMETER(DriverObject);
+    UNREFERENCED_PARAMETER(RegistryPath);
+
+    if (s_Driver != nullptr)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    driver = new HOST_DRIVER();
+    driver->Config = *DriverConfig;
+
+    status = HostObjectInitialize(driver, DriverAttributes, nullptr);
+
+    if (!NT_SUCCESS(status))
+    {
+        delete driver;
+        return status;
+    }
+
+    s_Driver = driver;
+
+    if (Driver != WDF_NO_HANDLE)
+    {
+        *Driver = driver;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+HostDriverDelete(VOID)
+{
+    HOST_DRIVER *driver = s_Driver;
+
+    if (driver == nullptr)
+    {
+        return;
+    }
+
+    if (driver->Config.EvtDriverUnload != nullptr)
+    {
+        driver->Config.EvtDriverUnload(driver);
+    }
+
+    HostObjectDelete(driver);
+    s_Driver = nullptr;
+}
+
+EXTERN_C
+WDFDRIVER
+WdfGetDriver(VOID)
+{
+    return s_Driver;
+}
+
+static
+NTSTATUS
+HostKeyCreate(
+    _In_      HOST_REGISTRY_NODE      *Node,
+    _In_opt_  PWDF_OBJECT_ATTRIBUTES   KeyAttributes,
+    _Out_     WDFKEY                  *Key)
+{
+    HOST_KEY *key = new HOST_KEY();
+    NTSTATUS status = HostObjectInitialize(key, KeyAttributes, HostGetDriver());
+
+    if (!NT_SUCCESS(status))
+    {
+        delete key;
+        return status;
+    }
+
+    key->Node = Node;
+    *Key = key;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDriverOpenParametersRegistryKey(
+    WDFDRIVER               Driver,
+    ACCESS_MASK             DesiredAccess,
+    PWDF_OBJECT_ATTRIBUTES  KeyAttributes,
+    WDFKEY                 *Key)
+{
+    HOST_DRIVER *driver = HostObjectCast<HOST_DRIVER>(Driver, HostObjectTypeDriver);
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+
+    return HostKeyCreate(&driver->Parameters, KeyAttributes, Key);
+}
+
+/////////////////////////////////////////////////
+//
+// Devices.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+VOID
+WdfDeviceInitSetPnpPowerEventCallbacks(
+    PWDFDEVICE_INIT                 DeviceInit,
+    PWDF_PNPPOWER_EVENT_CALLBACKS   PnpPowerEventCallbacks)
+{
+    DeviceInit->PnpPowerCallbacks = *PnpPowerEventCallbacks;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceInitAssignSDDLString(
+    PWDFDEVICE_INIT     DeviceInit,
+    PCUNICODE_STRING    SDDLString)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(SDDLString);
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceInitAssignName(
+    PWDFDEVICE_INIT     DeviceInit,
+    PCUNICODE_STRING    DeviceName)
+{
+    DeviceInit->Name.assign(DeviceName->Buffer, DeviceName->Length / sizeof(WCHAR));
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfDeviceInitSetExclusive(
+    PWDFDEVICE_INIT DeviceInit,
+    BOOLEAN         IsExclusive)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(IsExclusive);
+}
+
+EXTERN_C
+VOID
+WdfDeviceInitSetDeviceType(
+    PWDFDEVICE_INIT DeviceInit,
+    ULONG           DeviceType)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(DeviceType);
+}
+
+EXTERN_C
+VOID
+WdfDeviceInitFree(
+    PWDFDEVICE_INIT DeviceInit)
+{
+    if (DeviceInit->Control)
+    {
+        delete DeviceInit;
+    }
+}
+
+EXTERN_C
+PWDFDEVICE_INIT
+WdfControlDeviceInitAllocate(
+    WDFDRIVER           Driver,
+    PCUNICODE_STRING    SDDLString)
+{
+    PWDFDEVICE_INIT init = new HOST_DEVICE_INIT();
+
+    UNREFERENCED_PARAMETER(Driver);
+    UNREFERENCED_PARAMETER(SDDLString);
+
+    RtlZeroMemory(&init->PnpPowerCallbacks, sizeof(init->PnpPowerCallbacks));
+    init->Control = TRUE;
+
+    return init;
+}
+
+EXTERN_C
+VOID
+WdfControlFinishInitializing(
+    WDFDEVICE Device)
+{
+    UNREFERENCED_PARAMETER(Device);
+}
+
+HOST_DEVICE::~HOST_DEVICE()
+{
+    HostCancelEvent(IdleEventId);
+    delete WdmDevice;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceCreate(
+    PWDFDEVICE_INIT        *DeviceInit,
+    PWDF_OBJECT_ATTRIBUTES  DeviceAttributes,
+    WDFDEVICE              *Device)
+{
+    PWDFDEVICE_INIT init = *DeviceInit;
+    HOST_DEVICE *device = new HOST_DEVICE();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    device->PnpPowerCallbacks = init->PnpPowerCallbacks;
+    device->Control = init->Control;
+    device->Name = init->Name;
+    device->SimDevice = init->SimDevice;
+    device->WdmDevice = new DEVICE_OBJECT{device};
+    WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(&device->IdleSettings, IdleCannotWakeFromS0);
+    WDF_OBJECT_ATTRIBUTES_INIT(&device->TargetAttributes);
+    WDF_OBJECT_ATTRIBUTES_INIT(&device->RequestAttributes);
+
+    status = HostObjectInitialize(device, DeviceAttributes, HostGetDriver());
+
+    if (!NT_SUCCESS(status))
+    {
+        delete device;
+        return status;
+    }
+
+    if (init->SimDevice != nullptr)
+    {
+        init->SimDevice->Device = device;
+    }
+
+    //
+    // The framework owns the initialization structure of a
+    // control device once it is created. The harness frees the
+    // structure of a PnP device after device add.
+    //
+
+    if (init->Control)
+    {
+        delete init;
+    }
+
+    *DeviceInit = nullptr;
+    *Device = device;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceCreateSymbolicLink(
+    WDFDEVICE           Device,
+    PCUNICODE_STRING    SymbolicLinkName)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+
+    device->SymbolicLink.assign(SymbolicLinkName->Buffer,
+        SymbolicLinkName->Length / sizeof(WCHAR));
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfDeviceSetDeviceState(
+    WDFDEVICE           Device,
+    PWDF_DEVICE_STATE   DeviceState)
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(DeviceState);
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceAssignS0IdleSettings(
+    WDFDEVICE                               Device,
+    PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS  Settings)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+
+    device->IdleSettings = *Settings;
+
+    //
+    // A new timeout applies from the next idle period.
+    //
+
+    if (device->IdleEventId != 0)
+    {
+        HostDeviceScheduleIdle(device);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceStopIdleActual(
+    WDFDEVICE   Device,
+    BOOLEAN     WaitForD0,
+    PVOID       Tag,
+    LONG        Line,
+    PCSTR       File)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+    HOST_LOCK lock(HostFrameworkLock());
+
+    UNREFERENCED_PARAMETER(WaitForD0);
+    UNREFERENCED_PARAMETER(Tag);
+    UNREFERENCED_PARAMETER(Line);
+    UNREFERENCED_PARAMETER(File);
+
+    device->PowerReferences++;
+    HostCancelEvent(device->IdleEventId);
+    device->IdleEventId = 0;
+
+    return HostDeviceSetPower(device, TRUE);
+}
+
+EXTERN_C
+VOID
+WdfDeviceResumeIdleActual(
+    WDFDEVICE   Device,
+    PVOID       Tag,
+    LONG        Line,
+    PCSTR       File)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+    HOST_LOCK lock(HostFrameworkLock());
+
+    UNREFERENCED_PARAMETER(Tag);
+    UNREFERENCED_PARAMETER(Line);
+    UNREFERENCED_PARAMETER(File);
+
+    NT_ASSERT(device->PowerReferences > 0);
+
+    device->PowerReferences--;
+    HostDeviceScheduleIdle(device);
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceEnqueueRequest(
+    WDFDEVICE   Device,
+    WDFREQUEST  Request)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    device->Pending.push_back(request);
+    HostDeviceDispatch(device);
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+PDEVICE_OBJECT
+WdfDeviceWdmGetDeviceObject(
+    WDFDEVICE Device)
+{
+    return HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice)->WdmDevice;
+}
+
+EXTERN_C
+POWER_ACTION
+WdfDeviceGetSystemPowerAction(
+    WDFDEVICE Device)
+{
+    UNREFERENCED_PARAMETER(Device);
+
+    return g_HostSystemPowerAction;
+}
+
+EXTERN_C
+WDFDRIVER
+WdfDeviceGetDriver(
+    WDFDEVICE Device)
+{
+    UNREFERENCED_PARAMETER(Device);
+
+    return s_Driver;
+}
+
+EXTERN_C
+NTSTATUS
+WdfDeviceOpenRegistryKey(
+    WDFDEVICE               Device,
+    ULONG                   DeviceInstanceKeyType,
+    ACCESS_MASK             DesiredAccess,
+    PWDF_OBJECT_ATTRIBUTES  KeyAttributes,
+    WDFKEY                 *Key)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+
+    if ((DeviceInstanceKeyType != PLUGPLAY_REGKEY_DEVICE) ||
+        (device->SimDevice == nullptr))
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    return HostKeyCreate(&device->SimDevice->Registry, KeyAttributes, Key);
+}
+
+/////////////////////////////////////////////////
+//
+// Sequential queue and idle power management.
+//
+/////////////////////////////////////////////////
+
+NTSTATUS
+HostDeviceSetPower(
+    _In_  HOST_DEVICE  *Device,
+    _In_  BOOLEAN       D0)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (D0 == Device->InD0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (D0)
+    {
+        if (Device->PnpPowerCallbacks.EvtDeviceD0Entry != nullptr)
+        {
+            status = Device->PnpPowerCallbacks.EvtDeviceD0Entry(
+                Device, WdfPowerDeviceD3);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            Device->InD0 = TRUE;
+        }
+    }
+    else
+    {
+        if (Device->PnpPowerCallbacks.EvtDeviceD0Exit != nullptr)
+        {
+            Device->PnpPowerCallbacks.EvtDeviceD0Exit(
+                Device,
+                Device->Deleted ? WdfPowerDeviceD3Final : WdfPowerDeviceD3);
+        }
+
+        Device->InD0 = FALSE;
+    }
+
+    return status;
+}
+
+VOID
+HostDeviceScheduleIdle(
+    _In_  HOST_DEVICE  *Device)
+{
+    ULONG timeoutMs;
+    ULONGLONG id;
+
+    HostCancelEvent(Device->IdleEventId);
+    Device->IdleEventId = 0;
+
+    if (!Device->IdleEnabled ||
+        !Device->InD0 ||
+        (Device->PowerReferences != 0) ||
+        (Device->Presented != nullptr) ||
+        !Device->Pending.empty())
+    {
+        return;
+    }
+
+    //
+    // The framework default idle timeout is 5 seconds.
+    //
+
+    timeoutMs = Device->IdleSettings.IdleTimeout;
+
+    if (timeoutMs == IdleTimeoutDefaultValue)
+    {
+        timeoutMs = 5000;
+    }
+
+    id = HostScheduleEvent((ULONGLONG)timeoutMs * 1000, [Device]()
+    {
+        Device->IdleEventId = 0;
+
+        if ((Device->Presented == nullptr) &&
+            Device->Pending.empty() &&
+            (Device->PowerReferences == 0))
+        {
+            HostDeviceSetPower(Device, FALSE);
+        }
+    });
+
+    Device->IdleEventId = id;
+}
+
+static
+VOID
+HostDevicePresent(
+    _In_  HOST_DEVICE   *Device,
+    _In_  HOST_REQUEST  *Request)
+{
+    PSPB_CONTROLLER_CONFIG config = &Device->SpbConfig;
+    SPBTARGET target = Request->Target;
+
+    switch (Request->SpbType)
+    {
+    case SpbRequestTypeRead:
+        if (config->EvtSpbIoRead != nullptr)
+        {
+            config->EvtSpbIoRead(Device, target, Request, Request->Parameters.Parameters.Read.Length);
+            return;
+        }
+        break;
+
+    case SpbRequestTypeWrite:
+        if (config->EvtSpbIoWrite != nullptr)
+        {
+            config->EvtSpbIoWrite(Device, target, Request, Request->Parameters.Parameters.Write.Length);
+            return;
+        }
+        break;
+
+    case SpbRequestTypeSequence:
+        if (config->EvtSpbIoSequence != nullptr)
+        {
+            config->EvtSpbIoSequence(Device, target, Request, (ULONG)Request->Transfers.size());
+            return;
+        }
+        break;
+
+    case SpbRequestTypeLockController:
+        if (config->EvtSpbControllerLock != nullptr)
+        {
+            config->EvtSpbControllerLock(Device, target, Request);
+            return;
+        }
+        break;
+
+    case SpbRequestTypeUnlockController:
+        if (config->EvtSpbControllerUnlock != nullptr)
+        {
+            config->EvtSpbControllerUnlock(Device, target, Request);
+            return;
+        }
+        break;
+
+    case SpbRequestTypeLockConnection:
+        if (config->EvtSpbConnectionLock != nullptr)
+        {
+            config->EvtSpbConnectionLock(Device, target, Request);
+            return;
+        }
+        break;
+
+    case SpbRequestTypeUnlockConnection:
+        if (config->EvtSpbConnectionUnlock != nullptr)
+        {
+            config->EvtSpbConnectionUnlock(Device, target, Request);
+            return;
+        }
+        break;
+
+    case SpbRequestTypeOther:
+        if (Device->EvtSpbIoOther != nullptr)
+        {
+            Device->EvtSpbIoOther(
+                Device,
+                target,
+                Request,
+                Request->Parameters.Parameters.DeviceIoControl.OutputBufferLength,
+                Request->Parameters.Parameters.DeviceIoControl.InputBufferLength,
+                Request->Parameters.Parameters.DeviceIoControl.IoControlCode);
+            return;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    //
+    // Unsupported lock requests succeed in SPBCx, everything
+    // else is rejected.
+    //
+
+    switch (Request->SpbType)
+    {
+    case SpbRequestTypeLockController:
+    case SpbRequestTypeUnlockController:
+    case SpbRequestTypeLockConnection:
+    case SpbRequestTypeUnlockConnection:
+        HostRequestComplete(Request, STATUS_SUCCESS, 0);
+        break;
+
+    default:
+        HostRequestComplete(Request, STATUS_NOT_SUPPORTED, 0);
+        break;
+    }
+}
+
+VOID
+HostDeviceDispatch(
+    _In_  HOST_DEVICE  *Device)
+{
+    if (Device->Dispatching)
+    {
+        return;
+    }
+
+    Device->Dispatching = TRUE;
+
+    while (Device->Presented == nullptr)
+    {
+        auto next = Device->Pending.begin();
+        HOST_REQUEST *request;
+        NTSTATUS status;
+
+        //
+        // While a target holds the controller lock, SPBCx only
+        // presents the requests of that target.
+        //
+
+        if (Device->LockOwner != nullptr)
+        {
+            next = std::find_if(Device->Pending.begin(), Device->Pending.end(),
+                [Device](HOST_REQUEST *Pending) { return Pending->Target == Device->LockOwner; });
+        }
+
+        if (next == Device->Pending.end())
+        {
+            break;
+        }
+
+        request = *next;
+        Device->Pending.erase(next);
+
+        HostCancelEvent(Device->IdleEventId);
+        Device->IdleEventId = 0;
+
+        //
+        // The SPBCx queue is power managed: the device resumes
+        // before a request is presented.
+        //
+
+        status = HostDeviceSetPower(Device, TRUE);
+
+        if (!NT_SUCCESS(status))
+        {
+            HostRequestComplete(request, status, 0);
+            continue;
+        }
+
+        if (request->Cancelled)
+        {
+            HostRequestComplete(request, STATUS_CANCELLED, 0);
+            continue;
+        }
+
+        Device->Presented = request;
+        HostDevicePresent(Device, request);
+    }
+
+    Device->Dispatching = FALSE;
+
+    HostDeviceScheduleIdle(Device);
+}
+
+/////////////////////////////////////////////////
+//
+// Resources.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+ULONG
+WdfCmResourceListGetCount(
+    WDFCMRESLIST List)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(List, HostObjectTypeDevice);
+
+    if ((device == nullptr) || (device->SimDevice == nullptr))
+    {
+        return 0;
+    }
+
+    return (ULONG)device->SimDevice->Resources.size();
+}
+
+EXTERN_C
+PCM_PARTIAL_RESOURCE_DESCRIPTOR
+WdfCmResourceListGetDescriptor(
+    WDFCMRESLIST    List,
+    ULONG           Index)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(List, HostObjectTypeDevice);
+
+    if ((device->SimDevice == nullptr) || (Index >= device->SimDevice->Resources.size()))
+    {
+        return nullptr;
+    }
+
+    return &device->SimDevice->Resources[Index];
+}
+
+/////////////////////////////////////////////////
+//
+// Registry.
+//
+/////////////////////////////////////////////////
+
+HOST_REGISTRY_NODE *
+HOST_REGISTRY_NODE::Open(
+    _In_opt_  PCWSTR  Path,
+    _In_      BOOLEAN Create)
+{
+    HOST_REGISTRY_NODE *node = this;
+    std::wstring path = (Path != nullptr) ? Path : L"";
+    size_t start = 0;
+
+    while (start < path.size())
+    {
+        size_t end = path.find(L'\\', start);
+        std::wstring name;
+
+        if (end == std::wstring::npos)
+        {
+            end = path.size();
+        }
+
+        name = path.substr(start, end - start);
+        start = end + 1;
+
+        if (name.empty())
+        {
+            continue;
+        }
+
+        auto subKey = node->SubKeys.find(name);
+
+        if (subKey == node->SubKeys.end())
+        {
+            if (!Create)
+            {
+                return nullptr;
+            }
+
+            subKey = node->SubKeys.emplace(name,
+                std::unique_ptr<HOST_REGISTRY_NODE>(new HOST_REGISTRY_NODE())).first;
+        }
+
+        node = subKey->second.get();
+    }
+
+    return node;
+}
+
+static
+const HOST_REGISTRY_VALUE *
+HostRegistryFind(
+    _In_  WDFKEY            Key,
+    _In_  PCUNICODE_STRING  ValueName)
+{
+    HOST_KEY *key = HostObjectCast<HOST_KEY>(Key, HostObjectTypeKey);
+    std::wstring name(ValueName->Buffer, ValueName->Length / sizeof(WCHAR));
+    auto value = key->Node->Values.find(name);
+
+    return (value != key->Node->Values.end()) ? &value->second : nullptr;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRegistryOpenKey(
+    WDFKEY                  ParentKey,
+    PCUNICODE_STRING        KeyName,
+    ACCESS_MASK             DesiredAccess,
+    PWDF_OBJECT_ATTRIBUTES  KeyAttributes,
+    WDFKEY                 *Key)
+{
+    HOST_KEY *parent = HostObjectCast<HOST_KEY>(ParentKey, HostObjectTypeKey);
+    std::wstring name(KeyName->Buffer, KeyName->Length / sizeof(WCHAR));
+    HOST_REGISTRY_NODE *node = parent->Node->Open(name.c_str(), FALSE);
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+
+    if (node == nullptr)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    return HostKeyCreate(node, KeyAttributes, Key);
+}
+
+EXTERN_C
+VOID
+WdfRegistryClose(
+    WDFKEY Key)
+{
+    HostObjectDelete(HostObjectCast<HOST_KEY>(Key, HostObjectTypeKey));
+}
+
+EXTERN_C
+NTSTATUS
+WdfRegistryQueryULong(
+    WDFKEY              Key,
+    PCUNICODE_STRING    ValueName,
+    PULONG              Value)
+{
+    const HOST_REGISTRY_VALUE *value = HostRegistryFind(Key, ValueName);
+
+    if (value == nullptr)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    if ((value->Type != REG_DWORD) || (value->Data.size() != sizeof(ULONG)))
+    {
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    }
+
+    RtlCopyMemory(Value, value->Data.data(), sizeof(ULONG));
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRegistryQueryValue(
+    WDFKEY              Key,
+    PCUNICODE_STRING    ValueName,
+    ULONG               ValueLength,
+    PVOID               Value,
+    PULONG              ValueLengthQueried,
+    PULONG              ValueType)
+{
+    const HOST_REGISTRY_VALUE *value = HostRegistryFind(Key, ValueName);
+
+    if (value == nullptr)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    if (ValueLengthQueried != nullptr)
+    {
+        *ValueLengthQueried = (ULONG)value->Data.size();
+    }
+
+    if (ValueType != nullptr)
+    {
+        *ValueType = value->Type;
+    }
+
+    if (ValueLength < value->Data.size())
+    {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    RtlCopyMemory(Value, value->Data.data(), value->Data.size());
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRegistryQueryMemory(
+    WDFKEY                  Key,
+    PCUNICODE_STRING        ValueName,
+    POOL_TYPE               PoolType,
+    PWDF_OBJECT_ATTRIBUTES  MemoryAttributes,
+    WDFMEMORY              *Memory,
+    PULONG                  ValueType)
+{
+    const HOST_REGISTRY_VALUE *value = HostRegistryFind(Key, ValueName);
+    PVOID buffer;
+    NTSTATUS status;
+
+    if (value == nullptr)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    status = WdfMemoryCreate(
+        MemoryAttributes,
+        PoolType,
+        0,
+        value->Data.size(),
+        Memory,
+        &buffer);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    RtlCopyMemory(buffer, value->Data.data(), value->Data.size());
+
+    if (ValueType != nullptr)
+    {
+        *ValueType = value->Type;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/////////////////////////////////////////////////
+//
+// Memory.
+//
+/////////////////////////////////////////////////
+
+HOST_MEMORY::~HOST_MEMORY()
+{
+    if (Owned)
+    {
+        free(Buffer);
+    }
+}
+
+HOST_MEMORY *
+HostMemoryCreate(
+    _In_opt_  HOST_OBJECT  *Parent,
+    _In_      PVOID         Buffer,
+    _In_      size_t        Size,
+    _In_      BOOLEAN       Copy)
+{
+    HOST_MEMORY *memory = new HOST_MEMORY();
+
+    memory->Size = Size;
+
+    if (Copy)
+    {
+        memory->Buffer = calloc(1, std::max(Size, (size_t)1));
+        memory->Owned = TRUE;
+
+        if (Buffer != nullptr)
+        {
+            RtlCopyMemory(memory->Buffer, Buffer, Size);
+        }
+    }
+    else
+    {
+        memory->Buffer = Buffer;
+    }
+
+    HostObjectInitialize(memory, WDF_NO_OBJECT_ATTRIBUTES, Parent);
+
+    return memory;
+}
+
+EXTERN_C
+NTSTATUS
+WdfMemoryCreate(
+    PWDF_OBJECT_ATTRIBUTES  Attributes,
+    POOL_TYPE               PoolType,
+    ULONG                   PoolTag,
+    size_t                  BufferSize,
+    WDFMEMORY              *Memory,
+    PVOID                  *Buffer)
+{
+    HOST_MEMORY *memory = new HOST_MEMORY();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(PoolTag);
+
+    if (BufferSize == 0)
+    {
+        delete memory;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memory->Buffer = calloc(1, BufferSize);
+    memory->Size = BufferSize;
+    memory->Owned = TRUE;
+
+    status = HostObjectInitialize(memory, Attributes, HostGetDriver());
+
+    if ((memory->Buffer == nullptr) || !NT_SUCCESS(status))
+    {
+        delete memory;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Memory = memory;
+
+    if (Buffer != nullptr)
+    {
+        *Buffer = memory->Buffer;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfMemoryCreatePreallocated(
+    PWDF_OBJECT_ATTRIBUTES  Attributes,
+    PVOID                   Buffer,
+    size_t                  BufferSize,
+    WDFMEMORY              *Memory)
+{
+    HOST_MEMORY *memory = new HOST_MEMORY();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    memory->Buffer = Buffer;
+    memory->Size = BufferSize;
+
+    status = HostObjectInitialize(memory, Attributes, HostGetDriver());
+
+    if (!NT_SUCCESS(status))
+    {
+        delete memory;
+        return status;
+    }
+
+    *Memory = memory;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfMemoryAssignBuffer(
+    WDFMEMORY   Memory,
+    PVOID       Buffer,
+    size_t      BufferSize)
+{
+    HOST_MEMORY *memory = (HOST_MEMORY *)Memory;
+
+    if ((Buffer == nullptr) || (BufferSize == 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memory->Buffer = Buffer;
+    memory->Size = BufferSize;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+PVOID
+WdfMemoryGetBuffer(
+    WDFMEMORY   Memory,
+    size_t     *BufferSize)
+{
+    HOST_MEMORY *memory = HostObjectCast<HOST_MEMORY>(Memory, HostObjectTypeMemory);
+
+    if (BufferSize != nullptr)
+    {
+        *BufferSize = memory->Size;
+    }
+
+    return memory->Buffer;
+}
+
+EXTERN_C
+NTSTATUS
+WdfMemoryCopyToBuffer(
+    WDFMEMORY   SourceMemory,
+    size_t      SourceOffset,
+    PVOID       Buffer,
+    size_t      NumBytesToCopyTo)
+{
+    HOST_MEMORY *memory = HostObjectCast<HOST_MEMORY>(SourceMemory, HostObjectTypeMemory);
+
+    if ((SourceOffset > memory->Size) ||
+        (NumBytesToCopyTo > memory->Size - SourceOffset))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlCopyMemory(Buffer, (PUCHAR)memory->Buffer + SourceOffset, NumBytesToCopyTo);
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfMemoryCopyFromBuffer(
+    WDFMEMORY   DestinationMemory,
+    size_t      DestinationOffset,
+    PVOID       Buffer,
+    size_t      NumBytesToCopyFrom)
+{
+    HOST_MEMORY *memory = HostObjectCast<HOST_MEMORY>(DestinationMemory, HostObjectTypeMemory);
+
+    if ((DestinationOffset > memory->Size) ||
+        (NumBytesToCopyFrom > memory->Size - DestinationOffset))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlCopyMemory((PUCHAR)memory->Buffer + DestinationOffset, Buffer, NumBytesToCopyFrom);
+
+    return STATUS_SUCCESS;
+}
+
+/////////////////////////////////////////////////
+//
+// Requests.
+//
+/////////////////////////////////////////////////
+
+HOST_REQUEST::~HOST_REQUEST()
+{
+    HostCancelEvent(CompletionEventId);
+}
+
+VOID
+HostRequestComplete(
+    _In_  HOST_REQUEST  *Request,
+    _In_  NTSTATUS       Status,
+    _In_  ULONG_PTR      Information)
+{
+    HOST_DEVICE *device = Request->Device;
+
+    NT_ASSERT(Request->Client && !Request->Completed);
+
+    Request->Status = Status;
+    Request->Information = Information;
+    Request->Completed = TRUE;
+    Request->EvtCancel = nullptr;
+
+    if (device != nullptr)
+    {
+        if (device->Presented == Request)
+        {
+            device->Presented = nullptr;
+        }
+
+        if ((Request->SpbType == SpbRequestTypeLockController) && NT_SUCCESS(Status))
+        {
+            device->LockOwner = Request->Target;
+        }
+        else if (Request->SpbType == SpbRequestTypeUnlockController)
+        {
+            device->LockOwner = nullptr;
+        }
+
+        auto pending = std::find(device->Pending.begin(), device->Pending.end(), Request);
+
+        if (pending != device->Pending.end())
+        {
+            device->Pending.erase(pending);
+        }
+    }
+
+    Request->CompletedEvent.notify_all();
+
+    if (device != nullptr)
+    {
+        HostDeviceDispatch(device);
+    }
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestCreate(
+    PWDF_OBJECT_ATTRIBUTES  RequestAttributes,
+    WDFIOTARGET             IoTarget,
+    WDFREQUEST             *Request)
+{
+    HOST_REQUEST *request = new HOST_REQUEST();
+    HOST_OBJECT *parent = HostGetDriver();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    if (IoTarget != nullptr)
+    {
+        parent = HostObjectCast<HOST_IO_TARGET>(IoTarget, HostObjectTypeIoTarget)->Device;
+    }
+
+    WDF_REQUEST_PARAMETERS_INIT(&request->Parameters);
+    RtlZeroMemory(&request->Operation, sizeof(request->Operation));
+
+    status = HostObjectInitialize(request, RequestAttributes, parent);
+
+    if (!NT_SUCCESS(status))
+    {
+        delete request;
+        return status;
+    }
+
+    *Request = request;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestReuse(
+    WDFREQUEST                  Request,
+    PWDF_REQUEST_REUSE_PARAMS   ReuseParams)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    NT_ASSERT(!request->Sent);
+
+    request->Status = ReuseParams->Status;
+    request->Information = 0;
+    request->FormattedTarget = nullptr;
+    request->FormattedInput.clear();
+    request->Bounce.clear();
+    request->BounceMdls.clear();
+    request->CompletionRoutine = nullptr;
+    request->CompletionContext = nullptr;
+    RtlZeroMemory(&request->Operation, sizeof(request->Operation));
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Completes a sent request: copies the bounce buffers of the
+// operation back to the MDL chains they were gathered from and
+// calls the completion routine.
+//
+
+static
+VOID
+HostSentRequestComplete(
+    _In_  HOST_REQUEST  *Request,
+    _In_  NTSTATUS       Status,
+    _In_  ULONG_PTR      Information)
+{
+    WDF_REQUEST_COMPLETION_PARAMS params;
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE routine = Request->CompletionRoutine;
+    HOST_SPB_OPERATION *operation = &Request->Operation;
+
+    NT_ASSERT(Request->Sent);
+
+    for (ULONG i = 0; i < operation->TransferCount; i++)
+    {
+        PMDL mdl = (i < Request->BounceMdls.size()) ? Request->BounceMdls[i] : nullptr;
+        PUCHAR buffer = operation->Transfers[i].Buffer;
+        size_t remaining = operation->Transfers[i].Length;
+
+        if ((mdl == nullptr) ||
+            (operation->Transfers[i].Direction != SpbTransferDirectionFromDevice))
+        {
+            continue;
+        }
+
+        for (; (mdl != nullptr) && (remaining != 0); mdl = mdl->Next)
+        {
+            size_t length = std::min((size_t)mdl->ByteCount, remaining);
+
+            RtlCopyMemory(mdl->MappedSystemVa, buffer, length);
+            buffer += length;
+            remaining -= length;
+        }
+    }
+
+    Request->Sent = FALSE;
+    Request->CompletionEventId = 0;
+    Request->Status = Status;
+    Request->Information = NT_SUCCESS(Status) ? Information : 0;
+
+    RtlZeroMemory(&params, sizeof(params));
+    params.Size = sizeof(params);
+    params.IoStatus.Status = Request->Status;
+    params.IoStatus.Information = Request->Information;
+
+    switch (operation->Type)
+    {
+    case HostSpbOperationRead:
+        params.Type = WdfRequestTypeRead;
+        params.Parameters.Read.Length = Request->Information;
+        break;
+
+    case HostSpbOperationWrite:
+        params.Type = WdfRequestTypeWrite;
+        params.Parameters.Write.Length = Request->Information;
+        break;
+
+    default:
+        params.Type = WdfRequestTypeDeviceControlInternal;
+        params.Parameters.Ioctl.IoControlCode = operation->IoControlCode;
+        break;
+    }
+
+    if (routine != nullptr)
+    {
+        routine(Request, Request->FormattedTarget, &params, Request->CompletionContext);
+    }
+}
+
+//
+// Flattens one SPB transfer buffer into a transfer of the
+// operation. MDL chains and buffer lists go through a bounce
+// buffer.
+//
+
+static
+NTSTATUS
+HostRequestAddTransfer(
+    _In_  HOST_REQUEST                   *Request,
+    _In_  const SPB_TRANSFER_LIST_ENTRY  *Entry)
+{
+    HOST_SPB_OPERATION *operation = &Request->Operation;
+    HOST_SPB_TRANSFER *transfer;
+    PMDL bounceMdl = nullptr;
+
+    if (operation->TransferCount >= HOST_SPB_MAX_TRANSFERS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    transfer = &operation->Transfers[operation->TransferCount];
+    transfer->Direction = Entry->Direction;
+    transfer->DelayInUs = Entry->DelayInUs;
+
+    switch (Entry->Buffer.Format)
+    {
+    case SpbTransferBufferFormatSimple:
+    case SpbTransferBufferFormatSimpleNonPaged:
+        transfer->Buffer = (PUCHAR)Entry->Buffer.Simple.Buffer;
+        transfer->Length = Entry->Buffer.Simple.BufferCb;
+        break;
+
+    case SpbTransferBufferFormatMdl:
+    {
+        PMDL mdl = Entry->Buffer.Mdl;
+
+        if (mdl == nullptr)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (mdl->Next == nullptr)
+        {
+            transfer->Buffer = (PUCHAR)mdl->MappedSystemVa;
+            transfer->Length = mdl->ByteCount;
+            break;
+        }
+
+        std::vector<UCHAR> bounce;
+
+        for (; mdl != nullptr; mdl = mdl->Next)
+        {
+            bounce.insert(bounce.end(),
+                (PUCHAR)mdl->MappedSystemVa,
+                (PUCHAR)mdl->MappedSystemVa + mdl->ByteCount);
+        }
+
+        Request->Bounce.push_back(std::move(bounce));
+        transfer->Buffer = Request->Bounce.back().data();
+        transfer->Length = Request->Bounce.back().size();
+        bounceMdl = Entry->Buffer.Mdl;
+        break;
+    }
+
+    case SpbTransferBufferFormatList:
+    {
+        //
+        // Read buffer lists are not used by the probe and are
+        // only gathered.
+        //
+
+        std::vector<UCHAR> bounce;
+
+        for (ULONG i = 0; i < Entry->Buffer.BufferList.ListCe; i++)
+        {
+            PSPB_TRANSFER_BUFFER_LIST_ENTRY list = &Entry->Buffer.BufferList.List[i];
+
+            bounce.insert(bounce.end(),
+                (PUCHAR)list->Buffer,
+                (PUCHAR)list->Buffer + list->BufferCb);
+        }
+
+        Request->Bounce.push_back(std::move(bounce));
+        transfer->Buffer = Request->Bounce.back().data();
+        transfer->Length = Request->Bounce.back().size();
+        break;
+    }
+
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Request->BounceMdls.resize(operation->TransferCount + 1, nullptr);
+    Request->BounceMdls[operation->TransferCount] = bounceMdl;
+    operation->TransferCount++;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Builds the operation from the formatted request, at send
+// time: SPB IOCTLs are METHOD_NEITHER and the controller reads
+// the transfer list from the sender's buffer.
+//
+
+static
+NTSTATUS
+HostRequestBuildOperation(
+    _In_  HOST_REQUEST  *Request)
+{
+    HOST_SPB_OPERATION *operation = &Request->Operation;
+    PSPB_TRANSFER_LIST list;
+    PVOID buffer;
+    size_t length;
+
+    operation->TransferCount = 0;
+    operation->Information = 0;
+    operation->CompletionDelayUs = 0;
+    operation->Pend = FALSE;
+    Request->Bounce.clear();
+    Request->BounceMdls.clear();
+    Request->Bounce.reserve(HOST_SPB_MAX_TRANSFERS);
+
+    //
+    // FormattedInput holds the buffer pointer and length of the
+    // formatted memory, see HostRequestFormat.
+    //
+
+    if (Request->FormattedInput.size() != sizeof(PVOID) + sizeof(size_t))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlCopyMemory(&buffer, Request->FormattedInput.data(), sizeof(buffer));
+    RtlCopyMemory(&length, Request->FormattedInput.data() + sizeof(buffer), sizeof(length));
+
+    switch (operation->Type)
+    {
+    case HostSpbOperationRead:
+    case HostSpbOperationWrite:
+    {
+        SPB_TRANSFER_LIST_ENTRY entry = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+            (operation->Type == HostSpbOperationRead) ?
+                SpbTransferDirectionFromDevice : SpbTransferDirectionToDevice,
+            0,
+            buffer,
+            (ULONG)length);
+
+        return HostRequestAddTransfer(Request, &entry);
+    }
+
+    case HostSpbOperationLockController:
+    case HostSpbOperationUnlockController:
+    case HostSpbOperationLockConnection:
+    case HostSpbOperationUnlockConnection:
+        return STATUS_SUCCESS;
+
+    default:
+        break;
+    }
+
+    list = (PSPB_TRANSFER_LIST)buffer;
+
+    if ((list == nullptr) ||
+        (length < sizeof(SPB_TRANSFER_LIST)) ||
+        (list->Size < sizeof(SPB_TRANSFER_LIST)) ||
+        (list->TransferCount == 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (ULONG i = 0; i < list->TransferCount; i++)
+    {
+        NTSTATUS status = HostRequestAddTransfer(Request, &list->Transfers[i]);
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    if ((operation->Type == HostSpbOperationFullDuplex) &&
+        (operation->TransferCount != 2))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+ULONG_PTR
+HostSpbOperationLength(
+    _In_  const HOST_SPB_OPERATION *Operation)
+{
+    ULONG_PTR length = 0;
+
+    for (ULONG i = 0; i < Operation->TransferCount; i++)
+    {
+        length += Operation->Transfers[i].Length;
+    }
+
+    return length;
+}
+
+EXTERN_C
+BOOLEAN
+WdfRequestSend(
+    WDFREQUEST                  Request,
+    WDFIOTARGET                 Target,
+    PWDF_REQUEST_SEND_OPTIONS   Options)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+    HOST_IO_TARGET *target = HostObjectCast<HOST_IO_TARGET>(Target, HostObjectTypeIoTarget);
+    HOST_SPB_OPERATION *operation = &request->Operation;
+    HOST_LOCK lock(HostFrameworkLock());
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(Options);
+
+    NT_ASSERT(!request->Sent);
+
+    if (!target->Started || (target->Controller == nullptr))
+    {
+        request->Status = STATUS_INVALID_DEVICE_STATE;
+        return FALSE;
+    }
+
+    status = HostRequestBuildOperation(request);
+
+    if (!NT_SUCCESS(status))
+    {
+        request->Status = status;
+        return FALSE;
+    }
+
+    request->FormattedTarget = target;
+    request->Sent = TRUE;
+    request->Status = STATUS_PENDING;
+
+    operation->Information = HostSpbOperationLength(operation);
+    status = target->Controller->Execute(operation);
+
+    if (operation->Pend)
+    {
+        return TRUE;
+    }
+
+    if (operation->CompletionDelayUs != 0)
+    {
+        ULONG_PTR information = operation->Information;
+        ULONGLONG id = 0;
+
+        id = HostScheduleEvent(operation->CompletionDelayUs,
+            [request, status, information]()
+        {
+            HostSentRequestComplete(request, status, information);
+        });
+
+        request->CompletionEventId = id;
+
+        return TRUE;
+    }
+
+    HostSentRequestComplete(request, status, operation->Information);
+
+    return TRUE;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestGetStatus(
+    WDFREQUEST Request)
+{
+    return HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest)->Status;
+}
+
+EXTERN_C
+VOID
+WdfRequestSetCompletionRoutine(
+    WDFREQUEST                          Request,
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE  CompletionRoutine,
+    WDFCONTEXT                          CompletionContext)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    request->CompletionRoutine = CompletionRoutine;
+    request->CompletionContext = CompletionContext;
+}
+
+EXTERN_C
+BOOLEAN
+WdfRequestCancelSentRequest(
+    WDFREQUEST Request)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+    HOST_LOCK lock(HostFrameworkLock());
+
+    if (!request->Sent)
+    {
+        return FALSE;
+    }
+
+    //
+    // The controller completes a cancelled request
+    // asynchronously, never from within the cancel call.
+    //
+
+    HostCancelEvent(request->CompletionEventId);
+
+    request->CompletionEventId = HostScheduleEvent(0, [request]()
+    {
+        HostSentRequestComplete(request, STATUS_CANCELLED, 0);
+    });
+
+    return TRUE;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestMarkCancelableEx(
+    WDFREQUEST              Request,
+    PFN_WDF_REQUEST_CANCEL  EvtRequestCancel)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    if (request->Cancelled)
+    {
+        return STATUS_CANCELLED;
+    }
+
+    request->EvtCancel = EvtRequestCancel;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestUnmarkCancelable(
+    WDFREQUEST Request)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    if (request->EvtCancel != nullptr)
+    {
+        request->EvtCancel = nullptr;
+        return STATUS_SUCCESS;
+    }
+
+    return request->CancelRoutineCalled ? STATUS_CANCELLED : STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfRequestComplete(
+    WDFREQUEST  Request,
+    NTSTATUS    Status)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    HostRequestComplete(request, Status, request->Information);
+}
+
+EXTERN_C
+VOID
+WdfRequestCompleteWithInformation(
+    WDFREQUEST  Request,
+    NTSTATUS    Status,
+    ULONG_PTR   Information)
+{
+    HostRequestComplete(
+        HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest),
+        Status,
+        Information);
+}
+
+EXTERN_C
+VOID
+WdfRequestSetInformation(
+    WDFREQUEST  Request,
+    ULONG_PTR   Information)
+{
+    HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest)->Information = Information;
+}
+
+EXTERN_C
+ULONG_PTR
+WdfRequestGetInformation(
+    WDFREQUEST Request)
+{
+    return HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest)->Information;
+}
+
+EXTERN_C
+VOID
+WdfRequestGetParameters(
+    WDFREQUEST              Request,
+    PWDF_REQUEST_PARAMETERS Parameters)
+{
+    *Parameters = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest)->Parameters;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestRetrieveInputMemory(
+    WDFREQUEST  Request,
+    WDFMEMORY  *Memory)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    if (request->InputMemory == nullptr)
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Memory = request->InputMemory;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestRetrieveOutputMemory(
+    WDFREQUEST  Request,
+    WDFMEMORY  *Memory)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    if (request->OutputMemory == nullptr)
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Memory = request->OutputMemory;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+HostRequestRetrieveBuffer(
+    _In_opt_  HOST_MEMORY  *Memory,
+    _In_      size_t        MinimumRequiredLength,
+    _Out_     PVOID        *Buffer,
+    _Out_opt_ size_t       *Length)
+{
+    if ((Memory == nullptr) || (Memory->Size < MinimumRequiredLength))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Buffer = Memory->Buffer;
+
+    if (Length != nullptr)
+    {
+        *Length = Memory->Size;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestRetrieveInputBuffer(
+    WDFREQUEST  Request,
+    size_t      MinimumRequiredLength,
+    PVOID      *Buffer,
+    size_t     *Length)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    return HostRequestRetrieveBuffer(request->InputMemory, MinimumRequiredLength,
+        Buffer, Length);
+}
+
+EXTERN_C
+NTSTATUS
+WdfRequestRetrieveOutputBuffer(
+    WDFREQUEST  Request,
+    size_t      MinimumRequiredSize,
+    PVOID      *Buffer,
+    size_t     *Length)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    return HostRequestRetrieveBuffer(request->OutputMemory, MinimumRequiredSize,
+        Buffer, Length);
+}
+
+EXTERN_C
+WDFQUEUE
+WdfRequestGetIoQueue(
+    WDFREQUEST Request)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+
+    return (request->Device != nullptr) ? request->Device->DefaultQueue : nullptr;
+}
+
+/////////////////////////////////////////////////
+//
+// Queues.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+NTSTATUS
+WdfIoQueueCreate(
+    WDFDEVICE               Device,
+    PWDF_IO_QUEUE_CONFIG    Config,
+    PWDF_OBJECT_ATTRIBUTES  QueueAttributes,
+    WDFQUEUE               *Queue)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+    HOST_QUEUE *queue = new HOST_QUEUE();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    queue->Config = *Config;
+
+    status = HostObjectInitialize(queue, QueueAttributes, device);
+
+    if (!NT_SUCCESS(status))
+    {
+        delete queue;
+        return status;
+    }
+
+    if (Config->DefaultQueue)
+    {
+        device->DefaultQueue = queue;
+    }
+
+    if (Queue != WDF_NO_HANDLE)
+    {
+        *Queue = queue;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+WDFDEVICE
+WdfIoQueueGetDevice(
+    WDFQUEUE Queue)
+{
+    return HostObjectCast<HOST_QUEUE>(Queue, HostObjectTypeQueue)->Parent;
+}
+
+/////////////////////////////////////////////////
+//
+// I/O targets.
+//
+/////////////////////////////////////////////////
+
+EXTERN_C
+NTSTATUS
+WdfIoTargetCreate(
+    WDFDEVICE               Device,
+    PWDF_OBJECT_ATTRIBUTES  IoTargetAttributes,
+    WDFIOTARGET            *IoTarget)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+    HOST_IO_TARGET *target = new HOST_IO_TARGET();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    target->Device = device;
+
+    status = HostObjectInitialize(target, IoTargetAttributes, device);
+
+    if (!NT_SUCCESS(status))
+    {
+        delete target;
+        return status;
+    }
+
+    *IoTarget = target;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfIoTargetOpen(
+    WDFIOTARGET                 IoTarget,
+    PWDF_IO_TARGET_OPEN_PARAMS  OpenParams)
+{
+    HOST_IO_TARGET *target = HostObjectCast<HOST_IO_TARGET>(IoTarget, HostObjectTypeIoTarget);
+    std::wstring name(OpenParams->TargetDeviceName.Buffer,
+        OpenParams->TargetDeviceName.Length / sizeof(WCHAR));
+    std::wstring prefix = RESOURCE_HUB_DEVICE_NAME L"\\";
+    HostSpbController *controller;
+    LONGLONG id;
+
+    //
+    // Only resource hub paths are supported:
+    // \Device\RESOURCE_HUB\<connection ID in hex>.
+    //
+
+    if ((name.compare(0, prefix.size(), prefix) != 0) ||
+        (name.size() == prefix.size()))
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    id = (LONGLONG)wcstoull(name.c_str() + prefix.size(), nullptr, 16);
+    controller = HostFindController(id);
+
+    if (controller == nullptr)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    target->Controller = controller;
+    target->Opened = TRUE;
+    target->Started = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfIoTargetClose(
+    WDFIOTARGET IoTarget)
+{
+    HOST_IO_TARGET *target = HostObjectCast<HOST_IO_TARGET>(IoTarget, HostObjectTypeIoTarget);
+
+    target->Opened = FALSE;
+    target->Started = FALSE;
+    target->Controller = nullptr;
+}
+
+EXTERN_C
+NTSTATUS
+WdfIoTargetStart(
+    WDFIOTARGET IoTarget)
+{
+    HOST_IO_TARGET *target = HostObjectCast<HOST_IO_TARGET>(IoTarget, HostObjectTypeIoTarget);
+
+    if (!target->Opened)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    target->Started = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfIoTargetStop(
+    WDFIOTARGET                     IoTarget,
+    WDF_IO_TARGET_SENT_IO_ACTION    Action)
+{
+    HOST_IO_TARGET *target = HostObjectCast<HOST_IO_TARGET>(IoTarget, HostObjectTypeIoTarget);
+
+    UNREFERENCED_PARAMETER(Action);
+
+    target->Started = FALSE;
+}
+
+static
+NTSTATUS
+HostRequestFormat(
+    _In_      WDFIOTARGET              IoTarget,
+    _In_      WDFREQUEST               Request,
+    _In_      HOST_SPB_OPERATION_TYPE  Type,
+    _In_      ULONG                    IoctlCode,
+    _In_opt_  WDFMEMORY                Memory,
+    _In_opt_  PWDFMEMORY_OFFSET        Offset)
+{
+    HOST_REQUEST *request = HostObjectCast<HOST_REQUEST>(Request, HostObjectTypeRequest);
+    HOST_MEMORY *memory = nullptr;
+    PVOID buffer = nullptr;
+    size_t length = 0;
+
+    NT_ASSERT(!request->Sent);
+
+    if (Memory != nullptr)
+    {
+        memory = HostObjectCast<HOST_MEMORY>(Memory, HostObjectTypeMemory);
+        buffer = memory->Buffer;
+        length = memory->Size;
+
+        if (Offset != nullptr)
+        {
+            if ((Offset->BufferOffset > memory->Size) ||
+                (Offset->BufferLength > memory->Size - Offset->BufferOffset))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            buffer = (PUCHAR)buffer + Offset->BufferOffset;
+            length = Offset->BufferLength;
+        }
+    }
+
+    //
+    // Only the buffer pointer and length are kept, as with an
+    // IRP: the memory is read again when the request is sent.
+    //
+
+    request->FormattedTarget =
+        HostObjectCast<HOST_IO_TARGET>(IoTarget, HostObjectTypeIoTarget);
+    request->FormattedInput.resize(sizeof(buffer) + sizeof(length));
+    RtlCopyMemory(request->FormattedInput.data(), &buffer, sizeof(buffer));
+    RtlCopyMemory(request->FormattedInput.data() + sizeof(buffer), &length, sizeof(length));
+    RtlZeroMemory(&request->Operation, sizeof(request->Operation));
+    request->Operation.Type = Type;
+    request->Operation.IoControlCode = IoctlCode;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfIoTargetFormatRequestForRead(
+    WDFIOTARGET         IoTarget,
+    WDFREQUEST          Request,
+    WDFMEMORY           OutputBuffer,
+    PWDFMEMORY_OFFSET   OutputBufferOffset,
+    PLONGLONG           DeviceOffset)
+{
+    UNREFERENCED_PARAMETER(DeviceOffset);
+
+    return HostRequestFormat(IoTarget, Request, HostSpbOperationRead, 0,
+        OutputBuffer, OutputBufferOffset);
+}
+
+EXTERN_C
+NTSTATUS
+WdfIoTargetFormatRequestForWrite(
+    WDFIOTARGET         IoTarget,
+    WDFREQUEST          Request,
+    WDFMEMORY           InputBuffer,
+    PWDFMEMORY_OFFSET   InputBufferOffset,
+    PLONGLONG           DeviceOffset)
+{
+    UNREFERENCED_PARAMETER(DeviceOffset);
+
+    return HostRequestFormat(IoTarget, Request, HostSpbOperationWrite, 0,
+        InputBuffer, InputBufferOffset);
+}
+
+EXTERN_C
+NTSTATUS
+WdfIoTargetFormatRequestForIoctl(
+    WDFIOTARGET         IoTarget,
+    WDFREQUEST          Request,
+    ULONG               IoctlCode,
+    WDFMEMORY           InputBuffer,
+    PWDFMEMORY_OFFSET   InputBufferOffset,
+    WDFMEMORY           OutputBuffer,
+    PWDFMEMORY_OFFSET   OutputBufferOffset)
+{
+    HOST_SPB_OPERATION_TYPE type;
+
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferOffset);
+
+    switch (IoctlCode)
+    {
+    case IOCTL_SPB_EXECUTE_SEQUENCE:
+        type = HostSpbOperationSequence;
+        break;
+
+    case IOCTL_SPB_FULL_DUPLEX:
+        type = HostSpbOperationFullDuplex;
+        break;
+
+    case IOCTL_SPB_LOCK_CONTROLLER:
+        type = HostSpbOperationLockController;
+        break;
+
+    case IOCTL_SPB_UNLOCK_CONTROLLER:
+        type = HostSpbOperationUnlockController;
+        break;
+
+    case IOCTL_SPB_LOCK_CONNECTION:
+        type = HostSpbOperationLockConnection;
+        break;
+
+    case IOCTL_SPB_UNLOCK_CONNECTION:
+        type = HostSpbOperationUnlockConnection;
+        break;
+
+    default:
+        type = HostSpbOperationIoctl;
+        break;
+    }
+
+    return HostRequestFormat(IoTarget, Request, type, IoctlCode,
+        InputBuffer, InputBufferOffset);
+}
+
+/////////////////////////////////////////////////
+//
+// Timers and work items.
+//
+/////////////////////////////////////////////////
+
+struct HOST_TIMER : HOST_OBJECT
+{
+    HOST_TIMER() : HOST_OBJECT(HostObjectTypeTimer) {}
+
+    ~HOST_TIMER(
+        ) override
+    {
+        HostCancelEvent(EventId);
+    }
+
+    WDF_TIMER_CONFIG                Config;
+    ULONGLONG                       EventId = 0;
+};
+
+struct HOST_WORKITEM : HOST_OBJECT
+{
+    HOST_WORKITEM() : HOST_OBJECT(HostObjectTypeWorkItem) {}
+
+    ~HOST_WORKITEM(
+        ) override
+    {
+        HostCancelEvent(EventId);
+    }
+
+    WDF_WORKITEM_CONFIG             Config;
+    ULONGLONG                       EventId = 0;
+};
+
+EXTERN_C
+NTSTATUS
+WdfTimerCreate(
+    PWDF_TIMER_CONFIG       Config,
+    PWDF_OBJECT_ATTRIBUTES  Attributes,
+    WDFTIMER               *Timer)
+{
+    HOST_TIMER *timer = new HOST_TIMER();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    if ((Attributes == WDF_NO_OBJECT_ATTRIBUTES) || (Attributes->ParentObject == nullptr))
+    {
+        delete timer;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    timer->Config = *Config;
+
+    status = HostObjectInitialize(timer, Attributes, nullptr);
+
+    if (!NT_SUCCESS(status))
+    {
+        delete timer;
+        return status;
+    }
+
+    *Timer = timer;
+
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+HostTimerSchedule(
+    _In_  HOST_TIMER  *Timer,
+    _In_  ULONGLONG    DelayUs)
+{
+    ULONGLONG id = HostScheduleEvent(DelayUs, [Timer]()
+    {
+        Timer->EventId = 0;
+
+        if (Timer->Config.Period != 0)
+        {
+            HostTimerSchedule(Timer, (ULONGLONG)Timer->Config.Period * 1000);
+        }
+
+        Timer->Config.EvtTimerFunc(Timer);
+    });
+
+    Timer->EventId = id;
+}
+
+EXTERN_C
+BOOLEAN
+WdfTimerStart(
+    WDFTIMER    Timer,
+    LONGLONG    DueTime)
+{
+    HOST_TIMER *timer = HostObjectCast<HOST_TIMER>(Timer, HostObjectTypeTimer);
+    HOST_LOCK lock(HostFrameworkLock());
+    BOOLEAN queued = HostCancelEvent(timer->EventId);
+    ULONGLONG delayUs = 0;
+
+    //
+    // Negative due times are relative, in 100ns units, positive
+    // ones are absolute system times.
+    //
+
+    if (DueTime < 0)
+    {
+        delayUs = (ULONGLONG)(-DueTime) / 10;
+    }
+    else if (DueTime > 0)
+    {
+        LARGE_INTEGER now;
+
+        KeQuerySystemTimePrecise(&now);
+
+        if (DueTime > now.QuadPart)
+        {
+            delayUs = (ULONGLONG)(DueTime - now.QuadPart) / 10;
+        }
+    }
+
+    HostTimerSchedule(timer, delayUs);
+
+    return queued;
+}
+
+EXTERN_C
+BOOLEAN
+WdfTimerStop(
+    WDFTIMER    Timer,
+    BOOLEAN     Wait)
+{
+    HOST_TIMER *timer = HostObjectCast<HOST_TIMER>(Timer, HostObjectTypeTimer);
+    HOST_LOCK lock(HostFrameworkLock());
+    BOOLEAN queued = HostCancelEvent(timer->EventId);
+
+    UNREFERENCED_PARAMETER(Wait);
+
+    timer->EventId = 0;
+
+    return queued;
+}
+
+EXTERN_C
+WDFOBJECT
+WdfTimerGetParentObject(
+    WDFTIMER Timer)
+{
+    return HostObjectCast<HOST_TIMER>(Timer, HostObjectTypeTimer)->Parent;
+}
+
+EXTERN_C
+NTSTATUS
+WdfWorkItemCreate(
+    PWDF_WORKITEM_CONFIG    Config,
+    PWDF_OBJECT_ATTRIBUTES  Attributes,
+    WDFWORKITEM            *WorkItem)
+{
+    HOST_WORKITEM *workItem = new HOST_WORKITEM();
+    NTSTATUS status;
+
+    HostCountObjectCreation();
+
+    if ((Attributes == WDF_NO_OBJECT_ATTRIBUTES) || (Attributes->ParentObject == nullptr))
+    {
+        delete workItem;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    workItem->Config = *Config;
+
+    status = HostObjectInitialize(workItem, Attributes, nullptr);
+
+    if (!NT_SUCCESS(status))
+    {
+        delete workItem;
+        return status;
+    }
+
+    *WorkItem = workItem;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfWorkItemEnqueue(
+    WDFWORKITEM WorkItem)
+{
+    HOST_WORKITEM *workItem = HostObjectCast<HOST_WORKITEM>(WorkItem, HostObjectTypeWorkItem);
+    HOST_LOCK lock(HostFrameworkLock());
+
+    if (workItem->EventId != 0)
+    {
+        return;
+    }
+
+    workItem->EventId = HostScheduleEvent(0, [workItem]()
+    {
+        workItem->EventId = 0;
+        workItem->Config.EvtWorkItemFunc(workItem);
+    });
+}
+
+EXTERN_C
+WDFOBJECT
+WdfWorkItemGetParentObject(
+    WDFWORKITEM WorkItem)
+{
+    return HostObjectCast<HOST_WORKITEM>(WorkItem, HostObjectTypeWorkItem)->Parent;
+}
+
+EXTERN_C
+VOID
+WdfWorkItemFlush(
+    WDFWORKITEM WorkItem)
+{
+    HOST_WORKITEM *workItem = HostObjectCast<HOST_WORKITEM>(WorkItem, HostObjectTypeWorkItem);
+    HOST_LOCK lock(HostFrameworkLock());
+
+    //
+    // A queued work item runs now; one already running holds
+    // the framework lock, so it has finished by now.
+    //
+
+    if (HostCancelEvent(workItem->EventId))
+    {
+        workItem->EventId = 0;
+        workItem->Config.EvtWorkItemFunc(workItem);
+    }
+}
+
+/////////////////////////////////////////////////
+//
+// Locks and collections.
+//
+/////////////////////////////////////////////////
+
+struct HOST_SPINLOCK : HOST_OBJECT
+{
+    HOST_SPINLOCK() : HOST_OBJECT(HostObjectTypeSpinLock) {}
+
+    std::mutex                      Lock;
+    KIRQL                           OldIrql = PASSIVE_LEVEL;
+};
+
+struct HOST_WAITLOCK : HOST_OBJECT
+{
+    HOST_WAITLOCK() : HOST_OBJECT(HostObjectTypeWaitLock) {}
+
+    std::timed_mutex                Lock;
+};
+
+struct HOST_COLLECTION : HOST_OBJECT
+{
+    HOST_COLLECTION() : HOST_OBJECT(HostObjectTypeCollection) {}
+
+    std::vector<WDFOBJECT>          Items;
+};
+
+EXTERN_C
+NTSTATUS
+WdfSpinLockCreate(
+    PWDF_OBJECT_ATTRIBUTES  SpinLockAttributes,
+    WDFSPINLOCK            *SpinLock)
+{
+    HOST_SPINLOCK *lock = new HOST_SPINLOCK();
+    NTSTATUS status = HostObjectInitialize(lock, SpinLockAttributes, HostGetDriver());
+
+    HostCountObjectCreation();
+
+    if (!NT_SUCCESS(status))
+    {
+        delete lock;
+        return status;
+    }
+
+    *SpinLock = lock;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfSpinLockAcquire(
+    WDFSPINLOCK SpinLock)
+{
+    HOST_SPINLOCK *lock = HostObjectCast<HOST_SPINLOCK>(SpinLock, HostObjectTypeSpinLock);
+    KIRQL oldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    lock->Lock.lock();
+    lock->OldIrql = oldIrql;
+}
+
+EXTERN_C
+VOID
+WdfSpinLockRelease(
+    WDFSPINLOCK SpinLock)
+{
+    HOST_SPINLOCK *lock = HostObjectCast<HOST_SPINLOCK>(SpinLock, HostObjectTypeSpinLock);
+    KIRQL oldIrql = lock->OldIrql;
+
+    lock->Lock.unlock();
+    KeLowerIrql(oldIrql);
+}
+
+EXTERN_C
+NTSTATUS
+WdfWaitLockCreate(
+    PWDF_OBJECT_ATTRIBUTES  LockAttributes,
+    WDFWAITLOCK            *Lock)
+{
+    HOST_WAITLOCK *lock = new HOST_WAITLOCK();
+    NTSTATUS status = HostObjectInitialize(lock, LockAttributes, HostGetDriver());
+
+    HostCountObjectCreation();
+
+    if (!NT_SUCCESS(status))
+    {
+        delete lock;
+        return status;
+    }
+
+    *Lock = lock;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+NTSTATUS
+WdfWaitLockAcquire(
+    WDFWAITLOCK Lock,
+    PLONGLONG   Timeout)
+{
+    HOST_WAITLOCK *lock = HostObjectCast<HOST_WAITLOCK>(Lock, HostObjectTypeWaitLock);
+
+    if (Timeout == nullptr)
+    {
+        lock->Lock.lock();
+        return STATUS_SUCCESS;
+    }
+
+    if (*Timeout == 0)
+    {
+        return lock->Lock.try_lock() ? STATUS_SUCCESS : STATUS_TIMEOUT;
+    }
+
+    return lock->Lock.try_lock_for(std::chrono::microseconds(
+        (*Timeout < 0) ? (-*Timeout / 10) : 0)) ? STATUS_SUCCESS : STATUS_TIMEOUT;
+}
+
+EXTERN_C
+VOID
+WdfWaitLockRelease(
+    WDFWAITLOCK Lock)
+{
+    HostObjectCast<HOST_WAITLOCK>(Lock, HostObjectTypeWaitLock)->Lock.unlock();
+}
+
+EXTERN_C
+NTSTATUS
+WdfCollectionCreate(
+    PWDF_OBJECT_ATTRIBUTES  CollectionAttributes,
+    WDFCOLLECTION          *Collection)
+{
+    HOST_COLLECTION *collection = new HOST_COLLECTION();
+    NTSTATUS status = HostObjectInitialize(collection, CollectionAttributes, HostGetDriver());
+
+    HostCountObjectCreation();
+
+    if (!NT_SUCCESS(status))
+    {
+        delete collection;
+        return status;
+    }
+
+    *Collection = collection;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+ULONG
+WdfCollectionGetCount(
+    WDFCOLLECTION Collection)
+{
+    return (ULONG)HostObjectCast<HOST_COLLECTION>(
+        Collection, HostObjectTypeCollection)->Items.size();
+}
+
+EXTERN_C
+NTSTATUS
+WdfCollectionAdd(
+    WDFCOLLECTION   Collection,
+    WDFOBJECT       Object)
+{
+    HostObjectCast<HOST_COLLECTION>(
+        Collection, HostObjectTypeCollection)->Items.push_back(Object);
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+VOID
+WdfCollectionRemove(
+    WDFCOLLECTION   Collection,
+    WDFOBJECT       Item)
+{
+    std::vector<WDFOBJECT> &items = HostObjectCast<HOST_COLLECTION>(
+        Collection, HostObjectTypeCollection)->Items;
+
+    items.erase(std::remove(items.begin(), items.end(), Item), items.end());
+}
+
+EXTERN_C
+WDFOBJECT
+WdfCollectionGetItem(
+    WDFCOLLECTION   Collection,
+    ULONG           Index)
+{
+    std::vector<WDFOBJECT> &items = HostObjectCast<HOST_COLLECTION>(
+        Collection, HostObjectTypeCollection)->Items;
+
+    return (Index < items.size()) ? items[Index] : nullptr;
+}
+
+/////////////////////////////////////////////////
+//
+// Interrupts.
+//
+/////////////////////////////////////////////////
+
+struct HOST_INTERRUPT : HOST_OBJECT
+{
+    HOST_INTERRUPT() : HOST_OBJECT(HostObjectTypeInterrupt) {}
+
+    ~HOST_INTERRUPT(
+        ) override
+    {
+        HostCancelEvent(DpcEventId);
+    }
+
+    WDF_INTERRUPT_CONFIG            Config;
+    ULONGLONG                       DpcEventId = 0;
+};
+
+EXTERN_C
+NTSTATUS
+WdfInterruptCreate(
+    WDFDEVICE               Device,
+    PWDF_INTERRUPT_CONFIG   Configuration,
+    PWDF_OBJECT_ATTRIBUTES  Attributes,
+    WDFINTERRUPT           *Interrupt)
+{
+    HOST_DEVICE *device = HostObjectCast<HOST_DEVICE>(Device, HostObjectTypeDevice);
+    HOST_INTERRUPT *interrupt;
+    NTSTATUS status;
+
+    //
+    // Only line interrupts from the resources of the device,
+    // handled at DIRQL with a DPC.
+    //
+
+    if ((Configuration->EvtInterruptIsr == nullptr) ||
+        (Configuration->PassiveHandling) ||
+        (Configuration->InterruptTranslated == nullptr) ||
+        (Configuration->InterruptTranslated->Type != CmResourceTypeInterrupt))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    interrupt = new HOST_INTERRUPT();
+
+    HostCountObjectCreation();
+
+    interrupt->Config = *Configuration;
+
+    status = HostObjectInitialize(interrupt, Attributes, device);
+
+    if (!NT_SUCCESS(status))
+    {
+        delete interrupt;
+        return status;
+    }
+
+    *Interrupt = interrupt;
+
+    return STATUS_SUCCESS;
+}
+
+EXTERN_C
+BOOLEAN
+WdfInterruptQueueDpcForIsr(
+    WDFINTERRUPT Interrupt)
+{
+    HOST_INTERRUPT *interrupt = HostObjectCast<HOST_INTERRUPT>(Interrupt, HostObjectTypeInterrupt);
+    HOST_LOCK lock(HostFrameworkLock());
+
+    if ((interrupt->DpcEventId != 0) || (interrupt->Config.EvtInterruptDpc == nullptr))
+    {
+        return FALSE;
+    }
+
+    interrupt->DpcEventId = HostScheduleEvent(0, [interrupt]()
+    {
+        interrupt->DpcEventId = 0;
+        interrupt->Config.EvtInterruptDpc(interrupt, interrupt->Parent);
+    });
+
+    return TRUE;
+}
+
+VOID
+HostDeviceSignalInterrupts(
+    _In_  HOST_DEVICE  *Device)
+{
+    HOST_LOCK lock(HostFrameworkLock());
+    std::vector<HOST_OBJECT *> children = Device->Children;
+
+    if (!Device->InD0)
+    {
+        return;
+    }
+
+    for (HOST_OBJECT *child : children)
+    {
+        if (child->Type != HostObjectTypeInterrupt)
+        {
+            continue;
+        }
+
+        HOST_INTERRUPT *interrupt = static_cast<HOST_INTERRUPT *>(child);
+
+        (VOID)interrupt->Config.EvtInterruptIsr(interrupt, 0);
+    }
+}
+
+EXTERN_C
+WDFDEVICE
+WdfInterruptGetDevice(
+    WDFINTERRUPT Interrupt)
+{
+    return Interrupt->Parent;
+}
@@ -41,8 +41,14 @@ extern "C"
         )
 }
 
+//
+// Levels above PBC_TRACE_LEVEL_MAX of the trace policy are
+// constant false, and the compiler drops the call.
+//
+
 #define WPP_LEVEL_FLAGS_LOGGER(level,flags) WPP_LEVEL_LOGGER(flags)
-#define WPP_LEVEL_FLAGS_ENABLED(level, flags) (WPP_LEVEL_ENABLED(flags) && WPP_CONTROL(WPP_BIT_ ## flags).Level >= level)
+#define WPP_LEVEL_FLAGS_ENABLED(level, flags) \
+    (((level) <= PBC_TRACE_LEVEL_MAX) && WPP_LEVEL_ENABLED(flags) && WPP_CONTROL(WPP_BIT_ ## flags).Level >= level)
 
 // begin_wpp config
 // FUNC FuncEntry{LEVEL=TRACE_LEVEL_VERBOSE}(FLAGS);
@@ -0,0 +1,524 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    idle.cpp
+
+Abstract:
+
+    This module selects the idle timeout of the device from
+    the monitor state and, optionally, from the gaps between
+    transfers, and counts the idle transitions.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "stats.h"
+#include "idle.h"
+
+#include "idle.tmh"
+
+static
+ULONG
+PbcIdleSelectTimeout(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns the idle timeout for the current
+    monitor state. The timeout stays short while the monitor
+    is off, since the device is then rarely used.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    The idle timeout in ms
+
+--*/
+{
+    PPBC_IDLE pIdle = &pDevice->Idle;
+
+    if (pIdle->MonitorOn == FALSE)
+    {
+        return IDLE_TIMEOUT_MONITOR_OFF;
+    }
+
+    return pIdle->AdaptiveTimeoutMs;
+}
+
+static
+NTSTATUS
+PbcIdleAssignTimeout(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine assigns the selected idle timeout to the
+    device when it changed. It must be called at passive
+    level.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    PPBC_IDLE pIdle = &pDevice->Idle;
+    WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS idleSettings;
+    ULONG timeoutMs = PbcIdleSelectTimeout(pDevice);
+    NTSTATUS status;
+
+    if (timeoutMs == pIdle->AssignedTimeoutMs)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(
+        &idleSettings,
+        IdleCannotWakeFromS0);
+
+    idleSettings.IdleTimeoutType = SystemManagedIdleTimeoutWithHint;
+    idleSettings.IdleTimeout = timeoutMs;
+
+    status = WdfDeviceAssignS0IdleSettings(
+        pDevice->FxDevice,
+        &idleSettings);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to assign idle timeout %lu ms for WDFDEVICE %p - %!STATUS!",
+            timeoutMs,
+            pDevice->FxDevice,
+            status);
+
+        return status;
+    }
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_WDFLOADING,
+        "device %I64d: idle timeout %lu -> %lu ms (monitor %s)",
+        pDevice->PeripheralId.QuadPart,
+        pIdle->AssignedTimeoutMs,
+        timeoutMs,
+        pIdle->MonitorOn ? "on" : "off");
+
+    pIdle->AssignedTimeoutMs = timeoutMs;
+
+    return status;
+}
+
+NTSTATUS
+PbcIdleInitialize(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine registers for monitor power notifications.
+    It must be called once the initial S0 idle settings are
+    assigned, with IDLE_TIMEOUT_MONITOR_ON. A failure to
+    register leaves the initial timeout in place.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    PPBC_IDLE pIdle = &pDevice->Idle;
+    WDF_WORKITEM_CONFIG workItemConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
+
+    RtlZeroMemory(pIdle, sizeof(PBC_IDLE));
+
+    pIdle->MonitorOn = TRUE;
+    pIdle->AdaptiveTimeoutMs = IDLE_TIMEOUT_MONITOR_ON;
+    pIdle->AssignedTimeoutMs = IDLE_TIMEOUT_MONITOR_ON;
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, OnIdleAssignWorkItem);
+    workItemConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = pDevice->FxDevice;
+
+    status = WdfWorkItemCreate(
+        &workItemConfig,
+        &attributes,
+        &pIdle->AssignWorkItem);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to create idle work item - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    //
+    // The callback is invoked right away with the current
+    // monitor state.
+    //
+
+    status = PoRegisterPowerSettingCallback(
+        WdfDeviceWdmGetDeviceObject(pDevice->FxDevice),
+        &GUID_MONITOR_POWER_ON,
+        OnMonitorPowerSettingCallback,
+        pDevice,
+        &pDevice->pMonitorPowerSettingHandle);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to register for monitor power notifications - %!STATUS!",
+            status);
+
+        pDevice->pMonitorPowerSettingHandle = NULL;
+        status = STATUS_SUCCESS;
+    }
+
+exit:
+
+    return status;
+}
+
+VOID
+PbcIdleUninitialize(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine unregisters the monitor power notifications.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (pDevice->pMonitorPowerSettingHandle != NULL)
+    {
+        PoUnregisterPowerSettingCallback(
+            pDevice->pMonitorPowerSettingHandle);
+
+        pDevice->pMonitorPowerSettingHandle = NULL;
+    }
+}
+
+NTSTATUS
+OnMonitorPowerSettingCallback(
+    _In_  LPCGUID  SettingGuid,
+    _In_  PVOID    Value,
+    _In_  ULONG    ValueLength,
+    _In_  PVOID    Context
+    )
+/*++
+
+  Routine Description:
+
+    This routine switches the idle timeout when the monitor
+    is turned on or off. A dimmed monitor counts as on.
+
+  Arguments:
+
+    SettingGuid - GUID_MONITOR_POWER_ON
+    Value - a pointer to the monitor state, 0 when off
+    ValueLength - the length of the value
+    Context - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_WDFLOADING);
+
+    PPBC_DEVICE pDevice = (PPBC_DEVICE)Context;
+    PPBC_IDLE pIdle = &pDevice->Idle;
+    BOOLEAN monitorOn;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!IsEqualGUID(*SettingGuid, GUID_MONITOR_POWER_ON) ||
+        (ValueLength != sizeof(ULONG)))
+    {
+        goto exit;
+    }
+
+    monitorOn = (*(PULONG)Value != 0);
+
+    if (monitorOn != pIdle->MonitorOn)
+    {
+        pIdle->MonitorOn = monitorOn;
+        pIdle->MonitorTransitions++;
+    }
+
+    status = PbcIdleAssignTimeout(pDevice);
+
+exit:
+
+    FuncExit(TRACE_FLAG_WDFLOADING);
+
+    return status;
+}
+
+VOID
+OnIdleAssignWorkItem(
+    _In_  WDFWORKITEM  WorkItem
+    )
+/*++
+
+  Routine Description:
+
+    This routine assigns the adapted idle timeout.
+
+  Arguments:
+
+    WorkItem - the idle work item
+
+  Return Value:
+
+    None
+
+--*/
+{
+    WDFDEVICE fxDevice = (WDFDEVICE)WdfWorkItemGetParentObject(WorkItem);
+
+    (VOID)PbcIdleAssignTimeout(GetDeviceContext(fxDevice));
+}
+
+VOID
+PbcIdleCountD0Exit(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          StartTime
+    )
+/*++
+
+  Routine Description:
+
+    This routine counts a D0 exit caused by the idle
+    timeout. D0 exits for system power transitions are
+    ignored.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    StartTime - the timestamp at the start of the D0 exit
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_IDLE pIdle = &pDevice->Idle;
+
+    if (WdfDeviceGetSystemPowerAction(pDevice->FxDevice) != PowerActionNone)
+    {
+        pIdle->IdleStartTime = 0;
+        return;
+    }
+
+    pIdle->IdleStartTime = PbcQueryTimestamp();
+    pIdle->IdleTransitions++;
+    pIdle->D0ExitTimeUs += PbcElapsedUs(StartTime, pIdle->IdleStartTime);
+}
+
+VOID
+PbcIdleCountD0Entry(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime
+    )
+/*++
+
+  Routine Description:
+
+    This routine counts the D0 entry ending an idle period.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    StartTime - the timestamp at the start of the D0 entry
+    EndTime - the timestamp at the end of the D0 entry
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_IDLE pIdle = &pDevice->Idle;
+
+    if (pIdle->IdleStartTime == 0)
+    {
+        return;
+    }
+
+    PbcHistogramRecord(
+        &pIdle->IdleTime,
+        PbcElapsedUs(pIdle->IdleStartTime, StartTime) / 1000);
+
+    pIdle->D0EntryTimeUs += PbcElapsedUs(StartTime, EndTime);
+    pIdle->IdleStartTime = 0;
+    pIdle->ResumedFromIdle = TRUE;
+}
+
+VOID
+PbcIdleCountTransfer(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          SendTime
+    )
+/*++
+
+  Routine Description:
+
+    This routine adapts the idle timeout to the gap before
+    the first transfer after a resume from idle. A gap up to
+    IDLE_TIMEOUT_ADAPTIVE_MAX means that the device went idle
+    while the client was still polling: the timeout is raised
+    above the gap. A longer gap means that going idle paid
+    off: the timeout decays back to IDLE_TIMEOUT_MONITOR_ON.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    SendTime - the timestamp of the transfer
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_IDLE pIdle = &pDevice->Idle;
+    ULONG timeoutMs = pIdle->AdaptiveTimeoutMs;
+    ULONGLONG gapMs;
+
+    if (pIdle->ResumedFromIdle && (pIdle->LastTransferTime != 0))
+    {
+        gapMs = PbcElapsedUs(pIdle->LastTransferTime, SendTime) / 1000;
+
+        if (gapMs <= IDLE_TIMEOUT_ADAPTIVE_MAX)
+        {
+            pIdle->ShortIdleTransitions++;
+
+            timeoutMs = (ULONG)min(
+                gapMs + (gapMs / 2),
+                (ULONGLONG)IDLE_TIMEOUT_ADAPTIVE_MAX);
+        }
+        else
+        {
+            timeoutMs = max(timeoutMs / 2, (ULONG)IDLE_TIMEOUT_MONITOR_ON);
+        }
+
+        if (pDevice->Config.AdaptiveIdle &&
+            (timeoutMs != pIdle->AdaptiveTimeoutMs))
+        {
+            pIdle->AdaptiveTimeoutMs = max(timeoutMs,
+                (ULONG)IDLE_TIMEOUT_MONITOR_ON);
+
+            WdfWorkItemEnqueue(pIdle->AssignWorkItem);
+        }
+    }
+
+    pIdle->ResumedFromIdle = FALSE;
+    pIdle->LastTransferTime = SendTime;
+}
+
+VOID
+PbcIdleTrace(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine dumps the idle transitions of the device
+    and their cost.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_IDLE pIdle = &pDevice->Idle;
+    PPBC_HISTOGRAM pHistogram = &pIdle->IdleTime;
+
+    if (pIdle->IdleTransitions == 0)
+    {
+        return;
+    }
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_OTHER,
+        "device %I64d: idle transitions=%lu short=%lu monitor "
+        "transitions=%lu timeout=%lu ms D0 exit=%I64u us D0 entry=%I64u us",
+        pDevice->PeripheralId.QuadPart,
+        pIdle->IdleTransitions,
+        pIdle->ShortIdleTransitions,
+        pIdle->MonitorTransitions,
+        pIdle->AssignedTimeoutMs,
+        pIdle->D0ExitTimeUs,
+        pIdle->D0EntryTimeUs);
+
+    if (pHistogram->Count == 0)
+    {
+        return;
+    }
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_OTHER,
+        "device %I64d: idle time count=%lu min=%I64u avg=%I64u max=%I64u ms",
+        pDevice->PeripheralId.QuadPart,
+        pHistogram->Count,
+        pHistogram->Min,
+        pHistogram->Sum / pHistogram->Count,
+        pHistogram->Max);
+}
@@ -0,0 +1,56 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    idle.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the idle timeout selection.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _IDLE_H_
+#define _IDLE_H_
+
+POWER_SETTING_CALLBACK  OnMonitorPowerSettingCallback;
+EVT_WDF_WORKITEM        OnIdleAssignWorkItem;
+
+NTSTATUS
+PbcIdleInitialize(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+PbcIdleUninitialize(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+PbcIdleCountD0Exit(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          StartTime);
+
+VOID
+PbcIdleCountD0Entry(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime);
+
+VOID
+PbcIdleCountTransfer(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          SendTime);
+
+VOID
+PbcIdleTrace(
+    _In_  PPBC_DEVICE       pDevice);
+
+#endif // _IDLE_H_
@@ -0,0 +1,469 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    inject.cpp
+
+Abstract:
+
+    This module injects latency and faults into the requests
+    forwarded to the SPB controller, to stress the error and
+    timeout handling of client drivers.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "peripheral.h"
+#include "stats.h"
+#include "inject.h"
+
+#include "inject.tmh"
+
+ULONG
+PbcInjectionNextRandom(
+    _Inout_  PULONG  pState
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns the next number of a xorshift
+    generator.
+
+  Arguments:
+
+    pState - the generator state, never 0
+
+  Return Value:
+
+    The next pseudo random number
+
+--*/
+{
+    ULONG x = *pState;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    *pState = x;
+
+    return x;
+}
+
+VOID
+PbcInjectionEvaluate(
+    _In_     PPBC_DEVICE_CONFIG      pConfig,
+    _Inout_  PPBC_INJECTION          pInjection,
+    _In_     ULONG                   Address,
+    _In_     SPB_REQUEST_TYPE        Type,
+    _Out_    PPBC_INJECTION_VERDICT  pVerdict
+    )
+/*++
+
+  Routine Description:
+
+    This routine applies the injection rules to the next
+    request. It only depends on the rules and the state, so
+    that the same request order gives the same schedule.
+
+  Arguments:
+
+    pConfig - the configuration holding the rules
+    pInjection - the injection state
+    Address - the address of the target of the request
+    Type - the type of the request
+    pVerdict - receives the actions for the request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    RtlZeroMemory(pVerdict, sizeof(PBC_INJECTION_VERDICT));
+
+    pInjection->Sequence++;
+
+    for (ULONG i = 0; i < pConfig->InjectionRuleCount; i++)
+    {
+        PPBC_INJECTION_RULE pRule = &pConfig->InjectionRules[i];
+
+        if ((pRule->Target != PBC_INJECTION_ANY_TARGET) &&
+            (pRule->Target != Address))
+        {
+            continue;
+        }
+
+        if ((pRule->RequestTypes != 0) &&
+            ((pRule->RequestTypes & (1UL << Type)) == 0))
+        {
+            continue;
+        }
+
+        if ((++pInjection->Matches[i] % pRule->Every) != 0)
+        {
+            continue;
+        }
+
+        pVerdict->LatencyUs += pRule->LatencyUs;
+
+        if (pRule->JitterUs != 0)
+        {
+            pVerdict->LatencyUs +=
+                PbcInjectionNextRandom(&pInjection->RandomState) %
+                (pRule->JitterUs + 1);
+        }
+
+        if (pVerdict->FailStatus == STATUS_SUCCESS)
+        {
+            pVerdict->FailStatus = pRule->FailStatus;
+        }
+
+        pVerdict->TruncateBytes += pRule->TruncateBytes;
+        pVerdict->DropCompletion |= pRule->DropCompletion;
+    }
+}
+
+NTSTATUS
+PbcInjectionInitialize(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine seeds the injection state and creates the
+    latency timer when injection rules are configured.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    PPBC_INJECTION pInjection = &pDevice->Injection;
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    RtlZeroMemory(pInjection, sizeof(PBC_INJECTION));
+
+    if (pDevice->Config.InjectionRuleCount == 0)
+    {
+        goto exit;
+    }
+
+    pInjection->RandomState = pDevice->Config.InjectionSeed;
+
+    if (pInjection->RandomState == 0)
+    {
+        pInjection->RandomState = 1;
+    }
+
+    //
+    // A default timer fires on the system clock tick, up to
+    // 15.6 ms late, which would round microsecond latencies
+    // and jitter up to the tick.
+    //
+
+    WDF_TIMER_CONFIG_INIT(&timerConfig, SpbPeripheralOnInjectedLatency);
+    timerConfig.AutomaticSerialization = FALSE;
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = pDevice->FxDevice;
+
+    status = WdfTimerCreate(
+        &timerConfig,
+        &attributes,
+        &pInjection->LatencyTimer);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to create injection timer - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    Trace(
+        TRACE_LEVEL_WARNING,
+        TRACE_FLAG_WDFLOADING,
+        "Injecting faults with %lu rules, seed %lu",
+        pDevice->Config.InjectionRuleCount,
+        pDevice->Config.InjectionSeed);
+
+exit:
+
+    return status;
+}
+
+NTSTATUS
+SpbPeripheralInjectBeforeSend(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine evaluates the injection rules for the client
+    request about to be forwarded.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request object
+
+  Return Value:
+
+    The status to fail the request with, STATUS_SUCCESS to
+    send it
+
+--*/
+{
+    PPBC_INJECTION pInjection = &pDevice->Injection;
+    PPBC_INJECTION_VERDICT pVerdict = &pInjection->Verdict;
+    PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+
+    RtlZeroMemory(pVerdict, sizeof(PBC_INJECTION_VERDICT));
+
+    if ((pDevice->Config.InjectionRuleCount == 0) ||
+        (pRequest->pTarget == NULL))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    PbcInjectionEvaluate(
+        &pDevice->Config,
+        pInjection,
+        pRequest->pTarget->Settings.Address,
+        pRequest->Type,
+        pVerdict);
+
+    if ((pVerdict->LatencyUs != 0) ||
+        (pVerdict->FailStatus != STATUS_SUCCESS) ||
+        (pVerdict->TruncateBytes != 0) ||
+        pVerdict->DropCompletion)
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_SPBAPI,
+            "device %I64d: injection #%lu on client request %p (txn %I64u): "
+            "latency %lu us fail %!STATUS! truncate %lu drop %d",
+            pDevice->PeripheralId.QuadPart,
+            pInjection->Sequence,
+            ClientRequest,
+            pRequest->TransactionId,
+            pVerdict->LatencyUs,
+            pVerdict->FailStatus,
+            pVerdict->TruncateBytes,
+            pVerdict->DropCompletion);
+    }
+
+    return pVerdict->FailStatus;
+}
+
+BOOLEAN
+SpbPeripheralInjectLatency(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine delays the sending of the SPB request by the
+    injected latency.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    TRUE if the SPB request is sent by the latency timer
+
+--*/
+{
+    PPBC_INJECTION pInjection = &pDevice->Injection;
+
+    if (pInjection->Verdict.LatencyUs == 0)
+    {
+        return FALSE;
+    }
+
+    WdfTimerStart(
+        pInjection->LatencyTimer,
+        WDF_REL_TIMEOUT_IN_US(pInjection->Verdict.LatencyUs));
+
+    return TRUE;
+}
+
+VOID
+SpbPeripheralOnInjectedLatency(
+    _In_  WDFTIMER  Timer
+    )
+/*++
+
+  Routine Description:
+
+    This routine sends the SPB request once the injected
+    latency elapsed.
+
+  Arguments:
+
+    Timer - the latency timer
+
+  Return Value:
+
+    None
+
+--*/
+{
+    FuncEntry(TRACE_FLAG_SPBAPI);
+
+    WDFDEVICE fxDevice = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+    PPBC_DEVICE pDevice = GetDeviceContext(fxDevice);
+    NTSTATUS status;
+
+    GetRequestContext(pDevice->ClientRequest)->SendTime = PbcQueryTimestamp();
+
+    SpbPeripheralTraceSubmit(pDevice, pDevice->ClientRequest);
+
+    if (WdfRequestSend(
+        pDevice->SpbRequest,
+        pDevice->TrueSpbController,
+        WDF_NO_SEND_OPTIONS))
+    {
+        goto exit;
+    }
+
+    status = WdfRequestGetStatus(pDevice->SpbRequest);
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_SPBAPI,
+        "Failed to send delayed SPB request %p (txn %I64u) - %!STATUS!",
+        pDevice->SpbRequest,
+        PbcTransactionId(pDevice->SpbRequest),
+        status);
+
+    //
+    // The cancel routine completes the client request only
+    // while the timer is queued. Once it fired, the request
+    // is completed here, whether or not it has been cancelled
+    // meanwhile, since its cancel routine cannot cancel an SPB
+    // request that was not sent.
+    //
+
+    (VOID)WdfRequestUnmarkCancelable(pDevice->ClientRequest);
+
+    SpbPeripheralCompleteRequestPair(pDevice, status, 0);
+
+exit:
+
+    FuncExit(TRACE_FLAG_SPBAPI);
+}
+
+BOOLEAN
+SpbPeripheralInjectDropCompletion(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest
+    )
+/*++
+
+  Routine Description:
+
+    This routine withholds the completion of the client
+    request. The request stays pending until the client
+    cancels it, see SpbPeripheralOnCancel.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request, no longer cancelable
+
+  Return Value:
+
+    TRUE if the completion is withheld
+
+--*/
+{
+    PPBC_INJECTION pInjection = &pDevice->Injection;
+    NTSTATUS status;
+
+    if (pInjection->Verdict.DropCompletion == FALSE)
+    {
+        return FALSE;
+    }
+
+    //
+    // The flag is set before the request becomes cancelable
+    // again, since the cancel routine may run right away.
+    //
+
+    pInjection->CompletionDropped = TRUE;
+
+    status = WdfRequestMarkCancelableEx(
+        ClientRequest,
+        SpbPeripheralOnCancel);
+
+    if (!NT_SUCCESS(status))
+    {
+        pInjection->CompletionDropped = FALSE;
+        return FALSE;
+    }
+
+    Trace(
+        TRACE_LEVEL_WARNING,
+        TRACE_FLAG_SPBAPI,
+        "Dropped completion of client request %p (txn %I64u)",
+        ClientRequest,
+        PbcTransactionId(ClientRequest));
+
+    return TRUE;
+}
+
+ULONG_PTR
+SpbPeripheralInjectTruncate(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  ULONG_PTR         bytesCompleted
+    )
+/*++
+
+  Routine Description:
+
+    This routine shortens the length reported to the client.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    bytesCompleted - the length reported by the controller
+
+  Return Value:
+
+    The length reported to the client
+
+--*/
+{
+    ULONG truncateBytes = pDevice->Injection.Verdict.TruncateBytes;
+
+    return (bytesCompleted > truncateBytes) ?
+        (bytesCompleted - truncateBytes) : 0;
+}
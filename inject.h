@@ -0,0 +1,62 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    inject.h
+
+Abstract:
+
+    This module contains the function definitions for
+    fault and latency injection.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _INJECT_H_
+#define _INJECT_H_
+
+EVT_WDF_TIMER SpbPeripheralOnInjectedLatency;
+
+ULONG
+PbcInjectionNextRandom(
+    _Inout_  PULONG                  pState);
+
+VOID
+PbcInjectionEvaluate(
+    _In_     PPBC_DEVICE_CONFIG      pConfig,
+    _Inout_  PPBC_INJECTION          pInjection,
+    _In_     ULONG                   Address,
+    _In_     SPB_REQUEST_TYPE        Type,
+    _Out_    PPBC_INJECTION_VERDICT  pVerdict);
+
+NTSTATUS
+PbcInjectionInitialize(
+    _In_  PPBC_DEVICE       pDevice);
+
+NTSTATUS
+SpbPeripheralInjectBeforeSend(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest);
+
+BOOLEAN
+SpbPeripheralInjectLatency(
+    _In_  PPBC_DEVICE       pDevice);
+
+BOOLEAN
+SpbPeripheralInjectDropCompletion(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest);
+
+ULONG_PTR
+SpbPeripheralInjectTruncate(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  ULONG_PTR         bytesCompleted);
+
+#endif // _INJECT_H_
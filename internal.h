@@ -42,6 +42,7 @@ Revision History:
 
 #include "SPBCx.h"
 #include "i2ctrace.h"
+#include "spbprobeioctl.h"
 
 #define RESHUB_USE_HELPER_ROUTINES
 #include "reshub.h"
@@ -93,6 +94,8 @@ typedef struct _PNP_SPI_SERIAL_BUS_DESCRIPTOR {
 #define I2C_SERIAL_BUS_SPECIFIC_FLAG_10BIT_ADDRESS 0x0001
 
 #define SPI_SERIAL_BUS_TYPE 0x02
+#define SPI_SERIAL_BUS_SPECIFIC_FLAG_3WIRE 0x0001
+#define SPI_SERIAL_BUS_SPECIFIC_FLAG_DEVICE_POLARITY_HIGH 0x0002
 
 /////////////////////////////////////////////////
 //
@@ -107,6 +110,9 @@ typedef struct _PNP_SPI_SERIAL_BUS_DESCRIPTOR {
 #define IDLE_TIMEOUT_MONITOR_ON  2000
 #define IDLE_TIMEOUT_MONITOR_OFF 50
 
+// Upper bound of the adaptive idle timeout (ms).
+#define IDLE_TIMEOUT_ADAPTIVE_MAX 10000
+
 //
 // Target settings.
 //
@@ -120,18 +126,497 @@ ADDRESS_MODE, *PADDRESS_MODE;
 
 typedef struct PBC_TARGET_SETTINGS
 {
+    UCHAR                         BusType;
     ADDRESS_MODE                  AddressMode;
+
+    // I2C slave address, or SPI device selection (chip
+    // select line).
     USHORT                        Address;
     ULONG                         ConnectionSpeed;
+
+    // SPI only: bits per word, clock phase and polarity
+    // (SPI mode = Polarity << 1 | Phase), chip select
+    // polarity and 3-wire mode.
+    UCHAR                         DataBitLength;
+    UCHAR                         Phase;
+    UCHAR                         Polarity;
+    BOOLEAN                       ChipSelectActiveHigh;
+    BOOLEAN                       ThreeWire;
 }
 PBC_TARGET_SETTINGS, *PPBC_TARGET_SETTINGS;
 
+//
+// Device configuration, read from the device parameters
+// registry key when the device is added.
+//
+
+#define PBC_REGVALUE_FORWARDED_IOCTLS   L"ForwardedIoctls"
+#define PBC_REGVALUE_COALESCED_TARGETS  L"CoalescedTargets"
+#define PBC_REGVALUE_CACHED_REGISTERS   L"CachedRegisters"
+#define PBC_REGVALUE_CACHE_TTL          L"CacheTtlMs"
+#define PBC_REGVALUE_INJECTION_SEED     L"InjectionSeed"
+#define PBC_REGVALUE_ADAPTIVE_IDLE      L"AdaptiveIdle"
+#define PBC_REGVALUE_TRACE_BUFFERS      L"TraceBuffers"
+#define PBC_REGVALUE_CAPTURE_POLICY     L"CapturePolicy"
+#define PBC_REGVALUE_CAPTURE_SAMPLING   L"CaptureSampleRate"
+#define PBC_REGVALUE_CAPTURE_WATERMARK  L"CaptureWatermark"
+
+#define PBC_REGKEY_INJECTION            L"Injection"
+#define PBC_REGKEY_FLIGHT_RECORDER      L"FlightRecorder"
+
+//
+// TraceBuffers bits: text dump through WPP, one TraceLogging
+// event per transfer with the binary payload, and records in
+// the capture buffers read through the control device.
+//
+
+#define PBC_TRACE_BUFFERS_TEXT          0x1
+#define PBC_TRACE_BUFFERS_EVENTS        0x2
+#define PBC_TRACE_BUFFERS_CAPTURE       0x4
+
+//
+// Trace policy, chosen at build time (PbcTracePolicy property
+// of the project): which TraceBuffers stages are compiled in,
+// and the most verbose WPP level kept. The stages left out
+// are masked out of the configuration and fold away from the
+// completion path, and the traces above the level, among them
+// FuncEntry and FuncExit, compile to nothing.
+//
+
+#define PBC_TRACE_POLICY_FULL           0
+#define PBC_TRACE_POLICY_CAPTURE        1
+#define PBC_TRACE_POLICY_FORWARD        2
+
+#ifndef PBC_TRACE_POLICY
+#define PBC_TRACE_POLICY PBC_TRACE_POLICY_FULL
+#endif
+
+template <ULONG Policy>
+struct PBC_TRACE_POLICY_TRAITS
+{
+    static const ULONG Stages = PBC_TRACE_BUFFERS_TEXT |
+                                PBC_TRACE_BUFFERS_EVENTS |
+                                PBC_TRACE_BUFFERS_CAPTURE;
+    static const ULONG MaxLevel = TRACE_LEVEL_VERBOSE;
+};
+
+//
+// Binary capture only: the capture buffers and the warnings.
+//
+
+template <>
+struct PBC_TRACE_POLICY_TRAITS<PBC_TRACE_POLICY_CAPTURE>
+{
+    static const ULONG Stages = PBC_TRACE_BUFFERS_CAPTURE;
+    static const ULONG MaxLevel = TRACE_LEVEL_WARNING;
+};
+
+//
+// Forward only: no buffer traced, the warnings.
+//
+
+template <>
+struct PBC_TRACE_POLICY_TRAITS<PBC_TRACE_POLICY_FORWARD>
+{
+    static const ULONG Stages = 0;
+    static const ULONG MaxLevel = TRACE_LEVEL_WARNING;
+};
+
+#define PBC_TRACE_STAGES    (PBC_TRACE_POLICY_TRAITS<PBC_TRACE_POLICY>::Stages)
+#define PBC_TRACE_LEVEL_MAX (PBC_TRACE_POLICY_TRAITS<PBC_TRACE_POLICY>::MaxLevel)
+
+#define PBC_MAX_FORWARDED_IOCTLS 16
+#define PBC_MAX_CONFIG_TARGETS   8
+#define PBC_MAX_CACHED_REGISTERS 16
+
+#define PBC_DEFAULT_CACHE_TTL_MS 1000
+
+#define PBC_DEFAULT_CAPTURE_SAMPLE_RATE 8
+#define PBC_DEFAULT_CAPTURE_WATERMARK   75
+
+#define PBC_MAX_RECORDER_STATUSES       8
+#define PBC_DEFAULT_RECORDER_WINDOW_MS  100
+#define PBC_DEFAULT_RECORDER_BYTES      16384
+#define PBC_MAX_RECORDER_BYTES          (1024 * 1024)
+
+//
+// Fault and latency injection rule, read from a numbered
+// subkey of the Injection key. A rule fires on every Nth
+// request matching its target and request types; all the
+// actions set in the rule are then applied to the request.
+//
+
+#define PBC_MAX_INJECTION_RULES  8
+#define PBC_INJECTION_ANY_TARGET 0xFFFFFFFF
+
+typedef struct PBC_INJECTION_RULE
+{
+    // Target address, or PBC_INJECTION_ANY_TARGET.
+    ULONG                         Target;
+
+    // Bit mask of (1 << SPB_REQUEST_TYPE), 0 for any type.
+    ULONG                         RequestTypes;
+
+    // The rule fires on every Nth matching request.
+    ULONG                         Every;
+
+    // Latency added before the request is sent (us). A
+    // uniformly distributed random part of up to JitterUs
+    // is added to LatencyUs.
+    ULONG                         LatencyUs;
+    ULONG                         JitterUs;
+
+    // Status completing the request without sending it,
+    // STATUS_SUCCESS to send it.
+    NTSTATUS                      FailStatus;
+
+    // Bytes removed from the length reported to the client.
+    ULONG                         TruncateBytes;
+
+    // Leave the client request pending until it is cancelled.
+    BOOLEAN                       DropCompletion;
+}
+PBC_INJECTION_RULE, *PPBC_INJECTION_RULE;
+
+//
+// Flight recorder settings, read from the FlightRecorder key.
+// The recorder keeps the transfers of the last WindowMs in
+// up to Bytes of records, and dumps them when a completion
+// fires one of the triggers.
+//
+
+typedef struct PBC_RECORDER_CONFIG
+{
+    // No recorder when WindowMs is 0.
+    ULONG                         WindowMs;
+    ULONG                         Bytes;
+
+    // Completion statuses firing a dump. Without a list,
+    // every failure status, cancellation included.
+    ULONG                         StatusCount;
+    ULONG                         Statuses[PBC_MAX_RECORDER_STATUSES];
+
+    // Time from dispatch to completion firing a dump (us),
+    // 0 for none.
+    ULONG                         LatencyUs;
+
+    // Payload firing a dump: the bytes of PatternValue
+    // selected by PatternMask, the low byte first, found at
+    // PatternOffset of a transfer. No pattern when
+    // PatternMask is 0.
+    ULONG                         PatternOffset;
+    ULONG                         PatternMask;
+    ULONG                         PatternValue;
+}
+PBC_RECORDER_CONFIG, *PPBC_RECORDER_CONFIG;
+
+typedef struct PBC_DEVICE_CONFIG
+{
+    // Custom IOCTLs forwarded to the true controller. Without
+    // an allow-list in the registry, every IOCTL using the SPB
+    // transfer list format is forwarded.
+    BOOLEAN                       ForwardAllIoctls;
+    ULONG                         ForwardedIoctlCount;
+    ULONG                         ForwardedIoctls[PBC_MAX_FORWARDED_IOCTLS];
+
+    // Addresses of the targets whose register address writes
+    // are merged with the following read (see PBC_POSTED_WRITE).
+    ULONG                         CoalescedTargetCount;
+    ULONG                         CoalescedTargets[PBC_MAX_CONFIG_TARGETS];
+
+    // Registers whose reads are served from the response
+    // cache, each encoded as (target address << 16) | register,
+    // and the lifetime of a cached response.
+    ULONG                         CachedRegisterCount;
+    ULONG                         CachedRegisters[PBC_MAX_CACHED_REGISTERS];
+    ULONG                         CacheTtlMs;
+
+    // Fault and latency injection rules, and the seed of
+    // the latency jitter.
+    ULONG                         InjectionRuleCount;
+    PBC_INJECTION_RULE            InjectionRules[PBC_MAX_INJECTION_RULES];
+    ULONG                         InjectionSeed;
+
+    // Adapt the idle timeout to the gaps between transfers.
+    BOOLEAN                       AdaptiveIdle;
+
+    // How the buffers of every completed request are traced,
+    // a combination of PBC_TRACE_BUFFERS_*.
+    ULONG                         TraceBuffers;
+
+    // What the capture does when the ring fills up.
+    SPBPROBE_CAPTURE_POLICY       CapturePolicy;
+
+    // Flight recorder.
+    PBC_RECORDER_CONFIG           Recorder;
+}
+PBC_DEVICE_CONFIG, *PPBC_DEVICE_CONFIG;
+
+//
+// Actions applied to the request in flight.
+//
+
+typedef struct PBC_INJECTION_VERDICT
+{
+    ULONG                         LatencyUs;
+    NTSTATUS                      FailStatus;
+    ULONG                         TruncateBytes;
+    BOOLEAN                       DropCompletion;
+}
+PBC_INJECTION_VERDICT, *PPBC_INJECTION_VERDICT;
+
+//
+// Injection state. The schedule only depends on the rules,
+// the seed and the order of the requests, so that a run can
+// be replayed.
+//
+
+typedef struct PBC_INJECTION
+{
+    // Requests evaluated, and matching requests per rule.
+    ULONG                         Sequence;
+    ULONG                         Matches[PBC_MAX_INJECTION_RULES];
+
+    // State of the jitter random number generator.
+    ULONG                         RandomState;
+
+    // Verdict for the request in flight.
+    PBC_INJECTION_VERDICT         Verdict;
+
+    // Timer sending the SPB request once the injected
+    // latency elapsed.
+    WDFTIMER                      LatencyTimer;
+
+    // TRUE while the completion of the SPB request is
+    // withheld, until the client request is cancelled.
+    BOOLEAN                       CompletionDropped;
+}
+PBC_INJECTION, *PPBC_INJECTION;
+
+//
+// Flight recorder state: a ring of capture records of the
+// last transfers, written at every completion and only read
+// when a trigger fires. Requests complete one at a time, so
+// the ring has a single writer.
+//
+
+typedef struct PBC_RECORDER
+{
+    WDFMEMORY                     Memory;
+    PSPBPROBE_CAPTURE_RECORD      pRecords;
+    ULONG                         Capacity;
+
+    // Next record written, and records held.
+    ULONG                         Next;
+    ULONG                         Count;
+
+    // Dumps so far, and records exported by them.
+    ULONG                         Dumps;
+    ULONGLONG                     Exported;
+}
+PBC_RECORDER, *PPBC_RECORDER;
+
+//
+// Longest register address, in bytes.
+//
+
+#define PBC_MAX_REGISTER_BYTES 2
+
+//
+// Register address write held back by the probe so that it
+// can be sent together with the next read as a single
+// repeated-start sequence. Only writes as short as a register
+// address, issued while the controller is locked, are held.
+// The client write is completed when it is posted; the status
+// of the bus transfer is that of the read it goes out with. A
+// posted write sent alone before another request that fails
+// is counted and traced, the other request goes on.
+//
+
+typedef struct PBC_POSTED_WRITE
+{
+    // TRUE from the write completion until the data is sent.
+    BOOLEAN                       Pending;
+
+    // Target the write was issued on.
+    struct PBC_TARGET*            pTarget;
+
+    // Copy of the client data, and the transaction of the
+    // client write.
+    ULONG                         Length;
+    UCHAR                         Buffer[PBC_MAX_REGISTER_BYTES];
+    ULONGLONG                     TransactionId;
+
+    // Request waiting for the posted write to be sent alone.
+    // It is cancelable meanwhile, and completed as cancelled
+    // once the write completes.
+    SPBREQUEST                    DeferredRequest;
+    BOOLEAN                       DeferredCancelable;
+}
+PBC_POSTED_WRITE, *PPBC_POSTED_WRITE;
+
+//
+// Response of a register read, keyed by the register address
+// written ahead of the read. The register is the address
+// bytes as sent on the bus, the first byte in the low byte.
+//
+
+#define PBC_MAX_CACHE_ENTRIES  4
+#define PBC_MAX_CACHED_READ    64
+
+typedef struct PBC_CACHE_ENTRY
+{
+    BOOLEAN                       Valid;
+    ULONG                         Register;
+
+    // Time the response was read, and the bus time it took (us).
+    LONGLONG                      Timestamp;
+    ULONGLONG                     BusTime;
+
+    ULONG                         Length;
+    UCHAR                         Data[PBC_MAX_CACHED_READ];
+}
+PBC_CACHE_ENTRY, *PPBC_CACHE_ENTRY;
+
+//
+// Register read cache of one target address. The targets
+// opened on the same address share it, so that a write
+// through any of them drops the responses read through the
+// others.
+//
+
+typedef struct PBC_REGISTER_CACHE
+{
+    // Targets open on the address, the slot is free at 0.
+    ULONG                         TargetCount;
+    USHORT                        Address;
+
+    // Length of a register address select: 2 bytes when a
+    // cached register of the address is above 0xFF, 1 byte
+    // otherwise. Any other write carries data.
+    ULONG                         RegisterBytes;
+
+    PBC_CACHE_ENTRY               Entries[PBC_MAX_CACHE_ENTRIES];
+}
+PBC_REGISTER_CACHE, *PPBC_REGISTER_CACHE;
+
+/////////////////////////////////////////////////
+//
+// Statistics.
+//
+/////////////////////////////////////////////////
+
+//
+// Log2 histogram. Bucket 0 counts zero values, bucket N
+// counts values in [2^(N-1), 2^N). The last bucket also
+// collects everything above its lower bound.
+//
+
+#define PBC_HISTOGRAM_BUCKETS 24
+
+typedef struct PBC_HISTOGRAM
+{
+    ULONG                         Count;
+    ULONGLONG                     Sum;
+    ULONGLONG                     Min;
+    ULONGLONG                     Max;
+    ULONG                         Buckets[PBC_HISTOGRAM_BUCKETS];
+}
+PBC_HISTOGRAM, *PPBC_HISTOGRAM;
+
+//
+// Per target accounting of a controller or connection lock.
+//
+
+typedef struct PBC_LOCK_STATISTICS
+{
+    // TRUE between a successful lock and the matching unlock.
+    BOOLEAN                       Held;
+
+    // Timestamps of the lock request and of the lock grant.
+    LONGLONG                      RequestTime;
+    LONGLONG                      AcquireTime;
+
+    // Number of transfers issued while the lock is held.
+    ULONG                         Transfers;
+
+    // Time between lock request and grant (us).
+    PBC_HISTOGRAM                 WaitTime;
+
+    // Time between lock grant and unlock request (us).
+    PBC_HISTOGRAM                 HoldTime;
+
+    // Transfers issued per lock.
+    PBC_HISTOGRAM                 TransfersPerLock;
+}
+PBC_LOCK_STATISTICS, *PPBC_LOCK_STATISTICS;
+
 /////////////////////////////////////////////////
 //
 // Context definitions.
 //
 /////////////////////////////////////////////////
 
+//
+// Idle timeout selection and idle transition accounting.
+//
+
+typedef struct PBC_IDLE
+{
+    // Monitor state, from the power setting callback.
+    BOOLEAN                       MonitorOn;
+    ULONG                         MonitorTransitions;
+
+    // Idle timeout used while the monitor is on, raised
+    // when the device resumes for a transfer shortly after
+    // going idle, and the timeout currently assigned (ms).
+    ULONG                         AdaptiveTimeoutMs;
+    ULONG                         AssignedTimeoutMs;
+
+    // Work item assigning the adapted timeout at passive
+    // level.
+    WDFWORKITEM                   AssignWorkItem;
+
+    // Send time of the last transfer, and TRUE until the
+    // first transfer after a resume from idle.
+    LONGLONG                      LastTransferTime;
+    BOOLEAN                       ResumedFromIdle;
+
+    // Idle transitions, those followed by a transfer within
+    // IDLE_TIMEOUT_ADAPTIVE_MAX, and their cost (us).
+    LONGLONG                      IdleStartTime;
+    ULONG                         IdleTransitions;
+    ULONG                         ShortIdleTransitions;
+    ULONGLONG                     D0ExitTimeUs;
+    ULONGLONG                     D0EntryTimeUs;
+
+    // Time spent idle per transition (ms).
+    PBC_HISTOGRAM                 IdleTime;
+}
+PBC_IDLE, *PPBC_IDLE;
+
+//
+// Transfer list of a forwarded sequence of up to
+// PBC_INLINE_TRANSFERS transfers: a write-read, a full duplex
+// transfer or a coalesced write-read. Longer sequences use a
+// pooled list of the device, grown by PBC_POOLED_TRANSFERS
+// entries (a power of 2) up to PBC_MAX_TRANSFERS.
+//
+
+#define PBC_INLINE_TRANSFERS     4
+#define PBC_POOLED_TRANSFERS     16
+#define PBC_MAX_TRANSFERS        4096
+
+typedef SPB_TRANSFER_LIST_AND_ENTRIES(PBC_INLINE_TRANSFERS) PBC_TRANSFER_LIST;
+
+//
+// Capture records of the transfers to the device taken when
+// the request is sent. The writes of longer sequences past
+// PBC_CAPTURE_SUBMIT_RECORDS are captured at the completion.
+//
+
+#define PBC_CAPTURE_SUBMIT_RECORDS  PBC_POOLED_TRANSFERS
+
 typedef struct PBC_DEVICE   PBC_DEVICE,   *PPBC_DEVICE;
 typedef struct PBC_TARGET   PBC_TARGET,   *PPBC_TARGET;
 typedef struct PBC_REQUEST  PBC_REQUEST,  *PPBC_REQUEST;
@@ -152,10 +637,15 @@ struct PBC_DEVICE
 	LARGE_INTEGER PeripheralId;
 	
 	//
-	// SPB controller target
+	// SPB controller target, and whether it is open. A target
+	// that failed to open when the hardware was prepared is
+	// opened again on the next target connect, under
+	// SpbTargetLock.
 	//
 
 	WDFIOTARGET TrueSpbController;
+	BOOLEAN SpbTargetOpen;
+	WDFWAITLOCK SpbTargetLock;
 
 	//
 	// SPB request object
@@ -164,11 +654,30 @@ struct PBC_DEVICE
 	WDFREQUEST SpbRequest;
 
 	//
-	// Input memory for request. Valid while request in progress.
+	// Input memory of the SPB request, created with it and
+	// assigned the buffer of each request sent.
 	//
 
 	WDFMEMORY InputMemory;
 
+	//
+	// Transfer list behind InputMemory for forwarded sequences.
+	// The SPB IOCTLs are METHOD_NEITHER, so the list must stay
+	// valid until the request is sent, which may happen from a
+	// timer when latency is injected.
+	//
+
+	PBC_TRANSFER_LIST TransferList;
+
+	//
+	// Pooled transfer list for the longer sequences, kept
+	// from one request to the next.
+	//
+
+	WDFMEMORY PooledListMemory;
+	PSPB_TRANSFER_LIST PooledList;
+	ULONG PooledTransfers;
+
 	//
 	// Client request object
 	//
@@ -184,6 +693,69 @@ struct PBC_DEVICE
     
     // The power setting callback handle
     PVOID                          pMonitorPowerSettingHandle;
+
+    // Idle timeout and idle transitions.
+    PBC_IDLE                       Idle;
+
+    // Registry configuration.
+    PBC_DEVICE_CONFIG              Config;
+
+    // Write waiting to be merged with the next read.
+    PBC_POSTED_WRITE               PostedWrite;
+
+    // Fault and latency injection.
+    PBC_INJECTION                  Injection;
+
+    // Recent transfers, dumped on error.
+    PBC_RECORDER                   Recorder;
+
+    // Register read caches, one per cached target address.
+    PBC_REGISTER_CACHE             RegisterCaches[PBC_MAX_CACHED_REGISTERS];
+
+    // Time of the last D0 entry, cleared when the first
+    // transfer after it is sent.
+    LONGLONG                       ResumeTime;
+    ULONG                          D0Entries;
+    PBC_HISTOGRAM                  ResumeToFirstTransfer;
+
+    // GPIO interrupt of the peripheral, if it has one. It is
+    // shared with the client driver: the ISR only timestamps
+    // the edge and never claims it. PendingInterruptTime is
+    // the first edge not yet followed by a read, cleared by
+    // the completion of the next read dispatched after it.
+    //
+    // On a level-triggered line, the kernel stops calling the
+    // ISRs of the chain at the first one that claims the
+    // interrupt, so the probe misses every interrupt the
+    // client ISR takes first. InterruptReads counts the
+    // successful reads and UnsignaledReads those with no edge
+    // pending, so that the missing edges show up.
+    WDFINTERRUPT                   Interrupt;
+    volatile LONG                  Interrupts;
+    volatile LONG64                InterruptTime;
+    volatile LONG64                PendingInterruptTime;
+    PBC_HISTOGRAM                  InterruptToRead;
+    ULONG                          InterruptReads;
+    ULONG                          UnsignaledReads;
+
+    // Startup and resume phases, relative to the start of
+    // the device add.
+    LONGLONG                       TimelineBase;
+    SPBPROBE_TIMELINE              Timeline;
+
+    // Capture policy, from the configuration until changed
+    // through the control device.
+    SPBPROBE_CAPTURE_POLICY        CapturePolicy;
+
+    // SPBTARGETs connected to the device, whose lock
+    // statistics are queried through the control device.
+    WDFCOLLECTION                  Targets;
+    WDFWAITLOCK                    TargetsLock;
+
+    // Capture records of the writes of the request in
+    // progress, taken when it was sent.
+    ULONG                          SubmitRecordCount;
+    SPBPROBE_CAPTURE_RECORD        SubmitRecords[PBC_CAPTURE_SUBMIT_RECORDS];
 };
 
 //
@@ -203,6 +775,39 @@ struct PBC_TARGET
     // when this target is the controller's current
     // target.
     PPBC_REQUEST                   pCurrentRequest;
+
+    // Lock statistics, for IOCTL_SPB_LOCK_CONTROLLER
+    // and IOCTL_SPB_LOCK_CONNECTION respectively.
+    PBC_LOCK_STATISTICS            ControllerLock;
+    PBC_LOCK_STATISTICS            ConnectionLock;
+
+    // Write/read coalescing, enabled from the registry.
+    // Each coalesced read saves one round-trip to the
+    // controller, and so does each posted register select
+    // consumed by a read served from the cache.
+    BOOLEAN                        CoalesceWriteRead;
+    ULONG                          PostedWrites;
+    ULONG                          CoalescedReads;
+    ULONG                          CachedCoalescedReads;
+    ULONG                          FailedPostedWrites;
+
+    // Register read cache of the address, enabled from the
+    // registry, NULL otherwise. Any write other than a
+    // register address select invalidates every entry.
+    PPBC_REGISTER_CACHE            pCache;
+    ULONG                          CacheHits;
+    ULONG                          CacheMisses;
+    ULONG                          CacheInvalidations;
+    ULONGLONG                      CacheTimeSaved;
+
+    // Bus time model. The wire time of each forwarded request,
+    // computed from the connection speed, is compared to the
+    // time between send and completion. The difference is the
+    // controller overhead.
+    ULONG                          ModeledRequests;
+    ULONGLONG                      WireTimeNs;
+    ULONGLONG                      BusyTimeNs;
+    PBC_HISTOGRAM                  ControllerOverhead;
 };
 
 //
@@ -226,6 +831,45 @@ struct PBC_REQUEST
     // Handle to the SPB request.
     SPBREQUEST                     SpbRequest;
 
+    //
+    // Variables that are set when a client request is
+    // dispatched to the driver.
+    //
+
+    // Transaction ID, monotonic over all the devices from 1,
+    // given when the client request is first dispatched. The
+    // SPB request carries the ID of the client request it
+    // forwards. Traces, events and capture records of the
+    // request are stamped with it.
+    ULONGLONG                      TransactionId;
+
+    // Type of the client request.
+    SPB_REQUEST_TYPE               Type;
+
+    // Target the client request was issued on.
+    PPBC_TARGET                    pTarget;
+
+    // Length of the posted write sent ahead of this
+    // read, reported by the controller with the read.
+    ULONG                          CoalescedWriteLength;
+
+    // Time the request was dispatched by the probe, and time
+    // the SPB request was sent, 0 if it was not sent.
+    LONGLONG                       DispatchTime;
+    LONGLONG                       SendTime;
+
+    // Set when the transfers to the device were traced, just
+    // before the SPB request was sent. The completion then
+    // only traces the transfers from the device.
+    BOOLEAN                        Submitted;
+
+    // Set when the response of a cacheable register is to
+    // be stored on completion. CacheReadIndex is the index
+    // of the read transfer in the client request.
+    BOOLEAN                        CacheFill;
+    ULONG                          CacheRegister;
+    ULONG                          CacheReadIndex;
+
 };
 
 //
@@ -236,6 +880,18 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(PBC_DEVICE,  GetDeviceContext);
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(PBC_TARGET,  GetTargetContext);
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(PBC_REQUEST, GetRequestContext);
 
+//
+// Transaction ID of a client or SPB request, 0 without one.
+//
+
+FORCEINLINE
+ULONGLONG
+PbcTransactionId(
+    _In_opt_  WDFREQUEST  Request)
+{
+    return (Request != nullptr) ? GetRequestContext(Request)->TransactionId : 0;
+}
+
 #pragma warning(pop)
 
 #endif // _INTERNAL_H_
@@ -21,6 +21,14 @@ Revision History:
 
 #include "internal.h"
 #include "peripheral.h"
+#include "stats.h"
+#include "cache.h"
+#include "inject.h"
+#include "bustime.h"
+#include "idle.h"
+#include "event.h"
+#include "capture.h"
+#include "recorder.h"
 
 #include "peripheral.tmh"
 
@@ -47,6 +55,7 @@ SpbPeripheralOpen(
     FuncEntry(TRACE_FLAG_SPBAPI);
 
     WDF_IO_TARGET_OPEN_PARAMS  openParams;
+    LONGLONG startTime;
     NTSTATUS status;
 
     //
@@ -55,8 +64,6 @@ SpbPeripheralOpen(
 
     DECLARE_UNICODE_STRING_SIZE(DevicePath, RESOURCE_HUB_PATH_SIZE);
 
-	WdfDeviceStopIdle(pDevice->FxDevice, WdfTrue);
-
 	if (pDevice->TrueSpbController == WDF_NO_HANDLE)
 	{
 		status = STATUS_NOT_SUPPORTED;
@@ -87,6 +94,8 @@ SpbPeripheralOpen(
     openParams.CreateDisposition = FILE_OPEN;
     openParams.FileAttributes = FILE_ATTRIBUTE_NORMAL;
     
+    startTime = PbcQueryTimestamp();
+
     status = WdfIoTargetOpen(
         pDevice->TrueSpbController,
         &openParams);
@@ -99,6 +108,16 @@ SpbPeripheralOpen(
             "Failed to open SPB target - %!STATUS!",
             status);
     }
+    else
+    {
+        pDevice->SpbTargetOpen = TRUE;
+
+        PbcTimelineRecord(
+            pDevice,
+            SpbProbePhaseIoTargetOpen,
+            startTime,
+            PbcQueryTimestamp());
+    }
 
 exit:
     FuncExit(TRACE_FLAG_SPBDDI);
@@ -128,17 +147,16 @@ SpbPeripheralClose(
 {
     FuncEntry(TRACE_FLAG_SPBAPI);
 
-	UNREFERENCED_PARAMETER(pDevice);
-
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Closing handle to SPB target");
 
-	if (pDevice->TrueSpbController != WDF_NO_HANDLE)
+	if (pDevice->SpbTargetOpen)
+	{
 		WdfIoTargetClose(pDevice->TrueSpbController);
-
-	WdfDeviceResumeIdle(pDevice->FxDevice);
+		pDevice->SpbTargetOpen = FALSE;
+	}
 
     FuncExit(TRACE_FLAG_SPBAPI);
     
@@ -176,8 +194,9 @@ SpbPeripheralLock(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for IOCTL_SPB_LOCK_CONTROLLER",
-        pDevice->SpbRequest);
+        "Formatting SPB request %p (txn %I64u) for IOCTL_SPB_LOCK_CONTROLLER",
+        pDevice->SpbRequest,
+        PbcTransactionId(spbRequest));
         
     //
     // Save the client request.
@@ -211,9 +230,10 @@ SpbPeripheralLock(
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_FLAG_SPBAPI,
-            "Failed to send SPB request %p for "
+            "Failed to send SPB request %p (txn %I64u) for "
             "IOCTL_SPB_LOCK_CONTROLLER - %!STATUS!",
             pDevice->SpbRequest,
+            PbcTransactionId(spbRequest),
             status);
 
         SpbPeripheralCompleteRequestPair(
@@ -256,8 +276,9 @@ SpbPeripheralUnlock(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for IOCTL_SPB_UNLOCK_CONTROLLER",
-        pDevice->SpbRequest);
+        "Formatting SPB request %p (txn %I64u) for IOCTL_SPB_UNLOCK_CONTROLLER",
+        pDevice->SpbRequest,
+        PbcTransactionId(spbRequest));
         
     //
     // Save the client request.
@@ -291,9 +312,10 @@ SpbPeripheralUnlock(
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_FLAG_SPBAPI,
-            "Failed to send SPB request %p for "
+            "Failed to send SPB request %p (txn %I64u) for "
             "IOCTL_SPB_UNLOCK_CONTROLLER - %!STATUS!",
             pDevice->SpbRequest,
+            PbcTransactionId(spbRequest),
             status);
 
         SpbPeripheralCompleteRequestPair(
@@ -336,8 +358,9 @@ SpbPeripheralLockConnection(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for IOCTL_SPB_LOCK_CONNECTION",
-        pDevice->SpbRequest);
+        "Formatting SPB request %p (txn %I64u) for IOCTL_SPB_LOCK_CONNECTION",
+        pDevice->SpbRequest,
+        PbcTransactionId(spbRequest));
         
     //
     // Save the client request.
@@ -371,9 +394,10 @@ SpbPeripheralLockConnection(
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_FLAG_SPBAPI,
-            "Failed to send SPB request %p for "
+            "Failed to send SPB request %p (txn %I64u) for "
             "IOCTL_SPB_LOCK_CONNECTION - %!STATUS!",
             pDevice->SpbRequest,
+            PbcTransactionId(spbRequest),
             status);
 
         SpbPeripheralCompleteRequestPair(
@@ -416,8 +440,9 @@ SpbPeripheralUnlockConnection(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for IOCTL_SPB_UNLOCK_CONNECTION",
-        pDevice->SpbRequest);
+        "Formatting SPB request %p (txn %I64u) for IOCTL_SPB_UNLOCK_CONNECTION",
+        pDevice->SpbRequest,
+        PbcTransactionId(spbRequest));
         
     //
     // Save the client request.
@@ -451,9 +476,10 @@ SpbPeripheralUnlockConnection(
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_FLAG_SPBAPI,
-            "Failed to send SPB request %p for "
+            "Failed to send SPB request %p (txn %I64u) for "
             "IOCTL_SPB_UNLOCK_CONNECTION - %!STATUS!",
             pDevice->SpbRequest,
+            PbcTransactionId(spbRequest),
             status);
 
         SpbPeripheralCompleteRequestPair(
@@ -465,6 +491,50 @@ SpbPeripheralUnlockConnection(
     FuncExit(TRACE_FLAG_SPBAPI);
 }
 
+static
+VOID
+SpbFormatTargetTag(
+	_In_opt_ PPBC_TARGET pTarget,
+	_Out_writes_(size) PCHAR pTag,
+	_In_ size_t size
+)
+/*++
+
+Routine Description:
+
+This routine formats the bus configuration of a target,
+"i2c 0x2c" for I2C and "spi cs0 m3 8b" for SPI (chip select,
+SPI mode, bits per word, "+" for an active high chip select,
+"3w" for 3-wire).
+
+--*/
+{
+	PPBC_TARGET_SETTINGS pSettings;
+
+	if (pTarget == NULL)
+	{
+		sprintf_s(pTag, size, "?");
+		return;
+	}
+
+	pSettings = &pTarget->Settings;
+
+	if (pSettings->BusType == SPI_SERIAL_BUS_TYPE)
+	{
+		sprintf_s(pTag, size, "spi cs%u%s m%u %ub%s",
+			pSettings->Address,
+			pSettings->ChipSelectActiveHigh ? "+" : "",
+			(pSettings->Polarity << 1) | pSettings->Phase,
+			pSettings->DataBitLength,
+			pSettings->ThreeWire ? " 3w" : "");
+	}
+	else
+	{
+		sprintf_s(pTag, size, "i2c 0x%02x",
+			pSettings->Address);
+	}
+}
+
 VOID
 SpbTraceBufferIndex(
 	_In_ PPBC_DEVICE pDevice,
@@ -476,9 +546,21 @@ SpbTraceBufferIndex(
 	PMDL pMdl;
 	const ULONG max_len = 1024;
 	UCHAR pBuffer[max_len] = { 0 };
-	CHAR pPrefix[32]; /*  format "device NNN: ##nn write llll -" */
+	CHAR pTag[24]; /* format "spi csN+ mN NNb 3w" */
+	CHAR pPrefix[96]; /*  format "device NNN tag: ##nn write llll txn N -" */
 	CHAR pDataString[5 + 3 * 16 + 1]; /* format "0000: XX XX XX XX" */
 	int dataIndex;
+
+	//
+	// Nothing is copied or formatted without a session to
+	// see it.
+	//
+
+	if (!WPP_LEVEL_FLAGS_ENABLED(TRACE_LEVEL_ERROR, TRACE_FLAG_SPBAPI))
+	{
+		return;
+	}
+
 	SPB_TRANSFER_DESCRIPTOR_INIT(&transferDescriptor);
 
 	SpbRequestGetTransferParameters(
@@ -487,6 +569,11 @@ SpbTraceBufferIndex(
 		&transferDescriptor,
 		&pMdl);
 
+	SpbFormatTargetTag(
+		GetRequestContext(clientRequest)->pTarget,
+		pTag,
+		sizeof(pTag));
+
 	for (ULONG offset = 0; offset < (ULONG)transferDescriptor.TransferLength; offset += max_len)
 	{
 		ULONG length = min((ULONG)transferDescriptor.TransferLength - offset, max_len);
@@ -497,12 +584,14 @@ SpbTraceBufferIndex(
 		}
 
 		sprintf_s(pPrefix, sizeof(pPrefix),
-			"device %3I64d: %c#%02d %5s %4lu - ",
+			"device %3I64d %s: %c#%02d %5s %4lu txn %I64u - ",
 			pDevice->PeripheralId.QuadPart,
+			pTag,
 			index == 0 ? '#' : ' ',
 			index,
 			transferDescriptor.Direction == SpbTransferDirectionToDevice ? "write" : "read",
-			(unsigned long)transferDescriptor.TransferLength
+			(unsigned long)transferDescriptor.TransferLength,
+			PbcTransactionId(clientRequest)
 		);
 
 		dataIndex = 0;
@@ -531,22 +620,54 @@ SpbTraceBufferIndex(
 }
 
 VOID
-SpbTraceBuffers(
+SpbTraceBuffersInDirection(
 	_In_ PPBC_DEVICE pDevice,
-	_In_ SPBREQUEST clientRequest
+	_In_ SPBREQUEST clientRequest,
+	_In_ SPB_TRANSFER_DIRECTION direction
 )
+/*++
+
+Routine Description:
+
+This routine dumps the buffers of the transfers of a request
+in one direction, or of all of them with
+SpbTransferDirectionNone.
+
+--*/
 {
 	SPB_REQUEST_PARAMETERS parameters;
-	
+
 	SPB_REQUEST_PARAMETERS_INIT(&parameters);
 
 	SpbRequestGetParameters(clientRequest, &parameters);
 
 	for (ULONG i = 0; i < parameters.SequenceTransferCount; i += 1)
 	{
+		if (direction != SpbTransferDirectionNone)
+		{
+			SPB_TRANSFER_DESCRIPTOR transferDescriptor;
+			PMDL pMdl;
+
+			SPB_TRANSFER_DESCRIPTOR_INIT(&transferDescriptor);
+			SpbRequestGetTransferParameters(clientRequest, i, &transferDescriptor, &pMdl);
+
+			if (transferDescriptor.Direction != direction)
+			{
+				continue;
+			}
+		}
+
 		SpbTraceBufferIndex(pDevice, clientRequest, i);
 	}
+}
 
+VOID
+SpbTraceBuffers(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST clientRequest
+)
+{
+	SpbTraceBuffersInDirection(pDevice, clientRequest, SpbTransferDirectionNone);
 }
 
 VOID
@@ -582,8 +703,9 @@ SpbPeripheralRead(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for read",
-        pDevice->SpbRequest);
+        "Formatting SPB request %p (txn %I64u) for read",
+        pDevice->SpbRequest,
+        PbcTransactionId(spbRequest));
         
     //
     // Save the client request.
@@ -631,9 +753,10 @@ SpbPeripheralRead(
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_FLAG_SPBAPI,
-            "Failed to send SPB request %p for "
+            "Failed to send SPB request %p (txn %I64u) for "
             "read - %!STATUS!",
             pDevice->SpbRequest,
+            PbcTransactionId(spbRequest),
             status);
 
         SpbPeripheralCompleteRequestPair(
@@ -678,8 +801,9 @@ SpbPeripheralWrite(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Formatting SPB request %p for write",
-        pDevice->SpbRequest);
+        "Formatting SPB request %p (txn %I64u) for write",
+        pDevice->SpbRequest,
+        PbcTransactionId(spbRequest));
         
     //
     // Save the client request.
@@ -727,9 +851,10 @@ SpbPeripheralWrite(
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_FLAG_SPBAPI,
-            "Failed to send SPB request %p for "
+            "Failed to send SPB request %p (txn %I64u) for "
             "write - %!STATUS!",
             pDevice->SpbRequest,
+            PbcTransactionId(spbRequest),
             status);
 
         SpbPeripheralCompleteRequestPair(
@@ -741,304 +866,239 @@ SpbPeripheralWrite(
     FuncExit(TRACE_FLAG_SPBAPI);
 }
 
-VOID
-SpbPeripheralFullDuplex(
-	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest
+template <ULONG Count>
+static
+FORCEINLINE
+size_t
+SpbPeripheralFillTransferList(
+	_In_  SPBREQUEST         spbRequest,
+	_Out_ PSPB_TRANSFER_LIST pList,
+	_In_  ULONG              TransferCount
 )
 /*++
 
 Routine Description:
 
-This routine sends a full duplex transfer to the SPB controller.
+This routine copies the transfers of the client request into a
+transfer list, with the client MDLs. Count is the number of
+transfers when known at build time, so that the loop unrolls,
+or 0 to take TransferCount.
 
 Arguments:
 
-pDevice - a pointer to the device context
 spbRequest - the framework request object
+pList - the transfer list, with room for the transfers
+TransferCount - the transfer count, when Count is 0
 
 Return Value:
 
-None
+The byte length of the transfers
 
 --*/
 {
-	FuncEntry(TRACE_FLAG_SPBAPI);
+	const ULONG transfers = (Count != 0) ? Count : TransferCount;
+	size_t length = 0;
 
-	UNREFERENCED_PARAMETER(spbRequest);
+	SPB_TRANSFER_LIST_INIT(pList, transfers);
 
-	WDF_OBJECT_ATTRIBUTES attributes;
-	PPBC_REQUEST pRequest;
-	NTSTATUS status;
+	for (ULONG i = 0; i < transfers; i++)
+	{
+		SPB_TRANSFER_DESCRIPTOR descriptor;
+		PMDL pMdl;
 
-	pRequest = GetRequestContext(pDevice->SpbRequest);
+		SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
 
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_FLAG_SPBAPI,
-		"Formatting SPB request %p for IOCTL_SPB_FULL_DUPLEX",
-		pDevice->SpbRequest);
+		SpbRequestGetTransferParameters(
+			spbRequest,
+			i,
+			&descriptor,
+			&pMdl);
 
-	//
-	// Save the client request.
-	//
+		pList->Transfers[i] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
+			descriptor.Direction,
+			descriptor.DelayInUs,
+			pMdl);
 
-	pDevice->ClientRequest = spbRequest;
+		length += descriptor.TransferLength;
+	}
 
-	//
-	// Get input and output buffers.
-	//
+	return length;
+}
 
-	const ULONG fullDuplexWriteIndex = 0;
-	const ULONG fullDuplexReadIndex = 1;
+static
+NTSTATUS
+SpbPeripheralGetTransferList(
+	_In_  PPBC_DEVICE         pDevice,
+	_In_  ULONG               TransferCount,
+	_Out_ PSPB_TRANSFER_LIST *ppList
+)
+/*++
 
-	SPB_TRANSFER_DESCRIPTOR writeDescriptor;
-	SPB_TRANSFER_DESCRIPTOR readDescriptor;
-	PMDL pWriteMdl;
-	PMDL pReadMdl;
+Routine Description:
 
-	SPB_TRANSFER_DESCRIPTOR_INIT(&writeDescriptor);
-	SPB_TRANSFER_DESCRIPTOR_INIT(&readDescriptor);
+This routine returns a transfer list with room for TransferCount
+transfers: the list of the device up to PBC_INLINE_TRANSFERS,
+the pooled list of the device otherwise, grown when too small
+and kept for the next requests.
 
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		fullDuplexWriteIndex,
-		&writeDescriptor,
-		&pWriteMdl);
+Arguments:
 
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		fullDuplexReadIndex,
-		&readDescriptor,
-		&pReadMdl);
+pDevice - a pointer to the device context
+TransferCount - the transfer count
+ppList - the transfer list
 
-	//
-	// Build full duplex transfer using SPB transfer list.
-	//
+Return Value:
 
-	const ULONG transfers = 2;
+Status
 
-	SPB_TRANSFER_LIST_AND_ENTRIES(transfers) seq;
-	SPB_TRANSFER_LIST_INIT(&(seq.List), transfers);
+--*/
+{
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDFMEMORY memory;
+	PVOID pBuffer;
+	ULONG transfers;
+	NTSTATUS status;
 
+	if (TransferCount <= PBC_INLINE_TRANSFERS)
 	{
-		//
-		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
-		// "struct hack" size but using an index variable quiets 
-		// the warning. This is a false positive from OACR.
-		// 
-
-		const ULONG index = 0;
-
-		seq.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			SpbTransferDirectionToDevice,
-			0,
-			pWriteMdl);
-
-		seq.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			SpbTransferDirectionFromDevice,
-			0,
-			pReadMdl);
+		*ppList = &pDevice->TransferList.List;
+		return STATUS_SUCCESS;
 	}
 
-	//
-	// Create preallocated WDFMEMORY. The IOCTL is METHOD_BUFFERED,
-	// so the memory doesn't have to persist until the request is
-	// completed.
-	//
-
-	NT_ASSERT(pDevice->InputMemory == WDF_NO_HANDLE);
-
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-
-	status = WdfMemoryCreatePreallocated(
-		&attributes,
-		(PVOID)&seq,
-		sizeof(seq),
-		&pDevice->InputMemory);
-
-	if (!NT_SUCCESS(status))
+	if (TransferCount > pDevice->PooledTransfers)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to create WDFMEMORY - %!STATUS!",
-			status);
-
-		goto Done;
-	}
-
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_FLAG_SPBAPI,
-		"Built full duplex transfer %p with byte length=%lu",
-		&seq,
-		(ULONG)(writeDescriptor.TransferLength + readDescriptor.TransferLength));
+		if (TransferCount > PBC_MAX_TRANSFERS)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
 
-	//
-	// Send full duplex IOCTL.
-	//
+		transfers = (TransferCount + PBC_POOLED_TRANSFERS - 1) & ~(PBC_POOLED_TRANSFERS - 1);
 
-	//
-	// Format and send the full duplex request.
-	//
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = pDevice->FxDevice;
 
-	status = WdfIoTargetFormatRequestForIoctl(
-		pDevice->TrueSpbController,
-		pDevice->SpbRequest,
-		IOCTL_SPB_FULL_DUPLEX,
-		pDevice->InputMemory,
-		nullptr,
-		nullptr,
-		nullptr);
+		status = WdfMemoryCreate(
+			&attributes,
+			NonPagedPoolNx,
+			SI2C_POOL_TAG,
+			FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) +
+				(transfers * sizeof(SPB_TRANSFER_LIST_ENTRY)),
+			&memory,
+			&pBuffer);
 
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to format request - %!STATUS!",
-			status);
+		if (!NT_SUCCESS(status))
+		{
+			return status;
+		}
 
-		goto Done;
-	}
+		if (pDevice->PooledListMemory != WDF_NO_HANDLE)
+		{
+			WdfObjectDelete(pDevice->PooledListMemory);
+		}
 
-	status = SpbPeripheralSendRequest(
-		pDevice,
-		pDevice->SpbRequest,
-		spbRequest);
+		pDevice->PooledListMemory = memory;
+		pDevice->PooledList = (PSPB_TRANSFER_LIST)pBuffer;
+		pDevice->PooledTransfers = transfers;
 
-	if (!NT_SUCCESS(status))
-	{
 		Trace(
-			TRACE_LEVEL_ERROR,
+			TRACE_LEVEL_INFORMATION,
 			TRACE_FLAG_SPBAPI,
-			"Failed to send SPB request %p for "
-			"IOCTL_SPB_FULL_DUPLEX - %!STATUS!",
-			pDevice->SpbRequest,
-			status);
-
-		goto Done;
+			"Pooled transfer list grown to %lu transfers",
+			transfers);
 	}
 
-Done:
-
-	if (!NT_SUCCESS(status))
-	{
-		SpbPeripheralCompleteRequestPair(
-			pDevice,
-			status,
-			0);
-	}
+	*ppList = pDevice->PooledList;
 
-	FuncExit(TRACE_FLAG_SPBAPI);
+	return STATUS_SUCCESS;
 }
 
+template <ULONG Count>
+static
 NTSTATUS
-SpbPeripheralSequence1(
+SpbPeripheralSendTransferList(
 	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest
+	_In_  SPBREQUEST        spbRequest,
+	_In_  ULONG             IoControlCode,
+	_In_  ULONG             TransferCount
 )
 /*++
 
 Routine Description:
 
-This routine sends a sequence of 1 transfer to the SPB controller.
+This routine forwards the transfers of the client request to the
+SPB controller in a transfer list, with the client buffers. Up
+to PBC_INLINE_TRANSFERS, Count sets the transfer count at build
+time and the list of the device is used without any allocation.
 
 Arguments:
 
 pDevice - a pointer to the device context
 spbRequest - the framework request object
+IoControlCode - the device IO control code
+TransferCount - the transfer count, when Count is 0
 
 Return Value:
 
-None
+Status
 
 --*/
 {
-	FuncEntry(TRACE_FLAG_SPBAPI);
-
-	UNREFERENCED_PARAMETER(spbRequest);
-
-	WDF_OBJECT_ATTRIBUTES attributes;
-	PPBC_REQUEST pRequest;
+	PSPB_TRANSFER_LIST pList;
+	const ULONG transfers = (Count != 0) ? Count : TransferCount;
+	size_t length;
 	NTSTATUS status;
 
-	pRequest = GetRequestContext(pDevice->SpbRequest);
+	static_assert(Count <= PBC_INLINE_TRANSFERS, "Count is above the list of the device");
 
 	Trace(
 		TRACE_LEVEL_INFORMATION,
 		TRACE_FLAG_SPBAPI,
-		"Formatting SPB request %p for IOCTL_SPB_EXECUTE_SEQUENCE",
-		pDevice->SpbRequest);
-
-	//
-	// Save the client request.
-	//
-
-	pDevice->ClientRequest = spbRequest;
-
-	//
-	// Get buffer.
-	//
-
-	SPB_TRANSFER_DESCRIPTOR firstDescriptor;
-	PMDL pFirstMdl;
-
-	SPB_TRANSFER_DESCRIPTOR_INIT(&firstDescriptor);
-
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		0,
-		&firstDescriptor,
-		&pFirstMdl);
-
-	//
-	// Build full duplex transfer using SPB transfer list.
-	//
-
-	const ULONG transfers = 2;
-
-	SPB_TRANSFER_LIST seq;
-	SPB_TRANSFER_LIST_INIT(&seq, 1);
+		"Formatting SPB request %p (txn %I64u) for IOCTL 0x%lx with %lu transfers",
+		pDevice->SpbRequest,
+		PbcTransactionId(spbRequest),
+		IoControlCode,
+		transfers);
 
+	if (Count != 0)
 	{
-		//
-		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
-		// "struct hack" size but using an index variable quiets 
-		// the warning. This is a false positive from OACR.
-		// 
-
-		const ULONG index = 0;
-
-		seq.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			firstDescriptor.Direction,
-			0,
-			pFirstMdl);
+		pList = &pDevice->TransferList.List;
 	}
+	else
+	{
+		status = SpbPeripheralGetTransferList(pDevice, transfers, &pList);
 
-	//
-	// Create preallocated WDFMEMORY. The IOCTL is METHOD_BUFFERED,
-	// so the memory doesn't have to persist until the request is
-	// completed.
-	//
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_FLAG_SPBAPI,
+				"Failed to get a list of %lu transfers - %!STATUS!",
+				transfers,
+				status);
+
+			goto Done;
+		}
+	}
 
-	NT_ASSERT(pDevice->InputMemory == WDF_NO_HANDLE);
+	length = SpbPeripheralFillTransferList<Count>(spbRequest, pList, transfers);
 
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	//
+	// Point the WDFMEMORY of the device at the transfer list,
+	// which persists until the request is sent.
+	//
 
-	status = WdfMemoryCreatePreallocated(
-		&attributes,
-		(PVOID)&seq,
-		sizeof(seq),
-		&pDevice->InputMemory);
+	status = WdfMemoryAssignBuffer(
+		pDevice->InputMemory,
+		(PVOID)pList,
+		FIELD_OFFSET(SPB_TRANSFER_LIST, Transfers) +
+			(transfers * sizeof(SPB_TRANSFER_LIST_ENTRY)));
 
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_SPBAPI,
-			"Failed to create WDFMEMORY - %!STATUS!",
+			"Failed to assign WDFMEMORY - %!STATUS!",
 			status);
 
 		goto Done;
@@ -1047,22 +1107,19 @@ None
 	Trace(
 		TRACE_LEVEL_INFORMATION,
 		TRACE_FLAG_SPBAPI,
-		"Built sequence transfer %p with byte length=%lu",
-		&seq,
-		(ULONG)(firstDescriptor.TransferLength));
+		"Built transfer list %p with %lu transfers and byte length=%lu",
+		pList,
+		transfers,
+		(ULONG)length);
 
 	//
-	// Send full duplex IOCTL.
-	//
-
-	//
-	// Format and send the full duplex request.
+	// Format and send the request.
 	//
 
 	status = WdfIoTargetFormatRequestForIoctl(
 		pDevice->TrueSpbController,
 		pDevice->SpbRequest,
-		IOCTL_SPB_EXECUTE_SEQUENCE,
+		IoControlCode,
 		pDevice->InputMemory,
 		nullptr,
 		nullptr,
@@ -1084,227 +1141,196 @@ None
 		pDevice->SpbRequest,
 		spbRequest);
 
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to send SPB request %p for "
-			"IOCTL_SPB_EXECUTE_SEQUENCE - %!STATUS!",
-			pDevice->SpbRequest,
-			status);
-
-		goto Done;
-	}
-
 Done:
 
-	FuncExit(TRACE_FLAG_SPBAPI);
-
 	return status;
 }
 
+static
 NTSTATUS
-SpbPeripheralSequence2(
+SpbPeripheralSendTransfers(
 	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest
+	_In_  SPBREQUEST        spbRequest,
+	_In_  ULONG             IoControlCode,
+	_In_  ULONG             TransferCount
 )
 /*++
 
 Routine Description:
 
-This routine sends a sequence of 2 transfers to the SPB controller.
+This routine forwards the transfers of the client request, with
+an instance of SpbPeripheralSendTransferList for each transfer
+count up to PBC_INLINE_TRANSFERS, and the runtime count above.
 
 Arguments:
 
 pDevice - a pointer to the device context
 spbRequest - the framework request object
+IoControlCode - the device IO control code
+TransferCount - the transfer count
 
 Return Value:
 
-None
+Status
 
 --*/
 {
-	FuncEntry(TRACE_FLAG_SPBAPI);
+	switch (TransferCount)
+	{
+	case 1:
+		return SpbPeripheralSendTransferList<1>(pDevice, spbRequest, IoControlCode, 1);
+	case 2:
+		return SpbPeripheralSendTransferList<2>(pDevice, spbRequest, IoControlCode, 2);
+	case 3:
+		return SpbPeripheralSendTransferList<3>(pDevice, spbRequest, IoControlCode, 3);
+	case 4:
+		return SpbPeripheralSendTransferList<4>(pDevice, spbRequest, IoControlCode, 4);
+	default:
+		return SpbPeripheralSendTransferList<0>(pDevice, spbRequest, IoControlCode, TransferCount);
+	}
+}
 
-	UNREFERENCED_PARAMETER(spbRequest);
+VOID
+SpbPeripheralFullDuplex(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        spbRequest
+)
+/*++
 
-	WDF_OBJECT_ATTRIBUTES attributes;
-	PPBC_REQUEST pRequest;
-	NTSTATUS status;
-
-	pRequest = GetRequestContext(pDevice->SpbRequest);
-
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_FLAG_SPBAPI,
-		"Formatting SPB request %p for IOCTL_SPB_EXECUTE_SEQUENCE",
-		pDevice->SpbRequest);
+Routine Description:
 
-	//
-	// Save the client request.
-	//
+This routine sends a full duplex transfer to the SPB controller.
 
-	pDevice->ClientRequest = spbRequest;
+Arguments:
 
-	//
-	// Get input and output buffers.
-	//
+pDevice - a pointer to the device context
+spbRequest - the framework request object
 
-	SPB_TRANSFER_DESCRIPTOR firstDescriptor;
-	SPB_TRANSFER_DESCRIPTOR secondDescriptor;
-	PMDL pFirstMdl;
-	PMDL pSecondMdl;
+Return Value:
 
-	SPB_TRANSFER_DESCRIPTOR_INIT(&firstDescriptor);
-	SPB_TRANSFER_DESCRIPTOR_INIT(&secondDescriptor);
+None
 
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		0,
-		&firstDescriptor,
-		&pFirstMdl);
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBAPI);
 
-	SpbRequestGetTransferParameters(
-		spbRequest,
-		1,
-		&secondDescriptor,
-		&pSecondMdl);
+	NTSTATUS status;
 
 	//
-	// Build full duplex transfer using SPB transfer list.
+	// Save the client request.
 	//
 
-	const ULONG transfers = 2;
-
-	SPB_TRANSFER_LIST_AND_ENTRIES(transfers) seq;
-	SPB_TRANSFER_LIST_INIT(&(seq.List), transfers);
-
-	{
-		//
-		// PreFAST cannot figure out the SPB_TRANSFER_LIST_ENTRY
-		// "struct hack" size but using an index variable quiets 
-		// the warning. This is a false positive from OACR.
-		// 
-
-		const ULONG index = 0;
-
-		seq.List.Transfers[index] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			firstDescriptor.Direction,
-			0,
-			pFirstMdl);
-
-		seq.List.Transfers[index + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_MDL(
-			secondDescriptor.Direction,
-			0,
-			pSecondMdl);
-	}
+	pDevice->ClientRequest = spbRequest;
 
 	//
-	// Create preallocated WDFMEMORY. The IOCTL is METHOD_BUFFERED,
-	// so the memory doesn't have to persist until the request is
-	// completed.
+	// The write transfer, then the read transfer.
 	//
 
-	NT_ASSERT(pDevice->InputMemory == WDF_NO_HANDLE);
-
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-
-	status = WdfMemoryCreatePreallocated(
-		&attributes,
-		(PVOID)&seq,
-		sizeof(seq),
-		&pDevice->InputMemory);
+	status = SpbPeripheralSendTransferList<2>(
+		pDevice,
+		spbRequest,
+		IOCTL_SPB_FULL_DUPLEX,
+		2);
 
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_SPBAPI,
-			"Failed to create WDFMEMORY - %!STATUS!",
+			"Failed to send SPB request %p (txn %I64u) for "
+			"IOCTL_SPB_FULL_DUPLEX - %!STATUS!",
+			pDevice->SpbRequest,
+			PbcTransactionId(spbRequest),
 			status);
 
-		goto Done;
+		SpbPeripheralCompleteRequestPair(
+			pDevice,
+			status,
+			0);
 	}
 
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_FLAG_SPBAPI,
-		"Built sequence transfer %p with byte length=%lu",
-		&seq,
-		(ULONG)(firstDescriptor.TransferLength + secondDescriptor.TransferLength));
+	FuncExit(TRACE_FLAG_SPBAPI);
+}
 
-	//
-	// Send full duplex IOCTL.
-	//
+VOID
+SpbPeripheralSequence(
+	_In_  PPBC_DEVICE       pDevice,
+	_In_  SPBREQUEST        spbRequest,
+	_In_  ULONG             TransferCount
+)
+/*++
 
-	//
-	// Format and send the full duplex request.
-	//
+Routine Description:
 
-	status = WdfIoTargetFormatRequestForIoctl(
-		pDevice->TrueSpbController,
-		pDevice->SpbRequest,
-		IOCTL_SPB_EXECUTE_SEQUENCE,
-		pDevice->InputMemory,
-		nullptr,
-		nullptr,
-		nullptr);
+This routine sends a sequence of transfers to the SPB controller.
 
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_FLAG_SPBAPI,
-			"Failed to format request - %!STATUS!",
-			status);
+Arguments:
 
-		goto Done;
-	}
+pDevice - a pointer to the device context
+spbRequest - the framework request object
+TransferCount - the transfer count
 
-	status = SpbPeripheralSendRequest(
+Return Value:
+
+None
+
+--*/
+{
+	FuncEntry(TRACE_FLAG_SPBAPI);
+
+	NTSTATUS status;
+
+	//
+	// Save the client request, so that it is completed if the
+	// sequence cannot be sent.
+	//
+
+	pDevice->ClientRequest = spbRequest;
+
+	status = SpbPeripheralSendTransfers(
 		pDevice,
-		pDevice->SpbRequest,
-		spbRequest);
+		spbRequest,
+		IOCTL_SPB_EXECUTE_SEQUENCE,
+		TransferCount);
 
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_SPBAPI,
-			"Failed to send SPB request %p for "
+			"Failed to send SPB request %p (txn %I64u) for "
 			"IOCTL_SPB_EXECUTE_SEQUENCE - %!STATUS!",
 			pDevice->SpbRequest,
+			PbcTransactionId(spbRequest),
 			status);
 
-		goto Done;
+		SpbPeripheralCompleteRequestPair(
+			pDevice,
+			status,
+			0);
 	}
 
-Done:
-
 	FuncExit(TRACE_FLAG_SPBAPI);
-
-	return status;
 }
 
 VOID
-SpbPeripheralSequence(
+SpbPeripheralOther(
 	_In_  PPBC_DEVICE       pDevice,
 	_In_  SPBREQUEST        spbRequest,
-	_In_  ULONG             TransferCount
+	_In_  ULONG             IoControlCode
 )
 /*++
 
 Routine Description:
 
-This routine sends a sequence of 2 transfers to the SPB controller.
+This routine forwards a custom IOCTL using the SPB transfer
+list format to the SPB controller, with the client buffers.
 
 Arguments:
 
 pDevice - a pointer to the device context
 spbRequest - the framework request object
-TransferCount - the transfer count
+IoControlCode - the device IO control code
 
 Return Value:
 
@@ -1314,26 +1340,48 @@ None
 {
 	FuncEntry(TRACE_FLAG_SPBAPI);
 
-	NTSTATUS status = STATUS_NOT_SUPPORTED;
+	SPB_REQUEST_PARAMETERS params;
+	NTSTATUS status;
 
-	switch (TransferCount)
+	//
+	// Save the client request.
+	//
+
+	pDevice->ClientRequest = spbRequest;
+
+	SPB_REQUEST_PARAMETERS_INIT(&params);
+	SpbRequestGetParameters(spbRequest, &params);
+
+	if (params.SequenceTransferCount == 0)
 	{
-	case 1:
-		status = SpbPeripheralSequence1(pDevice, spbRequest);
-		break;
-	case 2:
-		status = SpbPeripheralSequence2(pDevice, spbRequest);
-		break;
+		status = STATUS_INVALID_PARAMETER;
+
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_FLAG_SPBAPI,
+			"IOCTL 0x%lx has no captured transfer - %!STATUS!",
+			IoControlCode,
+			status);
+
+		goto Done;
 	}
 
+	status = SpbPeripheralSendTransfers(
+		pDevice,
+		spbRequest,
+		IoControlCode,
+		params.SequenceTransferCount);
+
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			TRACE_FLAG_SPBAPI,
-			"Failed to send SPB request %p for "
-			"IOCTL_SPB_FULL_DUPLEX - %!STATUS!",
+			"Failed to send SPB request %p (txn %I64u) for "
+			"IOCTL 0x%lx - %!STATUS!",
 			pDevice->SpbRequest,
+			PbcTransactionId(spbRequest),
+			IoControlCode,
 			status);
 
 		goto Done;
@@ -1385,9 +1433,10 @@ SpbPeripheralSendRequest(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Saving client request %p, and "
-        "sending SPB request %p",
+        "sending SPB request %p for txn %I64u",
         ClientRequest,
-        SpbRequest);
+        SpbRequest,
+        pRequest->TransactionId);
 
     //
     // Init client request context.
@@ -1395,6 +1444,19 @@ SpbPeripheralSendRequest(
 
     pRequest->FxDevice = pDevice->FxDevice;
 
+    //
+    // The SPB request carries the transaction it forwards.
+    //
+
+    GetRequestContext(SpbRequest)->TransactionId = pRequest->TransactionId;
+
+    //
+    // Apply the fault injection rules. An injected failure
+    // completes the request without sending it.
+    //
+
+    status = SpbPeripheralInjectBeforeSend(pDevice, ClientRequest);
+
     //
     // Mark the client request as cancellable.
     //
@@ -1417,10 +1479,22 @@ SpbPeripheralSendRequest(
             SpbPeripheralOnCompletion,
             GetRequestContext(SpbRequest));
 
-        BOOLEAN fSent = WdfRequestSend(
-            SpbRequest,
-            pDevice->TrueSpbController,
-            WDF_NO_SEND_OPTIONS);
+        pRequest->SendTime = PbcQueryTimestamp();
+
+        PbcResumeCountTransfer(pDevice, pRequest->SendTime);
+        PbcIdleCountTransfer(pDevice, pRequest->SendTime);
+
+        BOOLEAN fSent = SpbPeripheralInjectLatency(pDevice);
+
+        if (!fSent)
+        {
+            SpbPeripheralTraceSubmit(pDevice, ClientRequest);
+
+            fSent = WdfRequestSend(
+                SpbRequest,
+                pDevice->TrueSpbController,
+                WDF_NO_SEND_OPTIONS);
+        }
 
         if (!fSent)
         {
@@ -1429,8 +1503,9 @@ SpbPeripheralSendRequest(
             Trace(
                 TRACE_LEVEL_ERROR,
                 TRACE_FLAG_SPBAPI,
-                "Failed to send SPB request %p - %!STATUS!",
+                "Failed to send SPB request %p (txn %I64u) - %!STATUS!",
                 SpbRequest,
+                pRequest->TransactionId,
                 status);
 
             NTSTATUS cancelStatus;
@@ -1444,9 +1519,10 @@ SpbPeripheralSendRequest(
                 Trace(
                     TRACE_LEVEL_INFORMATION, 
                     TRACE_FLAG_SPBAPI, 
-                    "Client request %p has already been cancelled - "
+                    "Client request %p (txn %I64u) has already been cancelled - "
                     "%!STATUS!",
                     ClientRequest,
+                    pRequest->TransactionId,
                     cancelStatus);
             }
         }
@@ -1502,8 +1578,9 @@ SpbPeripheralOnCompletion(
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Completion callback received for SPB request %p with %!STATUS!",
+        "Completion callback received for SPB request %p (txn %I64u) with %!STATUS!",
         spbRequest,
+        pRequest->TransactionId,
         status);
 
 	//if (NT_SUCCESS(status))
@@ -1602,21 +1679,44 @@ SpbPeripheralOnCompletion(
         Trace(
             TRACE_LEVEL_INFORMATION, 
             TRACE_FLAG_SPBAPI, 
-            "Client request %p has already been cancelled - %!STATUS!",
+            "Client request %p (txn %I64u) has already been cancelled - %!STATUS!",
             pDevice->ClientRequest,
+            PbcTransactionId(pDevice->ClientRequest),
             cancelStatus);
     }
+    else if (SpbPeripheralInjectDropCompletion(pDevice, pDevice->ClientRequest))
+    {
+        goto exit;
+    }
 
     //
     // Complete the request pair
     //
 
-    bytesCompleted = Params->IoStatus.Information;
+    bytesCompleted = SpbPeripheralInjectTruncate(
+        pDevice,
+        Params->IoStatus.Information);
+
+    //
+    // A coalesced read also reports the bytes of the
+    // posted write sent ahead of it.
+    //
+
+    if (pDevice->ClientRequest != nullptr)
+    {
+        ULONG postedLength =
+            GetRequestContext(pDevice->ClientRequest)->CoalescedWriteLength;
+
+        bytesCompleted = (bytesCompleted > postedLength) ?
+            (bytesCompleted - postedLength) : 0;
+    }
 
     SpbPeripheralCompleteRequestPair(
         pDevice,
         status,
         bytesCompleted);
+
+exit:
     
     FuncExit(TRACE_FLAG_SPBAPI);
 }
@@ -1648,6 +1748,52 @@ Return Value:
     pRequest = GetRequestContext(spbRequest);
     pDevice = GetDeviceContext(pRequest->FxDevice);
 
+    //
+    // The SPB request already completed if its completion
+    // was dropped by the fault injection.
+    //
+
+    if (pDevice->Injection.CompletionDropped)
+    {
+        pDevice->Injection.CompletionDropped = FALSE;
+
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_FLAG_SPBAPI,
+            "Cancel received for client request %p (txn %I64u) with dropped "
+            "completion",
+            spbRequest,
+            pRequest->TransactionId);
+
+        SpbPeripheralCompleteRequestPair(pDevice, STATUS_CANCELLED, 0);
+
+        FuncExit(TRACE_FLAG_SPBAPI);
+        return;
+    }
+
+    //
+    // While injected latency is pending, the SPB request has
+    // not been sent yet; stopping the timer keeps it from
+    // ever being sent.
+    //
+
+    if ((pDevice->Injection.LatencyTimer != WDF_NO_HANDLE) &&
+        WdfTimerStop(pDevice->Injection.LatencyTimer, FALSE))
+    {
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_FLAG_SPBAPI,
+            "Cancel received for client request %p (txn %I64u) during "
+            "injected latency",
+            spbRequest,
+            pRequest->TransactionId);
+
+        SpbPeripheralCompleteRequestPair(pDevice, STATUS_CANCELLED, 0);
+
+        FuncExit(TRACE_FLAG_SPBAPI);
+        return;
+    }
+
     //
     // Attempt to cancel the SPB request
     //
@@ -1655,9 +1801,10 @@ Return Value:
     Trace(
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
-        "Cancel received for client request %p, "
+        "Cancel received for client request %p (txn %I64u), "
         "attempting to cancel SPB request %p",
         spbRequest,
+        pRequest->TransactionId,
         pDevice->SpbRequest);
 
     WdfRequestCancelSentRequest(pDevice->SpbRequest);
@@ -1665,6 +1812,240 @@ Return Value:
     FuncExit(TRACE_FLAG_SPBAPI);
 }
 
+VOID
+SpbPeripheralAccountRequest(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          status
+    )
+/*++
+Routine Description:
+
+    This routine updates the target statistics once a
+    client request is about to be completed.
+
+Arguments:
+
+    pDevice - the device context
+    ClientRequest - the client request object
+    status - the client completion status
+
+Return Value:
+
+   VOID
+
+--*/
+{
+    PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+    PPBC_TARGET pTarget = pRequest->pTarget;
+    ULONGLONG holdTime;
+
+    if (pTarget == NULL)
+    {
+        return;
+    }
+
+    switch (pRequest->Type)
+    {
+    case SpbRequestTypeLockController:
+
+        if (NT_SUCCESS(status))
+        {
+            PbcLockAcquired(&pTarget->ControllerLock);
+            pDevice->pCurrentTarget = pTarget;
+        }
+
+        break;
+
+    case SpbRequestTypeUnlockController:
+
+        holdTime = PbcLockReleased(&pTarget->ControllerLock);
+
+        if (pDevice->pCurrentTarget == pTarget)
+        {
+            pDevice->pCurrentTarget = NULL;
+        }
+
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_FLAG_SPBAPI,
+            "Controller held %I64u us by target 0x%hx with %lu transfers",
+            holdTime,
+            pTarget->Settings.Address,
+            pTarget->ControllerLock.Transfers);
+
+        break;
+
+    case SpbRequestTypeLockConnection:
+
+        if (NT_SUCCESS(status))
+        {
+            PbcLockAcquired(&pTarget->ConnectionLock);
+        }
+
+        break;
+
+    case SpbRequestTypeUnlockConnection:
+
+        holdTime = PbcLockReleased(&pTarget->ConnectionLock);
+
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_FLAG_SPBAPI,
+            "Connection held %I64u us by target 0x%hx with %lu transfers",
+            holdTime,
+            pTarget->Settings.Address,
+            pTarget->ConnectionLock.Transfers);
+
+        break;
+
+    default:
+
+        break;
+    }
+}
+
+template <ULONG Stages>
+static
+FORCEINLINE
+VOID
+SpbTraceSubmittedRequest(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest
+)
+/*++
+
+Routine Description:
+
+This routine runs the TraceBuffers stages of a request about
+to be sent, for its transfers to the device, so that what is
+traced is what the controller gets even if the client reuses
+its buffers before the completion.
+
+--*/
+{
+	ULONG stages = pDevice->Config.TraceBuffers & Stages;
+
+	if (stages == 0)
+	{
+		return;
+	}
+
+	GetRequestContext(clientRequest)->Submitted = TRUE;
+
+	if (stages & PBC_TRACE_BUFFERS_TEXT)
+	{
+		SpbTraceBuffersInDirection(pDevice, clientRequest, SpbTransferDirectionToDevice);
+	}
+
+	if (stages & PBC_TRACE_BUFFERS_EVENTS)
+	{
+		PbcEventWriteTransfers(pDevice, clientRequest, STATUS_PENDING, SpbTransferDirectionToDevice);
+	}
+
+	if (stages & PBC_TRACE_BUFFERS_CAPTURE)
+	{
+		PbcCaptureSubmit(pDevice, clientRequest);
+	}
+}
+
+VOID
+SpbPeripheralTraceSubmit(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest
+)
+/*++
+
+Routine Description:
+
+This routine traces the transfers to the device of the
+client request, just before the SPB request is sent.
+
+Arguments:
+
+pDevice - the device context
+clientRequest - the client request
+
+Return Value:
+
+None
+
+--*/
+{
+	SpbTraceSubmittedRequest<PBC_TRACE_STAGES>(pDevice, clientRequest);
+}
+
+template <ULONG Stages>
+static
+FORCEINLINE
+VOID
+SpbTraceCompletedRequest(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ NTSTATUS    status
+)
+/*++
+
+Routine Description:
+
+This routine runs the TraceBuffers stages of a completed
+request, among the Stages compiled in by the trace policy.
+Without stages, it compiles to nothing. The transfers to the
+device were already traced if the request was sent; their
+status is in the completion event.
+
+--*/
+{
+	ULONG stages = pDevice->Config.TraceBuffers & Stages;
+	SPB_TRANSFER_DIRECTION direction = GetRequestContext(clientRequest)->Submitted ?
+		SpbTransferDirectionFromDevice : SpbTransferDirectionNone;
+
+	if (stages & PBC_TRACE_BUFFERS_TEXT)
+	{
+		SpbTraceBuffersInDirection(pDevice, clientRequest, direction);
+	}
+
+	if (stages & PBC_TRACE_BUFFERS_EVENTS)
+	{
+		PbcEventWriteTransfers(pDevice, clientRequest, status, direction);
+		PbcEventWriteCompletion(pDevice, clientRequest, status);
+	}
+
+	if (stages & PBC_TRACE_BUFFERS_CAPTURE)
+	{
+		PbcCaptureTransfers(pDevice, clientRequest, status);
+	}
+}
+
+VOID
+SpbPeripheralTraceComplete(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ NTSTATUS    status
+)
+/*++
+
+Routine Description:
+
+This routine traces the transfers of a client request
+completed by the probe itself, without a SPB request, such
+as a read served from the register cache or a posted write.
+
+Arguments:
+
+pDevice - the device context
+clientRequest - the client request
+status - the completion status of the request
+
+Return Value:
+
+None
+
+--*/
+{
+	SpbTraceCompletedRequest<PBC_TRACE_STAGES>(pDevice, clientRequest, status);
+}
+
 VOID
 SpbPeripheralCompleteRequestPair(
     _In_  PPBC_DEVICE       pDevice,
@@ -1699,9 +2080,10 @@ Return Value:
         TRACE_LEVEL_INFORMATION,
         TRACE_FLAG_SPBAPI,
         "Marking SPB request %p for reuse, and completing "
-        "client request %p with %!STATUS! and bytes=%lu",
+        "client request %p (txn %I64u) with %!STATUS! and bytes=%lu",
         pDevice->SpbRequest,
         pDevice->ClientRequest,
+        PbcTransactionId(pDevice->ClientRequest),
         status,
         (ULONG)bytesCompleted);
 
@@ -1717,12 +2099,6 @@ Return Value:
 
     WdfRequestReuse(pDevice->SpbRequest, &params);
 
-    if (pDevice->InputMemory != WDF_NO_HANDLE)
-    {
-        WdfObjectDelete(pDevice->InputMemory);
-        pDevice->InputMemory = WDF_NO_HANDLE;
-    }
-
     //
     // Complete the client request
     //
@@ -1732,7 +2108,17 @@ Return Value:
         SPBREQUEST clientRequest = pDevice->ClientRequest;
         pDevice->ClientRequest = nullptr;
 
-		SpbTraceBuffers(pDevice, clientRequest);
+		SpbTraceCompletedRequest<PBC_TRACE_STAGES>(pDevice, clientRequest, status);
+
+		SpbPeripheralAccountRequest(pDevice, clientRequest, status);
+
+		PbcBusTimeRecord(pDevice, clientRequest, status);
+
+		PbcInterruptCountRead(pDevice, clientRequest, status);
+
+		PbcRecorderRecord(pDevice, clientRequest, status);
+
+		PbcCacheFill(pDevice, clientRequest, status);
 
         // In order to satisfy SDV, assume clientRequest
         // is equal to pDevice->ClientRequest. This suppresses
@@ -78,15 +78,11 @@ SpbPeripheralSequence(
 	_In_  SPBREQUEST        spbRequest,
 	_In_  ULONG             TransferCount);
 
-NTSTATUS
-SpbPeripheralSequence1(
-	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest);
-
-NTSTATUS
-SpbPeripheralSequence2(
+VOID
+SpbPeripheralOther(
 	_In_  PPBC_DEVICE       pDevice,
-	_In_  SPBREQUEST        spbRequest);
+	_In_  SPBREQUEST        spbRequest,
+	_In_  ULONG             IoControlCode);
 
 NTSTATUS
 SpbPeripheralSendRequest(
@@ -94,6 +90,34 @@ SpbPeripheralSendRequest(
     _In_  WDFREQUEST        SpbRequest,
     _In_  WDFREQUEST        ClientRequest);
 
+VOID
+SpbTraceBuffers(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST clientRequest);
+
+VOID
+SpbTraceBuffersInDirection(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST clientRequest,
+	_In_ SPB_TRANSFER_DIRECTION direction);
+
+VOID
+SpbPeripheralTraceSubmit(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest);
+
+VOID
+SpbPeripheralTraceComplete(
+	_In_ PPBC_DEVICE pDevice,
+	_In_ SPBREQUEST  clientRequest,
+	_In_ NTSTATUS    status);
+
+VOID
+SpbPeripheralAccountRequest(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          status);
+
 VOID
 SpbPeripheralCompleteRequestPair(
     _In_  PPBC_DEVICE        pDevice,
@@ -177,4 +201,70 @@ otherwise STATUS_SUCCESS
 	return status;
 }
 
+NTSTATUS
+FORCEINLINE
+RequestSetByte(
+	_In_  PMDL          mdl,
+	_In_  size_t        mdlLength,
+	_In_  size_t        Index,
+	_In_  UCHAR         Byte
+)
+/*++
+
+Routine Description:
+
+This is a helper routine used to store the
+specified byte of the current transfer descriptor buffer.
+
+Arguments:
+
+mdl - the MDL chain of the transfer
+
+mdlLength - the length of the transfer
+
+Index - index of desired byte in current transfer descriptor buffer
+
+Byte - the value to store
+
+Return Value:
+
+STATUS_INFO_LENGTH_MISMATCH if invalid index,
+otherwise STATUS_SUCCESS
+
+--*/
+{
+	size_t mdlByteCount;
+	size_t currentOffset = Index;
+	PUCHAR pBuffer;
+	NTSTATUS status = STATUS_INFO_LENGTH_MISMATCH;
+
+	if (Index < mdlLength)
+	{
+		while (mdl != NULL)
+		{
+			mdlByteCount = MmGetMdlByteCount(mdl);
+
+			if (currentOffset < mdlByteCount)
+			{
+				pBuffer = (PUCHAR)MmGetSystemAddressForMdlSafe(
+					mdl,
+					NormalPagePriority | MdlMappingNoExecute);
+
+				if (pBuffer != NULL)
+				{
+					pBuffer[currentOffset] = Byte;
+					status = STATUS_SUCCESS;
+				}
+
+				break;
+			}
+
+			currentOffset -= mdlByteCount;
+			mdl = mdl->Next;
+		}
+	}
+
+	return status;
+}
+
 #endif // _PERIPHERAL_H_
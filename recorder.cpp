@@ -0,0 +1,449 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    recorder.cpp
+
+Abstract:
+
+    This module keeps the recent transfers of a device in a
+    flight recorder: a ring of capture records, bounded in
+    bytes, written at every completion and read only when a
+    completion fires one of the triggers, a status, a latency
+    or a payload pattern. The records of the last WindowMs are
+    then dumped, oldest first, as TraceLogging events and into
+    the capture stream, and the ring starts over. Nothing
+    leaves the recorder otherwise.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "capture.h"
+#include "event.h"
+#include "stats.h"
+#include "recorder.h"
+
+#include "recorder.tmh"
+
+NTSTATUS
+PbcRecorderInitialize(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine allocates the ring of the flight recorder,
+    when the device has one.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    PPBC_RECORDER pRecorder = &pDevice->Recorder;
+    PPBC_RECORDER_CONFIG pConfig = &pDevice->Config.Recorder;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    PVOID pBuffer;
+    NTSTATUS status;
+
+    RtlZeroMemory(pRecorder, sizeof(PBC_RECORDER));
+
+    if (pConfig->WindowMs == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = pDevice->FxDevice;
+
+    status = WdfMemoryCreate(
+        &attributes,
+        NonPagedPoolNx,
+        SI2C_POOL_TAG,
+        pConfig->Bytes,
+        &pRecorder->Memory,
+        &pBuffer);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_WDFLOADING,
+            "Failed to allocate the flight recorder - %!STATUS!",
+            status);
+
+        return status;
+    }
+
+    pRecorder->pRecords = (PSPBPROBE_CAPTURE_RECORD)pBuffer;
+    pRecorder->Capacity = pConfig->Bytes / sizeof(SPBPROBE_CAPTURE_RECORD);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_WDFLOADING,
+        "Flight recorder of %lu records for the last %lu ms",
+        pRecorder->Capacity,
+        pConfig->WindowMs);
+
+    return STATUS_SUCCESS;
+}
+
+static
+PSPBPROBE_CAPTURE_RECORD
+PbcRecorderAppend(
+    _In_  PPBC_RECORDER     pRecorder
+    )
+/*++
+
+  Routine Description:
+
+    This routine takes the next record of the ring, in place
+    of the oldest one once the ring is full.
+
+  Arguments:
+
+    pRecorder - the flight recorder
+
+  Return Value:
+
+    The record
+
+--*/
+{
+    PSPBPROBE_CAPTURE_RECORD pRecord = &pRecorder->pRecords[pRecorder->Next];
+
+    pRecorder->Next = (pRecorder->Next + 1) % pRecorder->Capacity;
+
+    if (pRecorder->Count < pRecorder->Capacity)
+    {
+        pRecorder->Count++;
+    }
+
+    return pRecord;
+}
+
+static
+BOOLEAN
+PbcRecorderMatchPattern(
+    _In_  const PBC_RECORDER_CONFIG *pConfig,
+    _In_  const SPBPROBE_CAPTURE_RECORD *pRecord
+    )
+/*++
+
+  Routine Description:
+
+    This routine tells whether the payload of a record holds
+    the pattern at its offset. Bytes beyond the payload of the
+    record never match.
+
+  Arguments:
+
+    pConfig - the flight recorder settings
+    pRecord - the record
+
+  Return Value:
+
+    TRUE if the pattern matches
+
+--*/
+{
+    if ((pConfig->PatternMask == 0) ||
+        (pConfig->PatternOffset >= SPBPROBE_CAPTURE_PAYLOAD))
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < sizeof(ULONG); i++)
+    {
+        UCHAR mask = (UCHAR)(pConfig->PatternMask >> (i * 8));
+        UCHAR value = (UCHAR)(pConfig->PatternValue >> (i * 8));
+
+        if (mask == 0)
+        {
+            continue;
+        }
+
+        if ((pConfig->PatternOffset + i >= pRecord->PayloadLength) ||
+            (((pRecord->Payload[pConfig->PatternOffset + i] ^ value) & mask) != 0))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static
+VOID
+PbcRecorderDump(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  ULONGLONG         TriggerTransactionId,
+    _In_  PCSTR             Trigger
+    )
+/*++
+
+  Routine Description:
+
+    This routine exports the records of the last WindowMs,
+    oldest first, and empties the ring. The two halves of a
+    full duplex transfer go to the capture stream together.
+    It runs in the completion that fired the trigger, so no
+    record is added meanwhile.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    TriggerTransactionId - the transaction ID of the request
+        that fired the trigger
+    Trigger - what fired the dump
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_RECORDER pRecorder = &pDevice->Recorder;
+    ULONGLONG windowUs = (ULONGLONG)pDevice->Config.Recorder.WindowMs * 1000;
+    SPBPROBE_CAPTURE_RECORD records[2];
+    SPBPROBE_CAPTURE_POLICY policy;
+    LONGLONG now = PbcQueryTimestamp();
+    ULONG first;
+    ULONG exported = 0;
+    ULONG captured = 0;
+    ULONG count;
+
+    policy = pDevice->CapturePolicy;
+
+    first = (pRecorder->Next + pRecorder->Capacity - pRecorder->Count) % pRecorder->Capacity;
+
+    for (ULONG i = 0; i < pRecorder->Count; i += count)
+    {
+        const SPBPROBE_CAPTURE_RECORD *pRecord =
+            &pRecorder->pRecords[(first + i) % pRecorder->Capacity];
+
+        count = 1;
+
+        if (PbcElapsedUs(pRecord->Timestamp, now) > windowUs)
+        {
+            continue;
+        }
+
+        RtlCopyMemory(&records[0], pRecord, sizeof(SPBPROBE_CAPTURE_RECORD));
+
+        if ((pRecord->Flags & SPBPROBE_CAPTURE_FLAG_FULL_DUPLEX) &&
+            (i + 1 < pRecorder->Count))
+        {
+            const SPBPROBE_CAPTURE_RECORD *pNext =
+                &pRecorder->pRecords[(first + i + 1) % pRecorder->Capacity];
+
+            if (pNext->TransactionId == pRecord->TransactionId)
+            {
+                RtlCopyMemory(&records[1], pNext, sizeof(SPBPROBE_CAPTURE_RECORD));
+                count = 2;
+            }
+        }
+
+        for (ULONG j = 0; j < count; j++)
+        {
+            PbcEventWriteRecord(pDevice, &records[j], TriggerTransactionId);
+        }
+
+        if (PbcCaptureWrite(records, count, &policy))
+        {
+            captured += count;
+        }
+
+        exported += count;
+    }
+
+    pRecorder->Next = 0;
+    pRecorder->Count = 0;
+    pRecorder->Dumps++;
+    pRecorder->Exported += exported;
+
+    Trace(
+        TRACE_LEVEL_WARNING,
+        TRACE_FLAG_SPBAPI,
+        "device %I64d: flight recorder dump #%lu on %s of txn %I64u, "
+        "%lu records of the last %lu ms, %lu captured",
+        pDevice->PeripheralId.QuadPart,
+        pRecorder->Dumps,
+        Trigger,
+        TriggerTransactionId,
+        exported,
+        pDevice->Config.Recorder.WindowMs,
+        captured);
+}
+
+VOID
+PbcRecorderRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status
+    )
+/*++
+
+  Routine Description:
+
+    This routine records one record per transfer of a client
+    request about to be completed, or one without transfer for
+    the other requests, and dumps the recorder when the
+    completion fires a trigger.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request
+    Status - the completion status of the request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_RECORDER pRecorder = &pDevice->Recorder;
+    PPBC_RECORDER_CONFIG pConfig = &pDevice->Config.Recorder;
+    PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+    PSPBPROBE_CAPTURE_RECORD pRecord;
+    SPB_REQUEST_PARAMETERS parameters;
+    SPBPROBE_CAPTURE_RECORD record;
+    PCSTR trigger = NULL;
+    LONGLONG now;
+
+    if (pRecorder->pRecords == NULL)
+    {
+        return;
+    }
+
+    now = PbcQueryTimestamp();
+
+    SPB_REQUEST_PARAMETERS_INIT(&parameters);
+    SpbRequestGetParameters(ClientRequest, &parameters);
+
+    PbcCaptureInitRecord(pDevice, ClientRequest, parameters.SequenceTransferCount, &record);
+
+    record.Timestamp = now;
+    record.Status = Status;
+    record.Direction = (UCHAR)SpbTransferDirectionNone;
+    record.Flags = SPBPROBE_CAPTURE_FLAG_RECORDED;
+
+    if ((parameters.SequenceTransferCount == 2) && PbcCaptureIsFullDuplex(ClientRequest))
+    {
+        record.Flags |= SPBPROBE_CAPTURE_FLAG_FULL_DUPLEX;
+    }
+
+    if (parameters.SequenceTransferCount == 0)
+    {
+        RtlCopyMemory(PbcRecorderAppend(pRecorder), &record, sizeof(record));
+    }
+
+    for (ULONG i = 0; i < parameters.SequenceTransferCount; i++)
+    {
+        SPB_TRANSFER_DESCRIPTOR descriptor;
+        PMDL pMdl;
+
+        SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+        SpbRequestGetTransferParameters(ClientRequest, i, &descriptor, &pMdl);
+
+        pRecord = PbcRecorderAppend(pRecorder);
+
+        RtlCopyMemory(pRecord, &record, sizeof(record));
+
+        PbcCaptureCopyPayload(i, &descriptor, pMdl, pRecord);
+
+        if ((trigger == NULL) && PbcRecorderMatchPattern(pConfig, pRecord))
+        {
+            trigger = "pattern";
+        }
+    }
+
+    //
+    // Without a list of statuses, any failure fires a dump.
+    //
+
+    if (pConfig->StatusCount == 0)
+    {
+        if (!NT_SUCCESS(Status))
+        {
+            trigger = "status";
+        }
+    }
+    else
+    {
+        for (ULONG i = 0; i < pConfig->StatusCount; i++)
+        {
+            if (Status == (NTSTATUS)pConfig->Statuses[i])
+            {
+                trigger = "status";
+                break;
+            }
+        }
+    }
+
+    if ((trigger == NULL) &&
+        (pConfig->LatencyUs != 0) &&
+        (pRequest->DispatchTime != 0) &&
+        (PbcElapsedUs(pRequest->DispatchTime, now) >= pConfig->LatencyUs))
+    {
+        trigger = "latency";
+    }
+
+    if (trigger != NULL)
+    {
+        PbcRecorderDump(pDevice, pRequest->TransactionId, trigger);
+    }
+}
+
+VOID
+PbcRecorderTrace(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine dumps the statistics of the flight recorder.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_RECORDER pRecorder = &pDevice->Recorder;
+
+    if (pRecorder->pRecords == NULL)
+    {
+        return;
+    }
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_OTHER,
+        "device %I64d: flight recorder of %lu records dumps=%lu "
+        "records exported=%I64u",
+        pDevice->PeripheralId.QuadPart,
+        pRecorder->Capacity,
+        pRecorder->Dumps,
+        pRecorder->Exported);
+}
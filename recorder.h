@@ -0,0 +1,39 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    recorder.h
+
+Abstract:
+
+    This module contains the function definitions for the
+    flight recorder of the recent transfers.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+NTSTATUS
+PbcRecorderInitialize(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+PbcRecorderRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status);
+
+VOID
+PbcRecorderTrace(
+    _In_  PPBC_DEVICE       pDevice);
+
+#endif // _RECORDER_H_
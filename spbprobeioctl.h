@@ -0,0 +1,281 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    spbprobeioctl.h
+
+Abstract:
+
+    This module contains the IOCTL definitions of the probe
+    control device, shared with user-mode tools.
+
+Environment:
+
+    kernel-mode and user-mode
+
+Revision History:
+
+--*/
+
+#ifndef _SPBPROBEIOCTL_H_
+#define _SPBPROBEIOCTL_H_
+
+//
+// Control device names. User-mode tools open \\.\SpbProbe.
+//
+
+#define SPBPROBE_DEVICE_NAME       L"\\Device\\SpbProbe"
+#define SPBPROBE_SYMBOLIC_NAME     L"\\DosDevices\\SpbProbe"
+
+#define FILE_DEVICE_SPBPROBE       0x8000
+
+//
+// Input:  ULONG, the index of the probe device (0 for the first).
+// Output: SPBPROBE_TIMELINE.
+// Fails with STATUS_NO_MORE_ENTRIES past the last device.
+//
+
+#define IOCTL_SPBPROBE_QUERY_TIMELINE \
+    CTL_CODE(FILE_DEVICE_SPBPROBE, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Startup and resume phases of a probe device. D0 entry
+// and the first transfer are updated on every resume.
+//
+
+typedef enum _SPBPROBE_PHASE
+{
+    SpbProbePhaseDeviceAdd = 0,
+    SpbProbePhasePrepareHardware,
+    SpbProbePhaseIoTargetOpen,
+    SpbProbePhaseD0Entry,
+    SpbProbePhaseTargetConnect,
+    SpbProbePhaseFirstTransfer,
+    SpbProbePhaseMax
+}
+SPBPROBE_PHASE;
+
+typedef struct _SPBPROBE_PHASE_TIMING
+{
+    // Number of times the phase ran.
+    ULONG                         Count;
+
+    // Start of the last run, from the start of the device
+    // add, and duration of the last run (us). The first
+    // transfer phase runs from the end of D0 entry to the
+    // send of the first transfer.
+    ULONGLONG                     StartUs;
+    ULONGLONG                     DurationUs;
+}
+SPBPROBE_PHASE_TIMING, *PSPBPROBE_PHASE_TIMING;
+
+typedef struct _SPBPROBE_TIMELINE
+{
+    LONGLONG                      PeripheralId;
+    ULONG                         PhaseCount;
+    SPBPROBE_PHASE_TIMING         Phases[SpbProbePhaseMax];
+}
+SPBPROBE_TIMELINE, *PSPBPROBE_TIMELINE;
+
+//
+// Input:  none.
+// Output: an array of SPBPROBE_CAPTURE_RECORD.
+// Moves the transfers captured by the probe devices with the
+// capture enabled (TraceBuffers bit 0x4) to the output buffer,
+// merged from the buffers of all the processors in the order
+// of their sequence number. Returns fewer records than fit
+// when no more are available. Records lost by the capture
+// policy are counted in the Dropped field of the next record
+// of the same processor.
+//
+
+#define IOCTL_SPBPROBE_READ_CAPTURE \
+    CTL_CODE(FILE_DEVICE_SPBPROBE, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define SPBPROBE_CAPTURE_PAYLOAD   32
+
+//
+// Flags of a capture record.
+//
+// SUBMIT: the payload and timestamp were taken just before
+// the request was sent, so that a client reusing its write
+// buffer before the completion does not change them.
+//
+// FULL_DUPLEX: one half of a full duplex transfer. The MOSI
+// record (to the device) comes right before the MISO record
+// (from the device), on the same processor with the next
+// sequence number. Both payloads start at byte 0 of their
+// transfer: byte i of one was clocked with byte i of the
+// other.
+//
+// INTERRUPT: an edge of the GPIO interrupt of the device,
+// timestamped in its ISR. The record has no transfer: its
+// TransactionId and Length are 0 and its Direction is
+// SpbTransferDirectionNone.
+//
+// RECORDED: a record of the flight recorder, dumped after the
+// completion that triggered it. It keeps the timestamp of its
+// completion, older than those of the records around it, and
+// a request without transfers has one record with Direction
+// SpbTransferDirectionNone.
+//
+
+#define SPBPROBE_CAPTURE_FLAG_SUBMIT        0x01
+#define SPBPROBE_CAPTURE_FLAG_FULL_DUPLEX   0x02
+#define SPBPROBE_CAPTURE_FLAG_INTERRUPT     0x04
+#define SPBPROBE_CAPTURE_FLAG_RECORDED      0x08
+
+typedef struct _SPBPROBE_CAPTURE_RECORD
+{
+    // Global and monotonic over all the devices and
+    // processors, from 1.
+    ULONGLONG                     Sequence;
+
+    // Transaction ID of the request, shared by the records of
+    // its transfers and stamped on its traces.
+    ULONGLONG                     TransactionId;
+
+    // Performance counter ticks when the payload was taken:
+    // just before the request was sent to the controller for
+    // the transfers to the device (SPBPROBE_CAPTURE_FLAG_SUBMIT),
+    // at the completion otherwise, or when the interrupt was
+    // raised (SPBPROBE_CAPTURE_FLAG_INTERRUPT).
+    LONGLONG                      Timestamp;
+
+    LONGLONG                      PeripheralId;
+    LONG                          Status;
+
+    // Length of the transfer; the first PayloadLength bytes
+    // are in Payload.
+    ULONG                         Length;
+    ULONG                         Processor;
+
+    // Records of this processor lost since the previous one:
+    // dropped, not sampled or overwritten.
+    ULONG                         Dropped;
+
+    USHORT                        Address;
+    UCHAR                         BusType;
+    UCHAR                         Direction;
+    UCHAR                         Index;
+    UCHAR                         TransferCount;
+    UCHAR                         Flags;
+    UCHAR                         PayloadLength;
+    UCHAR                         Payload[SPBPROBE_CAPTURE_PAYLOAD];
+}
+SPBPROBE_CAPTURE_RECORD, *PSPBPROBE_CAPTURE_RECORD;
+
+//
+// Input:  SPBPROBE_CAPTURE_POLICY_INPUT.
+// Output: none.
+// Changes what the capture of a probe device does when the
+// ring of the processor fills up. The capture never holds a
+// client request, whatever the policy.
+// Fails with STATUS_NO_MORE_ENTRIES past the last device.
+//
+
+#define IOCTL_SPBPROBE_SET_CAPTURE_POLICY \
+    CTL_CODE(FILE_DEVICE_SPBPROBE, 0x802, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+typedef enum _SPBPROBE_CAPTURE_MODE
+{
+    // Drop the new records while the ring is full.
+    SpbProbeCaptureDropNewest = 0,
+
+    // Overwrite the oldest records, as a flight recorder.
+    SpbProbeCaptureOverwriteOldest,
+
+    // Keep 1 record in SampleRate while the ring is filled
+    // above WatermarkPercent, and drop the new records while
+    // it is full.
+    SpbProbeCaptureSample,
+
+    SpbProbeCaptureModeMax
+}
+SPBPROBE_CAPTURE_MODE;
+
+typedef struct _SPBPROBE_CAPTURE_POLICY
+{
+    ULONG                         Mode;
+    ULONG                         SampleRate;
+    ULONG                         WatermarkPercent;
+}
+SPBPROBE_CAPTURE_POLICY, *PSPBPROBE_CAPTURE_POLICY;
+
+typedef struct _SPBPROBE_CAPTURE_POLICY_INPUT
+{
+    // Index of the probe device (0 for the first).
+    ULONG                         DeviceIndex;
+    SPBPROBE_CAPTURE_POLICY       Policy;
+}
+SPBPROBE_CAPTURE_POLICY_INPUT, *PSPBPROBE_CAPTURE_POLICY_INPUT;
+
+//
+// Input:  SPBPROBE_LOCK_STATISTICS_INPUT.
+// Output: SPBPROBE_LOCK_STATISTICS.
+// Returns the lock histograms of a target connected to a
+// probe device, as they stand: they keep growing until the
+// target disconnects, when they are also traced.
+// Fails with STATUS_NO_MORE_ENTRIES past the last device or
+// the last connected target of the device.
+//
+
+#define IOCTL_SPBPROBE_QUERY_LOCK_STATISTICS \
+    CTL_CODE(FILE_DEVICE_SPBPROBE, 0x803, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Bucket 0 counts the zero values, bucket N > 0 counts the
+// values in [2^(N-1), 2^N). The last bucket also collects
+// everything above its lower bound.
+//
+
+#define SPBPROBE_HISTOGRAM_BUCKETS 24
+
+typedef struct _SPBPROBE_HISTOGRAM
+{
+    ULONG                         Count;
+    ULONGLONG                     Sum;
+    ULONGLONG                     Min;
+    ULONGLONG                     Max;
+    ULONG                         Buckets[SPBPROBE_HISTOGRAM_BUCKETS];
+}
+SPBPROBE_HISTOGRAM, *PSPBPROBE_HISTOGRAM;
+
+typedef struct _SPBPROBE_LOCK_HISTOGRAMS
+{
+    // Time between lock request and grant (us).
+    SPBPROBE_HISTOGRAM            WaitTime;
+
+    // Time between lock grant and unlock request (us).
+    SPBPROBE_HISTOGRAM            HoldTime;
+
+    // Transfers issued per lock.
+    SPBPROBE_HISTOGRAM            TransfersPerLock;
+}
+SPBPROBE_LOCK_HISTOGRAMS, *PSPBPROBE_LOCK_HISTOGRAMS;
+
+typedef struct _SPBPROBE_LOCK_STATISTICS_INPUT
+{
+    // Index of the probe device (0 for the first).
+    ULONG                         DeviceIndex;
+
+    // Index of the target among those connected to the
+    // device (0 for the first).
+    ULONG                         TargetIndex;
+}
+SPBPROBE_LOCK_STATISTICS_INPUT, *PSPBPROBE_LOCK_STATISTICS_INPUT;
+
+typedef struct _SPBPROBE_LOCK_STATISTICS
+{
+    LONGLONG                      PeripheralId;
+    ULONG                         Address;
+
+    // IOCTL_SPB_LOCK_CONTROLLER and IOCTL_SPB_LOCK_CONNECTION.
+    SPBPROBE_LOCK_HISTOGRAMS      ControllerLock;
+    SPBPROBE_LOCK_HISTOGRAMS      ConnectionLock;
+}
+SPBPROBE_LOCK_STATISTICS, *PSPBPROBE_LOCK_STATISTICS;
+
+#endif // _SPBPROBEIOCTL_H_
@@ -0,0 +1,901 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    stats.cpp
+
+Abstract:
+
+    This module contains the timing and histogram helpers
+    used to account for the requests going through the probe.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#include "internal.h"
+#include "stats.h"
+#include "bustime.h"
+#include "idle.h"
+#include "recorder.h"
+
+#include "stats.tmh"
+
+//
+// Performance counter frequency, queried once at driver load.
+//
+
+static LONGLONG s_PerformanceFrequency = 1;
+
+VOID
+PbcStatsInitialize(VOID)
+/*++
+
+  Routine Description:
+
+    This routine caches the performance counter frequency.
+
+  Arguments:
+
+    None
+
+  Return Value:
+
+    None
+
+--*/
+{
+    LARGE_INTEGER frequency;
+
+    KeQueryPerformanceCounter(&frequency);
+
+    if (frequency.QuadPart > 0)
+    {
+        s_PerformanceFrequency = frequency.QuadPart;
+    }
+}
+
+LONGLONG
+PbcQueryTimestamp(VOID)
+/*++
+
+  Routine Description:
+
+    This routine returns the current performance counter value.
+
+  Arguments:
+
+    None
+
+  Return Value:
+
+    The timestamp, in performance counter ticks
+
+--*/
+{
+    return KeQueryPerformanceCounter(nullptr).QuadPart;
+}
+
+ULONGLONG
+PbcElapsedUs(
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime
+    )
+/*++
+
+  Routine Description:
+
+    This routine converts the interval between two timestamps
+    to microseconds.
+
+  Arguments:
+
+    StartTime - the timestamp at the start of the interval
+    EndTime - the timestamp at the end of the interval
+
+  Return Value:
+
+    The interval in microseconds, 0 if EndTime precedes StartTime
+
+--*/
+{
+    if (EndTime <= StartTime)
+    {
+        return 0;
+    }
+
+    ULONGLONG ticks = (ULONGLONG)(EndTime - StartTime);
+    ULONGLONG frequency = (ULONGLONG)s_PerformanceFrequency;
+
+    //
+    // Split the conversion to avoid overflowing on long intervals.
+    //
+
+    return ((ticks / frequency) * 1000000) +
+        (((ticks % frequency) * 1000000) / frequency);
+}
+
+ULONGLONG
+PbcElapsedNs(
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime
+    )
+/*++
+
+  Routine Description:
+
+    This routine converts the interval between two timestamps
+    to nanoseconds.
+
+  Arguments:
+
+    StartTime - the timestamp at the start of the interval
+    EndTime - the timestamp at the end of the interval
+
+  Return Value:
+
+    The interval in nanoseconds, 0 if EndTime precedes StartTime
+
+--*/
+{
+    if (EndTime <= StartTime)
+    {
+        return 0;
+    }
+
+    ULONGLONG ticks = (ULONGLONG)(EndTime - StartTime);
+    ULONGLONG frequency = (ULONGLONG)s_PerformanceFrequency;
+
+    return ((ticks / frequency) * 1000000000) +
+        (((ticks % frequency) * 1000000000) / frequency);
+}
+
+VOID
+PbcHistogramRecord(
+    _Inout_  PPBC_HISTOGRAM  pHistogram,
+    _In_     ULONGLONG       Value
+    )
+/*++
+
+  Routine Description:
+
+    This routine adds a sample to a histogram.
+
+  Arguments:
+
+    pHistogram - a pointer to the histogram
+    Value - the sample
+
+  Return Value:
+
+    None
+
+--*/
+{
+    ULONG bucket = 0;
+
+    if (Value != 0)
+    {
+        bucket = (ULONG)RtlFindMostSignificantBit(Value) + 1;
+
+        if (bucket >= PBC_HISTOGRAM_BUCKETS)
+        {
+            bucket = PBC_HISTOGRAM_BUCKETS - 1;
+        }
+    }
+
+    if ((pHistogram->Count == 0) || (Value < pHistogram->Min))
+    {
+        pHistogram->Min = Value;
+    }
+
+    if (Value > pHistogram->Max)
+    {
+        pHistogram->Max = Value;
+    }
+
+    pHistogram->Count++;
+    pHistogram->Sum += Value;
+    pHistogram->Buckets[bucket]++;
+}
+
+VOID
+PbcHistogramTrace(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_opt_ PPBC_TARGET    pTarget,
+    _In_  PPBC_HISTOGRAM    pHistogram,
+    _In_  PCSTR             Name,
+    _In_  PCSTR             Unit
+    )
+/*++
+
+  Routine Description:
+
+    This routine dumps a histogram, one line per non-empty bucket.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target the histogram belongs to,
+        NULL for a histogram of the device
+    pHistogram - a pointer to the histogram
+    Name - the name of the histogram
+    Unit - the unit of the samples
+
+  Return Value:
+
+    None
+
+--*/
+{
+    CHAR pScope[20] = ""; /*  format "target 0xNNNN " */
+
+    if (pHistogram->Count == 0)
+    {
+        return;
+    }
+
+    if (pTarget != NULL)
+    {
+        sprintf_s(pScope, sizeof(pScope), "target 0x%hx ", pTarget->Settings.Address);
+    }
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_OTHER,
+        "device %I64d: %s%s count=%lu min=%I64u avg=%I64u "
+        "max=%I64u %s",
+        pDevice->PeripheralId.QuadPart,
+        pScope,
+        Name,
+        pHistogram->Count,
+        pHistogram->Min,
+        pHistogram->Sum / pHistogram->Count,
+        pHistogram->Max,
+        Unit);
+
+    for (ULONG i = 0; i < PBC_HISTOGRAM_BUCKETS; i++)
+    {
+        if (pHistogram->Buckets[i] == 0)
+        {
+            continue;
+        }
+
+        ULONGLONG lower = (i == 0) ? 0 : (1ULL << (i - 1));
+        ULONGLONG upper = (i == PBC_HISTOGRAM_BUCKETS - 1) ?
+            pHistogram->Max : (1ULL << i) - 1;
+
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_OTHER,
+            "device %I64d: %s%s [%I64u-%I64u] %s: %lu",
+            pDevice->PeripheralId.QuadPart,
+            pScope,
+            Name,
+            lower,
+            upper,
+            Unit,
+            pHistogram->Buckets[i]);
+    }
+}
+
+VOID
+PbcLockRequested(
+    _Inout_  PPBC_LOCK_STATISTICS  pLock
+    )
+/*++
+
+  Routine Description:
+
+    This routine records that a lock request was received.
+
+  Arguments:
+
+    pLock - a pointer to the lock statistics
+
+  Return Value:
+
+    None
+
+--*/
+{
+    pLock->RequestTime = PbcQueryTimestamp();
+}
+
+VOID
+PbcLockAcquired(
+    _Inout_  PPBC_LOCK_STATISTICS  pLock
+    )
+/*++
+
+  Routine Description:
+
+    This routine records that the controller granted a lock.
+
+  Arguments:
+
+    pLock - a pointer to the lock statistics
+
+  Return Value:
+
+    None
+
+--*/
+{
+    pLock->AcquireTime = PbcQueryTimestamp();
+    pLock->Transfers = 0;
+    pLock->Held = TRUE;
+
+    PbcHistogramRecord(
+        &pLock->WaitTime,
+        PbcElapsedUs(pLock->RequestTime, pLock->AcquireTime));
+}
+
+ULONGLONG
+PbcLockReleased(
+    _Inout_  PPBC_LOCK_STATISTICS  pLock
+    )
+/*++
+
+  Routine Description:
+
+    This routine records that a lock is released.
+
+  Arguments:
+
+    pLock - a pointer to the lock statistics
+
+  Return Value:
+
+    The time the lock was held in microseconds
+
+--*/
+{
+    if (pLock->Held == FALSE)
+    {
+        return 0;
+    }
+
+    ULONGLONG holdTime = PbcElapsedUs(
+        pLock->AcquireTime,
+        PbcQueryTimestamp());
+
+    PbcHistogramRecord(&pLock->HoldTime, holdTime);
+    PbcHistogramRecord(&pLock->TransfersPerLock, pLock->Transfers);
+
+    pLock->Held = FALSE;
+
+    return holdTime;
+}
+
+VOID
+PbcLockCountTransfer(
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine accounts a transfer against the locks
+    currently held by the target.
+
+  Arguments:
+
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (pTarget->ControllerLock.Held)
+    {
+        pTarget->ControllerLock.Transfers++;
+    }
+
+    if (pTarget->ConnectionLock.Held)
+    {
+        pTarget->ConnectionLock.Transfers++;
+    }
+}
+
+VOID
+PbcTimelineRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBPROBE_PHASE    Phase,
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime
+    )
+/*++
+
+  Routine Description:
+
+    This routine records the last run of a startup or
+    resume phase.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    Phase - the phase
+    StartTime - the timestamp at the start of the phase
+    EndTime - the timestamp at the end of the phase
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PSPBPROBE_PHASE_TIMING pTiming = &pDevice->Timeline.Phases[Phase];
+
+    pTiming->Count++;
+    pTiming->StartUs = PbcElapsedUs(pDevice->TimelineBase, StartTime);
+    pTiming->DurationUs = PbcElapsedUs(StartTime, EndTime);
+}
+
+VOID
+PbcTimelineTrace(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  UCHAR             Level
+    )
+/*++
+
+  Routine Description:
+
+    This routine emits the timeline of the device as a
+    single event, each phase as start+duration in us.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    Level - the trace level of the event
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PSPBPROBE_PHASE_TIMING pPhases = pDevice->Timeline.Phases;
+
+    Trace(
+        Level,
+        TRACE_FLAG_OTHER,
+        "device %I64d: timeline us add=%I64u+%I64u "
+        "prepare=%I64u+%I64u open=%I64u+%I64u d0#%lu=%I64u+%I64u "
+        "connect=%I64u+%I64u first=%I64u+%I64u",
+        pDevice->PeripheralId.QuadPart,
+        pPhases[SpbProbePhaseDeviceAdd].StartUs,
+        pPhases[SpbProbePhaseDeviceAdd].DurationUs,
+        pPhases[SpbProbePhasePrepareHardware].StartUs,
+        pPhases[SpbProbePhasePrepareHardware].DurationUs,
+        pPhases[SpbProbePhaseIoTargetOpen].StartUs,
+        pPhases[SpbProbePhaseIoTargetOpen].DurationUs,
+        pPhases[SpbProbePhaseD0Entry].Count,
+        pPhases[SpbProbePhaseD0Entry].StartUs,
+        pPhases[SpbProbePhaseD0Entry].DurationUs,
+        pPhases[SpbProbePhaseTargetConnect].StartUs,
+        pPhases[SpbProbePhaseTargetConnect].DurationUs,
+        pPhases[SpbProbePhaseFirstTransfer].StartUs,
+        pPhases[SpbProbePhaseFirstTransfer].DurationUs);
+}
+
+VOID
+PbcResumeCountTransfer(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          SendTime
+    )
+/*++
+
+  Routine Description:
+
+    This routine records the time between the last D0 entry
+    and the first transfer sent after it.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    SendTime - the timestamp of the transfer
+
+  Return Value:
+
+    None
+
+--*/
+{
+    ULONGLONG elapsed;
+
+    if (pDevice->ResumeTime == 0)
+    {
+        return;
+    }
+
+    elapsed = PbcElapsedUs(pDevice->ResumeTime, SendTime);
+
+    PbcHistogramRecord(&pDevice->ResumeToFirstTransfer, elapsed);
+
+    PbcTimelineRecord(
+        pDevice,
+        SpbProbePhaseFirstTransfer,
+        pDevice->ResumeTime,
+        SendTime);
+
+    pDevice->ResumeTime = 0;
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_FLAG_OTHER,
+        "device %I64d: first transfer %I64u us after D0 entry #%lu",
+        pDevice->PeripheralId.QuadPart,
+        elapsed,
+        pDevice->D0Entries);
+
+    //
+    // Every resume updates the timeline; the summary at
+    // release traces the last one as an error.
+    //
+
+    PbcTimelineTrace(pDevice, TRACE_LEVEL_INFORMATION);
+}
+
+VOID
+PbcInterruptCountRead(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status
+    )
+/*++
+
+  Routine Description:
+
+    This routine records the time between the first pending
+    edge of the GPIO interrupt and the completion of the read
+    that serves it: the next successful request reading from
+    the device dispatched after the edge. For a HID over I2C
+    device, from the assertion of the interrupt to the input
+    report read. Reads with no edge pending are counted too,
+    see OnInterruptIsr.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    ClientRequest - the client request being completed
+    Status - the completion status of the request
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_REQUEST pRequest = GetRequestContext(ClientRequest);
+    SPB_REQUEST_PARAMETERS parameters;
+    LONGLONG interruptTime;
+    ULONGLONG elapsed;
+    BOOLEAN read = FALSE;
+
+    if ((pDevice->Interrupt == WDF_NO_HANDLE) ||
+        !NT_SUCCESS(Status))
+    {
+        return;
+    }
+
+    SPB_REQUEST_PARAMETERS_INIT(&parameters);
+    SpbRequestGetParameters(ClientRequest, &parameters);
+
+    for (ULONG i = 0; (i < parameters.SequenceTransferCount) && !read; i++)
+    {
+        SPB_TRANSFER_DESCRIPTOR descriptor;
+        PMDL pMdl;
+
+        SPB_TRANSFER_DESCRIPTOR_INIT(&descriptor);
+        SpbRequestGetTransferParameters(ClientRequest, i, &descriptor, &pMdl);
+
+        read = (descriptor.Direction == SpbTransferDirectionFromDevice);
+    }
+
+    if (!read)
+    {
+        return;
+    }
+
+    pDevice->InterruptReads++;
+
+    interruptTime = ReadAcquire64(&pDevice->PendingInterruptTime);
+
+    if ((interruptTime == 0) ||
+        (interruptTime > pRequest->DispatchTime))
+    {
+        pDevice->UnsignaledReads++;
+        return;
+    }
+
+    //
+    // The ISR may set a new pending edge once this one is
+    // cleared; it is left for the next read.
+    //
+
+    if ((InterlockedCompareExchange64(
+            &pDevice->PendingInterruptTime, 0, interruptTime) != interruptTime))
+    {
+        return;
+    }
+
+    elapsed = PbcElapsedUs(interruptTime, PbcQueryTimestamp());
+
+    PbcHistogramRecord(&pDevice->InterruptToRead, elapsed);
+
+    Trace(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_FLAG_OTHER,
+        "device %I64d: read (txn %I64u) completed %I64u us after interrupt",
+        pDevice->PeripheralId.QuadPart,
+        pRequest->TransactionId,
+        elapsed);
+}
+
+VOID
+PbcDeviceTraceStatistics(
+    _In_  PPBC_DEVICE       pDevice
+    )
+/*++
+
+  Routine Description:
+
+    This routine dumps the statistics collected for the
+    device across power transitions.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PPBC_HISTOGRAM pHistogram = &pDevice->ResumeToFirstTransfer;
+
+    PbcTimelineTrace(pDevice, TRACE_LEVEL_ERROR);
+    PbcIdleTrace(pDevice);
+    PbcRecorderTrace(pDevice);
+
+    if (pDevice->Interrupt != WDF_NO_HANDLE)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_OTHER,
+            "device %I64d: interrupts=%ld served by a read=%lu "
+            "reads=%lu without an interrupt=%lu",
+            pDevice->PeripheralId.QuadPart,
+            ReadAcquire(&pDevice->Interrupts),
+            pDevice->InterruptToRead.Count,
+            pDevice->InterruptReads,
+            pDevice->UnsignaledReads);
+
+        //
+        // The probe may not see every edge of a level-triggered
+        // interrupt, see OnInterruptIsr.
+        //
+
+        if ((ULONG)ReadAcquire(&pDevice->Interrupts) < pDevice->InterruptReads)
+        {
+            Trace(
+                TRACE_LEVEL_WARNING,
+                TRACE_FLAG_OTHER,
+                "device %I64d: %lu reads for %ld interrupts, either "
+                "the client polls or an ISR ahead of the probe "
+                "claimed the missing interrupts",
+                pDevice->PeripheralId.QuadPart,
+                pDevice->InterruptReads,
+                ReadAcquire(&pDevice->Interrupts));
+        }
+
+        PbcHistogramTrace(pDevice, NULL,
+            &pDevice->InterruptToRead, "interrupt to read", "us");
+    }
+
+    if (pHistogram->Count == 0)
+    {
+        return;
+    }
+
+    Trace(
+        TRACE_LEVEL_ERROR,
+        TRACE_FLAG_OTHER,
+        "device %I64d: D0 entries=%lu resume to first transfer "
+        "count=%lu min=%I64u avg=%I64u max=%I64u us",
+        pDevice->PeripheralId.QuadPart,
+        pDevice->D0Entries,
+        pHistogram->Count,
+        pHistogram->Min,
+        pHistogram->Sum / pHistogram->Count,
+        pHistogram->Max);
+}
+
+VOID
+PbcTargetTraceStatistics(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget
+    )
+/*++
+
+  Routine Description:
+
+    This routine dumps the statistics collected for a target.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PbcHistogramTrace(pDevice, pTarget,
+        &pTarget->ControllerLock.WaitTime,
+        "controller lock wait", "us");
+    PbcHistogramTrace(pDevice, pTarget,
+        &pTarget->ControllerLock.HoldTime,
+        "controller lock hold", "us");
+    PbcHistogramTrace(pDevice, pTarget,
+        &pTarget->ControllerLock.TransfersPerLock,
+        "controller lock transfers", "transfers");
+
+    PbcHistogramTrace(pDevice, pTarget,
+        &pTarget->ConnectionLock.WaitTime,
+        "connection lock wait", "us");
+    PbcHistogramTrace(pDevice, pTarget,
+        &pTarget->ConnectionLock.HoldTime,
+        "connection lock hold", "us");
+    PbcHistogramTrace(pDevice, pTarget,
+        &pTarget->ConnectionLock.TransfersPerLock,
+        "connection lock transfers", "transfers");
+
+    PbcBusTimeTrace(pDevice, pTarget);
+
+    if (pTarget->PostedWrites != 0)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_OTHER,
+            "device %I64d: target 0x%hx posted writes=%lu coalesced reads=%lu "
+            "served from cache=%lu round-trips saved=%lu failed alone=%lu",
+            pDevice->PeripheralId.QuadPart,
+            pTarget->Settings.Address,
+            pTarget->PostedWrites,
+            pTarget->CoalescedReads,
+            pTarget->CachedCoalescedReads,
+            pTarget->CoalescedReads + pTarget->CachedCoalescedReads,
+            pTarget->FailedPostedWrites);
+    }
+
+    if ((pTarget->CacheHits + pTarget->CacheMisses) != 0)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_FLAG_OTHER,
+            "device %I64d: target 0x%hx cache hits=%lu misses=%lu "
+            "hit rate=%lu%% invalidations=%lu bus time saved=%I64u us",
+            pDevice->PeripheralId.QuadPart,
+            pTarget->Settings.Address,
+            pTarget->CacheHits,
+            pTarget->CacheMisses,
+            (pTarget->CacheHits * 100) /
+                (pTarget->CacheHits + pTarget->CacheMisses),
+            pTarget->CacheInvalidations,
+            pTarget->CacheTimeSaved);
+    }
+}
+
+static
+VOID
+PbcHistogramCopy(
+    _In_   const PBC_HISTOGRAM  *pHistogram,
+    _Out_  PSPBPROBE_HISTOGRAM  pOutput
+    )
+/*++
+
+  Routine Description:
+
+    This routine copies a histogram to its user-mode layout.
+
+  Arguments:
+
+    pHistogram - a pointer to the histogram
+    pOutput - the histogram returned to user-mode
+
+  Return Value:
+
+    None
+
+--*/
+{
+    C_ASSERT(PBC_HISTOGRAM_BUCKETS == SPBPROBE_HISTOGRAM_BUCKETS);
+
+    pOutput->Count = pHistogram->Count;
+    pOutput->Sum = pHistogram->Sum;
+    pOutput->Min = pHistogram->Min;
+    pOutput->Max = pHistogram->Max;
+
+    RtlCopyMemory(
+        pOutput->Buckets,
+        pHistogram->Buckets,
+        sizeof(pOutput->Buckets));
+}
+
+static
+VOID
+PbcLockCopy(
+    _In_   const PBC_LOCK_STATISTICS  *pLock,
+    _Out_  PSPBPROBE_LOCK_HISTOGRAMS  pOutput
+    )
+/*++
+
+  Routine Description:
+
+    This routine copies the histograms of a lock to their
+    user-mode layout.
+
+  Arguments:
+
+    pLock - the statistics of the lock
+    pOutput - the histograms returned to user-mode
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PbcHistogramCopy(&pLock->WaitTime, &pOutput->WaitTime);
+    PbcHistogramCopy(&pLock->HoldTime, &pOutput->HoldTime);
+    PbcHistogramCopy(&pLock->TransfersPerLock, &pOutput->TransfersPerLock);
+}
+
+VOID
+PbcTargetQueryLockStatistics(
+    _In_   PPBC_DEVICE               pDevice,
+    _In_   PPBC_TARGET               pTarget,
+    _Out_  PSPBPROBE_LOCK_STATISTICS pStatistics
+    )
+/*++
+
+  Routine Description:
+
+    This routine returns the lock histograms of a connected
+    target, for IOCTL_SPBPROBE_QUERY_LOCK_STATISTICS. They
+    are updated without a lock, so a lock completing during
+    the copy may be counted in some of them only.
+
+  Arguments:
+
+    pDevice - a pointer to the device context
+    pTarget - a pointer to the target context
+    pStatistics - the statistics returned to user-mode
+
+  Return Value:
+
+    None
+
+--*/
+{
+    RtlZeroMemory(pStatistics, sizeof(SPBPROBE_LOCK_STATISTICS));
+
+    pStatistics->PeripheralId = pDevice->PeripheralId.QuadPart;
+    pStatistics->Address = pTarget->Settings.Address;
+
+    PbcLockCopy(&pTarget->ControllerLock, &pStatistics->ControllerLock);
+    PbcLockCopy(&pTarget->ConnectionLock, &pStatistics->ConnectionLock);
+}
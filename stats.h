@@ -0,0 +1,108 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+Module Name:
+
+    stats.h
+
+Abstract:
+
+    This module contains the function definitions for
+    the timing and statistics helpers.
+
+Environment:
+
+    kernel-mode only
+
+Revision History:
+
+--*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+VOID
+PbcStatsInitialize(VOID);
+
+LONGLONG
+PbcQueryTimestamp(VOID);
+
+ULONGLONG
+PbcElapsedUs(
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime);
+
+ULONGLONG
+PbcElapsedNs(
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime);
+
+VOID
+PbcHistogramRecord(
+    _Inout_  PPBC_HISTOGRAM  pHistogram,
+    _In_     ULONGLONG       Value);
+
+VOID
+PbcHistogramTrace(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_opt_ PPBC_TARGET    pTarget,
+    _In_  PPBC_HISTOGRAM    pHistogram,
+    _In_  PCSTR             Name,
+    _In_  PCSTR             Unit);
+
+VOID
+PbcLockRequested(
+    _Inout_  PPBC_LOCK_STATISTICS  pLock);
+
+VOID
+PbcLockAcquired(
+    _Inout_  PPBC_LOCK_STATISTICS  pLock);
+
+ULONGLONG
+PbcLockReleased(
+    _Inout_  PPBC_LOCK_STATISTICS  pLock);
+
+VOID
+PbcLockCountTransfer(
+    _In_  PPBC_TARGET       pTarget);
+
+VOID
+PbcTimelineRecord(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBPROBE_PHASE    Phase,
+    _In_  LONGLONG          StartTime,
+    _In_  LONGLONG          EndTime);
+
+VOID
+PbcTimelineTrace(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  UCHAR             Level);
+
+VOID
+PbcResumeCountTransfer(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  LONGLONG          SendTime);
+
+VOID
+PbcInterruptCountRead(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  SPBREQUEST        ClientRequest,
+    _In_  NTSTATUS          Status);
+
+VOID
+PbcDeviceTraceStatistics(
+    _In_  PPBC_DEVICE       pDevice);
+
+VOID
+PbcTargetTraceStatistics(
+    _In_  PPBC_DEVICE       pDevice,
+    _In_  PPBC_TARGET       pTarget);
+
+VOID
+PbcTargetQueryLockStatistics(
+    _In_   PPBC_DEVICE               pDevice,
+    _In_   PPBC_TARGET               pTarget,
+    _Out_  PSPBPROBE_LOCK_STATISTICS pStatistics);
+
+#endif // _STATS_H_